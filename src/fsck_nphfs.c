@@ -0,0 +1,735 @@
+/*
+  NPHeap File System - fsck.nphfs
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Consistency checker for an unmounted heap.  It runs in three passes:
+
+  1. The inode table is split between worker threads.  Each thread
+     checks the inode bitmap for its slots and walks the block map of
+     every live inode, counting the references to each object it
+     reaches.  A subtree reached again through another reference is
+     only counted, not walked twice.  Each data block is checked
+     against its checksum the first time it is reached, and each
+     attribute block for its header and hash.
+  2. Names are checked on one thread: entries whose parent directory
+     does not exist are moved to /lost+found, entries that share a
+     path with an earlier one are renamed, hard links that point at no
+     inode are removed and link counts are matched to the names each
+     inode has.
+  3. The data area is split between worker threads again and every
+     object is compared against the data bitmap and the reference
+     counts: blocks left behind by a crash are given back, and share
+     counts that do not match what points at a block are corrected.
+
+  Last, the used inode and block counts kept in the superblock for
+  statfs are checked against the bitmaps.
+
+  The metadata journal is replayed first, as mounting would.  Without
+  -y nothing is changed, problems are only reported.
+
+  Data blocks a mount moved out to a spill file are checked in place
+  there; the file has to be given with -s.
+
+  usage: fsck.nphfs [-y] [-j threads] [-s spill_file] npheap_device_name[,...]
+*/
+
+#include "nphfuse_extra.h"
+#include <npheap.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+// Exit codes, as for the other fsck programs
+#define FSCK_OK          0
+#define FSCK_CORRECTED   1
+#define FSCK_UNCORRECTED 4
+#define FSCK_ERROR       8
+
+#define LOST_FOUND  "lost+found"
+
+static int repair = 0;
+static int nthreads = 1;
+static uint32_t *refs;
+static uint64_t errors_found = 0;
+static uint64_t errors_fixed = 0;
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void problem(int fixed, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void problem(int fixed, const char *format, ...)
+{
+    va_list ap;
+
+    pthread_mutex_lock(&report_lock);
+    va_start(ap, format);
+    vprintf(format, ap);
+    va_end(ap);
+    printf(fixed ? " (fixed)\n" : "\n");
+    errors_found++;
+    if(fixed){
+        errors_fixed++;
+    }
+    pthread_mutex_unlock(&report_lock);
+}
+
+// Count a reference to object id; returns the references seen before
+static uint32_t add_ref(uint64_t id)
+{
+    return __atomic_fetch_add(&refs[id - superblock->data_start], 1, __ATOMIC_RELAXED);
+}
+
+static int in_data_area(uint64_t id)
+{
+    return id >= superblock->data_start &&
+           id < superblock->data_start + superblock->data_blocks;
+}
+
+// Check the reference *ref from inode ino to an object at the given
+// height of its block map, then descend into it the first time it is
+// reached
+static void check_ref(uint64_t ino, uint64_t *ref, uint64_t height)
+{
+    uint64_t id = BMAP_ID(*ref);
+    uint64_t want = height == 0 ? data_block_size : BLOCK_SIZE;
+    uint64_t size;
+    uint64_t *node;
+    uint64_t i;
+
+    if(!in_data_area(id) || (height > 0 && (*ref & BMAP_COMPRESSED))){
+        problem(repair, "inode %llu: block map points outside the data area (%llu)",
+                (unsigned long long)ino, (unsigned long long)*ref);
+        if(repair){
+            *ref = 0;
+        }
+        return;
+    }
+    size = heap_size(id);
+    if(size != 0 && (*ref & BMAP_COMPRESSED)){
+        // A compressed block is as big as its header says
+        node = (uint64_t *)heap_get(id);
+        want = node != NULL ? zblock_size((struct nph_zblock *)node) : 0;
+        if(want == 0){
+            want = UINT64_MAX;
+        }
+    }
+    if(size < want){
+        problem(repair, "inode %llu: block %llu is missing or too small",
+                (unsigned long long)ino, (unsigned long long)id);
+        if(repair){
+            *ref = 0;
+        }
+        return;
+    }
+    if(add_ref(id) != 0){
+        return;
+    }
+    if(height == 0){
+        // Damaged data cannot be repaired, only reported
+        node = (uint64_t *)heap_get(id);
+        if(node != NULL && csum_check(id, node, want) != 0){
+            problem(0, "inode %llu: block %llu does not match its checksum",
+                    (unsigned long long)ino, (unsigned long long)id);
+        }
+        return;
+    }
+
+    node = (uint64_t *)heap_get(id);
+    if(node == NULL){
+        return;
+    }
+    for(i = 0; i < BMAP_FANOUT; i++){
+        if(node[i] != 0){
+            check_ref(ino, &node[i], height - 1);
+        }
+    }
+}
+
+// Check inode ino's reference to its attribute block.  A damaged block
+// cannot be repaired; the inode loses the attributes it spilled there.
+static void check_xattr(uint64_t ino, npheap_store *inode)
+{
+    uint64_t id = inode->xattr;
+    const struct nph_xblock *blk = NULL;
+
+    if(in_data_area(id)){
+        blk = (const struct nph_xblock *)heap_get(id);
+    }
+    if(blk == NULL || !xblock_ok(blk, heap_size(id)) ||
+       blk->hash != dedup_hash(blk + 1, blk->used)){
+        problem(repair, "inode %llu: attribute block %llu is missing or damaged",
+                (unsigned long long)ino, (unsigned long long)id);
+        if(repair){
+            inode->xattr = 0;
+        }
+        return;
+    }
+    add_ref(id);
+}
+
+struct range {
+    uint64_t first;
+    uint64_t last;
+};
+
+// Pass 1: inode bitmap and block maps for a range of inode slots
+static void *scan_inodes(void *arg)
+{
+    struct range *r = (struct range *)arg;
+    npheap_store *inode;
+    uint64_t index;
+    int used;
+
+    for(index = r->first; index < r->last; index++){
+        inode = inode_slot(index);
+        if(inode == NULL){
+            continue;
+        }
+        used = inode->filename[0] != '\0';
+
+        if(used != bitmap_test(&inode_bitmap, index)){
+            problem(repair, "inode slot %llu is %s but marked %s in the bitmap",
+                    (unsigned long long)index, used ? "in use" : "free",
+                    used ? "free" : "in use");
+            if(repair){
+                if(used){
+                    bitmap_set(&inode_bitmap, index);
+                }else{
+                    bitmap_clear(&inode_bitmap, index);
+                }
+            }
+        }
+        if(!used){
+            continue;
+        }
+
+        if(inode->mystat.st_ino != index + ROOT_INO){
+            problem(repair, "inode slot %llu carries inode number %llu",
+                    (unsigned long long)index, (unsigned long long)inode->mystat.st_ino);
+            if(repair){
+                inode->mystat.st_ino = index + ROOT_INO;
+            }
+        }
+        if(inode->height > BMAP_MAX_HEIGHT){
+            problem(repair, "inode %llu: block map height %llu is impossible",
+                    (unsigned long long)index + ROOT_INO, (unsigned long long)inode->height);
+            if(repair){
+                inode->offset = 0;
+                inode->height = 0;
+            }
+            continue;
+        }
+        if(inode->offset != 0){
+            check_ref(index + ROOT_INO, &inode->offset, inode->height);
+            if(inode->offset == 0){
+                inode->height = 0;
+            }
+        }
+        if(inode->xattr != 0){
+            check_xattr(index + ROOT_INO, inode);
+        }
+    }
+    return NULL;
+}
+
+// Pass 3: data area against the data bitmap and the reference counts
+static void *scan_data(void *arg)
+{
+    struct range *r = (struct range *)arg;
+    uint64_t bit;
+    uint64_t id;
+    uint32_t shared;
+    int used;
+    int seen;
+
+    for(bit = r->first; bit < r->last; bit++){
+        id = superblock->data_start + bit;
+        used = bitmap_test(&data_bitmap, bit);
+        seen = refs[bit] != 0;
+        shared = share_count(id);
+
+        if(seen && shared != refs[bit] - 1){
+            problem(repair, "block %llu has %u references but a share count of %u",
+                    (unsigned long long)id, refs[bit], shared);
+            if(repair){
+                share_set(id, refs[bit] - 1);
+            }
+        }else if(!seen && shared != 0){
+            problem(repair, "unused block %llu has a share count of %u",
+                    (unsigned long long)id, shared);
+            if(repair){
+                share_set(id, 0);
+            }
+        }
+        if(!seen && csum_get(id) != 0){
+            problem(repair, "unused block %llu still has a checksum", (unsigned long long)id);
+            if(repair){
+                csum_set(id, 0);
+            }
+        }
+
+        if(seen && !used){
+            problem(repair, "block %llu is in use but marked free", (unsigned long long)id);
+            if(repair){
+                bitmap_set(&data_bitmap, bit);
+            }
+        }else if(!seen && used){
+            problem(repair, "block %llu is allocated but no file uses it", (unsigned long long)id);
+            if(repair){
+                heap_free(id);
+            }
+        }else if(!seen && heap_size(id) != 0){
+            problem(repair, "npheap object %llu in the data area is leaked", (unsigned long long)id);
+            if(repair){
+                heap_drop(id);
+            }
+        }
+    }
+    return NULL;
+}
+
+static void run_parallel(void *(*fn)(void *), uint64_t count)
+{
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    struct range *ranges = calloc(nthreads, sizeof(struct range));
+    int i;
+
+    for(i = 0; i < nthreads; i++){
+        ranges[i].first = count * i / nthreads;
+        ranges[i].last = count * (i + 1) / nthreads;
+        if(pthread_create(&threads[i], NULL, fn, &ranges[i]) != 0){
+            fn(&ranges[i]);
+            threads[i] = 0;
+        }
+    }
+    for(i = 0; i < nthreads; i++){
+        if(threads[i] != 0){
+            pthread_join(threads[i], NULL);
+        }
+    }
+    free(threads);
+    free(ranges);
+}
+
+static void full_path(char *out, size_t len, const char *dir, const char *name)
+{
+    if(strcmp(dir, "/") == 0){
+        snprintf(out, len, "/%s", name);
+    }else{
+        snprintf(out, len, "%s/%s", dir, name);
+    }
+}
+
+// FNV-1a of a full path; never 0 so it can be used as a map key
+static uint64_t path_hash(const char *path)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    const char *p;
+
+    for(p = path; *p; p++){
+        h = (h ^ (unsigned char)*p) * 0x100000001b3ULL;
+    }
+    return h ? h : 1;
+}
+
+static uint64_t entry_hash(npheap_store *inode)
+{
+    char path[DIR_MAX + FILE_MAX];
+
+    full_path(path, sizeof(path), inode->dirname, inode->filename);
+    return path_hash(path);
+}
+
+// Every inode that lives under directory path old now lives under new
+static void move_subtree(const char *old, const char *new)
+{
+    size_t len = strlen(old);
+    npheap_store *inode;
+    char moved[DIR_MAX + FILE_MAX];
+    uint64_t index;
+
+    for(index = 1; index < superblock->inode_count; index++){
+        inode = inode_slot(index);
+        if(inode == NULL || inode->filename[0] == '\0'){
+            continue;
+        }
+        if(strncmp(inode->dirname, old, len) == 0 &&
+           (inode->dirname[len] == '\0' || inode->dirname[len] == '/')){
+            snprintf(moved, sizeof(moved), "%s%s", new, inode->dirname + len);
+            strncpy(inode->dirname, moved, sizeof(inode->dirname) - 1);
+            inode->dirname[sizeof(inode->dirname) - 1] = '\0';
+        }
+    }
+}
+
+// How much longer than directory path dir the longest parent path
+// under it is, -1 if nothing is under it
+static int64_t subtree_extra(const char *dir)
+{
+    size_t len = strlen(dir);
+    npheap_store *inode;
+    int64_t extra = -1;
+    uint64_t index;
+
+    for(index = 1; index < superblock->inode_count; index++){
+        inode = inode_slot(index);
+        if(inode == NULL || inode->filename[0] == '\0'){
+            continue;
+        }
+        if(strncmp(inode->dirname, dir, len) == 0 &&
+           (inode->dirname[len] == '\0' || inode->dirname[len] == '/') &&
+           (int64_t)(strlen(inode->dirname) - len) > extra){
+            extra = strlen(inode->dirname) - len;
+        }
+    }
+    return extra;
+}
+
+// Give the entry in slot index, whose full path old another entry
+// also has, a name ending in its inode number that no entry checked so
+// far has.  The name is shortened to make room for the number and, for
+// a directory, for the parent paths of everything under it.  Returns 0
+// when no such name fits.
+static int rename_duplicate(npheap_store *inode, uint64_t index, struct nph_map *names,
+                            const char *old)
+{
+    char name[sizeof(inode->filename)];
+    char path[DIR_MAX + FILE_MAX];
+    char suffix[48];
+    size_t room = sizeof(inode->filename) - 1;
+    size_t prefix = strcmp(inode->dirname, "/") == 0 ? 1 : strlen(inode->dirname) + 1;
+    size_t base;
+    int64_t extra = -1;
+    int n;
+
+    if(S_ISDIR(inode->mystat.st_mode)){
+        extra = subtree_extra(old);
+    }
+    if(extra >= 0){
+        if(prefix + extra >= sizeof(inode->dirname) - 1){
+            return 0;
+        }
+        if(room > sizeof(inode->dirname) - 1 - prefix - extra){
+            room = sizeof(inode->dirname) - 1 - prefix - extra;
+        }
+    }
+    for(n = 0; n < 100; n++){
+        if(n == 0){
+            snprintf(suffix, sizeof(suffix), ".%llu", (unsigned long long)index + ROOT_INO);
+        }else{
+            snprintf(suffix, sizeof(suffix), ".%llu.%d", (unsigned long long)index + ROOT_INO, n);
+        }
+        if(strlen(suffix) >= room){
+            return 0;
+        }
+        base = strlen(inode->filename);
+        if(base > room - strlen(suffix)){
+            base = room - strlen(suffix);
+        }
+        memcpy(name, inode->filename, base);
+        strcpy(name + base, suffix);
+        full_path(path, sizeof(path), inode->dirname, name);
+        if(!nph_map_get(names, path_hash(path), NULL)){
+            strcpy(inode->filename, name);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Find or create /lost+found; returns 0 if there is no room for it
+static int lost_found(struct nph_map *dirs)
+{
+    npheap_store *inode;
+    struct timeval currTime;
+    int64_t index;
+
+    if(nph_map_get(dirs, path_hash("/" LOST_FOUND), NULL)){
+        return 1;
+    }
+    index = bitmap_alloc(&inode_bitmap);
+    if(index < 0 || (inode = inode_slot(index)) == NULL){
+        return 0;
+    }
+    memset(inode, 0, sizeof(npheap_store));
+    strcpy(inode->dirname, "/");
+    strcpy(inode->filename, LOST_FOUND);
+    inode->mystat.st_ino = index + ROOT_INO;
+    inode->mystat.st_mode = S_IFDIR | 0700;
+    inode->mystat.st_nlink = 2;
+    inode->mystat.st_size = BLOCK_SIZE/2;
+    inode->mystat.st_blksize = data_block_size;
+    inode->mystat.st_uid = getuid();
+    inode->mystat.st_gid = getgid();
+    gettimeofday(&currTime, NULL);
+    inode->mystat.st_atime = currTime.tv_sec;
+    inode->mystat.st_mtime = currTime.tv_sec;
+    inode->mystat.st_ctime = currTime.tv_sec;
+    nph_map_put(dirs, path_hash("/" LOST_FOUND), index + 1);
+    return 1;
+}
+
+// Pass 2: dangling parents and duplicate names
+static void check_names(void)
+{
+    struct nph_map dirs;
+    struct nph_map names;
+    npheap_store *inode;
+    uint64_t index;
+    uint64_t other;
+    int fixed;
+    char old[DIR_MAX + FILE_MAX];
+    char newpath[DIR_MAX + FILE_MAX];
+
+    nph_map_init(&dirs);
+    nph_map_put(&dirs, path_hash("/"), 1);
+    for(index = 1; index < superblock->inode_count; index++){
+        inode = inode_slot(index);
+        if(inode != NULL && inode->filename[0] != '\0' && S_ISDIR(inode->mystat.st_mode)){
+            nph_map_put(&dirs, entry_hash(inode), index + 1);
+        }
+    }
+
+    for(index = 1; index < superblock->inode_count; index++){
+        inode = inode_slot(index);
+        if(inode == NULL || inode->filename[0] == '\0'){
+            continue;
+        }
+        if(nph_map_get(&dirs, path_hash(inode->dirname), NULL)){
+            continue;
+        }
+        if(!repair || !lost_found(&dirs)){
+            problem(0, "inode %llu: parent directory %s does not exist",
+                    (unsigned long long)index + ROOT_INO, inode->dirname);
+            continue;
+        }
+        full_path(old, sizeof(old), inode->dirname, inode->filename);
+        problem(1, "inode %llu: parent directory %s does not exist, moved to /%s",
+                (unsigned long long)index + ROOT_INO, inode->dirname, LOST_FOUND);
+        strcpy(inode->dirname, "/" LOST_FOUND);
+        snprintf(inode->filename, sizeof(inode->filename), "#%llu",
+                 (unsigned long long)index + ROOT_INO);
+        if(S_ISDIR(inode->mystat.st_mode)){
+            full_path(newpath, sizeof(newpath), inode->dirname, inode->filename);
+            move_subtree(old, newpath);
+            nph_map_put(&dirs, entry_hash(inode), index + 1);
+        }
+    }
+
+    nph_map_init(&names);
+    for(index = 1; index < superblock->inode_count; index++){
+        inode = inode_slot(index);
+        if(inode == NULL || inode->filename[0] == '\0'){
+            continue;
+        }
+        if(!nph_map_get(&names, entry_hash(inode), &other)){
+            nph_map_put(&names, entry_hash(inode), index + 1);
+            continue;
+        }
+        full_path(old, sizeof(old), inode->dirname, inode->filename);
+        fixed = repair && rename_duplicate(inode, index, &names, old);
+        problem(fixed, "inode %llu: %s is also the name of inode %llu",
+                (unsigned long long)index + ROOT_INO, old,
+                (unsigned long long)other - 1 + ROOT_INO);
+        if(fixed){
+            if(S_ISDIR(inode->mystat.st_mode)){
+                full_path(newpath, sizeof(newpath), inode->dirname, inode->filename);
+                move_subtree(old, newpath);
+            }
+            nph_map_put(&names, entry_hash(inode), index + 1);
+        }
+    }
+
+    nph_map_destroy(&dirs);
+    nph_map_destroy(&names);
+}
+
+// Pass 2, continued: hard links and the link counts of what they name
+static void check_links(void)
+{
+    uint32_t *names;
+    npheap_store *inode;
+    npheap_store *target;
+    uint64_t index;
+    uint64_t want;
+
+    names = calloc(superblock->inode_count, sizeof(uint32_t));
+    if(names == NULL){
+        perror("fsck.nphfs");
+        return;
+    }
+    for(index = 1; index < superblock->inode_count; index++){
+        inode = inode_slot(index);
+        if(inode == NULL || inode->filename[0] == '\0' || inode->link == 0){
+            continue;
+        }
+        target = inode_resolve(inode);
+        if(target == NULL || S_ISDIR(target->mystat.st_mode)){
+            problem(repair, "inode %llu: hard link %s points at no file (%llu)",
+                    (unsigned long long)index + ROOT_INO, inode->filename,
+                    (unsigned long long)inode->link);
+            if(repair){
+                memset(inode, 0, sizeof(npheap_store));
+                bitmap_clear(&inode_bitmap, index);
+            }
+            continue;
+        }
+        names[target->mystat.st_ino - ROOT_INO]++;
+    }
+    for(index = 1; index < superblock->inode_count; index++){
+        inode = inode_slot(index);
+        if(inode == NULL || inode->filename[0] == '\0' || inode->link != 0 ||
+           S_ISDIR(inode->mystat.st_mode)){
+            continue;
+        }
+        want = 1 + (uint64_t)names[index];
+        if(inode->mystat.st_nlink != want){
+            problem(repair, "inode %llu has a link count of %llu but %llu names",
+                    (unsigned long long)index + ROOT_INO,
+                    (unsigned long long)inode->mystat.st_nlink, (unsigned long long)want);
+            if(repair){
+                inode->mystat.st_nlink = want;
+            }
+        }
+    }
+    free(names);
+}
+
+// The counts statfs reports are kept by the allocators; after a crash
+// or the repairs above they can be off from what the bitmaps hold
+static void check_counts(void)
+{
+    uint64_t inodes;
+    uint64_t blocks;
+
+    inodes = bitmap_count(&inode_bitmap);
+    if(superblock->inodes_used != inodes){
+        problem(repair, "superblock counts %llu inodes in use, the bitmap %llu",
+                (unsigned long long)superblock->inodes_used, (unsigned long long)inodes);
+        if(repair){
+            superblock->inodes_used = inodes;
+        }
+    }
+    blocks = bitmap_count(&data_bitmap);
+    if(superblock->blocks_used != blocks){
+        problem(repair, "superblock counts %llu blocks in use, the bitmap %llu",
+                (unsigned long long)superblock->blocks_used, (unsigned long long)blocks);
+        if(repair){
+            superblock->blocks_used = blocks;
+        }
+    }
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage:  fsck.nphfs [-y] [-j threads] [-s spill_file] npheap_device_name[,...]\n");
+    fprintf(stderr, "        -y  repair what is found (default is to only report)\n");
+    fprintf(stderr, "        -j  number of checking threads (default: one per CPU)\n");
+    fprintf(stderr, "        -s  spill file the filesystem was mounted with\n");
+    exit(FSCK_ERROR);
+}
+
+int main(int argc, char *argv[])
+{
+    npheap_store *root;
+    const char *spill = NULL;
+    int batches;
+    int opt;
+    int err;
+    const char *bad;
+
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    repair = 0;
+    errors_found = 0;
+    errors_fixed = 0;
+    while((opt = getopt(argc, argv, "yj:s:")) != -1){
+        switch(opt){
+        case 'y':
+            repair = 1;
+            break;
+        case 'j':
+            nthreads = atoi(optarg);
+            break;
+        case 's':
+            spill = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if(optind != argc - 1){
+        usage();
+    }
+    if(nthreads < 1){
+        nthreads = 1;
+    }
+
+    if(heap_open(argv[optind], &bad) < 0){
+        perror(bad);
+        return FSCK_ERROR;
+    }
+    if(super_load() == NULL){
+        fprintf(stderr, "fsck.nphfs: %s does not hold an NPHeapFS filesystem\n", argv[optind]);
+        return FSCK_ERROR;
+    }
+    if(spill != NULL && (err = tier_attach(spill, 0, 0)) != 0){
+        fprintf(stderr, "fsck.nphfs: %s: %s\n", spill,
+                err == -ENOENT ? "does not hold the blocks spilled from this filesystem" : strerror(-err));
+        return FSCK_ERROR;
+    }
+    if(spill == NULL && superblock->blocks_spilled != 0){
+        fprintf(stderr, "fsck.nphfs: %llu data blocks are in a spill file, give it with -s\n",
+                (unsigned long long)superblock->blocks_spilled);
+        return FSCK_ERROR;
+    }
+
+    // Committed metadata updates are finished before anything is checked
+    batches = journal_replay(repair);
+    if(batches < 0){
+        fprintf(stderr, "fsck.nphfs: metadata journal header is damaged, run mkfs.nphfs\n");
+        return FSCK_UNCORRECTED;
+    }
+    if(batches > 0 && repair){
+        printf("Journal: replayed %d committed batches\n", batches);
+    }else if(batches > 0){
+        problem(0, "Journal: %d committed batches not replayed", batches);
+    }
+
+    root = inode_slot(0);
+    if(root == NULL || strcmp(root->filename, "/") != 0 || !S_ISDIR(root->mystat.st_mode)){
+        fprintf(stderr, "fsck.nphfs: root directory is damaged, run mkfs.nphfs\n");
+        return FSCK_UNCORRECTED;
+    }
+
+    refs = calloc(superblock->data_blocks, sizeof(uint32_t));
+    if(refs == NULL){
+        perror("fsck.nphfs");
+        return FSCK_ERROR;
+    }
+
+    printf("Pass 1: inodes and block maps\n");
+    run_parallel(scan_inodes, superblock->inode_count);
+    printf("Pass 2: names\n");
+    check_names();
+    check_links();
+    printf("Pass 3: data area\n");
+    run_parallel(scan_data, superblock->data_blocks);
+    check_counts();
+
+    printf("%s: %llu problems found, %llu fixed\n", argv[optind],
+           (unsigned long long)errors_found, (unsigned long long)errors_fixed);
+    free(refs);
+    heap_close();
+
+    if(errors_found == 0){
+        return FSCK_OK;
+    }
+    return errors_found == errors_fixed ? FSCK_CORRECTED : FSCK_UNCORRECTED;
+}
@@ -0,0 +1,218 @@
+/*
+  NPHeap File System - mkfs.nphfs
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Lays out a fresh filesystem on an npheap device: the superblock, the
+  inode table, the inode and data bitmaps, the share and checksum
+  tables, the metadata journal, the root directory and the hidden
+  snapshot directory are all written here up front, so that mounting
+  only has to map them.  Given a comma separated list of devices, all
+  of that goes on the first one and data blocks are striped over the
+  lot; the filesystem must then always be used with the same list.
+
+  usage: mkfs.nphfs [-b block_size] [-i inodes] [-d data_blocks] [-J journal_blocks] [-f] npheap_device_name[,...]
+*/
+
+#include "nphfuse_extra.h"
+#include <npheap.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define DEFAULT_INODES       8000
+#define DEFAULT_DATA_BLOCKS  (1024*1024)
+#define DEFAULT_JOURNAL_BLOCKS 64
+
+static void usage(void)
+{
+    fprintf(stderr, "usage:  mkfs.nphfs [-b block_size] [-i inodes] [-d data_blocks] [-J journal_blocks] [-f] npheap_device_name[,...]\n");
+    fprintf(stderr, "        -b  data block size, a power of two from %d to %d (default %d)\n",
+            MIN_DATA_BLOCK_SIZE, MAX_DATA_BLOCK_SIZE, BLOCK_SIZE);
+    fprintf(stderr, "        -i  number of inodes (default %d)\n", DEFAULT_INODES);
+    fprintf(stderr, "        -d  number of data blocks and block map nodes (default %d)\n", DEFAULT_DATA_BLOCKS);
+    fprintf(stderr, "        -J  number of %d byte journal objects, header included (default %d)\n",
+            BLOCK_SIZE, DEFAULT_JOURNAL_BLOCKS);
+    fprintf(stderr, "        -f  overwrite an existing filesystem\n");
+    exit(2);
+}
+
+// Make sure object id exists with exactly BLOCK_SIZE bytes and is zeroed
+static int lay_block(uint64_t id)
+{
+    uint64_t size = heap_size(id);
+    void *ptr;
+
+    if(size != 0 && size != BLOCK_SIZE){
+        heap_delete(id);
+    }
+    ptr = heap_map(id, BLOCK_SIZE);
+    if(ptr == NULL){
+        fprintf(stderr, "mkfs.nphfs: cannot allocate npheap object %llu\n", (unsigned long long)id);
+        return -1;
+    }
+    memset(ptr, 0, BLOCK_SIZE);
+    return 0;
+}
+
+// Drop every object of a filesystem we are about to overwrite, so that
+// none of them turns up with the wrong size inside the new data area
+static void wipe_old(struct nph_super *old)
+{
+    struct nph_bitmap bm;
+    uint64_t id;
+    uint64_t i;
+
+    bitmap_attach(&bm, old->data_bitmap, old->data_blocks, NULL);
+    for(i = 0; i < old->data_blocks; i++){
+        if(bitmap_test(&bm, i)){
+            id = old->data_start + i;
+            npheap_delete(heap_fd(id), id);
+        }
+    }
+    for(i = INODE_BLOCK_START; i < old->data_start; i++){
+        npheap_delete(npheap_fd, i);
+    }
+    heap_forget();
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t block_size = BLOCK_SIZE;
+    uint64_t inodes = DEFAULT_INODES;
+    uint64_t data_blocks = DEFAULT_DATA_BLOCKS;
+    uint64_t journal_blocks = DEFAULT_JOURNAL_BLOCKS;
+    const char *bad;
+    int force = 0;
+    int opt;
+    uint64_t id;
+    struct nph_super layout;
+    struct nph_super *sb;
+    npheap_store *root;
+    npheap_store *snapdir;
+    struct timeval currTime;
+
+    while((opt = getopt(argc, argv, "b:i:d:J:f")) != -1){
+        switch(opt){
+        case 'b':
+            block_size = strtoull(optarg, NULL, 0);
+            break;
+        case 'i':
+            inodes = strtoull(optarg, NULL, 0);
+            break;
+        case 'd':
+            data_blocks = strtoull(optarg, NULL, 0);
+            break;
+        case 'J':
+            journal_blocks = strtoull(optarg, NULL, 0);
+            break;
+        case 'f':
+            force = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+    if(optind != argc - 1){
+        usage();
+    }
+    if(!super_block_size_ok(block_size)){
+        fprintf(stderr, "mkfs.nphfs: block size %llu is not a power of two between %d and %d\n",
+                (unsigned long long)block_size, MIN_DATA_BLOCK_SIZE, MAX_DATA_BLOCK_SIZE);
+        return 1;
+    }
+    if(inodes == 0 || data_blocks == 0){
+        fprintf(stderr, "mkfs.nphfs: need at least one inode and one data block\n");
+        return 1;
+    }
+    if(journal_blocks < 2){
+        fprintf(stderr, "mkfs.nphfs: the journal needs at least 2 objects\n");
+        return 1;
+    }
+
+    if(heap_open(argv[optind], &bad) < 0){
+        perror(bad);
+        return 1;
+    }
+
+    sb = super_load();
+    if(sb != NULL){
+        if(!force){
+            fprintf(stderr, "mkfs.nphfs: %s already holds a filesystem, use -f to overwrite it\n",
+                    argv[optind]);
+            return 1;
+        }
+        wipe_old(sb);
+    }
+
+    // Work out where everything goes
+    memset(&layout, 0, sizeof(layout));
+    layout.magic = NPH_MAGIC;
+    layout.version = NPH_VERSION;
+    layout.block_size = block_size;
+    layout.inode_blocks = (inodes + TOTAL_BLOCKS - 1) / TOTAL_BLOCKS;
+    layout.inode_count = layout.inode_blocks * TOTAL_BLOCKS;
+    layout.inode_bitmap = INODE_BLOCK_START + layout.inode_blocks;
+    layout.data_bitmap = layout.inode_bitmap + bitmap_objects(layout.inode_count);
+    layout.share_table = layout.data_bitmap + bitmap_objects(data_blocks);
+    layout.csum_table = layout.share_table + share_objects(data_blocks);
+    layout.journal_start = layout.csum_table + csum_objects(data_blocks);
+    layout.journal_blocks = journal_blocks;
+    layout.data_start = layout.journal_start + journal_blocks;
+    layout.data_blocks = data_blocks;
+    layout.stripes = heap_devices();
+
+    // Superblock, inode table, both bitmaps, the share and checksum
+    // tables and the journal are one contiguous run
+    for(id = ROOT_BLOCK; id < layout.data_start; id++){
+        if(lay_block(id) != 0){
+            return 1;
+        }
+    }
+
+    sb = (struct nph_super *)heap_map(ROOT_BLOCK, BLOCK_SIZE);
+    memcpy(sb, &layout, sizeof(layout));
+    if(super_load() == NULL){
+        fprintf(stderr, "mkfs.nphfs: superblock did not read back\n");
+        return 1;
+    }
+    journal_format();
+
+    // Root directory lives in inode slot 0
+    root = inode_slot(0);
+    bitmap_set(&inode_bitmap, 0);
+    strcpy(root->dirname, "/");
+    strcpy(root->filename, "/");
+    root->mystat.st_ino = ROOT_INO;
+    root->mystat.st_mode = S_IFDIR | 0755;
+    root->mystat.st_nlink = 2;
+    root->mystat.st_size = BLOCK_SIZE;
+    root->mystat.st_blksize = block_size;
+    root->mystat.st_uid = getuid();
+    root->mystat.st_gid = getgid();
+    gettimeofday(&currTime, NULL);
+    root->mystat.st_atime = currTime.tv_sec;
+    root->mystat.st_mtime = currTime.tv_sec;
+    root->mystat.st_ctime = currTime.tv_sec;
+
+    // Snapshots are made and listed under a hidden directory in slot 1
+    snapdir = inode_slot(1);
+    bitmap_set(&inode_bitmap, 1);
+    strcpy(snapdir->dirname, "/");
+    strcpy(snapdir->filename, SNAPSHOT_DIR + 1);
+    snapdir->mystat = root->mystat;
+    snapdir->mystat.st_ino = 1 + ROOT_INO;
+    snapdir->mystat.st_mode = S_IFDIR | 0555;
+    snapdir->mystat.st_size = BLOCK_SIZE/2;
+
+    printf("%s: %llu byte blocks, %llu inodes, %llu data blocks over %llu devices, data starts at object %llu\n",
+           argv[optind], (unsigned long long)layout.block_size,
+           (unsigned long long)layout.inode_count, (unsigned long long)layout.data_blocks,
+           (unsigned long long)layout.stripes, (unsigned long long)layout.data_start);
+    heap_close();
+    return 0;
+}
@@ -0,0 +1,557 @@
+/*
+  NPHeap File System - nphfs-archive
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Streams a whole filesystem to a sequential archive (-c) and loads
+  such an archive straight into the npheap layout (-x), without going
+  through FUSE.  Loading fills inode slots and block maps directly and
+  reads file contents from the stream into the data blocks, so seeding
+  a heap costs one pass over the archive instead of a mknod and a run
+  of writes (each with a full inode scan) per file.
+
+  Archive layout:
+    header          magic, version, block size it was taken with
+    entry ...       one per inode, parents before their children; a
+                    regular file's entry is followed by its extents,
+                    each an (offset, length) pair and that many bytes,
+                    ending with a zero length.  Holes are not stored.
+    end entry
+
+  Like fsck.nphfs it works on a heap that is not mounted.  Loading
+  adds to whatever is already there; entries whose name is taken or
+  whose parent is missing are skipped.  Snapshots, extended
+  attributes and quota limits are not archived, and every name of a
+  hard-linked file comes back as a copy of its own.  A symlink's
+  target is archived as its contents.
+  Compressed blocks are archived decoded and loaded back uncompressed;
+  a file keeps its compression flag for the blocks it writes later.
+  A block that cannot be read, or fails its checksum, is reported and
+  left out as a hole, and the archive run fails.  Version 3 entries
+  carry the nanoseconds of each time; version 2 archives still load,
+  with whole seconds.
+
+  usage: nphfs-archive -c|-x [-f archive] [-s spill_file] npheap_device_name[,...]
+*/
+
+#include "nphfuse_extra.h"
+#include <npheap.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define ARCHIVE_MAGIC    0x5643524153504e4eULL
+#define ARCHIVE_VERSION  3
+#define ENTRY_MAGIC      0x59525445ULL
+#define END_MAGIC        0x444e45ULL
+#define STREAM_BUFFER    (1024*1024)
+
+struct archive_header {
+  uint64_t magic;
+  uint64_t version;
+  uint64_t block_size;
+};
+
+struct archive_entry {
+  uint64_t magic;
+  char dirname[FILE_MAX];
+  char filename[DIR_MAX];
+  uint64_t mode;
+  uint64_t uid;
+  uint64_t gid;
+  uint64_t nlink;
+  uint64_t rdev;
+  uint64_t size;
+  uint64_t atime;
+  uint64_t mtime;
+  uint64_t ctime;
+  uint64_t flags;
+  uint64_t atime_nsec;            // from version 3 on
+  uint64_t mtime_nsec;
+  uint64_t ctime_nsec;
+};
+
+// What a version 2 entry holds
+#define ENTRY_V2_SIZE  offsetof(struct archive_entry, atime_nsec)
+
+struct archive_extent {
+  uint64_t offset;
+  uint64_t len;
+};
+
+static FILE *stream;
+static uint64_t entries_done = 0;
+static uint64_t bytes_done = 0;
+static int stream_error = 0;
+
+static void usage(void)
+{
+    fprintf(stderr, "usage:  nphfs-archive -c|-x [-f archive] [-s spill_file] npheap_device_name[,...]\n");
+    fprintf(stderr, "        -c  write the filesystem to the archive\n");
+    fprintf(stderr, "        -x  load the archive into the filesystem\n");
+    fprintf(stderr, "        -f  archive file (default: standard output or input)\n");
+    fprintf(stderr, "        -s  spill file the filesystem was mounted with\n");
+    exit(2);
+}
+
+static void put(const void *buf, size_t len)
+{
+    if(!stream_error && fwrite(buf, 1, len, stream) != len){
+        stream_error = 1;
+    }
+}
+
+static int get(void *buf, size_t len)
+{
+    return fread(buf, 1, len, stream) == len ? 0 : -1;
+}
+
+static void full_path(char *out, size_t len, const char *dir, const char *name)
+{
+    if(strcmp(dir, "/") == 0){
+        snprintf(out, len, "/%s", name);
+    }else{
+        snprintf(out, len, "%s/%s", dir, name);
+    }
+}
+
+// FNV-1a of a full path; never 0 so it can be used as a map key
+static uint64_t path_hash(const char *path)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    const char *p;
+
+    for(p = path; *p; p++){
+        h = (h ^ (unsigned char)*p) * 0x100000001b3ULL;
+    }
+    return h ? h : 1;
+}
+
+static int path_depth(const char *dir)
+{
+    int depth = 0;
+
+    if(strcmp(dir, "/") == 0){
+        return 0;
+    }
+    for(; *dir; dir++){
+        depth += *dir == '/';
+    }
+    return depth;
+}
+
+struct live_inode {
+  int depth;
+  uint64_t index;
+};
+
+static int by_depth(const void *a, const void *b)
+{
+    const struct live_inode *la = (const struct live_inode *)a;
+    const struct live_inode *lb = (const struct live_inode *)b;
+
+    if(la->depth != lb->depth){
+        return la->depth - lb->depth;
+    }
+    return la->index < lb->index ? -1 : la->index > lb->index;
+}
+
+struct export_file {
+  const char *path;
+  uint64_t size;
+  uint64_t bad;                   // blocks that could not be read
+};
+
+static void export_block(uint64_t blkno, uint64_t id, void *arg)
+{
+    struct export_file *file = (struct export_file *)arg;
+    struct archive_extent ext;
+    static char data[MAX_DATA_BLOCK_SIZE];
+
+    ext.offset = blkno * data_block_size;
+    if(ext.offset >= file->size){
+        return;
+    }
+    ext.len = file->size - ext.offset;
+    if(ext.len > data_block_size){
+        ext.len = data_block_size;
+    }
+    // Compressed blocks go into the archive decoded
+    if(zblock_read(id, data, 0, ext.len) != 0){
+        fprintf(stderr, "nphfs-archive: %s: block %llu is missing or damaged, left out\n",
+                file->path, (unsigned long long)blkno);
+        file->bad++;
+        return;
+    }
+    put(&ext, sizeof(ext));
+    put(data, ext.len);
+    bytes_done += ext.len;
+}
+
+static int do_export(void)
+{
+    struct archive_header hdr;
+    struct archive_entry ent;
+    struct archive_extent end;
+    struct archive_extent ext;
+    struct export_file file;
+    npheap_store *inode;
+    struct live_inode *live;
+    char path[DIR_MAX + FILE_MAX];
+    uint64_t count = 0;
+    uint64_t bad = 0;
+    uint64_t index;
+    uint64_t i;
+
+    live = malloc(superblock->inode_count * sizeof(struct live_inode));
+    if(live == NULL){
+        perror("nphfs-archive");
+        return 1;
+    }
+    // Slot 0 is the root, which every filesystem already has; snapshots
+    // stay behind with the heap they were taken on
+    for(index = 1; index < superblock->inode_count; index++){
+        inode = inode_slot(index);
+        if(inode != NULL && bitmap_test(&inode_bitmap, index) && inode->filename[0] != '\0' &&
+           !snapshot_inode(inode)){
+            live[count].depth = path_depth(inode->dirname);
+            live[count].index = index;
+            count++;
+        }
+    }
+    qsort(live, count, sizeof(struct live_inode), by_depth);
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = ARCHIVE_MAGIC;
+    hdr.version = ARCHIVE_VERSION;
+    hdr.block_size = data_block_size;
+    put(&hdr, sizeof(hdr));
+
+    memset(&end, 0, sizeof(end));
+    for(i = 0; i < count && !stream_error; i++){
+        inode = inode_slot(live[i].index);
+        memset(&ent, 0, sizeof(ent));
+        ent.magic = ENTRY_MAGIC;
+        memcpy(ent.dirname, inode->dirname, sizeof(ent.dirname));
+        memcpy(ent.filename, inode->filename, sizeof(ent.filename));
+        inode = inode_resolve(inode);
+        if(inode == NULL){
+            continue;
+        }
+        ent.mode = inode->mystat.st_mode;
+        ent.uid = inode->mystat.st_uid;
+        ent.gid = inode->mystat.st_gid;
+        ent.nlink = S_ISDIR(inode->mystat.st_mode) ? inode->mystat.st_nlink : 1;
+        ent.rdev = inode->mystat.st_rdev;
+        ent.size = inode->mystat.st_size;
+        ent.atime = inode->mystat.st_atim.tv_sec;
+        ent.mtime = inode->mystat.st_mtim.tv_sec;
+        ent.ctime = inode->mystat.st_ctim.tv_sec;
+        ent.atime_nsec = inode->mystat.st_atim.tv_nsec;
+        ent.mtime_nsec = inode->mystat.st_mtim.tv_nsec;
+        ent.ctime_nsec = inode->mystat.st_ctim.tv_nsec;
+        ent.flags = inode->flags;
+        put(&ent, sizeof(ent));
+        if(INODE_FAST_SYMLINK(inode) && inode->mystat.st_size <= XATTR_INLINE){
+            ext.offset = 0;
+            ext.len = inode->mystat.st_size;
+            put(&ext, sizeof(ext));
+            put(inode->xattr_inline, ext.len);
+            put(&end, sizeof(end));
+        }else if(S_ISREG(inode->mystat.st_mode) || S_ISLNK(inode->mystat.st_mode)){
+            full_path(path, sizeof(path), ent.dirname, ent.filename);
+            file.path = path;
+            file.size = inode->mystat.st_size;
+            file.bad = 0;
+            bmap_walk(inode, export_block, &file);
+            put(&end, sizeof(end));
+            bad += file.bad;
+        }
+        entries_done++;
+    }
+
+    memset(&ent, 0, sizeof(ent));
+    ent.magic = END_MAGIC;
+    put(&ent, sizeof(ent));
+    free(live);
+    if(stream_error || fflush(stream) != 0){
+        perror("nphfs-archive: write");
+        return 1;
+    }
+    if(bad != 0){
+        fprintf(stderr, "nphfs-archive: %llu data blocks could not be read, run fsck.nphfs\n",
+                (unsigned long long)bad);
+        return 1;
+    }
+    return 0;
+}
+
+// Read the target of a symlink short enough to be kept in the inode
+static int load_inline(npheap_store *inode)
+{
+    struct archive_extent ext;
+    char target[XATTR_INLINE];
+
+    for(;;){
+        if(get(&ext, sizeof(ext)) != 0){
+            return -1;
+        }
+        if(ext.len == 0){
+            return 0;
+        }
+        if(ext.offset + ext.len > sizeof(target) || get(target, ext.len) != 0){
+            return -1;
+        }
+        if(inode != NULL){
+            memcpy(inode->xattr_inline + ext.offset, target, ext.len);
+        }
+    }
+}
+
+// Read the extents of a file into inode, or throw them away when inode
+// is NULL.  Returns 0, or -1 on a short archive or a full heap.
+static int load_extents(npheap_store *inode)
+{
+    struct archive_extent ext;
+    static char scratch[MAX_DATA_BLOCK_SIZE];
+    uint64_t blk_id;
+    uint64_t rem;
+    uint64_t chunk;
+    char *data;
+
+    for(;;){
+        if(get(&ext, sizeof(ext)) != 0){
+            return -1;
+        }
+        if(ext.len == 0){
+            return 0;
+        }
+        while(ext.len > 0){
+            rem = ext.offset % data_block_size;
+            chunk = data_block_size - rem;
+            if(chunk > ext.len){
+                chunk = ext.len;
+            }
+            data = scratch;
+            if(inode != NULL){
+                // Straight from the stream into the data block
+                blk_id = bmap_alloc(inode, ext.offset / data_block_size, NULL);
+                data = (char *)heap_get(blk_id);
+                if(data == NULL){
+                    fprintf(stderr, "nphfs-archive: out of data blocks\n");
+                    return -1;
+                }
+                data += rem;
+            }
+            if(get(data, chunk) != 0){
+                return -1;
+            }
+            if(inode != NULL){
+                csum_update(blk_id, data - rem, data_block_size);
+                bytes_done += chunk;
+            }
+            ext.offset += chunk;
+            ext.len -= chunk;
+        }
+    }
+}
+
+static int do_import(void)
+{
+    struct archive_header hdr;
+    struct archive_entry ent;
+    struct nph_map names;
+    npheap_store *inode;
+    char path[DIR_MAX + FILE_MAX];
+    uint64_t parent;
+    uint64_t index;
+    int64_t slot;
+    int skipped = 0;
+    int rc = 0;
+
+    if(get(&hdr, sizeof(hdr)) != 0 || hdr.magic != ARCHIVE_MAGIC){
+        fprintf(stderr, "nphfs-archive: input is not an archive\n");
+        return 1;
+    }
+    if(hdr.version != ARCHIVE_VERSION && hdr.version != 2){
+        fprintf(stderr, "nphfs-archive: archive version %llu is not supported\n",
+                (unsigned long long)hdr.version);
+        return 1;
+    }
+
+    // One pass over the table up front; every lookup after that is a hash probe
+    nph_map_init(&names);
+    nph_map_put(&names, path_hash("/"), 1);
+    for(index = 1; index < superblock->inode_count; index++){
+        inode = inode_slot(index);
+        if(inode != NULL && bitmap_test(&inode_bitmap, index) && inode->filename[0] != '\0'){
+            full_path(path, sizeof(path), inode->dirname, inode->filename);
+            nph_map_put(&names, path_hash(path), index + 1);
+        }
+    }
+
+    for(;;){
+        memset(&ent, 0, sizeof(ent));
+        if(get(&ent, hdr.version == 2 ? ENTRY_V2_SIZE : sizeof(ent)) != 0){
+            fprintf(stderr, "nphfs-archive: archive is truncated\n");
+            rc = 1;
+            break;
+        }
+        if(ent.magic == END_MAGIC){
+            break;
+        }
+        if(ent.magic != ENTRY_MAGIC){
+            fprintf(stderr, "nphfs-archive: archive is damaged\n");
+            rc = 1;
+            break;
+        }
+        ent.dirname[sizeof(ent.dirname) - 1] = '\0';
+        ent.filename[sizeof(ent.filename) - 1] = '\0';
+        full_path(path, sizeof(path), ent.dirname, ent.filename);
+
+        inode = NULL;
+        if(nph_map_get(&names, path_hash(path), NULL)){
+            fprintf(stderr, "nphfs-archive: %s already exists, skipped\n", path);
+            skipped++;
+        }else if(!nph_map_get(&names, path_hash(ent.dirname), &parent) ||
+                 (parent > 1 && !S_ISDIR(inode_slot(parent - 1)->mystat.st_mode))){
+            fprintf(stderr, "nphfs-archive: %s has no parent directory, skipped\n", path);
+            skipped++;
+        }else{
+            slot = bitmap_alloc(&inode_bitmap);
+            inode = slot < 0 ? NULL : inode_slot(slot);
+            if(inode == NULL){
+                fprintf(stderr, "nphfs-archive: out of inodes at %s\n", path);
+                rc = 1;
+                break;
+            }
+            memset(inode, 0, sizeof(npheap_store));
+            strcpy(inode->dirname, ent.dirname);
+            strcpy(inode->filename, ent.filename);
+            inode->mystat.st_ino = slot + ROOT_INO;
+            inode->mystat.st_mode = ent.mode;
+            inode->mystat.st_uid = ent.uid;
+            inode->mystat.st_gid = ent.gid;
+            inode->mystat.st_nlink = ent.nlink;
+            inode->mystat.st_rdev = ent.rdev;
+            inode->mystat.st_size = ent.size;
+            inode->mystat.st_blksize = data_block_size;
+            inode->mystat.st_atim.tv_sec = ent.atime;
+            inode->mystat.st_mtim.tv_sec = ent.mtime;
+            inode->mystat.st_ctim.tv_sec = ent.ctime;
+            inode->mystat.st_atim.tv_nsec = ent.atime_nsec;
+            inode->mystat.st_mtim.tv_nsec = ent.mtime_nsec;
+            inode->mystat.st_ctim.tv_nsec = ent.ctime_nsec;
+            inode->flags = ent.flags;
+            nph_map_put(&names, path_hash(path), slot + 1);
+            entries_done++;
+        }
+        if(S_ISLNK(ent.mode) && ent.size <= XATTR_INLINE){
+            if(load_inline(inode) != 0){
+                fprintf(stderr, "nphfs-archive: could not load the target of %s\n", path);
+                rc = 1;
+                break;
+            }
+        }else if((S_ISREG(ent.mode) || S_ISLNK(ent.mode)) && load_extents(inode) != 0){
+            fprintf(stderr, "nphfs-archive: could not load the contents of %s\n", path);
+            rc = 1;
+            break;
+        }
+    }
+    nph_map_destroy(&names);
+    if(skipped != 0){
+        fprintf(stderr, "nphfs-archive: %d entries skipped\n", skipped);
+    }
+    return rc;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *archive = "-";
+    const char *spill = NULL;
+    struct timeval start;
+    struct timeval end;
+    int mode = 0;
+    int opt;
+    const char *bad;
+    int rc;
+    int err;
+
+    entries_done = 0;
+    bytes_done = 0;
+    stream_error = 0;
+    while((opt = getopt(argc, argv, "cxf:s:")) != -1){
+        switch(opt){
+        case 'c':
+        case 'x':
+            mode = opt;
+            break;
+        case 'f':
+            archive = optarg;
+            break;
+        case 's':
+            spill = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if(mode == 0 || optind != argc - 1){
+        usage();
+    }
+
+    if(heap_open(argv[optind], &bad) < 0){
+        perror(bad);
+        return 1;
+    }
+    if(super_load() == NULL){
+        fprintf(stderr, "nphfs-archive: %s does not hold an NPHeapFS filesystem\n", argv[optind]);
+        return 1;
+    }
+    if(spill != NULL && (err = tier_attach(spill, 0, 0)) != 0){
+        fprintf(stderr, "nphfs-archive: %s: %s\n", spill,
+                err == -ENOENT ? "does not hold the blocks spilled from this filesystem" : strerror(-err));
+        return 1;
+    }
+    if(spill == NULL && superblock->blocks_spilled != 0){
+        fprintf(stderr, "nphfs-archive: %llu data blocks are in a spill file, give it with -s\n",
+                (unsigned long long)superblock->blocks_spilled);
+        return 1;
+    }
+    // Work from the state the last mount committed
+    if(journal_replay(1) < 0){
+        fprintf(stderr, "nphfs-archive: metadata journal is damaged, run fsck.nphfs\n");
+        return 1;
+    }
+
+    if(strcmp(archive, "-") == 0){
+        stream = mode == 'c' ? stdout : stdin;
+    }else{
+        stream = fopen(archive, mode == 'c' ? "w" : "r");
+        if(stream == NULL){
+            perror(archive);
+            return 1;
+        }
+    }
+    setvbuf(stream, NULL, _IOFBF, STREAM_BUFFER);
+
+    gettimeofday(&start, NULL);
+    rc = mode == 'c' ? do_export() : do_import();
+    gettimeofday(&end, NULL);
+    if(stream != stdout && stream != stdin){
+        fclose(stream);
+    }else{
+        fflush(stream);
+    }
+
+    fprintf(stderr, "nphfs-archive: %llu entries, %llu bytes of data in %.2f s\n",
+            (unsigned long long)entries_done, (unsigned long long)bytes_done,
+            (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6);
+    heap_close();
+    return rc;
+}
@@ -0,0 +1,120 @@
+/*
+  NPHeap File System - nphfs-clone
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Copies a file on a mounted nphfuse by having the filesystem share
+  the source's data blocks with the destination (NPHFS_IOC_CLONE),
+  instead of reading every block across FUSE and writing it back.  The
+  destination is created if it does not exist and is otherwise written
+  over from dst_offset on; both files must be on the same mount.
+
+  usage: nphfs-clone [-s src_offset] [-d dst_offset] [-l length] source dest
+*/
+
+#include "nphfuse_extra.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void usage(void)
+{
+    fprintf(stderr, "usage:  nphfs-clone [-s src_offset] [-d dst_offset] [-l length] source dest\n");
+    fprintf(stderr, "        -s  where to start in source (default 0)\n");
+    fprintf(stderr, "        -d  where to start in dest (default 0)\n");
+    fprintf(stderr, "        -l  bytes to copy (default: to the end of source)\n");
+    exit(2);
+}
+
+// Top directory of the mount holding path, found by walking up until
+// the device changes
+static int mount_root(const char *path, dev_t dev, char *root)
+{
+    char parent[PATH_MAX];
+    struct stat st;
+
+    strcpy(root, path);
+    for(;;){
+        strcpy(parent, root);
+        dirname(parent);
+        if(strcmp(parent, root) == 0 || stat(parent, &st) != 0 || st.st_dev != dev){
+            return 0;
+        }
+        strcpy(root, parent);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    struct nphfs_clone_range req;
+    struct stat src_st;
+    struct stat dst_st;
+    char source[PATH_MAX];
+    char root[PATH_MAX];
+    size_t len;
+    int opt;
+    int fd;
+
+    memset(&req, 0, sizeof(req));
+    while((opt = getopt(argc, argv, "s:d:l:")) != -1){
+        switch(opt){
+        case 's':
+            req.src_offset = strtoull(optarg, NULL, 0);
+            break;
+        case 'd':
+            req.dst_offset = strtoull(optarg, NULL, 0);
+            break;
+        case 'l':
+            req.length = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            usage();
+        }
+    }
+    if(optind != argc - 2){
+        usage();
+    }
+
+    if(realpath(argv[optind], source) == NULL || stat(source, &src_st) != 0){
+        perror(argv[optind]);
+        return 1;
+    }
+    fd = open(argv[optind + 1], O_WRONLY | O_CREAT, 0644);
+    if(fd < 0 || fstat(fd, &dst_st) != 0){
+        perror(argv[optind + 1]);
+        return 1;
+    }
+    if(src_st.st_dev != dst_st.st_dev){
+        fprintf(stderr, "nphfs-clone: %s and %s are not on the same filesystem\n",
+                argv[optind], argv[optind + 1]);
+        return 1;
+    }
+
+    // The filesystem knows the source by its path below the mount point
+    mount_root(source, src_st.st_dev, root);
+    len = strlen(root);
+    if(strcmp(root, "/") == 0){
+        len = 0;
+    }
+    if(strlen(source + len) >= sizeof(req.source)){
+        fprintf(stderr, "nphfs-clone: %s: path too long\n", argv[optind]);
+        return 1;
+    }
+    strcpy(req.source, source + len);
+
+    if(ioctl(fd, NPHFS_IOC_CLONE, &req) != 0){
+        if(errno == ENOTTY){
+            fprintf(stderr, "nphfs-clone: %s is not on an nphfuse mount\n", argv[optind + 1]);
+        }else{
+            perror("nphfs-clone");
+        }
+        return 1;
+    }
+    close(fd);
+    return 0;
+}
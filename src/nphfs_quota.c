@@ -0,0 +1,125 @@
+/*
+  NPHeap File System - nphfs-quota
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Lists the inodes and bytes every user and group uses on a mounted
+  nphfuse, with their limits (NPHFS_IOC_QUOTA), or sets the limits of
+  one user or group (NPHFS_IOC_SETQUOTA).  A limit of 0 is no limit.
+  Only the user who mounted the filesystem can set limits.  Any file
+  or directory on the mount will do.
+
+  usage: nphfs-quota [path]
+         nphfs-quota -u uid | -g gid [-i inodes] [-b bytes] [path]
+*/
+
+#include "nphfuse_extra.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void usage(void)
+{
+    fprintf(stderr, "usage:  nphfs-quota [path]\n");
+    fprintf(stderr, "        nphfs-quota -u uid | -g gid [-i inodes] [-b bytes] [path]\n");
+    fprintf(stderr, "        -u, -g  user or group whose limits to set\n");
+    fprintf(stderr, "        -i      most inodes it may have, 0 for no limit (default 0)\n");
+    fprintf(stderr, "        -b      most bytes it may have, 0 for no limit (default 0)\n");
+    exit(2);
+}
+
+static void print_limit(uint64_t limit)
+{
+    if(limit == 0){
+        printf(" %14s", "-");
+    }else{
+        printf(" %14llu", (unsigned long long)limit);
+    }
+}
+
+static int report(int fd)
+{
+    struct nphfs_quota_report r;
+    struct nphfs_quota *q;
+    uint32_t i;
+
+    printf("%-6s %10s %14s %14s %14s %14s\n", "type", "id", "inodes", "limit", "bytes", "limit");
+    memset(&r, 0, sizeof(r));
+    do{
+        if(ioctl(fd, NPHFS_IOC_QUOTA, &r) != 0){
+            return -1;
+        }
+        for(i = 0; i < r.count; i++){
+            q = &r.entries[i];
+            printf("%-6s %10u %14llu", q->type == QUOTA_USER ? "user" : "group", q->id,
+                   (unsigned long long)q->inodes);
+            print_limit(q->inode_limit);
+            printf(" %14llu", (unsigned long long)q->bytes);
+            print_limit(q->byte_limit);
+            printf("\n");
+        }
+        r.first += r.count;
+    }while(r.count != 0 && r.first < r.total);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct nphfs_quota q;
+    const char *path = ".";
+    int fd;
+    int opt;
+    int err;
+
+    memset(&q, 0, sizeof(q));
+    while((opt = getopt(argc, argv, "u:g:i:b:")) != -1){
+        switch(opt){
+        case 'u':
+            q.type = QUOTA_USER;
+            q.id = strtoul(optarg, NULL, 0);
+            break;
+        case 'g':
+            q.type = QUOTA_GROUP;
+            q.id = strtoul(optarg, NULL, 0);
+            break;
+        case 'i':
+            q.inode_limit = strtoull(optarg, NULL, 0);
+            break;
+        case 'b':
+            q.byte_limit = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            usage();
+        }
+    }
+    if(optind < argc - 1 || (q.type == 0 && (q.inode_limit != 0 || q.byte_limit != 0))){
+        usage();
+    }
+    if(optind == argc - 1){
+        path = argv[optind];
+    }
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0){
+        perror(path);
+        return 1;
+    }
+    if(q.type != 0){
+        err = ioctl(fd, NPHFS_IOC_SETQUOTA, &q);
+    }else{
+        err = report(fd);
+    }
+    if(err != 0){
+        if(errno == ENOTTY){
+            fprintf(stderr, "nphfs-quota: %s is not on an nphfuse mount\n", path);
+        }else{
+            perror("nphfs-quota");
+        }
+        return 1;
+    }
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,747 @@
+/*
+  NPHeap File System - nphfs-replay
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Runs the operations of a trace written with -o trace=FILE against a
+  mounted filesystem again and reports how long they took, next to how
+  long they took when they were recorded.  With -n it only reports the
+  trace.
+
+  A trace keeps hashes, not paths, so every path in it becomes a name
+  in dir made from its hash and the tree comes out flat.  Before the
+  clock starts, every path that was already there when the trace began
+  is made: a directory if the first thing done to it was a directory
+  operation, else a file as long as the furthest read of it.  Each
+  thread of the trace gets a thread here that runs its operations in
+  order, at the times they were recorded or, with -m, as fast as it
+  can.  Releases, flushes and ioctls have no call of their own and are
+  left out.
+
+  usage: nphfs-replay [-m] trace [dir]
+         nphfs-replay -n trace
+*/
+
+// fallocate()
+#define _GNU_SOURCE
+#include "nphfuse_extra.h"
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/statvfs.h>
+#ifdef HAVE_SYS_XATTR_H
+#include <sys/xattr.h>
+#endif
+
+#define REPLAY_SKIPPED  UINT64_MAX      // latency of an operation not run
+#define REPLAY_MAX_IO   (16 << 20)      // largest read or write replayed
+#define FILL_CHUNK      65536
+
+static const char *op_names[TRACE_OPS] = {
+    NULL, "getattr", "readlink", "mknod", "mkdir", "unlink",
+    "rmdir", "symlink", "rename", "link", "chmod",
+    "chown", "truncate", "utime", "open", "read",
+    "write", "statfs", "flush", "release", "fsync",
+    "setxattr", "getxattr", "listxattr", "removexattr",
+    "opendir", "readdir", "releasedir", "fsyncdir",
+    "access", "ftruncate", "fgetattr", "ioctl",
+    "fallocate"
+};
+
+enum { KIND_NONE, KIND_FILE, KIND_DIR };
+
+// A path of the trace
+struct replay_file {
+    uint64_t hash;
+    int kind;                           // what to make before starting
+    uint64_t size;                      // furthest read, for a file
+    int fd;                             // open read-write, or -1
+};
+
+static struct nphfs_trace_record *records;
+static uint64_t record_count;
+static uint64_t *latency;               // per record, REPLAY_SKIPPED if not run
+static uint64_t **thread_records;       // indexes of each thread's records
+static uint64_t *thread_counts;
+static uint32_t thread_count;
+
+static struct nph_map by_path;          // path hash to index in files
+static struct replay_file *files;
+static uint64_t file_count;
+static const char *dir;
+static pthread_mutex_t fd_lock = PTHREAD_MUTEX_INITIALIZER;
+static int *stale_fds;                  // fds of names since unlinked or renamed
+static uint64_t stale_count;
+static uint64_t stale_cap;
+
+static int fast = 0;
+static uint64_t start_ns;
+static uint64_t differed = 0;           // failed here but not in the trace, or the other way
+
+static void usage(void)
+{
+    fprintf(stderr, "usage:  nphfs-replay [-m] trace [dir]\n");
+    fprintf(stderr, "        nphfs-replay -n trace\n");
+    fprintf(stderr, "        -m  run every operation as soon as the one before it is done\n");
+    fprintf(stderr, "        -n  only report the latencies the trace recorded\n");
+    fprintf(stderr, "        dir directory on the mount to replay in (default .)\n");
+    exit(2);
+}
+
+static int load(const char *path)
+{
+    struct nphfs_trace_header hdr;
+    struct stat st;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if(f == NULL){
+        perror(path);
+        return -1;
+    }
+    if(fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != TRACE_MAGIC ||
+       hdr.version != TRACE_VERSION || hdr.record_size != sizeof(struct nphfs_trace_record)){
+        fprintf(stderr, "%s: not a trace this version of nphfs-replay reads\n", path);
+        fclose(f);
+        return -1;
+    }
+    // A mount that never got to unmount leaves the count at 0
+    record_count = hdr.records;
+    if(record_count == 0 && fstat(fileno(f), &st) == 0 && st.st_size > (off_t)sizeof(hdr)){
+        record_count = (st.st_size - sizeof(hdr)) / sizeof(struct nphfs_trace_record);
+    }
+    records = (struct nphfs_trace_record *)malloc((record_count + 1) *
+                                                  sizeof(struct nphfs_trace_record));
+    if(records == NULL){
+        fprintf(stderr, "%s: not enough memory for %llu records\n", path,
+                (unsigned long long)record_count);
+        fclose(f);
+        return -1;
+    }
+    record_count = fread(records, sizeof(struct nphfs_trace_record), record_count, f);
+    fclose(f);
+
+    printf("%s: %llu operations", path, (unsigned long long)record_count);
+    if(hdr.dropped != 0){
+        printf(", %llu more lost while tracing", (unsigned long long)hdr.dropped);
+    }
+    printf("\n");
+    return 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double pct(const uint64_t *sorted, uint64_t n, double p)
+{
+    uint64_t i = (uint64_t)(p * (double)(n - 1) + 0.5);
+
+    return (double)sorted[i] / 1000.0;
+}
+
+static void print_row(const char *name, uint64_t *lat, uint64_t n)
+{
+    qsort(lat, n, sizeof(uint64_t), cmp_u64);
+    printf("%-12s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", name, (unsigned long long)n,
+           pct(lat, n, 0.50), pct(lat, n, 0.90), pct(lat, n, 0.99), pct(lat, n, 0.999),
+           (double)lat[n - 1] / 1000.0);
+}
+
+// Latency percentiles in microseconds per operation, from the trace
+// or, with measured, from the replay
+static int report(const char *title, int measured)
+{
+    uint64_t *lat;
+    uint64_t *all;
+    uint64_t n;
+    uint64_t total = 0;
+    uint64_t i;
+    uint32_t op;
+
+    lat = (uint64_t *)malloc((record_count + 1) * sizeof(uint64_t));
+    all = (uint64_t *)malloc((record_count + 1) * sizeof(uint64_t));
+    if(lat == NULL || all == NULL){
+        fprintf(stderr, "nphfs-replay: not enough memory\n");
+        free(lat);
+        free(all);
+        return -1;
+    }
+    printf("\n%s (microseconds)\n", title);
+    printf("%-12s %10s %10s %10s %10s %10s %10s\n", "operation", "count", "p50", "p90",
+           "p99", "p99.9", "max");
+    for(op = 1; op < TRACE_OPS; op++){
+        n = 0;
+        for(i = 0; i < record_count; i++){
+            if(records[i].op != op){
+                continue;
+            }
+            if(measured && latency[i] == REPLAY_SKIPPED){
+                continue;
+            }
+            lat[n++] = measured ? latency[i] : records[i].latency_ns;
+        }
+        if(n == 0){
+            continue;
+        }
+        memcpy(all + total, lat, n * sizeof(uint64_t));
+        total += n;
+        print_row(op_names[op], lat, n);
+    }
+    if(total != 0){
+        print_row("all", all, total);
+    }
+    free(lat);
+    free(all);
+    return 0;
+}
+
+static struct replay_file *file_of(uint64_t hash)
+{
+    uint64_t index;
+
+    return hash != 0 && nph_map_get(&by_path, hash, &index) ? &files[index] : NULL;
+}
+
+static int file_add(uint64_t hash, int kind)
+{
+    struct replay_file *grown;
+
+    if(hash == 0 || file_of(hash) != NULL){
+        return 0;
+    }
+    grown = (struct replay_file *)realloc(files, (file_count + 1) * sizeof(struct replay_file));
+    if(grown == NULL){
+        return -1;
+    }
+    files = grown;
+    files[file_count].hash = hash;
+    files[file_count].kind = kind;
+    files[file_count].size = 0;
+    files[file_count].fd = -1;
+    if(nph_map_put(&by_path, hash, file_count) != 0){
+        return -1;
+    }
+    file_count++;
+    return 0;
+}
+
+static void name_of(uint64_t hash, char *path, size_t len)
+{
+    snprintf(path, len, "%s/%016llx", dir, (unsigned long long)hash);
+}
+
+static int is_dir_op(uint32_t op)
+{
+    return op == TRACE_OPENDIR || op == TRACE_READDIR || op == TRACE_RELEASEDIR ||
+           op == TRACE_FSYNCDIR || op == TRACE_RMDIR;
+}
+
+static int by_start(const void *a, const void *b)
+{
+    const struct nphfs_trace_record *x = &records[*(const uint64_t *)a];
+    const struct nphfs_trace_record *y = &records[*(const uint64_t *)b];
+
+    return x->start_ns < y->start_ns ? -1 : x->start_ns > y->start_ns;
+}
+
+// Work out which paths existed when the trace began and how big, and
+// split the records by thread
+static int plan(void)
+{
+    const struct nphfs_trace_record *r;
+    struct replay_file *f;
+    uint64_t *order;
+    uint64_t i;
+    uint32_t t;
+    int kind;
+
+    order = (uint64_t *)malloc((record_count + 1) * sizeof(uint64_t));
+    if(order == NULL){
+        return -1;
+    }
+    for(i = 0; i < record_count; i++){
+        order[i] = i;
+    }
+    qsort(order, record_count, sizeof(uint64_t), by_start);
+
+    nph_map_init(&by_path);
+    thread_count = 0;
+    for(i = 0; i < record_count; i++){
+        r = &records[order[i]];
+        if(r->thread >= thread_count){
+            thread_count = r->thread + 1;
+        }
+        // The first thing done to a path says whether it was there
+        if(r->op == TRACE_MKNOD || r->op == TRACE_MKDIR || r->op == TRACE_SYMLINK ||
+           r->result == -ENOENT){
+            kind = KIND_NONE;
+        }else{
+            kind = is_dir_op(r->op) ? KIND_DIR : KIND_FILE;
+        }
+        if(file_add(r->path, kind) != 0 || file_add(r->path2, KIND_NONE) != 0){
+            free(order);
+            return -1;
+        }
+        f = file_of(r->path);
+        if(r->op == TRACE_READ && f != NULL && f->kind == KIND_FILE &&
+           r->offset + r->size > f->size){
+            f->size = r->offset + r->size;
+        }
+    }
+    free(order);
+
+    thread_records = (uint64_t **)calloc(thread_count + 1, sizeof(uint64_t *));
+    thread_counts = (uint64_t *)calloc(thread_count + 1, sizeof(uint64_t));
+    if(thread_records == NULL || thread_counts == NULL){
+        return -1;
+    }
+    for(i = 0; i < record_count; i++){
+        thread_counts[records[i].thread]++;
+    }
+    for(t = 0; t < thread_count; t++){
+        thread_records[t] = (uint64_t *)malloc((thread_counts[t] + 1) * sizeof(uint64_t));
+        if(thread_records[t] == NULL){
+            return -1;
+        }
+        thread_counts[t] = 0;
+    }
+    // Each thread's records are in the file in the order it ran them
+    for(i = 0; i < record_count; i++){
+        t = records[i].thread;
+        thread_records[t][thread_counts[t]++] = i;
+    }
+    return 0;
+}
+
+// Make the paths that were there before the trace began
+static int prepare(void)
+{
+    char path[PATH_MAX];
+    struct replay_file *f;
+    char *chunk;
+    uint64_t i;
+    uint64_t off;
+    size_t len;
+    int fd;
+
+    chunk = (char *)malloc(FILL_CHUNK);
+    if(chunk == NULL){
+        return -1;
+    }
+    memset(chunk, 'r', FILL_CHUNK);
+    for(i = 0; i < file_count; i++){
+        f = &files[i];
+        if(f->kind == KIND_NONE){
+            continue;
+        }
+        name_of(f->hash, path, sizeof(path));
+        if(f->kind == KIND_DIR){
+            if(mkdir(path, 0755) != 0 && errno != EEXIST){
+                perror(path);
+                free(chunk);
+                return -1;
+            }
+            continue;
+        }
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0){
+            perror(path);
+            free(chunk);
+            return -1;
+        }
+        for(off = 0; off < f->size; off += len){
+            len = f->size - off;
+            len = len < FILL_CHUNK ? len : FILL_CHUNK;
+            if(pwrite(fd, chunk, len, off) != (ssize_t)len){
+                perror(path);
+                close(fd);
+                free(chunk);
+                return -1;
+            }
+        }
+        close(fd);
+    }
+    free(chunk);
+    return 0;
+}
+
+// Keep an fd whose name is gone until the end, so that no other
+// thread can be using it when it is closed
+static void stale(int fd)
+{
+    int *grown;
+
+    if(fd < 0){
+        return;
+    }
+    if(stale_count == stale_cap){
+        stale_cap = stale_cap ? stale_cap * 2 : 64;
+        grown = (int *)realloc(stale_fds, stale_cap * sizeof(int));
+        if(grown == NULL){
+            close(fd);
+            return;
+        }
+        stale_fds = grown;
+    }
+    stale_fds[stale_count++] = fd;
+}
+
+// The fd of a path, opened the first time one is needed
+static int file_fd(uint64_t hash)
+{
+    struct replay_file *f = file_of(hash);
+    char path[PATH_MAX];
+    int fd;
+
+    if(f == NULL){
+        return -1;
+    }
+    pthread_mutex_lock(&fd_lock);
+    fd = f->fd;
+    if(fd < 0){
+        name_of(hash, path, sizeof(path));
+        fd = open(path, O_RDWR);
+        f->fd = fd;
+    }
+    pthread_mutex_unlock(&fd_lock);
+    return fd;
+}
+
+// A name is going away or being replaced: its fd no longer goes with it
+static void file_gone(uint64_t hash)
+{
+    struct replay_file *f = file_of(hash);
+
+    if(f == NULL){
+        return;
+    }
+    pthread_mutex_lock(&fd_lock);
+    stale(f->fd);
+    f->fd = -1;
+    pthread_mutex_unlock(&fd_lock);
+}
+
+// Read every entry, as ls would; -1 with errno set if it cannot
+static int read_dir(const char *path)
+{
+    DIR *d = opendir(path);
+
+    if(d == NULL){
+        return -1;
+    }
+    while(readdir(d) != NULL){
+    }
+    closedir(d);
+    return 0;
+}
+
+static int sync_dir(const char *path, int datasync)
+{
+    int fd = open(path, O_RDONLY | O_DIRECTORY);
+    int ret;
+
+    if(fd < 0){
+        return -1;
+    }
+    ret = datasync ? fdatasync(fd) : fsync(fd);
+    close(fd);
+    return ret;
+}
+
+// Run one operation; 0 or -errno, or 1 for one that is not replayed.
+// Operations on an open file whose name could not be opened here are
+// not replayed either.
+static int run(const struct nphfs_trace_record *r, char *buf, uint64_t *took)
+{
+    char path[PATH_MAX];
+    char path2[PATH_MAX];
+    size_t size = r->size < REPLAY_MAX_IO ? r->size : REPLAY_MAX_IO;
+    struct stat st;
+    struct statvfs sv;
+    uint64_t begin;
+    int fd = -1;
+    int ret;
+
+    name_of(r->path, path, sizeof(path));
+    name_of(r->path2, path2, sizeof(path2));
+    switch(r->op){
+    case TRACE_READ:
+    case TRACE_WRITE:
+    case TRACE_FSYNC:
+    case TRACE_FTRUNCATE:
+    case TRACE_FGETATTR:
+    case TRACE_FALLOCATE:
+        fd = file_fd(r->path);
+        if(fd < 0){
+            return 1;
+        }
+        break;
+    case TRACE_UNLINK:
+    case TRACE_RMDIR:
+    case TRACE_RENAME:
+        file_gone(r->path);
+        file_gone(r->path2);
+        break;
+    case TRACE_FLUSH:
+    case TRACE_RELEASE:
+    case TRACE_RELEASEDIR:
+    case TRACE_IOCTL:
+        return 1;
+    }
+
+    begin = now_ns();
+    switch(r->op){
+    case TRACE_GETATTR:
+        ret = lstat(path, &st);
+        break;
+    case TRACE_READLINK:
+        ret = readlink(path, buf, size) < 0 ? -1 : 0;
+        break;
+    case TRACE_MKNOD:
+        ret = mknod(path, (r->mode & ~S_IFMT) | S_IFREG, 0);
+        break;
+    case TRACE_MKDIR:
+        ret = mkdir(path, r->mode & 07777);
+        break;
+    case TRACE_UNLINK:
+        ret = unlink(path);
+        break;
+    case TRACE_RMDIR:
+        ret = rmdir(path);
+        break;
+    case TRACE_SYMLINK:
+        // A target as long as the recorded one
+        memset(buf, 'l', size);
+        buf[size] = '\0';
+        ret = symlink(buf, path);
+        break;
+    case TRACE_RENAME:
+        ret = rename(path, path2);
+        break;
+    case TRACE_LINK:
+        ret = link(path, path2);
+        break;
+    case TRACE_CHMOD:
+        ret = chmod(path, r->mode & 07777);
+        break;
+    case TRACE_CHOWN:
+        ret = lchown(path, (uid_t)-1, (gid_t)-1);
+        break;
+    case TRACE_TRUNCATE:
+        ret = truncate(path, r->offset);
+        break;
+    case TRACE_UTIME:
+        ret = utime(path, NULL);
+        break;
+    case TRACE_OPEN:
+        ret = open(path, r->mode & (O_ACCMODE | O_APPEND));
+        if(ret >= 0){
+            close(ret);
+            ret = 0;
+        }
+        break;
+    case TRACE_READ:
+        ret = pread(fd, buf, size, r->offset) < 0 ? -1 : 0;
+        break;
+    case TRACE_WRITE:
+        ret = pwrite(fd, buf, size, r->offset) < 0 ? -1 : 0;
+        break;
+    case TRACE_STATFS:
+        ret = statvfs(path, &sv);
+        break;
+    case TRACE_FSYNC:
+        ret = r->mode ? fdatasync(fd) : fsync(fd);
+        break;
+#ifdef HAVE_SYS_XATTR_H
+    case TRACE_SETXATTR:
+        ret = lsetxattr(path, "user.replay", buf, size, 0);
+        break;
+    case TRACE_GETXATTR:
+        ret = lgetxattr(path, "user.replay", buf, size) < 0 ? -1 : 0;
+        break;
+    case TRACE_LISTXATTR:
+        ret = llistxattr(path, buf, size) < 0 ? -1 : 0;
+        break;
+    case TRACE_REMOVEXATTR:
+        ret = lremovexattr(path, "user.replay");
+        break;
+#endif
+    case TRACE_OPENDIR:
+    case TRACE_READDIR:
+        ret = read_dir(path);
+        break;
+    case TRACE_FSYNCDIR:
+        ret = sync_dir(path, r->mode);
+        break;
+    case TRACE_ACCESS:
+        ret = access(path, r->mode);
+        break;
+    case TRACE_FTRUNCATE:
+        ret = ftruncate(fd, r->offset);
+        break;
+    case TRACE_FGETATTR:
+        ret = fstat(fd, &st);
+        break;
+    case TRACE_FALLOCATE:
+        ret = fallocate(fd, r->mode, r->offset, r->size);
+        break;
+    default:
+        return 1;
+    }
+    *took = now_ns() - begin;
+    return ret < 0 ? -errno : 0;
+}
+
+static void *replay_main(void *arg)
+{
+    uint32_t t = (uint32_t)(uintptr_t)arg;
+    const struct nphfs_trace_record *r;
+    struct timespec at;
+    uint64_t largest = 0;
+    uint64_t took;
+    uint64_t when;
+    uint64_t i;
+    char *buf;
+    int ret;
+
+    for(i = 0; i < thread_counts[t]; i++){
+        r = &records[thread_records[t][i]];
+        if(r->size > largest){
+            largest = r->size;
+        }
+    }
+    largest = largest < REPLAY_MAX_IO ? largest : REPLAY_MAX_IO;
+    buf = (char *)malloc(largest + 1);
+    if(buf == NULL){
+        fprintf(stderr, "nphfs-replay: not enough memory for thread %u\n", t);
+        return NULL;
+    }
+    memset(buf, 'w', largest + 1);
+
+    for(i = 0; i < thread_counts[t]; i++){
+        r = &records[thread_records[t][i]];
+        if(!fast){
+            when = start_ns + r->start_ns;
+            at.tv_sec = when / 1000000000ULL;
+            at.tv_nsec = when % 1000000000ULL;
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, NULL);
+        }
+        ret = run(r, buf, &took);
+        if(ret == 1){
+            continue;
+        }
+        latency[thread_records[t][i]] = took;
+        if((ret < 0) != (r->result < 0)){
+            __atomic_add_fetch(&differed, 1, __ATOMIC_RELAXED);
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+static int replay(void)
+{
+    pthread_t *threads;
+    uint64_t elapsed;
+    uint64_t ran = 0;
+    uint64_t i;
+    uint32_t t;
+    int err;
+
+    latency = (uint64_t *)malloc((record_count + 1) * sizeof(uint64_t));
+    threads = (pthread_t *)calloc(thread_count + 1, sizeof(pthread_t));
+    if(latency == NULL || threads == NULL){
+        fprintf(stderr, "nphfs-replay: not enough memory\n");
+        return -1;
+    }
+    for(i = 0; i < record_count; i++){
+        latency[i] = REPLAY_SKIPPED;
+    }
+
+    start_ns = now_ns();
+    for(t = 0; t < thread_count; t++){
+        err = pthread_create(&threads[t], NULL, replay_main, (void *)(uintptr_t)t);
+        if(err != 0){
+            fprintf(stderr, "nphfs-replay: %s\n", strerror(err));
+            return -1;
+        }
+    }
+    for(t = 0; t < thread_count; t++){
+        pthread_join(threads[t], NULL);
+    }
+    elapsed = now_ns() - start_ns;
+    free(threads);
+
+    for(i = 0; i < record_count; i++){
+        ran += latency[i] != REPLAY_SKIPPED;
+    }
+    printf("\nreplayed %llu operations on %u threads in %.3f s, %.0f per second\n",
+           (unsigned long long)ran, thread_count, (double)elapsed / 1e9,
+           elapsed != 0 ? (double)ran * 1e9 / (double)elapsed : 0.0);
+    if(differed != 0){
+        printf("%llu succeeded in one and failed in the other\n", (unsigned long long)differed);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int only_report = 0;
+    int opt;
+    uint64_t i;
+
+    while((opt = getopt(argc, argv, "mn")) != -1){
+        switch(opt){
+        case 'm':
+            fast = 1;
+            break;
+        case 'n':
+            only_report = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+    if(optind >= argc || argc - optind > (only_report ? 1 : 2)){
+        usage();
+    }
+    dir = optind + 1 < argc ? argv[optind + 1] : ".";
+
+    if(load(argv[optind]) != 0 || report("recorded", 0) != 0){
+        return 1;
+    }
+    if(only_report){
+        return 0;
+    }
+    if(plan() != 0){
+        fprintf(stderr, "nphfs-replay: not enough memory\n");
+        return 1;
+    }
+    if(prepare() != 0 || replay() != 0 || report("replayed", 1) != 0){
+        return 1;
+    }
+    for(i = 0; i < file_count; i++){
+        if(files[i].fd >= 0){
+            close(files[i].fd);
+        }
+    }
+    for(i = 0; i < stale_count; i++){
+        close(stale_fds[i]);
+    }
+    return 0;
+}
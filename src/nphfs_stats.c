@@ -0,0 +1,113 @@
+/*
+  NPHeap File System - nphfs-stats
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Prints the counters a mounted nphfuse has kept since it was mounted
+  (NPHFS_IOC_STATS).  Any file or directory on the mount will do.
+
+  usage: nphfs-stats [path]
+*/
+
+#include "nphfuse_extra.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static double ratio(uint64_t a, uint64_t b)
+{
+    return b != 0 ? (double)a / (double)b : 0.0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct nphfs_stats st;
+    const char *path = ".";
+    int fd;
+
+    if(argc > 2){
+        fprintf(stderr, "usage:  nphfs-stats [path]\n");
+        return 2;
+    }
+    if(argc == 2){
+        path = argv[1];
+    }
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0){
+        perror(path);
+        return 1;
+    }
+    memset(&st, 0, sizeof(st));
+    if(ioctl(fd, NPHFS_IOC_STATS, &st) != 0){
+        if(errno == ENOTTY){
+            fprintf(stderr, "nphfs-stats: %s is not on an nphfuse mount\n", path);
+        }else{
+            perror("nphfs-stats");
+        }
+        return 1;
+    }
+    close(fd);
+
+    printf("compression\n");
+    printf("  blocks compressed      %llu\n", (unsigned long long)st.zblocks_written);
+    printf("  blocks left as is      %llu\n", (unsigned long long)st.zblocks_raw);
+    printf("  bytes in / out         %llu / %llu (%.2f:1)\n",
+           (unsigned long long)st.zbytes_in, (unsigned long long)st.zbytes_out,
+           ratio(st.zbytes_in, st.zbytes_out));
+    printf("  compress time          %.3f ms, %.2f us per block\n",
+           st.compress_ns / 1e6,
+           ratio(st.compress_ns, st.zblocks_written + st.zblocks_raw) / 1e3);
+    printf("  blocks decoded         %llu\n", (unsigned long long)st.zblocks_read);
+    printf("  decode time            %.3f ms, %.2f us per block\n",
+           st.decompress_ns / 1e6, ratio(st.decompress_ns, st.zblocks_read) / 1e3);
+    printf("  cache hits / misses    %llu / %llu (%.1f%% hit)\n",
+           (unsigned long long)st.zcache_hits, (unsigned long long)st.zcache_misses,
+           100.0 * ratio(st.zcache_hits, st.zcache_hits + st.zcache_misses));
+
+    printf("deduplication\n");
+    printf("  blocks looked up       %llu\n", (unsigned long long)st.dedup_blocks);
+    printf("  blocks shared          %llu (%.2f:1)\n", (unsigned long long)st.dedup_shared,
+           ratio(st.dedup_blocks, st.dedup_blocks - st.dedup_shared));
+    printf("  blocks in the index    %llu\n", (unsigned long long)st.dedup_index);
+    printf("  hash time              %.3f ms, %.2f us per block\n",
+           st.dedup_hash_ns / 1e6, ratio(st.dedup_hash_ns, st.dedup_blocks) / 1e3);
+
+    printf("checksums\n");
+    printf("  blocks verified        %llu\n", (unsigned long long)st.csum_verified);
+    printf("  checksum errors        %llu\n", (unsigned long long)st.csum_errors);
+    printf("  checksum time          %.3f ms\n", st.csum_ns / 1e6);
+    printf("  scrub passes           %llu\n", (unsigned long long)st.scrub_passes);
+    printf("  blocks scrubbed        %llu, %llu damaged\n",
+           (unsigned long long)st.scrub_blocks, (unsigned long long)st.scrub_errors);
+
+    printf("spill tier\n");
+    printf("  blocks in the heap     %llu", (unsigned long long)st.tier_resident);
+    if(st.tier_limit != 0){
+        printf(" of at most %llu", (unsigned long long)st.tier_limit);
+    }
+    printf("\n");
+    printf("  blocks spilled         %llu\n", (unsigned long long)st.tier_spilled);
+    printf("  lookups / from disk    %llu / %llu (%.1f%% from the heap)\n",
+           (unsigned long long)st.tier_lookups, (unsigned long long)st.tier_faults,
+           100.0 * (1.0 - ratio(st.tier_faults, st.tier_lookups)));
+    printf("  read back time         %.3f ms, %.2f us per block\n",
+           st.tier_fault_ns / 1e6, ratio(st.tier_fault_ns, st.tier_faults) / 1e3);
+    printf("  blocks moved out       %llu, %.2f us per block\n",
+           (unsigned long long)st.tier_evictions, ratio(st.tier_evict_ns, st.tier_evictions) / 1e3);
+
+    printf("npheap\n");
+    printf("  objects sized at mount %llu\n", (unsigned long long)st.heap_scanned);
+    printf("  size ioctls after that %llu\n", (unsigned long long)st.heap_getsize);
+
+    printf("timestamps\n");
+    printf("  atime updates skipped  %llu\n", (unsigned long long)st.time_atime_skipped);
+    printf("  updates kept in memory %llu, %llu not written back\n",
+           (unsigned long long)st.time_deferred, (unsigned long long)st.time_pending);
+    printf("  inodes written back    %llu in %llu batches\n",
+           (unsigned long long)st.time_written, (unsigned long long)st.time_batches);
+    return 0;
+}
@@ -25,6 +25,7 @@
 #include <fuse.h>
 #include <libgen.h>
 #include <limits.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -37,59 +38,160 @@
 
 struct nphfuse_state *nphfuse_data;
 
+// Operations that may hold pointers into the data area shut out the
+// spill tier's thread while they run.  One that failed because the
+// heap was full runs again once cold blocks are moved out, and gets
+// ENOSPC when none are left to move.
+#define TIER_HELD(op, params, args)             \
+    static int tier_##op params                 \
+    {                                           \
+        int ret;                                \
+        for(;;){                                \
+            tier_hold();                        \
+            ret = nphfuse_##op args;            \
+            tier_unhold();                      \
+            if(ret >= 0 || !tier_short()){      \
+                break;                          \
+            }                                   \
+            if(tier_reclaim() == 0){            \
+                ret = -ENOSPC;                  \
+                break;                          \
+            }                                   \
+        }                                       \
+        return ret;                             \
+    }
+
+TIER_HELD(readlink, (const char *path, char *link, size_t size), (path, link, size))
+TIER_HELD(mkdir, (const char *path, mode_t mode), (path, mode))
+TIER_HELD(unlink, (const char *path), (path))
+TIER_HELD(rmdir, (const char *path), (path))
+TIER_HELD(symlink, (const char *path, const char *link), (path, link))
+TIER_HELD(rename, (const char *path, const char *newpath), (path, newpath))
+TIER_HELD(truncate, (const char *path, off_t newsize), (path, newsize))
+TIER_HELD(read, (const char *path, char *buf, size_t size, off_t offset,
+                 struct fuse_file_info *fi), (path, buf, size, offset, fi))
+TIER_HELD(write, (const char *path, const char *buf, size_t size, off_t offset,
+                  struct fuse_file_info *fi), (path, buf, size, offset, fi))
+TIER_HELD(fsync, (const char *path, int datasync, struct fuse_file_info *fi),
+          (path, datasync, fi))
+TIER_HELD(fsyncdir, (const char *path, int datasync, struct fuse_file_info *fi),
+          (path, datasync, fi))
+#ifdef HAVE_SYS_XATTR_H
+TIER_HELD(setxattr, (const char *path, const char *name, const char *value, size_t size,
+                     int flags), (path, name, value, size, flags))
+TIER_HELD(getxattr, (const char *path, const char *name, char *value, size_t size),
+          (path, name, value, size))
+TIER_HELD(listxattr, (const char *path, char *list, size_t size), (path, list, size))
+TIER_HELD(removexattr, (const char *path, const char *name), (path, name))
+#endif
+TIER_HELD(ftruncate, (const char *path, off_t offset, struct fuse_file_info *fi),
+          (path, offset, fi))
+TIER_HELD(ioctl, (const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+                  unsigned int flags, void *data), (path, cmd, arg, fi, flags, data))
+TIER_HELD(fallocate, (const char *path, int mode, off_t offset, off_t length,
+                      struct fuse_file_info *fi), (path, mode, offset, length, fi))
+
 struct fuse_operations nphfuse_oper = {
   .getattr = nphfuse_getattr,
-  .readlink = nphfuse_readlink,
+  .readlink = tier_readlink,
   // no .getdir -- that's deprecated
   .getdir = NULL,
   .mknod = nphfuse_mknod,
-  .mkdir = nphfuse_mkdir,
-  .unlink = nphfuse_unlink,
-  .rmdir = nphfuse_rmdir,
-  .symlink = nphfuse_symlink,
-  .rename = nphfuse_rename,
+  .mkdir = tier_mkdir,
+  .unlink = tier_unlink,
+  .rmdir = tier_rmdir,
+  .symlink = tier_symlink,
+  .rename = tier_rename,
   .link = nphfuse_link,
   .chmod = nphfuse_chmod,
   .chown = nphfuse_chown,
-  .truncate = nphfuse_truncate,
+  .truncate = tier_truncate,
   .utime = nphfuse_utime,
   .open = nphfuse_open,
-  .read = nphfuse_read,
-  .write = nphfuse_write,
+  .read = tier_read,
+  .write = tier_write,
   .statfs = nphfuse_statfs,
   /** Just a placeholder, don't set */ // huh???
   .flush = nphfuse_flush,
   .release = nphfuse_release,
-  .fsync = nphfuse_fsync,
+  .fsync = tier_fsync,
   
 #ifdef HAVE_SYS_XATTR_H
-  .setxattr = nphfuse_setxattr,
-  .getxattr = nphfuse_getxattr,
-  .listxattr = nphfuse_listxattr,
-  .removexattr = nphfuse_removexattr,
+  .setxattr = tier_setxattr,
+  .getxattr = tier_getxattr,
+  .listxattr = tier_listxattr,
+  .removexattr = tier_removexattr,
 #endif
   
   .opendir = nphfuse_opendir,
   .readdir = nphfuse_readdir,
   .releasedir = nphfuse_releasedir,
-  .fsyncdir = nphfuse_fsyncdir,
+  .fsyncdir = tier_fsyncdir,
   .init = nphfuse_init,
   .destroy = nphfuse_destroy,
   .access = nphfuse_access,
-  .ftruncate = nphfuse_ftruncate,
-  .fgetattr = nphfuse_fgetattr
+  .ftruncate = tier_ftruncate,
+  .fgetattr = nphfuse_fgetattr,
+  .ioctl = tier_ioctl,
+  .fallocate = tier_fallocate
 };
 
 
+// Filesystem specific -o options
+static struct fuse_opt nphfuse_opts[] = {
+    // Backing file fsync writes to, and an empty heap is restored from
+    {"checkpoint=%s", offsetof(struct nphfuse_state, checkpoint), 0},
+    // Compress the blocks of every file, not only those flagged with chattr +c
+    {"compress", offsetof(struct nphfuse_state, compress), 1},
+    // Megabytes of decoded compressed blocks to keep around
+    {"zcache=%u", offsetof(struct nphfuse_state, zcache_mb), 0},
+    // Store identical blocks once
+    {"dedup", offsetof(struct nphfuse_state, dedup), 1},
+    // Seconds between passes of the checksum scrubber, 0 for none
+    {"scrub=%u", offsetof(struct nphfuse_state, scrub_secs), 0},
+    // Disk file cold data blocks are moved out to when the heap is full
+    {"spill=%s", offsetof(struct nphfuse_state, spill), 0},
+    // Most data blocks to keep in the heap with a spill file
+    {"resident=%lu", offsetof(struct nphfuse_state, resident), 0},
+    // Record every operation to this file for nphfs-replay
+    {"trace=%s", offsetof(struct nphfuse_state, trace), 0},
+    // Leave atime alone, or only update it once after each change
+    {"noatime", offsetof(struct nphfuse_state, atime_mode), ATIME_NEVER},
+    {"relatime", offsetof(struct nphfuse_state, atime_mode), ATIME_RELATIVE},
+    // Keep the times reads and writes change in memory for a while
+    {"lazytime", offsetof(struct nphfuse_state, lazytime), 1},
+    FUSE_OPT_END
+};
+
 void nphfuse_usage()
 {
-    fprintf(stderr, "usage:  nphfuse [FUSE and mount options] npheap_device_name mountPoint\n");
+    fprintf(stderr, "usage:  nphfuse [FUSE and mount options] npheap_device_name[,...] mountPoint\n");
+    fprintf(stderr, "        give every device mkfs.nphfs striped the filesystem over, in the same order\n");
+    fprintf(stderr, "        -o checkpoint=FILE   keep a durable copy of the heap in FILE\n");
+    fprintf(stderr, "        -o compress          store the data blocks of every file compressed\n");
+    fprintf(stderr, "        -o zcache=MB         cache for decoded compressed blocks (default 16)\n");
+    fprintf(stderr, "        -o dedup             share blocks identical to ones written before\n");
+    fprintf(stderr, "        -o scrub=SECS        check every block's checksum this often, 0 for never (default 3600)\n");
+    fprintf(stderr, "        -o spill=FILE        move cold data blocks out to FILE when the heap is full\n");
+    fprintf(stderr, "        -o resident=BLOCKS   most data blocks to keep in the heap (default: as many as fit)\n");
+    fprintf(stderr, "        -o trace=FILE        record every operation to FILE for nphfs-replay\n");
+    fprintf(stderr, "        -o noatime           never update access times\n");
+    fprintf(stderr, "        -o relatime          update the access time only once after each change\n");
+    fprintf(stderr, "        -o lazytime          write changed times back in batches, not on every read and write\n");
     abort();
 }
 
 int main(int argc, char *argv[])
 {
     int fuse_stat;
+    int journal_replayed;
+    int restored = 0;
+    int ckpt_err;
+    int tier_err;
+    int trace_err;
+    const char *bad;
+    const struct fuse_operations *oper = &nphfuse_oper;
+    struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
 
     // NPHeapFS doesn't do any access checking on its own (the comment
     // blocks in fuse.h mention some of the functions that need
@@ -116,7 +218,7 @@ int main(int argc, char *argv[])
     if ((argc < 3) || (argv[argc-2][0] == '-') || (argv[argc-1][0] == '-'))
 	nphfuse_usage();
 
-    nphfuse_data = (struct nphfuse_state *)malloc(sizeof(struct nphfuse_state));
+    nphfuse_data = (struct nphfuse_state *)calloc(1, sizeof(struct nphfuse_state));
     if (nphfuse_data == NULL) {
 	perror("main calloc");
 	abort();
@@ -126,16 +228,97 @@ int main(int argc, char *argv[])
     // internal data
     nphfuse_data->device_name = (char *)malloc((strlen(argv[argc-2])+1)*sizeof(char));
     strcpy(nphfuse_data->device_name,argv[argc-2]);
-    nphfuse_data->devfd = open(nphfuse_data->device_name,O_RDWR);
+    if (heap_open(nphfuse_data->device_name, &bad) < 0) {
+	perror(bad);
+	return 1;
+    }
+    nphfuse_data->devfd = npheap_fd;
+
     argv[argc-2] = argv[argc-1];
     argv[argc-1] = NULL;
     argc--;
+    args.argc = argc;
+    args.argv = argv;
+    // Pick out our own -o options, the rest go on to fuse
+    nphfuse_data->zcache_mb = 16;
+    nphfuse_data->scrub_secs = 3600;
+    if (fuse_opt_parse(&args, nphfuse_data, nphfuse_opts, NULL) == -1)
+	nphfuse_usage();
+    // Report our own inode numbers, from getattr and with each readdir
+    // entry, so hard links show up as one file
+    fuse_opt_add_arg(&args, "-ouse_ino");
+
+    // The heap has to be laid out by mkfs.nphfs, or come back from a
+    // checkpoint after the machine lost it; mounting only loads it
+    if (super_load() == NULL) {
+	if (nphfuse_data->checkpoint != NULL &&
+	    ckpt_restore(nphfuse_data->checkpoint) == 0) {
+	    fprintf(stderr, "restored %s from %s\n", nphfuse_data->device_name,
+		    nphfuse_data->checkpoint);
+	    restored = 1;
+	} else {
+	    fprintf(stderr, "%s does not hold an NPHeapFS filesystem, run mkfs.nphfs first\n",
+		    nphfuse_data->device_name);
+	    return 1;
+	}
+    }
+    // Blocks a mount before moved out have to be found before anything
+    // is read, the journal included
+    if (nphfuse_data->spill != NULL) {
+	tier_err = tier_attach(nphfuse_data->spill, 1, nphfuse_data->resident);
+	if (tier_err != 0) {
+	    fprintf(stderr, "%s: %s\n", nphfuse_data->spill,
+		    tier_err == -ENOENT ? "does not hold the blocks spilled from this filesystem" :
+		    strerror(-tier_err));
+	    return 1;
+	}
+    } else if (superblock->blocks_spilled != 0) {
+	fprintf(stderr, "%s: %llu data blocks are in a spill file, mount with -o spill=FILE\n",
+		nphfuse_data->device_name, (unsigned long long)superblock->blocks_spilled);
+	return 1;
+    }
+    // Finish whatever metadata updates were committed before the last exit
+    journal_replayed = journal_open();
+    if (journal_replayed < 0) {
+	fprintf(stderr, "%s: metadata journal is damaged, run fsck.nphfs\n",
+		nphfuse_data->device_name);
+	return 1;
+    }
+    if (journal_replayed > 0)
+	fprintf(stderr, "replayed %d journal batches\n", journal_replayed);
+    if (nphfuse_data->checkpoint != NULL) {
+	ckpt_err = ckpt_attach(nphfuse_data->checkpoint, restored);
+	if (ckpt_err != 0) {
+	    fprintf(stderr, "%s: %s\n", nphfuse_data->checkpoint, strerror(-ckpt_err));
+	    return 1;
+	}
+    }
+    // Usage per owner is counted once here and kept up to date after
+    if (quota_init() != 0) {
+	fprintf(stderr, "%s: not enough memory to count quota usage\n",
+		nphfuse_data->device_name);
+	return 1;
+    }
+    compress_init(nphfuse_data->compress, (uint64_t)nphfuse_data->zcache_mb << 20);
+    dedup_init(nphfuse_data->dedup);
+    time_init(nphfuse_data->atime_mode, nphfuse_data->lazytime);
     // You can output to a log file for debugging if you would like to.
     nphfuse_data->logfile = log_open();
-    
+
+    // Time and record every operation fuse hands us, if asked to
+    if (nphfuse_data->trace != NULL) {
+	trace_err = trace_open(nphfuse_data->trace);
+	if (trace_err != 0) {
+	    fprintf(stderr, "%s: %s\n", nphfuse_data->trace, strerror(-trace_err));
+	    return 1;
+	}
+	oper = trace_wrap(&nphfuse_oper);
+    }
+
     // turn over control to fuse
     fprintf(stderr, "about to call fuse_main\n");
-    fuse_stat = fuse_main(argc, argv, &nphfuse_oper, nphfuse_data);
+    fuse_stat = fuse_main(args.argc, args.argv, oper, nphfuse_data);
+    fuse_opt_free_args(&args);
     fprintf(stderr, "fuse_main returned %d\n", fuse_stat);
     
     return fuse_stat;
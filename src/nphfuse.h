@@ -16,9 +16,15 @@
 // writing, the most current API version is 29
 #define FUSE_USE_VERSION 29
 
-// need this to get pwrite().  I have to use setvbuf() instead of
-// setlinebuf() later in consequence.
-#define _XOPEN_SOURCE 500
+// need this to get pwrite() and the nanosecond st_atim, st_mtim and
+// st_ctim.  I have to use setvbuf() instead of setlinebuf() later in
+// consequence.
+#define _XOPEN_SOURCE 700
+
+// HAVE_SYS_XATTR_H and the rest of what configure found
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
 
 #include <limits.h>
 #include <stdio.h>
@@ -82,3 +88,10 @@ void nphfuse_destroy(void *userdata);
 int nphfuse_access(const char *path, int mask);
 int nphfuse_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi);
 int nphfuse_fgetattr(const char *path, struct stat *statbuf, struct fuse_file_info *fi);
+int nphfuse_fallocate(const char *path, int mode, off_t offset, off_t length,
+                      struct fuse_file_info *fi);
+int nphfuse_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+                  unsigned int flags, void *data);
+
+// The same operations, each one recorded to the trace (nphfuse_trace.c)
+const struct fuse_operations *trace_wrap(const struct fuse_operations *ops);
@@ -0,0 +1,238 @@
+/*
+  NPHeap File System - allocation bitmaps
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Inode and data allocation are tracked with plain bitmaps spread over
+  consecutive BLOCK_SIZE npheap objects, laid down by mkfs.nphfs.  A
+  set bit means the slot is in use.  Searches start from a hint just
+  past the last allocation so the common case touches a single word.
+  Each bitmap keeps a count of its set bits in the superblock, kept up
+  to date here, so statfs never has to scan anything.
+*/
+
+#include "nphfuse_extra.h"
+#include <pthread.h>
+
+#define BITS_PER_OBJECT  ((uint64_t)BLOCK_SIZE * 8)
+
+static pthread_mutex_t bitmap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// used points at the superblock counter for this bitmap, or is NULL
+// for a bitmap that is only read
+void bitmap_attach(struct nph_bitmap *bm, uint64_t start, uint64_t nbits, uint64_t *used)
+{
+    bm->start = start;
+    bm->nbits = nbits;
+    bm->hint = 0;
+    bm->used = used;
+}
+
+// Number of npheap objects needed to hold nbits
+uint64_t bitmap_objects(uint64_t nbits)
+{
+    return (nbits + BITS_PER_OBJECT - 1) / BITS_PER_OBJECT;
+}
+
+static uint64_t *bitmap_word(struct nph_bitmap *bm, uint64_t bit)
+{
+    uint64_t *words;
+
+    words = (uint64_t *)heap_map(bm->start + bit / BITS_PER_OBJECT, BLOCK_SIZE);
+    if(words == NULL){
+        return NULL;
+    }
+    return &words[(bit % BITS_PER_OBJECT) / 64];
+}
+
+// Allocation changed: the checkpoint needs this object and the metadata
+static void bitmap_dirty(struct nph_bitmap *bm, uint64_t bit)
+{
+    ckpt_dirty(bm->start + bit / BITS_PER_OBJECT);
+    ckpt_need_meta();
+}
+
+// Bits were set (delta > 0) or cleared; called with bitmap_lock held
+static void bitmap_account(struct nph_bitmap *bm, int64_t delta)
+{
+    if(bm->used != NULL && delta != 0){
+        *bm->used += delta;
+        ckpt_dirty(ROOT_BLOCK);
+    }
+}
+
+int bitmap_test(struct nph_bitmap *bm, uint64_t bit)
+{
+    uint64_t *word;
+
+    if(bit >= bm->nbits){
+        return 0;
+    }
+    word = bitmap_word(bm, bit);
+    return word != NULL && (*word >> (bit % 64)) & 1;
+}
+
+void bitmap_set(struct nph_bitmap *bm, uint64_t bit)
+{
+    uint64_t *word;
+
+    if(bit >= bm->nbits){
+        return;
+    }
+    pthread_mutex_lock(&bitmap_lock);
+    word = bitmap_word(bm, bit);
+    if(word != NULL && !(*word & (1ULL << (bit % 64)))){
+        *word |= 1ULL << (bit % 64);
+        bitmap_dirty(bm, bit);
+        bitmap_account(bm, 1);
+    }
+    pthread_mutex_unlock(&bitmap_lock);
+}
+
+void bitmap_clear(struct nph_bitmap *bm, uint64_t bit)
+{
+    uint64_t *word;
+
+    if(bit >= bm->nbits){
+        return;
+    }
+    pthread_mutex_lock(&bitmap_lock);
+    word = bitmap_word(bm, bit);
+    if(word != NULL && (*word & (1ULL << (bit % 64)))){
+        *word &= ~(1ULL << (bit % 64));
+        bitmap_dirty(bm, bit);
+        bitmap_account(bm, -1);
+    }
+    if(bit < bm->hint){
+        bm->hint = bit;
+    }
+    pthread_mutex_unlock(&bitmap_lock);
+}
+
+// Find a clear bit, set it and return its index; returns -1 when full
+int64_t bitmap_alloc(struct nph_bitmap *bm)
+{
+    uint64_t scanned = 0;
+    uint64_t bit;
+    uint64_t *word;
+    uint64_t free_bits;
+    int64_t found = -1;
+
+    pthread_mutex_lock(&bitmap_lock);
+    bit = bm->hint & ~63ULL;
+    while(scanned < bm->nbits + 64){
+        if(bit >= bm->nbits){
+            bit = 0;
+        }
+        word = bitmap_word(bm, bit);
+        if(word == NULL){
+            break;
+        }
+        free_bits = ~*word;
+        if(free_bits != 0){
+            bit += __builtin_ctzll(free_bits);
+            if(bit < bm->nbits){
+                *word |= 1ULL << (bit % 64);
+                bitmap_dirty(bm, bit);
+                bitmap_account(bm, 1);
+                bm->hint = bit + 1;
+                found = (int64_t)bit;
+                break;
+            }
+            // Only the padding past nbits was free; wrap around
+            bit = bm->nbits;
+        }else{
+            bit += 64;
+        }
+        scanned += 64;
+    }
+    pthread_mutex_unlock(&bitmap_lock);
+    return found;
+}
+
+// Take up to n clear bits in one pass under the lock, storing their
+// indexes in bits; returns how many were found
+uint64_t bitmap_alloc_many(struct nph_bitmap *bm, uint64_t n, uint64_t *bits)
+{
+    uint64_t scanned = 0;
+    uint64_t found = 0;
+    uint64_t bit;
+    uint64_t *word;
+    uint64_t free_bits;
+    uint64_t before;
+    uint64_t b;
+
+    pthread_mutex_lock(&bitmap_lock);
+    bit = bm->hint & ~63ULL;
+    while(found < n && scanned < bm->nbits + 64){
+        if(bit >= bm->nbits){
+            bit = 0;
+        }
+        word = bitmap_word(bm, bit);
+        if(word == NULL){
+            break;
+        }
+        free_bits = ~*word;
+        before = found;
+        while(free_bits != 0 && found < n){
+            b = bit + __builtin_ctzll(free_bits);
+            free_bits &= free_bits - 1;
+            if(b >= bm->nbits){
+                break;
+            }
+            *word |= 1ULL << (b % 64);
+            bits[found++] = b;
+            bm->hint = b + 1;
+        }
+        if(found != before){
+            bitmap_dirty(bm, bit);
+        }
+        bit += 64;
+        scanned += 64;
+    }
+    bitmap_account(bm, (int64_t)found);
+    pthread_mutex_unlock(&bitmap_lock);
+    return found;
+}
+
+// Count the set bits by scanning every word, for fsck to check the
+// kept count against
+uint64_t bitmap_count(struct nph_bitmap *bm)
+{
+    uint64_t count = 0;
+    uint64_t bit;
+    uint64_t *word;
+    uint64_t bits;
+
+    for(bit = 0; bit < bm->nbits; bit += 64){
+        word = bitmap_word(bm, bit);
+        if(word == NULL){
+            continue;
+        }
+        bits = *word;
+        if(bm->nbits - bit < 64){
+            bits &= (1ULL << (bm->nbits - bit)) - 1;
+        }
+        count += __builtin_popcountll(bits);
+    }
+    return count;
+}
+
+// First set bit at or after bit, or nbits if there is none
+uint64_t bitmap_next(struct nph_bitmap *bm, uint64_t bit)
+{
+    uint64_t *word;
+    uint64_t bits;
+
+    while(bit < bm->nbits){
+        word = bitmap_word(bm, bit);
+        bits = word != NULL ? *word >> (bit % 64) : 0;
+        if(bits != 0){
+            bit += __builtin_ctzll(bits);
+            return bit < bm->nbits ? bit : bm->nbits;
+        }
+        bit = (bit | 63) + 1;
+    }
+    return bm->nbits;
+}
@@ -0,0 +1,545 @@
+/*
+  NPHeap File System - per-file block map
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Each file's data is reached through a radix tree of npheap objects
+  rooted at inode->offset.  Interior nodes are BLOCK_SIZE objects
+  holding BMAP_FANOUT child offsets; a zero entry is an unallocated
+  block.  With height 0 the root is the file's only data block, which
+  keeps small files at a single npheap object, and every extra level
+  multiplies the reach by BMAP_FANOUT (8 MB, 8 GB, 8 TB, ... with the
+  default 8 KB data blocks).
+
+  Blocks are only allocated when something other than zeroes is
+  written to them: a hole reads back as zeroes, and writing zeroes over
+  one leaves it a hole.
+
+  Subtrees may be shared with snapshots (see nphfuse_share.c).  Nothing
+  reachable through a shared object is changed in place: the writer
+  takes a private copy first and hands its reference to the original
+  to the journal.
+
+  A leaf entry with BMAP_COMPRESSED set is a compressed block
+  (nphfuse_compress.c).  It is only ever replaced, never written
+  through, so it is not copied when shared either.
+
+  Data blocks carry a checksum (nphfuse_csum.c); a copy starts out
+  with the original's and one decoded from a compressed block gets a
+  fresh one.
+*/
+
+#include "nphfuse_extra.h"
+#include <errno.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Number of file blocks reachable from a tree of the given height
+static uint64_t bmap_capacity(uint64_t height)
+{
+    uint64_t cap = 1;
+
+    while(height-- > 0){
+        cap *= BMAP_FANOUT;
+    }
+    return cap;
+}
+
+// Return the block map entry for file block blkno, or 0 if none; it
+// is the npheap offset of the block unless BMAP_COMPRESSED is set
+uint64_t bmap_lookup(npheap_store *inode, uint64_t blkno)
+{
+    uint64_t id = inode->offset;
+    uint64_t height = inode->height;
+    uint64_t span;
+    uint64_t *node;
+
+    if(blkno >= bmap_capacity(height)){
+        return 0;
+    }
+    while(height > 0 && id != 0){
+        node = (uint64_t *)heap_get(id);
+        if(node == NULL){
+            return 0;
+        }
+        span = bmap_capacity(height - 1);
+        id = node[blkno / span];
+        blkno %= span;
+        height--;
+    }
+    return id;
+}
+
+// Replace the shared object *slot at the given height with a private
+// copy.  The children of a copied node gain a reference, and the
+// reference to the original is dropped when tx commits.  Returns the
+// copy, or 0 when the heap is out of space.
+static uint64_t bmap_unshare(uint64_t *slot, uint64_t height, struct jtx *tx)
+{
+    uint64_t size = height == 0 ? data_block_size : BLOCK_SIZE;
+    uint64_t *copy;
+    uint64_t *src;
+    uint64_t id;
+    uint64_t i;
+
+    src = (uint64_t *)heap_get(*slot);
+    if(src == NULL || tx == NULL){
+        return 0;
+    }
+    id = heap_new(size, (void **)&copy);
+    if(id == 0){
+        return 0;
+    }
+    memcpy(copy, src, size);
+    if(height == 0){
+        csum_set(id, csum_get(*slot));
+    }else{
+        for(i = 0; i < BMAP_FANOUT; i++){
+            if(copy[i] != 0){
+                share_ref(copy[i]);
+            }
+        }
+    }
+    jtx_free(tx, *slot, height);
+    *slot = id;
+    return id;
+}
+
+// Find the slot that holds file block blkno, growing the tree and
+// allocating or copying the interior nodes on the way so that the slot
+// can be written in place.  *parent is the node holding the slot, or 0
+// when it is inode->offset.  Returns NULL when the heap is out of space.
+static uint64_t *bmap_slot(npheap_store *inode, uint64_t blkno, struct jtx *tx, uint64_t *parent)
+{
+    uint64_t *slot = &inode->offset;
+    uint64_t height;
+    uint64_t span;
+    uint64_t id;
+    uint64_t *node;
+
+    // Grow the tree until blkno is in reach; the old root becomes child 0
+    while(blkno >= bmap_capacity(inode->height)){
+        if(inode->height >= BMAP_MAX_HEIGHT){
+            return NULL;
+        }
+        if(inode->offset != 0){
+            id = heap_new(BLOCK_SIZE, (void **)&node);
+            if(id == 0){
+                return NULL;
+            }
+            node[0] = inode->offset;
+            ckpt_dirty(id);
+            inode->offset = id;
+        }
+        inode->height++;
+    }
+
+    *parent = 0;
+    for(height = inode->height; height > 0; height--){
+        if(*slot == 0){
+            *slot = heap_new(BLOCK_SIZE, NULL);
+            if(*slot == 0){
+                return NULL;
+            }
+            ckpt_dirty(*parent);
+        }else if(share_count(*slot) != 0){
+            if(bmap_unshare(slot, height, tx) == 0){
+                return NULL;
+            }
+            ckpt_dirty(*parent);
+        }
+        node = (uint64_t *)heap_get(*slot);
+        if(node == NULL){
+            return NULL;
+        }
+        span = bmap_capacity(height - 1);
+        *parent = *slot;
+        slot = &node[blkno / span];
+        blkno %= span;
+    }
+    return slot;
+}
+
+// Return the npheap offset for file block blkno, allocating the data
+// block and any missing interior nodes on the way and copying any that
+// are shared, so the block returned can be written in place.  Returns
+// 0 when the heap is out of space.  New nodes are linked in directly,
+// but a new root only changes inode, which callers pass as a copy and
+// journal.  A compressed block is replaced by its decoded contents.
+// tx may be NULL for a file nothing shares and nothing compressed.
+uint64_t bmap_alloc(npheap_store *inode, uint64_t blkno, struct jtx *tx)
+{
+    uint64_t parent;
+    uint64_t *slot;
+    uint64_t id;
+    void *data;
+
+    slot = bmap_slot(inode, blkno, tx, &parent);
+    if(slot == NULL){
+        return 0;
+    }
+    if(*slot == 0){
+        *slot = heap_new(data_block_size, NULL);
+        if(*slot == 0){
+            return 0;
+        }
+        ckpt_dirty(parent);
+        return *slot;
+    }
+    if(*slot & BMAP_COMPRESSED){
+        if(tx == NULL){
+            return 0;
+        }
+        id = heap_new(data_block_size, &data);
+        if(id == 0){
+            return 0;
+        }
+        if(zblock_read(*slot, data, 0, data_block_size) != 0){
+            heap_free(id);
+            return 0;
+        }
+        csum_update(id, data, data_block_size);
+        jtx_free(tx, *slot, 0);
+        *slot = id;
+        ckpt_dirty(parent);
+        return *slot;
+    }
+    // Out of the dedup index before anyone can find it there and share it
+    dedup_forget(*slot);
+    if(share_count(*slot) != 0){
+        if(bmap_unshare(slot, 0, tx) == 0){
+            return 0;
+        }
+        ckpt_dirty(parent);
+    }
+    return *slot;
+}
+
+// Point file block blkno of inode at entry, an object nothing else
+// uses yet, or make it a hole when entry is 0.  Whatever block was
+// there before is given up when tx commits.  Returns 0, or -ENOSPC.
+int bmap_set(npheap_store *inode, uint64_t blkno, uint64_t entry, struct jtx *tx)
+{
+    uint64_t parent;
+    uint64_t *slot;
+
+    slot = bmap_slot(inode, blkno, tx, &parent);
+    if(slot == NULL){
+        return -ENOSPC;
+    }
+    jtx_free(tx, *slot, 0);
+    *slot = entry;
+    ckpt_dirty(parent);
+    return 0;
+}
+
+// The same for the data block id, which another file keeps using
+int bmap_share(npheap_store *inode, uint64_t blkno, uint64_t id, struct jtx *tx)
+{
+    int err;
+
+    if(bmap_lookup(inode, blkno) == id){
+        return 0;
+    }
+    // Reference first: a crash before tx commits is only a leak
+    if(id != 0){
+        share_ref(id);
+    }
+    err = bmap_set(inode, blkno, id, tx);
+    if(err != 0 && id != 0){
+        share_unref(id, 1);
+    }
+    return err;
+}
+
+static void bmap_walk_tree(uint64_t id, uint64_t height, uint64_t first,
+                           void (*fn)(uint64_t blkno, uint64_t id, void *arg), void *arg)
+{
+    uint64_t *node;
+    uint64_t span;
+    uint64_t i;
+
+    if(height == 0){
+        fn(first, id, arg);
+        return;
+    }
+    node = (uint64_t *)heap_get(id);
+    if(node == NULL){
+        return;
+    }
+    span = bmap_capacity(height - 1);
+    for(i = 0; i < BMAP_FANOUT; i++){
+        if(node[i] != 0){
+            bmap_walk_tree(node[i], height - 1, first + i * span, fn, arg);
+        }
+    }
+}
+
+// Call fn for every allocated block of the file in block order; holes
+// are skipped without being visited
+void bmap_walk(npheap_store *inode, void (*fn)(uint64_t blkno, uint64_t id, void *arg), void *arg)
+{
+    if(inode->offset != 0){
+        bmap_walk_tree(inode->offset, inode->height, 0, fn, arg);
+    }
+}
+
+// Drop a reference to the subtree rooted at id.  If it was the last
+// one every object under it goes the same way, children before their
+// parent, and each object deleted is reported to rel->freed.  Bitmap
+// bits are left to the caller, so an interrupted release can simply be
+// run again.
+void bmap_release(uint64_t id, uint64_t height, const struct bmap_releaser *rel)
+{
+    uint64_t *node;
+    uint64_t i;
+
+    id = BMAP_ID(id);
+    if(height == 0){
+        dedup_forget(id);
+        xattr_forget(id);
+    }
+    if(!rel->unref(id, rel->arg)){
+        return;
+    }
+    if(height > 0){
+        node = (uint64_t *)heap_get(id);
+        if(node != NULL){
+            for(i = 0; i < BMAP_FANOUT; i++){
+                if(node[i] != 0){
+                    bmap_release(node[i], height - 1, rel);
+                }
+            }
+        }
+    }
+    heap_drop(id);
+    rel->freed(id, rel->arg);
+}
+
+// Log the release of blocks lo up to hi under the subtree id and
+// return what the parent should point at from now on: 0 if the whole
+// subtree goes, a private copy if id was shared, or id.  A copy is not
+// reachable until tx commits, so it is edited directly; a node already
+// private has its slots cleared through tx.
+static uint64_t bmap_trim(uint64_t id, uint64_t height, uint64_t lo, uint64_t hi, struct jtx *tx)
+{
+    uint64_t *node;
+    uint64_t span;
+    uint64_t start;
+    uint64_t child;
+    uint64_t i;
+    int copied = 0;
+
+    if(lo == 0 && hi >= bmap_capacity(height)){
+        jtx_free(tx, id, height);
+        return 0;
+    }
+    if(height == 0){
+        return id;
+    }
+    node = (uint64_t *)heap_get(id);
+    if(node == NULL){
+        return id;
+    }
+    span = bmap_capacity(height - 1);
+    for(i = lo / span; i < BMAP_FANOUT && i * span < hi; i++){
+        start = i * span;
+        if(node[i] == 0){
+            continue;
+        }
+        if(!copied && share_count(id) != 0){
+            if(bmap_unshare(&id, height, tx) == 0){
+                tx->err = -ENOSPC;
+                return id;
+            }
+            node = (uint64_t *)heap_get(id);
+            copied = 1;
+        }
+        child = bmap_trim(node[i], height - 1, start >= lo ? 0 : lo - start, hi - start, tx);
+        if(child == node[i]){
+            continue;
+        }
+        if(copied){
+            node[i] = child;
+            ckpt_dirty(id);
+        }else{
+            jtx_bytes(tx, id, i * sizeof(uint64_t), &child, sizeof(child));
+        }
+    }
+    return id;
+}
+
+// Free every block at index nblocks and beyond; nblocks == 0 frees the
+// file.  inode is the caller's copy: its offset and height are updated
+// directly and the caller logs them, while the blocks themselves are
+// only released when tx commits.
+void bmap_truncate(npheap_store *inode, uint64_t nblocks, struct jtx *tx)
+{
+    if(inode->offset != 0 && nblocks < bmap_capacity(inode->height)){
+        inode->offset = bmap_trim(inode->offset, inode->height, nblocks, UINT64_MAX, tx);
+    }
+    if(inode->offset == 0){
+        inode->height = 0;
+    }
+}
+
+// Turn blocks first up to first + count into holes, the same way
+void bmap_punch(npheap_store *inode, uint64_t first, uint64_t count, struct jtx *tx)
+{
+    if(inode->offset != 0 && first < bmap_capacity(inode->height)){
+        inode->offset = bmap_trim(inode->offset, inode->height, first,
+                                  count > UINT64_MAX - first ? UINT64_MAX : first + count, tx);
+    }
+    if(inode->offset == 0){
+        inode->height = 0;
+    }
+}
+
+#define FILL_BATCH  256
+
+// Allocate every missing block from first up to first + count, taking
+// the new blocks from the data bitmap a batch at a time instead of one
+// allocation per block.  Blocks already there are left alone, shared
+// or not.  Returns 0, or -ENOSPC with the blocks so far kept.
+int bmap_fill(npheap_store *inode, uint64_t first, uint64_t count, struct jtx *tx)
+{
+    uint64_t pool[FILL_BATCH];
+    uint64_t npool = 0;
+    uint64_t used = 0;
+    uint64_t end = first + count;
+    uint64_t blkno = first;
+    uint64_t parent;
+    uint64_t *slot;
+    uint64_t run;
+    uint64_t i;
+    int err = 0;
+
+    while(blkno < end && err == 0){
+        slot = bmap_slot(inode, blkno, tx, &parent);
+        if(slot == NULL){
+            err = -ENOSPC;
+            break;
+        }
+        // Every slot of a leaf node can be filled without walking down again
+        run = inode->height == 0 ? 1 : BMAP_FANOUT - blkno % BMAP_FANOUT;
+        if(run > end - blkno){
+            run = end - blkno;
+        }
+        for(i = 0; i < run; i++){
+            if(slot[i] != 0){
+                continue;
+            }
+            if(used == npool){
+                npool = heap_new_many(data_block_size, end - blkno - i < FILL_BATCH ?
+                                      end - blkno - i : FILL_BATCH, pool);
+                used = 0;
+                if(npool == 0){
+                    err = -ENOSPC;
+                    break;
+                }
+            }
+            slot[i] = pool[used++];
+            csum_zeroed(slot[i]);
+        }
+        ckpt_dirty(parent);
+        blkno += run;
+    }
+    // Anything left over from the last batch goes straight back
+    while(used < npool){
+        heap_free(pool[used++]);
+    }
+    return err;
+}
+
+// Zero bytes from up to to of the file in place, copying any shared
+// block first; holes already read as zero and are left alone.  Returns
+// 0, or -ENOSPC if a block could not be copied and -EIO if one is
+// damaged, which tx also keeps so it will not commit.
+int bmap_zero(npheap_store *inode, uint64_t from, uint64_t to, struct jtx *tx)
+{
+    uint64_t blkno;
+    uint64_t rem;
+    uint64_t chunk;
+    uint64_t id;
+    char *data;
+
+    while(from < to){
+        blkno = from / data_block_size;
+        rem = from % data_block_size;
+        chunk = data_block_size - rem;
+        if(chunk > to - from){
+            chunk = to - from;
+        }
+        if(bmap_lookup(inode, blkno) != 0){
+            id = bmap_alloc(inode, blkno, tx);
+            data = id != 0 ? (char *)heap_get(id) : NULL;
+            if(data == NULL){
+                tx->err = -ENOSPC;
+                return tx->err;
+            }
+            csum_lock(id);
+            // Damage stays visible rather than being sealed under a new checksum
+            if(csum_check(id, data, data_block_size) != 0){
+                csum_unlock(id);
+                tx->err = -EIO;
+                return tx->err;
+            }
+            memset(data + rem, 0, chunk);
+            ckpt_dirty(id);
+            csum_update(id, data, data_block_size);
+            csum_unlock(id);
+        }
+        from += chunk;
+    }
+    return 0;
+}
+
+// 1 if the len bytes at buf are all zero.  Data is checked 64 bytes at
+// a time, with SSE2 where the compiler has it, so a block that is not
+// zero is usually turned down at its first cache line.
+int bmap_is_zero(const void *buf, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+#ifdef __SSE2__
+    __m128i acc;
+
+    while(len >= 64){
+        acc = _mm_or_si128(_mm_or_si128(_mm_loadu_si128((const __m128i *)p),
+                                        _mm_loadu_si128((const __m128i *)(p + 16))),
+                           _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + 32)),
+                                        _mm_loadu_si128((const __m128i *)(p + 48))));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xffff){
+            return 0;
+        }
+        p += 64;
+        len -= 64;
+    }
+#else
+    uint64_t w[8];
+    uint64_t acc;
+    int i;
+
+    while(len >= 64){
+        memcpy(w, p, sizeof(w));
+        acc = 0;
+        for(i = 0; i < 8; i++){
+            acc |= w[i];
+        }
+        if(acc != 0){
+            return 0;
+        }
+        p += 64;
+        len -= 64;
+    }
+#endif
+    while(len > 0){
+        if(*p++ != 0){
+            return 0;
+        }
+        len--;
+    }
+    return 1;
+}
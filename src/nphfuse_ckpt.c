@@ -0,0 +1,615 @@
+/*
+  NPHeap File System - checkpoint file
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  The heap lives in memory, so with -o checkpoint=FILE every object is
+  also kept in a backing file that fsync brings up to date.  Objects
+  are marked in an in-process dirty bitmap as they change and a sync
+  only writes the marked ones.
+
+  File layout, one slot per npheap object id:
+    0                            header
+    id * BLOCK_SIZE              metadata objects, id < data_start
+    data area                    data_block_size per data object
+    staging area                 (id, contents) pairs for a metadata update
+
+  A sync pauses the journal, takes the marked data objects and a copy
+  of the marked metadata together and writes the data in place before
+  letting batches through again, so the metadata never points at a
+  block whose contents are not in the file.  The copied metadata is
+  then written to the staging area, which the header only claims once
+  it is on disk, and only then copied home.  A crash mid-sync therefore
+  leaves either the old or the new metadata, never a mix.  The journal
+  is not checkpointed: it is empty whenever a sync copies metadata and
+  is laid down fresh on restore.
+*/
+
+#include "nphfuse_extra.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CKPT_MAGIC  0x54504b4348504e4eULL
+
+struct ckpt_header {
+  uint64_t magic;
+  uint64_t data_start;      // geometry of the filesystem in the file
+  uint64_t data_blocks;
+  uint64_t block_size;
+  uint64_t staged;          // metadata objects waiting in the staging area
+};
+
+static int ckpt_fd = -1;
+static uint64_t *dirty = NULL;      // one bit per object id
+static uint64_t dirty_words = 0;
+static int pending_data = 0;        // some data object is marked
+static int pending_meta = 0;        // some metadata object is marked
+static int need_meta = 0;           // data cannot be read back without the metadata
+static pthread_mutex_t ckpt_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t slot_offset(uint64_t id)
+{
+    if(id < superblock->data_start){
+        return id * BLOCK_SIZE;
+    }
+    return superblock->data_start * BLOCK_SIZE + (id - superblock->data_start) * data_block_size;
+}
+
+static uint64_t staging_offset(uint64_t index)
+{
+    return slot_offset(superblock->data_start + superblock->data_blocks) +
+           index * (sizeof(uint64_t) + BLOCK_SIZE);
+}
+
+// Journal objects never go to the file
+static int in_journal(uint64_t id)
+{
+    return id >= superblock->journal_start &&
+           id < superblock->journal_start + superblock->journal_blocks;
+}
+
+// Copy staged metadata home if the last sync died half way through
+static int ckpt_roll_forward(int fd, struct ckpt_header *hdr)
+{
+    char *buf;
+    uint64_t id;
+    uint64_t i;
+    off_t base;
+    int err = 0;
+
+    if(hdr->staged == 0){
+        return 0;
+    }
+    buf = malloc(BLOCK_SIZE);
+    if(buf == NULL){
+        return -ENOMEM;
+    }
+    base = hdr->data_start * BLOCK_SIZE + hdr->data_blocks * hdr->block_size;
+    for(i = 0; i < hdr->staged && err == 0; i++){
+        err = read_full(fd, &id, sizeof(id), base + i * (sizeof(uint64_t) + BLOCK_SIZE));
+        if(err == 0 && id != 0 && id < hdr->data_start){
+            err = read_full(fd, buf, BLOCK_SIZE, base + i * (sizeof(uint64_t) + BLOCK_SIZE) + sizeof(uint64_t));
+            if(err == 0){
+                err = write_full(fd, buf, BLOCK_SIZE, id * BLOCK_SIZE);
+            }
+        }
+    }
+    free(buf);
+    if(err == 0 && fdatasync(fd) != 0){
+        err = -errno;
+    }
+    if(err == 0){
+        hdr->staged = 0;
+        err = write_full(fd, hdr, sizeof(*hdr), 0);
+    }
+    return err;
+}
+
+// Create object id with exactly size bytes and fill it from the file
+// at off, or with zeroes when fd is -1
+static void *restore_object(int fd, uint64_t id, uint64_t size, off_t off)
+{
+    uint64_t old = heap_size(id);
+    void *ptr;
+
+    if(old != 0 && old != size){
+        heap_delete(id);
+    }
+    ptr = heap_map(id, size);
+    if(ptr == NULL){
+        return NULL;
+    }
+    if(fd < 0){
+        memset(ptr, 0, size);
+    }else if(read_full(fd, ptr, size, off) != 0){
+        return NULL;
+    }
+    return ptr;
+}
+
+// Mark data object id in reached; 0 if it is outside the data area or
+// was reached before
+static int reach(uint64_t id, uint64_t *reached)
+{
+    uint64_t bit;
+
+    if(id < superblock->data_start || id >= superblock->data_start + superblock->data_blocks){
+        return 0;
+    }
+    bit = id - superblock->data_start;
+    if(reached[bit / 64] & (1ULL << (bit % 64))){
+        return 0;
+    }
+    reached[bit / 64] |= 1ULL << (bit % 64);
+    return 1;
+}
+
+// Bring back the block map under entry, marking each object in reached
+static void restore_tree(int fd, uint64_t entry, uint64_t height, uint64_t *reached)
+{
+    struct nph_zblock hdr;
+    uint64_t id = BMAP_ID(entry);
+    uint64_t size = data_block_size;
+    uint64_t *node;
+    uint64_t i;
+
+    if(!reach(id, reached)){
+        return;
+    }
+
+    if(height == 0){
+        // A compressed block only takes up part of its slot
+        if((entry & BMAP_COMPRESSED) && read_full(fd, &hdr, sizeof(hdr), slot_offset(id)) == 0 &&
+           zblock_size(&hdr) != 0){
+            size = zblock_size(&hdr);
+        }
+        restore_object(fd, id, size, slot_offset(id));
+        return;
+    }
+    node = (uint64_t *)restore_object(fd, id, BLOCK_SIZE, slot_offset(id));
+    if(node == NULL){
+        return;
+    }
+    for(i = 0; i < BMAP_FANOUT; i++){
+        if(node[i] != 0){
+            restore_tree(fd, node[i], height - 1, reached);
+        }
+    }
+}
+
+// Load the filesystem held in the checkpoint file at path into an
+// empty heap.  Returns 0, or a negative errno if there is nothing
+// usable in the file.
+int ckpt_restore(const char *path)
+{
+    struct ckpt_header hdr;
+    struct nph_super sb;
+    npheap_store *inode;
+    uint64_t *reached;
+    uint64_t id;
+    uint64_t i;
+    int journal;
+    int fd;
+    int err;
+
+    fd = open(path, O_RDWR);
+    if(fd < 0){
+        return -errno;
+    }
+    err = read_full(fd, &hdr, sizeof(hdr), 0);
+    if(err == 0 && hdr.magic != CKPT_MAGIC){
+        err = -EINVAL;
+    }
+    if(err == 0){
+        err = ckpt_roll_forward(fd, &hdr);
+    }
+    if(err == 0){
+        err = read_full(fd, &sb, sizeof(sb), ROOT_BLOCK * BLOCK_SIZE);
+    }
+    if(err == 0 && (sb.magic != NPH_MAGIC || sb.data_start != hdr.data_start)){
+        err = -EINVAL;
+    }
+    if(err != 0){
+        close(fd);
+        return err;
+    }
+
+    // Metadata first; the superblock tells everything else where to go
+    for(id = ROOT_BLOCK; id < sb.data_start; id++){
+        journal = id >= sb.journal_start && id < sb.journal_start + sb.journal_blocks;
+        if(restore_object(journal ? -1 : fd, id, BLOCK_SIZE, id * BLOCK_SIZE) == NULL){
+            close(fd);
+            return -ENOMEM;
+        }
+    }
+    if(super_load() == NULL){
+        close(fd);
+        return -EINVAL;
+    }
+    journal_format();
+
+    // Then every block reachable from a live inode
+    reached = calloc((superblock->data_blocks + 63) / 64, sizeof(uint64_t));
+    if(reached == NULL){
+        close(fd);
+        return -ENOMEM;
+    }
+    for(i = 0; i < superblock->inode_count; i++){
+        inode = inode_slot(i);
+        if(inode == NULL || !bitmap_test(&inode_bitmap, i)){
+            continue;
+        }
+        if(inode->offset != 0){
+            restore_tree(fd, inode->offset, inode->height, reached);
+        }
+        if(inode->xattr != 0 && reach(inode->xattr, reached)){
+            restore_object(fd, inode->xattr, BLOCK_SIZE, slot_offset(inode->xattr));
+        }
+    }
+    // Blocks nothing points at were leaked before the checkpoint
+    for(i = 0; i < superblock->data_blocks; i++){
+        if(bitmap_test(&data_bitmap, i) && !(reached[i / 64] & (1ULL << (i % 64)))){
+            bitmap_clear(&data_bitmap, i);
+        }
+    }
+    free(reached);
+    close(fd);
+    return 0;
+}
+
+static void mark(uint64_t id)
+{
+    uint64_t bit = 1ULL << (id % 64);
+
+    if(!(dirty[id / 64] & bit)){
+        __sync_fetch_and_or(&dirty[id / 64], bit);
+    }
+}
+
+// Start keeping the checkpoint file at path.  Unless the heap was just
+// restored from it, every object is written by the first sync.
+int ckpt_attach(const char *path, int restored)
+{
+    struct ckpt_header hdr;
+    uint64_t id;
+    uint64_t i;
+    int err;
+
+    ckpt_fd = open(path, O_RDWR | O_CREAT, 0600);
+    if(ckpt_fd < 0){
+        return -errno;
+    }
+    err = read_full(ckpt_fd, &hdr, sizeof(hdr), 0);
+    if(err == 0 && hdr.magic == CKPT_MAGIC){
+        err = ckpt_roll_forward(ckpt_fd, &hdr);
+    }
+    if(err == 0 && (hdr.magic != CKPT_MAGIC || hdr.data_start != superblock->data_start ||
+                    hdr.data_blocks != superblock->data_blocks ||
+                    hdr.block_size != data_block_size)){
+        // A file from some other filesystem is started over
+        if(ftruncate(ckpt_fd, 0) != 0){
+            err = -errno;
+        }
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.magic = CKPT_MAGIC;
+        hdr.data_start = superblock->data_start;
+        hdr.data_blocks = superblock->data_blocks;
+        hdr.block_size = data_block_size;
+        if(err == 0){
+            err = write_full(ckpt_fd, &hdr, sizeof(hdr), 0);
+        }
+        restored = 0;
+    }
+    if(err != 0){
+        close(ckpt_fd);
+        ckpt_fd = -1;
+        return err;
+    }
+
+    dirty_words = (superblock->data_start + superblock->data_blocks + 63) / 64;
+    dirty = calloc(dirty_words, sizeof(uint64_t));
+    if(dirty == NULL){
+        close(ckpt_fd);
+        ckpt_fd = -1;
+        return -ENOMEM;
+    }
+    if(!restored){
+        for(id = ROOT_BLOCK; id < superblock->data_start; id++){
+            if(!in_journal(id)){
+                mark(id);
+            }
+        }
+        for(i = 0; i < superblock->data_blocks; i++){
+            if(bitmap_test(&data_bitmap, i)){
+                mark(superblock->data_start + i);
+            }
+        }
+        pending_meta = pending_data = need_meta = 1;
+    }
+    return 0;
+}
+
+// Object id changed and has to be written by the next sync
+void ckpt_dirty(uint64_t id)
+{
+    if(dirty == NULL || id == 0 || id / 64 >= dirty_words){
+        return;
+    }
+    if(id < superblock->data_start){
+        if(in_journal(id)){
+            return;
+        }
+        mark(id);
+        if(!pending_meta){
+            __sync_synchronize();
+            pending_meta = 1;
+        }
+    }else{
+        mark(id);
+        if(!pending_data){
+            __sync_synchronize();
+            pending_data = 1;
+        }
+    }
+}
+
+// Data written since the last sync cannot be found without the
+// metadata, so fdatasync has to write that too
+void ckpt_need_meta(void)
+{
+    if(dirty != NULL && !need_meta){
+        need_meta = 1;
+    }
+}
+
+// Take the marked objects in [first, last) off the dirty bitmap
+static uint64_t *collect(uint64_t first, uint64_t last, uint64_t *count)
+{
+    uint64_t *ids = NULL;
+    uint64_t *grown;
+    uint64_t n = 0;
+    uint64_t cap = 0;
+    uint64_t w;
+    uint64_t bits;
+    uint64_t id;
+
+    for(w = first / 64; w * 64 < last; w++){
+        if(dirty[w] == 0){
+            continue;
+        }
+        bits = __sync_lock_test_and_set(&dirty[w], 0);
+        while(bits != 0){
+            id = w * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            if(id < first || id >= last){
+                // Outside the range: put it back for its own pass
+                mark(id);
+                continue;
+            }
+            if(n == cap){
+                cap = cap ? cap * 2 : 256;
+                grown = realloc(ids, cap * sizeof(uint64_t));
+                if(grown == NULL){
+                    mark(id);
+                    continue;
+                }
+                ids = grown;
+            }
+            ids[n++] = id;
+        }
+    }
+    *count = n;
+    return ids;
+}
+
+// Put every id in ids back on the dirty bitmap
+static void remark(const uint64_t *ids, uint64_t n)
+{
+    uint64_t i;
+
+    for(i = 0; i < n; i++){
+        mark(ids[i]);
+    }
+}
+
+// Write the n data objects in ids to their slots.  Called with the
+// journal paused, so none of them can be freed and handed out again
+// while it runs.
+static int sync_data(uint64_t *ids, uint64_t n)
+{
+    uint64_t i;
+    uint64_t size;
+    void *ptr;
+    int err = 0;
+
+    for(i = 0; i < n; i++){
+        if(err != 0){
+            mark(ids[i]);
+            continue;
+        }
+        // Objects out in the spill file are copied from there rather
+        // than brought back
+        err = tier_copy(ids[i], ckpt_fd, slot_offset(ids[i]));
+        if(err != -ENOENT){
+            if(err != 0){
+                mark(ids[i]);
+            }
+            continue;
+        }
+        err = 0;
+        // Objects freed since they were marked are simply skipped
+        ptr = heap_get(ids[i]);
+        size = ptr != NULL ? heap_size(ids[i]) : 0;
+        if(size != 0){
+            err = write_full(ckpt_fd, ptr, size, slot_offset(ids[i]));
+            if(err != 0){
+                mark(ids[i]);
+            }
+        }
+    }
+    return err;
+}
+
+// Take the marked metadata objects and a copy of their contents.
+// Called with the journal paused.
+static int copy_meta(uint64_t **ids, uint64_t *n, char **copy)
+{
+    uint64_t i;
+    void *ptr;
+
+    *ids = collect(ROOT_BLOCK, superblock->data_start, n);
+    *copy = *n != 0 ? malloc(*n * BLOCK_SIZE) : NULL;
+    if(*n != 0 && *copy == NULL){
+        remark(*ids, *n);
+        free(*ids);
+        *ids = NULL;
+        *n = 0;
+        return -ENOMEM;
+    }
+    for(i = 0; i < *n; i++){
+        ptr = heap_get((*ids)[i]);
+        if(ptr != NULL){
+            memcpy(*copy + i * BLOCK_SIZE, ptr, BLOCK_SIZE);
+        }else{
+            memset(*copy + i * BLOCK_SIZE, 0, BLOCK_SIZE);
+        }
+    }
+    return 0;
+}
+
+// Write copied metadata through the staging area; the data it points
+// at is already in the file
+static int sync_meta(const uint64_t *ids, uint64_t n, const char *copy)
+{
+    struct ckpt_header hdr;
+    uint64_t i;
+    int err = 0;
+
+    for(i = 0; i < n && err == 0; i++){
+        err = write_full(ckpt_fd, &ids[i], sizeof(uint64_t), staging_offset(i));
+        if(err == 0){
+            err = write_full(ckpt_fd, copy + i * BLOCK_SIZE, BLOCK_SIZE,
+                             staging_offset(i) + sizeof(uint64_t));
+        }
+    }
+    if(err == 0 && fdatasync(ckpt_fd) != 0){
+        err = -errno;
+    }
+
+    // From here on a crash finishes the update on the next restore
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = CKPT_MAGIC;
+    hdr.data_start = superblock->data_start;
+    hdr.data_blocks = superblock->data_blocks;
+    hdr.block_size = data_block_size;
+    hdr.staged = n;
+    if(err == 0){
+        err = write_full(ckpt_fd, &hdr, sizeof(hdr), 0);
+    }
+    if(err == 0 && fdatasync(ckpt_fd) != 0){
+        err = -errno;
+    }
+    for(i = 0; i < n && err == 0; i++){
+        err = write_full(ckpt_fd, copy + i * BLOCK_SIZE, BLOCK_SIZE, slot_offset(ids[i]));
+    }
+    if(err == 0 && fdatasync(ckpt_fd) != 0){
+        err = -errno;
+    }
+    if(err == 0){
+        hdr.staged = 0;
+        err = write_full(ckpt_fd, &hdr, sizeof(hdr), 0);
+    }
+    return err;
+}
+
+// Bring the checkpoint file up to date.  With datasync set, changes
+// that only touch metadata are left for a later full sync.
+int ckpt_sync(int datasync)
+{
+    uint64_t *data_ids = NULL;
+    uint64_t *meta_ids = NULL;
+    char *copy = NULL;
+    uint64_t data_n = 0;
+    uint64_t meta_n = 0;
+    int data;
+    int meta;
+    int err = 0;
+
+    if(dirty == NULL){
+        return 0;
+    }
+    pthread_mutex_lock(&ckpt_lock);
+    meta = !datasync || need_meta;
+    if(!pending_data && !(meta && pending_meta)){
+        pthread_mutex_unlock(&ckpt_lock);
+        return 0;
+    }
+
+    // Flags drop before the bitmap is read, so a concurrent mark is
+    // either collected now or raises its flag again
+    data = pending_data;
+    pending_data = 0;
+    if(meta){
+        pending_meta = 0;
+        need_meta = 0;
+    }
+    __sync_synchronize();
+
+    // Both sets are taken under one pause, so every block the copied
+    // metadata reaches is either collected here or was written by an
+    // earlier sync.  The data goes out before the pause ends, while
+    // none of those blocks can be freed and reused.
+    journal_pause();
+    if(data){
+        data_ids = collect(superblock->data_start, superblock->data_start + superblock->data_blocks,
+                           &data_n);
+    }
+    if(meta){
+        err = copy_meta(&meta_ids, &meta_n, &copy);
+    }
+    if(err == 0){
+        err = sync_data(data_ids, data_n);
+    }else{
+        remark(data_ids, data_n);
+    }
+    journal_resume();
+
+    if(err == 0 && data && !meta && fdatasync(ckpt_fd) != 0){
+        err = -errno;
+    }
+    if(err == 0 && meta){
+        err = sync_meta(meta_ids, meta_n, copy);
+    }
+    if(err != 0){
+        remark(meta_ids, meta_n);
+        if(data){
+            pending_data = 1;
+        }
+        if(meta){
+            pending_meta = need_meta = 1;
+        }
+    }
+    free(copy);
+    free(meta_ids);
+    free(data_ids);
+    pthread_mutex_unlock(&ckpt_lock);
+    return err;
+}
+
+// Final sync at unmount
+void ckpt_close(void)
+{
+    if(dirty == NULL){
+        return;
+    }
+    ckpt_sync(0);
+    close(ckpt_fd);
+    ckpt_fd = -1;
+    free(dirty);
+    dirty = NULL;
+}
@@ -0,0 +1,165 @@
+/*
+  NPHeap File System - block sharing copies
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  A copy between two files of the filesystem hands the destination the
+  source's data blocks instead of their contents: both block maps point
+  at the same objects, counted in the share table, and whichever file
+  is written first takes a private copy (nphfuse_bmap.c).  Copying a
+  whole file onto one no larger just shares the root of its block map.
+  Only whole blocks at the same alignment in both files can be shared;
+  a ragged head or tail is copied byte by byte.
+*/
+
+#include "nphfuse_extra.h"
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+// Copy one stretch that does not cross a block boundary in either file
+static int clone_bytes(npheap_store *src, npheap_store *staged, uint64_t src_off,
+                       uint64_t dst_off, uint64_t len, struct jtx *tx)
+{
+    uint64_t sid = bmap_lookup(src, src_off / data_block_size);
+    uint64_t did;
+    char *from = NULL;
+    char *to;
+    int err = 0;
+
+    if(sid == 0 && bmap_lookup(staged, dst_off / data_block_size) == 0){
+        // Hole onto hole
+        return 0;
+    }
+    // A source block replaced by this is only given up when tx commits
+    did = bmap_alloc(staged, dst_off / data_block_size, tx);
+    to = (char *)heap_get(did);
+    if(to == NULL){
+        return -ENOSPC;
+    }
+    // A plain source is checked before the destination is locked, as
+    // checking may need its lock
+    if(sid != 0 && sid != did && !(sid & BMAP_COMPRESSED)){
+        from = (char *)heap_get(sid);
+        if(from == NULL || csum_verify(sid, from, data_block_size) != 0){
+            return -EIO;
+        }
+    }
+
+    csum_lock(did);
+    if(len != data_block_size && csum_check(did, to, data_block_size) != 0){
+        err = -EIO;
+    }else if(sid == 0){
+        memset(to + dst_off % data_block_size, 0, len);
+    }else if(sid == did){
+        memmove(to + dst_off % data_block_size, to + src_off % data_block_size, len);
+    }else if(from != NULL){
+        memcpy(to + dst_off % data_block_size, from + src_off % data_block_size, len);
+    }else if(zblock_read(sid, to + dst_off % data_block_size, src_off % data_block_size, len) != 0){
+        err = -EIO;
+    }
+    if(err == 0){
+        ckpt_dirty(did);
+        csum_update(did, to, data_block_size);
+    }
+    csum_unlock(did);
+    return err;
+}
+
+// Make len bytes of dst from dst_off on a copy of src from src_off on;
+// len 0 means up to the end of src.  Returns 0 or a negative errno;
+// on error the part already copied is kept.
+int clone_range(npheap_store *src, npheap_store *dst, uint64_t src_off,
+                uint64_t dst_off, uint64_t len)
+{
+    npheap_store staged;
+    struct jtx tx;
+    struct timespec now;
+    uint64_t size = src->mystat.st_size;
+    uint64_t oldsize = dst->mystat.st_size;
+    uint64_t end = oldsize;
+    uint64_t pos;
+    uint64_t chunk;
+    uint64_t s;
+    uint64_t d;
+    int err = 0;
+
+    if(!S_ISREG(src->mystat.st_mode) || !S_ISREG(dst->mystat.st_mode)){
+        return -EINVAL;
+    }
+    if(src_off >= size){
+        return 0;
+    }
+    if(len == 0 || len > size - src_off){
+        len = size - src_off;
+    }
+    if(src == dst && src_off < dst_off + len && dst_off < src_off + len){
+        return -EINVAL;
+    }
+    // The new size is charged up front, what is not copied given back
+    if(dst_off + len > oldsize){
+        end = dst_off + len;
+        err = quota_resize(dst, oldsize, end);
+        if(err != 0){
+            return err;
+        }
+    }
+
+    snapshot_hold();
+    jtx_begin(&tx);
+    staged = *dst;
+
+    if(src_off == 0 && dst_off == 0 && len == size && dst->mystat.st_size <= size){
+        // The whole file onto one no larger: share the block map root
+        if(src->offset != 0){
+            share_ref(src->offset);
+        }
+        jtx_free(&tx, staged.offset, staged.height);
+        staged.offset = src->offset;
+        staged.height = src->height;
+        pos = len;
+    }else{
+        for(pos = 0; pos < len && err == 0; pos += chunk){
+            s = src_off + pos;
+            d = dst_off + pos;
+            if(s % data_block_size == 0 && d % data_block_size == 0 &&
+               len - pos >= data_block_size){
+                chunk = data_block_size;
+                err = bmap_share(&staged, d / data_block_size,
+                                 bmap_lookup(src, s / data_block_size), &tx);
+                continue;
+            }
+            chunk = data_block_size - (s % data_block_size > d % data_block_size ?
+                                       s % data_block_size : d % data_block_size);
+            if(chunk > len - pos){
+                chunk = len - pos;
+            }
+            err = clone_bytes(src, &staged, s, d, chunk, &tx);
+        }
+        if(err != 0){
+            pos -= chunk;
+        }
+    }
+
+    now = time_now();
+    if(staged.offset != dst->offset || staged.height != dst->height){
+        jtx_field(&tx, dst, offset, staged.offset);
+        jtx_field(&tx, dst, height, staged.height);
+    }
+    if(dst_off + pos > dst->mystat.st_size){
+        jtx_field(&tx, dst, mystat.st_size, dst_off + pos);
+    }
+    jtx_field(&tx, dst, mystat.st_mtim, now);
+    jtx_field(&tx, dst, mystat.st_ctim, now);
+    ckpt_need_meta();
+    if(jtx_commit(&tx) != 0 && err == 0){
+        err = -ENOMEM;
+        pos = 0;
+    }
+    snapshot_unhold();
+    if(dst_off + pos < end){
+        quota_resize(dst, end, dst_off + pos > oldsize ? dst_off + pos : oldsize);
+    }
+    return err;
+}
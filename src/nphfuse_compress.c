@@ -0,0 +1,484 @@
+/*
+  NPHeap File System - data block compression
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Files flagged NPH_INODE_COMPRESS (chattr +c, inherited from the
+  directory they are made in), or every file when mounted with
+  -o compress, have each block they write compressed into an object
+  sized to fit it.  A block is only kept compressed when that saves at
+  least a page, since npheap hands out whole pages; otherwise it is
+  stored as it is.  The block map entry of a compressed block carries
+  BMAP_COMPRESSED and the object starts with a struct nph_zblock.
+
+  The encoding is the LZ4 block format, with a greedy single-probe
+  matcher written out here so the heap needs no extra library.
+
+  A compressed object is never changed in place: writing to the block
+  decodes it, and the result is stored again as a new object.  Decoded
+  blocks can therefore be kept by object id in a small cache, which
+  only has to forget an id when heap_drop() deletes the object.
+*/
+
+#include "nphfuse_extra.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// npheap allocates whole pages, so smaller savings buy nothing
+#define ZBLOCK_ALIGN   4096
+
+#define LZ4_MINMATCH      4
+#define LZ4_LASTLITERALS  5
+#define LZ4_MFLIMIT       12
+#define LZ4_MAX_OFFSET    65535
+#define LZ4_HASH_LOG      12
+
+static uint32_t lz4_read32(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t lz4_hash(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+// Append a length field of n beyond the 15 the token holds
+static uint8_t *lz4_put_len(uint8_t *op, size_t n)
+{
+    while(n >= 255){
+        *op++ = 255;
+        n -= 255;
+    }
+    *op++ = (uint8_t)n;
+    return op;
+}
+
+// Compress len bytes of src into dst.  Returns the compressed length,
+// or 0 if it would take more than cap bytes.
+size_t lz4_compress(const void *src, size_t len, void *dst, size_t cap)
+{
+    uint32_t table[1 << LZ4_HASH_LOG];
+    const uint8_t *in = (const uint8_t *)src;
+    const uint8_t *end = in + len;
+    const uint8_t *ip = in;
+    const uint8_t *anchor = in;
+    const uint8_t *ref;
+    uint8_t *op = (uint8_t *)dst;
+    uint8_t *oend = op + cap;
+    uint8_t *token;
+    size_t lit;
+    size_t mlen;
+    uint32_t h;
+
+    if(len > LZ4_MFLIMIT){
+        memset(table, 0, sizeof(table));
+        while(ip < end - LZ4_MFLIMIT){
+            h = lz4_hash(lz4_read32(ip));
+            ref = in + table[h];
+            table[h] = (uint32_t)(ip - in);
+            if(ref >= ip || ip - ref > LZ4_MAX_OFFSET || lz4_read32(ref) != lz4_read32(ip)){
+                ip++;
+                continue;
+            }
+            // The match may not reach into the last literals
+            mlen = LZ4_MINMATCH;
+            while(ip + mlen < end - LZ4_LASTLITERALS && ip[mlen] == ref[mlen]){
+                mlen++;
+            }
+            while(ip > anchor && ref > in && ip[-1] == ref[-1]){
+                ip--;
+                ref--;
+                mlen++;
+            }
+
+            lit = ip - anchor;
+            if((size_t)(oend - op) < lit + lit / 255 + mlen / 255 + 6){
+                return 0;
+            }
+            token = op++;
+            if(lit >= 15){
+                *token = 15 << 4;
+                op = lz4_put_len(op, lit - 15);
+            }else{
+                *token = (uint8_t)(lit << 4);
+            }
+            memcpy(op, anchor, lit);
+            op += lit;
+            *op++ = (uint8_t)(ip - ref);
+            *op++ = (uint8_t)((ip - ref) >> 8);
+            if(mlen - LZ4_MINMATCH >= 15){
+                *token |= 15;
+                op = lz4_put_len(op, mlen - LZ4_MINMATCH - 15);
+            }else{
+                *token |= (uint8_t)(mlen - LZ4_MINMATCH);
+            }
+            ip += mlen;
+            anchor = ip;
+            // Index the tail of the match too, it is often repeated
+            table[lz4_hash(lz4_read32(ip - 2))] = (uint32_t)(ip - 2 - in);
+        }
+    }
+
+    // Whatever is left goes out as literals
+    lit = end - anchor;
+    if((size_t)(oend - op) < lit + lit / 255 + 2){
+        return 0;
+    }
+    token = op++;
+    if(lit >= 15){
+        *token = 15 << 4;
+        op = lz4_put_len(op, lit - 15);
+    }else{
+        *token = (uint8_t)(lit << 4);
+    }
+    memcpy(op, anchor, lit);
+    op += lit;
+    return op - (uint8_t *)dst;
+}
+
+// Decode len bytes of LZ4 data at src into dst.  Returns the decoded
+// length, or -1 if src is damaged or decodes to more than cap bytes.
+long lz4_decompress(const void *src, size_t len, void *dst, size_t cap)
+{
+    const uint8_t *ip = (const uint8_t *)src;
+    const uint8_t *iend = ip + len;
+    uint8_t *ostart = (uint8_t *)dst;
+    uint8_t *op = ostart;
+    uint8_t *oend = op + cap;
+    const uint8_t *match;
+    size_t lit;
+    size_t mlen;
+    size_t off;
+    uint8_t token;
+    uint8_t b;
+
+    while(ip < iend){
+        token = *ip++;
+        lit = token >> 4;
+        if(lit == 15){
+            do{
+                if(ip >= iend){
+                    return -1;
+                }
+                b = *ip++;
+                lit += b;
+            }while(b == 255);
+        }
+        if((size_t)(iend - ip) < lit || (size_t)(oend - op) < lit){
+            return -1;
+        }
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if(ip == iend){
+            // The last sequence has no match
+            break;
+        }
+
+        if(iend - ip < 2){
+            return -1;
+        }
+        off = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if(off == 0 || off > (size_t)(op - ostart)){
+            return -1;
+        }
+        mlen = token & 15;
+        if(mlen == 15){
+            do{
+                if(ip >= iend){
+                    return -1;
+                }
+                b = *ip++;
+                mlen += b;
+            }while(b == 255);
+        }
+        mlen += LZ4_MINMATCH;
+        if((size_t)(oend - op) < mlen){
+            return -1;
+        }
+        match = op - off;
+        if(off >= mlen){
+            memcpy(op, match, mlen);
+            op += mlen;
+        }else{
+            // Overlapping copy repeats the last off bytes
+            while(mlen-- > 0){
+                *op++ = *match++;
+            }
+        }
+    }
+    return op - ostart;
+}
+
+// Bytes object hdr needs, or 0 if it is not a compressed block
+uint64_t zblock_size(const struct nph_zblock *hdr)
+{
+    if(hdr->magic != NPH_ZMAGIC || hdr->clen == 0 || hdr->clen >= data_block_size){
+        return 0;
+    }
+    return sizeof(*hdr) + hdr->clen;
+}
+
+static int compress_all = 0;
+static struct nphfs_stats stats;
+
+// Per-thread room to decode one block and to compress one
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+static void scratch_key_init(void)
+{
+    pthread_key_create(&scratch_key, free);
+}
+
+static char *scratch(void)
+{
+    char *buf;
+
+    pthread_once(&scratch_once, scratch_key_init);
+    buf = (char *)pthread_getspecific(scratch_key);
+    if(buf == NULL){
+        buf = (char *)malloc(2 * data_block_size);
+        if(buf != NULL && pthread_setspecific(scratch_key, buf) != 0){
+            free(buf);
+            buf = NULL;
+        }
+    }
+    return buf;
+}
+
+// Decoded blocks by object id, evicted in clock order
+struct zcache_entry {
+    uint64_t id;
+    int used;
+    char *data;
+};
+
+static struct zcache_entry *zcache = NULL;
+static uint64_t zcache_slots = 0;
+static uint64_t zcache_hand = 0;
+static uint64_t zcache_epoch = 0;     // bumped whenever an id is forgotten
+static struct nph_map zcache_index;   // id -> slot
+static pthread_mutex_t zcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Set the mount-wide mode and give the cache room for cache_bytes of
+// decoded blocks; 0 turns the cache off
+void compress_init(int all, uint64_t cache_bytes)
+{
+    uint64_t slots = cache_bytes / data_block_size;
+    uint64_t i;
+
+    compress_all = all;
+    if(slots == 0){
+        return;
+    }
+    zcache = (struct zcache_entry *)calloc(slots, sizeof(struct zcache_entry));
+    if(zcache == NULL){
+        return;
+    }
+    for(i = 0; i < slots; i++){
+        zcache[i].data = (char *)malloc(data_block_size);
+        if(zcache[i].data == NULL){
+            break;
+        }
+    }
+    zcache_slots = i;
+}
+
+// 1 if new blocks of inode are to be compressed
+int compress_wanted(const npheap_store *inode)
+{
+    return compress_all || (inode->flags & NPH_INODE_COMPRESS);
+}
+
+static int zcache_get(uint64_t id, void *dst, uint64_t off, uint64_t len)
+{
+    uint64_t slot;
+
+    if(zcache_slots == 0){
+        return 0;
+    }
+    pthread_mutex_lock(&zcache_lock);
+    if(!nph_map_get(&zcache_index, id, &slot)){
+        pthread_mutex_unlock(&zcache_lock);
+        stat_add(&stats.zcache_misses, 1);
+        return 0;
+    }
+    memcpy(dst, zcache[slot].data + off, len);
+    zcache[slot].used = 1;
+    pthread_mutex_unlock(&zcache_lock);
+    stat_add(&stats.zcache_hits, 1);
+    return 1;
+}
+
+// Keep a decoded copy of id, unless some object was deleted since
+// epoch was read: id may no longer be the object that was decoded
+static void zcache_put(uint64_t id, const void *data, uint64_t epoch)
+{
+    struct zcache_entry *victim;
+    uint64_t slot;
+
+    if(zcache_slots == 0){
+        return;
+    }
+    pthread_mutex_lock(&zcache_lock);
+    if(epoch != zcache_epoch || nph_map_get(&zcache_index, id, &slot)){
+        pthread_mutex_unlock(&zcache_lock);
+        return;
+    }
+    for(;;){
+        victim = &zcache[zcache_hand];
+        zcache_hand = (zcache_hand + 1) % zcache_slots;
+        if(!victim->used){
+            break;
+        }
+        victim->used = 0;
+    }
+    if(victim->id != 0){
+        nph_map_remove(&zcache_index, victim->id);
+        victim->id = 0;
+    }
+    if(nph_map_put(&zcache_index, id, victim - zcache) == 0){
+        memcpy(victim->data, data, data_block_size);
+        victim->id = id;
+        victim->used = 1;
+    }
+    pthread_mutex_unlock(&zcache_lock);
+}
+
+// Object id is being deleted; called by heap_drop()
+void zcache_forget(uint64_t id)
+{
+    uint64_t slot;
+
+    if(zcache_slots == 0){
+        return;
+    }
+    pthread_mutex_lock(&zcache_lock);
+    zcache_epoch++;
+    if(nph_map_get(&zcache_index, id, &slot)){
+        nph_map_remove(&zcache_index, id);
+        zcache[slot].id = 0;
+        zcache[slot].used = 0;
+    }
+    pthread_mutex_unlock(&zcache_lock);
+}
+
+// Store one data block compressed in a new object.  Returns its block
+// map entry, or 0 if the block does not compress well enough to be
+// worth it or the heap is out of space; the caller then stores it as
+// it is.
+uint64_t zblock_store(const void *data)
+{
+    struct nph_zblock *hdr;
+    char *out = scratch();
+    uint64_t start;
+    uint64_t epoch;
+    uint64_t used;
+    uint64_t id;
+    size_t clen;
+
+    if(out == NULL){
+        return 0;
+    }
+    out += data_block_size;
+    start = now_ns();
+    clen = lz4_compress(data, data_block_size, out,
+                        data_block_size - ZBLOCK_ALIGN - sizeof(struct nph_zblock));
+    stat_add(&stats.compress_ns, now_ns() - start);
+    stat_add(&stats.zbytes_in, data_block_size);
+    if(clen == 0){
+        stat_add(&stats.zblocks_raw, 1);
+        stat_add(&stats.zbytes_out, data_block_size);
+        return 0;
+    }
+
+    epoch = __atomic_load_n(&zcache_epoch, __ATOMIC_RELAXED);
+    id = heap_new(sizeof(struct nph_zblock) + clen, (void **)&hdr);
+    if(id == 0){
+        return 0;
+    }
+    hdr->magic = NPH_ZMAGIC;
+    hdr->clen = clen;
+    memcpy(hdr + 1, out, clen);
+    csum_update(id, hdr, sizeof(struct nph_zblock) + clen);
+
+    used = (sizeof(struct nph_zblock) + clen + ZBLOCK_ALIGN - 1) / ZBLOCK_ALIGN * ZBLOCK_ALIGN;
+    stat_add(&stats.zblocks_written, 1);
+    stat_add(&stats.zbytes_out, used);
+    // Just written is likely to be read again soon
+    zcache_put(id, data, epoch);
+    return id | BMAP_COMPRESSED;
+}
+
+// Copy len bytes from off on out of the data block with block map
+// entry entry, compressed or not, checking it against its checksum
+// unless it comes from the cache.  Returns 0 or -EIO.
+int zblock_read(uint64_t entry, void *dst, uint64_t off, uint64_t len)
+{
+    struct nph_zblock *hdr;
+    char *data;
+    uint64_t start;
+    uint64_t epoch;
+    long n;
+
+    if(!(entry & BMAP_COMPRESSED)){
+        data = (char *)heap_get(entry);
+        if(data == NULL || csum_verify(entry, data, data_block_size) != 0){
+            return -EIO;
+        }
+        memcpy(dst, data + off, len);
+        return 0;
+    }
+
+    entry = BMAP_ID(entry);
+    if(zcache_get(entry, dst, off, len)){
+        return 0;
+    }
+    epoch = __atomic_load_n(&zcache_epoch, __ATOMIC_RELAXED);
+    hdr = (struct nph_zblock *)heap_get(entry);
+    // Never written in place, so there is nothing to lock out
+    if(hdr == NULL || zblock_size(hdr) == 0 || csum_check(entry, hdr, zblock_size(hdr)) != 0){
+        return -EIO;
+    }
+    // A whole block is decoded straight into place
+    data = off == 0 && len == data_block_size ? (char *)dst : scratch();
+    if(data == NULL){
+        return -EIO;
+    }
+    start = now_ns();
+    n = lz4_decompress(hdr + 1, hdr->clen, data, data_block_size);
+    stat_add(&stats.decompress_ns, now_ns() - start);
+    stat_add(&stats.zblocks_read, 1);
+    if(n != (long)data_block_size){
+        return -EIO;
+    }
+    if(data != dst){
+        memcpy(dst, data + off, len);
+    }
+    zcache_put(entry, data, epoch);
+    return 0;
+}
+
+// Copy out the counters since mount
+void compress_stats(struct nphfs_stats *out)
+{
+    out->zblocks_written = __atomic_load_n(&stats.zblocks_written, __ATOMIC_RELAXED);
+    out->zblocks_raw = __atomic_load_n(&stats.zblocks_raw, __ATOMIC_RELAXED);
+    out->zblocks_read = __atomic_load_n(&stats.zblocks_read, __ATOMIC_RELAXED);
+    out->zbytes_in = __atomic_load_n(&stats.zbytes_in, __ATOMIC_RELAXED);
+    out->zbytes_out = __atomic_load_n(&stats.zbytes_out, __ATOMIC_RELAXED);
+    out->compress_ns = __atomic_load_n(&stats.compress_ns, __ATOMIC_RELAXED);
+    out->decompress_ns = __atomic_load_n(&stats.decompress_ns, __ATOMIC_RELAXED);
+    out->zcache_hits = __atomic_load_n(&stats.zcache_hits, __ATOMIC_RELAXED);
+    out->zcache_misses = __atomic_load_n(&stats.zcache_misses, __ATOMIC_RELAXED);
+}
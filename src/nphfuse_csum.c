@@ -0,0 +1,481 @@
+/*
+  NPHeap File System - data block checksums
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Data blocks are handed around as pointers straight into npheap
+  memory, so a stray write anywhere in the process lands in file data
+  without a trace.  The checksum table, laid down by mkfs.nphfs after
+  the share table, holds a CRC32C of every data block, or of the
+  stored bytes of a compressed one, indexed by object like the share
+  counts.  Blocks shared between files or snapshots therefore have a
+  single checksum, and 0 means none has been taken yet.
+
+  Whoever changes a block in place holds its stripe lock from the check
+  of what is already there (a partial write builds on it) until the
+  new checksum is stored.  Readers check without the lock and only take
+  it to look again when the block seems damaged, since it may simply
+  be in the middle of a write.  No thread ever holds two stripe locks.
+
+  Blocks nobody reads are checked by a scrub thread, which walks the
+  data area at a bounded rate once every -o scrub interval.
+
+  CRC32C runs on the SSE4.2 crc32 instruction when the CPU has it,
+  three streams at a time with PCLMULQDQ folding them back together,
+  and on slice-by-8 tables otherwise.
+*/
+
+#include "nphfuse_extra.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#define CRC_HW 1
+#endif
+
+#define CRC_POLY        0x82f63b78U     // Castagnoli, bit reversed
+#define SUMS_PER_OBJECT (BLOCK_SIZE / sizeof(uint32_t))
+#define CSUM_LOCKS      64
+#define SCRUB_BATCH     64              // blocks between pauses
+#define SCRUB_PAUSE_MS  5
+
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static int crc_hw = 0;
+
+#ifdef CRC_HW
+// Bytes per stream of the three-way loops, long and short
+#define CRC_LONG   1024
+#define CRC_SHORT  128
+
+static uint64_t crc_fold_long[2];
+static uint64_t crc_fold_short[2];
+
+// x^n mod P, bit reversed
+static uint32_t crc_xpow(uint64_t n)
+{
+    uint32_t r = 0x80000000U;
+
+    while(n-- > 0){
+        r = (r & 1) ? (r >> 1) ^ CRC_POLY : r >> 1;
+    }
+    return r;
+}
+#endif
+
+static void crc_setup(void)
+{
+    uint32_t c;
+    int i, j;
+
+    for(i = 0; i < 256; i++){
+        c = i;
+        for(j = 0; j < 8; j++){
+            c = (c & 1) ? (c >> 1) ^ CRC_POLY : c >> 1;
+        }
+        crc_table[0][i] = c;
+    }
+    for(i = 0; i < 256; i++){
+        for(j = 1; j < 8; j++){
+            crc_table[j][i] = (crc_table[j - 1][i] >> 8) ^ crc_table[0][crc_table[j - 1][i] & 0xff];
+        }
+    }
+#ifdef CRC_HW
+    // A carry-less product of a CRC with x^(8n-33) mod P, run through
+    // crc32, moves it past n bytes: the product brings one factor of x
+    // and the instruction another 32
+    crc_fold_long[0] = crc_xpow(8 * 2 * CRC_LONG - 33);
+    crc_fold_long[1] = crc_xpow(8 * CRC_LONG - 33);
+    crc_fold_short[0] = crc_xpow(8 * 2 * CRC_SHORT - 33);
+    crc_fold_short[1] = crc_xpow(8 * CRC_SHORT - 33);
+    __builtin_cpu_init();
+    crc_hw = __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul");
+#endif
+}
+
+static uint32_t crc_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+    uint64_t w;
+
+    while(len >= 8){
+        memcpy(&w, p, sizeof(w));
+        w ^= crc;
+        crc = crc_table[7][w & 0xff] ^ crc_table[6][(w >> 8) & 0xff] ^
+              crc_table[5][(w >> 16) & 0xff] ^ crc_table[4][(w >> 24) & 0xff] ^
+              crc_table[3][(w >> 32) & 0xff] ^ crc_table[2][(w >> 40) & 0xff] ^
+              crc_table[1][(w >> 48) & 0xff] ^ crc_table[0][w >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while(len > 0){
+        crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    return crc;
+}
+
+#ifdef CRC_HW
+__attribute__((target("sse4.2,pclmul")))
+static uint64_t crc_shift(uint64_t crc, uint64_t fold)
+{
+    __m128i t = _mm_clmulepi64_si128(_mm_cvtsi64_si128((long long)crc),
+                                     _mm_cvtsi64_si128((long long)fold), 0x00);
+
+    return _mm_crc32_u64(0, (uint64_t)_mm_cvtsi128_si64(t));
+}
+
+// Run three streams of stripe bytes each side by side while there is
+// room for them, then join them into crc
+__attribute__((target("sse4.2,pclmul")))
+static uint64_t crc_hw_3way(uint64_t crc, const unsigned char **pp, size_t *lenp,
+                            size_t stripe, const uint64_t *fold)
+{
+    const unsigned char *p = *pp;
+    uint64_t c1, c2;
+    uint64_t a, b, c;
+    size_t i;
+
+    while(*lenp >= 3 * stripe){
+        c1 = c2 = 0;
+        for(i = 0; i < stripe; i += 8){
+            memcpy(&a, p + i, 8);
+            memcpy(&b, p + stripe + i, 8);
+            memcpy(&c, p + 2 * stripe + i, 8);
+            crc = _mm_crc32_u64(crc, a);
+            c1 = _mm_crc32_u64(c1, b);
+            c2 = _mm_crc32_u64(c2, c);
+        }
+        crc = crc_shift(crc, fold[0]) ^ crc_shift(c1, fold[1]) ^ c2;
+        p += 3 * stripe;
+        *lenp -= 3 * stripe;
+    }
+    *pp = p;
+    return crc;
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc_hw_run(uint32_t crc32, const unsigned char *p, size_t len)
+{
+    uint64_t crc = crc32;
+    uint64_t w;
+
+    crc = crc_hw_3way(crc, &p, &len, CRC_LONG, crc_fold_long);
+    crc = crc_hw_3way(crc, &p, &len, CRC_SHORT, crc_fold_short);
+    while(len >= 8){
+        memcpy(&w, p, 8);
+        crc = _mm_crc32_u64(crc, w);
+        p += 8;
+        len -= 8;
+    }
+    while(len > 0){
+        crc = _mm_crc32_u8((uint32_t)crc, *p++);
+        len--;
+    }
+    return (uint32_t)crc;
+}
+#endif
+
+// CRC32C of len bytes at buf, continuing from crc (0 to start)
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    pthread_once(&crc_once, crc_setup);
+#ifdef CRC_HW
+    if(crc_hw){
+        return ~crc_hw_run(~crc, (const unsigned char *)buf, len);
+    }
+#endif
+    return ~crc_sw(~crc, (const unsigned char *)buf, len);
+}
+
+static struct {
+    uint64_t verified;
+    uint64_t errors;
+    uint64_t ns;
+    uint64_t scrub_passes;
+    uint64_t scrub_blocks;
+    uint64_t scrub_errors;
+} stats;
+
+static pthread_mutex_t csum_locks[CSUM_LOCKS] = {
+    [0 ... CSUM_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+
+// Number of npheap objects needed to hold the checksums of nblocks data objects
+uint64_t csum_objects(uint64_t nblocks)
+{
+    return (nblocks + SUMS_PER_OBJECT - 1) / SUMS_PER_OBJECT;
+}
+
+static uint32_t *csum_slot(uint64_t id, uint64_t *obj)
+{
+    uint64_t bit;
+    uint32_t *sums;
+
+    id = BMAP_ID(id);
+    if(superblock == NULL || id < superblock->data_start ||
+       id >= superblock->data_start + superblock->data_blocks){
+        return NULL;
+    }
+    bit = id - superblock->data_start;
+    *obj = superblock->csum_table + bit / SUMS_PER_OBJECT;
+    sums = (uint32_t *)heap_map(*obj, BLOCK_SIZE);
+    if(sums == NULL){
+        return NULL;
+    }
+    return &sums[bit % SUMS_PER_OBJECT];
+}
+
+// The checksum stored for len bytes at data; never 0
+static uint32_t csum_of(const void *data, uint64_t len)
+{
+    uint64_t start = now_ns();
+    uint32_t sum = crc32c(0, data, len);
+
+    stat_add(&stats.ns, now_ns() - start);
+    return sum != 0 ? sum : 1;
+}
+
+uint32_t csum_get(uint64_t id)
+{
+    uint64_t obj;
+    uint32_t *slot = csum_slot(id, &obj);
+
+    return slot != NULL ? __atomic_load_n(slot, __ATOMIC_ACQUIRE) : 0;
+}
+
+// Store sum as the checksum of id, 0 for none
+void csum_set(uint64_t id, uint32_t sum)
+{
+    uint64_t obj;
+    uint32_t *slot = csum_slot(id, &obj);
+
+    if(slot == NULL || __atomic_load_n(slot, __ATOMIC_ACQUIRE) == sum){
+        return;
+    }
+    __atomic_store_n(slot, sum, __ATOMIC_RELEASE);
+    ckpt_dirty(obj);
+    // The data it covers may go out with an fdatasync
+    ckpt_need_meta();
+}
+
+// Take the checksum of the len bytes of id at data
+void csum_update(uint64_t id, const void *data, uint64_t len)
+{
+    csum_set(id, csum_of(data, len));
+}
+
+// id was just allocated as a zeroed data block
+void csum_zeroed(uint64_t id)
+{
+    static uint32_t zero_sum = 0;
+    uint32_t sum = __atomic_load_n(&zero_sum, __ATOMIC_RELAXED);
+    void *zero;
+
+    if(sum == 0){
+        zero = calloc(1, data_block_size);
+        if(zero == NULL){
+            return;
+        }
+        sum = csum_of(zero, data_block_size);
+        free(zero);
+        __atomic_store_n(&zero_sum, sum, __ATOMIC_RELAXED);
+    }
+    csum_set(id, sum);
+}
+
+static pthread_mutex_t *csum_lock_of(uint64_t id)
+{
+    return &csum_locks[(BMAP_ID(id) * 0x9E3779B97F4A7C15ULL) >> 58];
+}
+
+// 1 if id has a checksum and data does not match it
+static int csum_bad(uint64_t id, const void *data, uint64_t len)
+{
+    uint32_t sum = csum_get(id);
+
+    return sum != 0 && csum_of(data, len) != sum;
+}
+
+// Check the len bytes of id at data against its checksum, with the
+// block locked or unable to change.  Returns 0, or -EIO if they do not
+// match.
+int csum_check(uint64_t id, const void *data, uint64_t len)
+{
+    stat_add(&stats.verified, 1);
+    if(csum_bad(id, data, len)){
+        stat_add(&stats.errors, 1);
+        return -EIO;
+    }
+    return 0;
+}
+
+// The same without holding the lock
+int csum_verify(uint64_t id, const void *data, uint64_t len)
+{
+    int bad;
+
+    stat_add(&stats.verified, 1);
+    if(!csum_bad(id, data, len)){
+        return 0;
+    }
+    csum_lock(id);
+    bad = csum_bad(id, data, len);
+    csum_unlock(id);
+    if(bad){
+        stat_add(&stats.errors, 1);
+        return -EIO;
+    }
+    return 0;
+}
+
+void csum_lock(uint64_t id)
+{
+    pthread_mutex_lock(csum_lock_of(id));
+}
+
+void csum_unlock(uint64_t id)
+{
+    pthread_mutex_unlock(csum_lock_of(id));
+}
+
+// Block id is about to be deleted
+void csum_forget(uint64_t id)
+{
+    csum_lock(id);
+    csum_set(id, 0);
+    csum_unlock(id);
+}
+
+static pthread_t scrub_thread;
+static pthread_mutex_t scrub_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scrub_cond = PTHREAD_COND_INITIALIZER;
+static int scrub_running = 0;
+static int scrub_quit = 0;
+static unsigned int scrub_interval = 0;
+static void (*scrub_bad)(uint64_t id) = NULL;
+
+// Sleep ms milliseconds; returns 1 if the scrubber was told to stop
+static int scrub_sleep(uint64_t ms)
+{
+    struct timespec until;
+    int quit;
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += ms / 1000;
+    until.tv_nsec += (ms % 1000) * 1000000;
+    if(until.tv_nsec >= 1000000000){
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&scrub_lock);
+    while(!scrub_quit && pthread_cond_timedwait(&scrub_cond, &scrub_lock, &until) == 0){
+    }
+    quit = scrub_quit;
+    pthread_mutex_unlock(&scrub_lock);
+    return quit;
+}
+
+// Check one block.  The lock keeps it from being written or deleted
+// meanwhile.  Only leaves carry checksums, and a compressed one is the
+// only kind smaller than a data block.  Blocks out in the spill file
+// are left there; they are checked when they are read back.
+static void scrub_block(uint64_t id)
+{
+    uint64_t size;
+    uint64_t len;
+    void *data;
+    int bad;
+
+    csum_lock(id);
+    if(csum_get(id) == 0 || tier_size(id) != 0){
+        csum_unlock(id);
+        return;
+    }
+    size = heap_size(id);
+    data = heap_get(id);
+    len = data_block_size;
+    if(data != NULL && size < data_block_size){
+        len = size >= sizeof(struct nph_zblock) ? zblock_size((struct nph_zblock *)data) : 0;
+    }
+    bad = data == NULL || len == 0 || len > size || csum_bad(id, data, len);
+    csum_unlock(id);
+
+    stat_add(&stats.scrub_blocks, 1);
+    if(bad){
+        stat_add(&stats.scrub_errors, 1);
+        if(scrub_bad != NULL){
+            scrub_bad(id);
+        }
+    }
+}
+
+static void *scrub_main(void *arg)
+{
+    uint64_t bit;
+    uint64_t batch;
+
+    while(!scrub_sleep((uint64_t)scrub_interval * 1000)){
+        batch = 0;
+        for(bit = 0; bit < superblock->data_blocks; bit++){
+            if(!bitmap_test(&data_bitmap, bit)){
+                continue;
+            }
+            tier_hold();
+            scrub_block(superblock->data_start + bit);
+            tier_unhold();
+            if(++batch % SCRUB_BATCH == 0 && scrub_sleep(SCRUB_PAUSE_MS)){
+                return NULL;
+            }
+        }
+        stat_add(&stats.scrub_passes, 1);
+    }
+    return NULL;
+}
+
+// Check every block with a checksum once each interval seconds, and
+// report the damaged ones to bad.  An interval of 0 is no scrubbing.
+int scrub_start(unsigned int interval, void (*bad)(uint64_t id))
+{
+    int err;
+
+    if(interval == 0 || scrub_running){
+        return 0;
+    }
+    scrub_interval = interval;
+    scrub_bad = bad;
+    scrub_quit = 0;
+    err = pthread_create(&scrub_thread, NULL, scrub_main, NULL);
+    if(err != 0){
+        return -err;
+    }
+    scrub_running = 1;
+    return 0;
+}
+
+void scrub_stop(void)
+{
+    if(!scrub_running){
+        return;
+    }
+    pthread_mutex_lock(&scrub_lock);
+    scrub_quit = 1;
+    pthread_cond_broadcast(&scrub_cond);
+    pthread_mutex_unlock(&scrub_lock);
+    pthread_join(scrub_thread, NULL);
+    scrub_running = 0;
+}
+
+void csum_stats(struct nphfs_stats *out)
+{
+    out->csum_verified = __atomic_load_n(&stats.verified, __ATOMIC_RELAXED);
+    out->csum_errors = __atomic_load_n(&stats.errors, __ATOMIC_RELAXED);
+    out->csum_ns = __atomic_load_n(&stats.ns, __ATOMIC_RELAXED);
+    out->scrub_passes = __atomic_load_n(&stats.scrub_passes, __ATOMIC_RELAXED);
+    out->scrub_blocks = __atomic_load_n(&stats.scrub_blocks, __ATOMIC_RELAXED);
+    out->scrub_errors = __atomic_load_n(&stats.scrub_errors, __ATOMIC_RELAXED);
+}
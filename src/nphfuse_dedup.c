@@ -0,0 +1,258 @@
+/*
+  NPHeap File System - block deduplication
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Mounted with -o dedup, every block nphfuse_write() stores is
+  fingerprinted and looked up in an index of the blocks written since
+  mount.  A block with the same contents as one already in the index
+  is not stored again: the file points at the existing one, which takes
+  another reference in the share table (nphfuse_share.c) and gets
+  copied if either file writes to it later.
+
+  The fingerprint is a 64-bit multiply-accumulate hash over 64-byte
+  stripes in the manner of XXH3, run with SSE2 where the compiler has
+  it.  It only picks the
+  candidate; the contents are compared before anything is shared, so
+  a collision costs a compare, never data.
+
+  The index only holds blocks nothing has changed since they went in.
+  A block is forgotten before it is written in place (bmap_alloc) and
+  before a reference to it is dropped (bmap_release), both under the
+  index lock that a lookup holds until it has taken its reference.  A
+  lookup can therefore never hand out a block that is about to change
+  or be freed.
+*/
+
+#include "nphfuse_extra.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define HASH_PRIME      0x9e3779b185ebca87ULL
+#define HASH_PRIME32    0x9e3779b1U
+#define HASH_ROUND      8           // stripes between scrambles
+
+// Stripe s of a round is keyed with hash_key[s..s+7]; the last eight
+// also key the scramble
+static const uint64_t hash_key[16] = {
+    0x6bcefab3a3b48c4bULL, 0xc12776e46dd451b3ULL, 0x1a004483b96ba5cbULL, 0x5dcc39d710f48bb9ULL,
+    0x769dd09fb2a724d9ULL, 0x0b2eaa635ffb86c9ULL, 0xaa3fc17d9ba845e5ULL, 0x97323aed2b8b1a47ULL,
+    0x53fa573e58358c1bULL, 0xb5c973c54457b531ULL, 0x9f40aa425458b675ULL, 0x4ecfd2bdba023ff3ULL,
+    0xfd8b29067919d907ULL, 0xc38d9a77f6798777ULL, 0x6696e05995351857ULL, 0xeefd282a3929bb9bULL,
+};
+
+static uint64_t hash_mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// Fingerprint len bytes at buf; never 0, so it can key an nph_map.
+// Each 64-bit lane adds the product of the two halves of its data
+// keyed, and its neighbour's data as it is; every HASH_ROUND stripes
+// the lanes are scrambled so that data cannot cancel out across them.
+// The SSE2 and plain versions give the same result.
+uint64_t dedup_hash(const void *buf, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+    uint64_t acc[8];
+    uint64_t h = len * HASH_PRIME;
+    uint64_t d;
+    size_t s = 0;
+    size_t i;
+#ifdef __SSE2__
+    const __m128i prime = _mm_set1_epi32((int)HASH_PRIME32);
+    __m128i vacc[4];
+    __m128i data;
+    __m128i keyed;
+
+    for(i = 0; i < 4; i++){
+        vacc[i] = _mm_set_epi64x(HASH_PRIME * (2 * i + 2), HASH_PRIME * (2 * i + 1));
+    }
+    while(len >= 64){
+        for(i = 0; i < 4; i++){
+            data = _mm_loadu_si128((const __m128i *)(p + 16 * i));
+            keyed = _mm_xor_si128(data, _mm_loadu_si128((const __m128i *)&hash_key[s + 2 * i]));
+            vacc[i] = _mm_add_epi64(vacc[i], _mm_mul_epu32(keyed, _mm_srli_epi64(keyed, 32)));
+            vacc[i] = _mm_add_epi64(vacc[i], _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2)));
+        }
+        p += 64;
+        len -= 64;
+        if(++s == HASH_ROUND){
+            for(i = 0; i < 4; i++){
+                keyed = _mm_xor_si128(vacc[i], _mm_srli_epi64(vacc[i], 47));
+                keyed = _mm_xor_si128(keyed, _mm_loadu_si128((const __m128i *)&hash_key[8 + 2 * i]));
+                vacc[i] = _mm_add_epi64(_mm_mul_epu32(keyed, prime),
+                                        _mm_slli_epi64(_mm_mul_epu32(_mm_srli_epi64(keyed, 32), prime), 32));
+            }
+            s = 0;
+        }
+    }
+    for(i = 0; i < 4; i++){
+        _mm_storeu_si128((__m128i *)&acc[2 * i], vacc[i]);
+    }
+#else
+    uint64_t keyed;
+
+    for(i = 0; i < 8; i++){
+        acc[i] = HASH_PRIME * (i + 1);
+    }
+    while(len >= 64){
+        for(i = 0; i < 8; i++){
+            memcpy(&d, p + 8 * i, sizeof(d));
+            keyed = d ^ hash_key[s + i];
+            acc[i] += (keyed & 0xffffffffULL) * (keyed >> 32);
+            acc[i ^ 1] += d;
+        }
+        p += 64;
+        len -= 64;
+        if(++s == HASH_ROUND){
+            for(i = 0; i < 8; i++){
+                acc[i] = (acc[i] ^ (acc[i] >> 47) ^ hash_key[8 + i]) * HASH_PRIME32;
+            }
+            s = 0;
+        }
+    }
+#endif
+    for(i = 0; i < 8; i++){
+        h = (h ^ hash_mix(acc[i])) * HASH_PRIME;
+    }
+    while(len >= 8){
+        memcpy(&d, p, sizeof(d));
+        h = (h ^ hash_mix(d)) * HASH_PRIME;
+        p += 8;
+        len -= 8;
+    }
+    while(len > 0){
+        h = (h ^ *p++) * HASH_PRIME;
+        len--;
+    }
+    h = hash_mix(h);
+    return h != 0 ? h : 1;
+}
+
+static int dedup_on = 0;
+static struct nph_map by_hash;      // fingerprint -> block map entry
+static struct nph_map by_id;        // object id -> fingerprint
+static pthread_mutex_t dedup_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t blocks_seen = 0;
+static uint64_t blocks_shared = 0;
+static uint64_t hash_ns = 0;
+
+void dedup_init(int on)
+{
+    dedup_on = on;
+}
+
+int dedup_wanted(void)
+{
+    return dedup_on;
+}
+
+// 1 if the block behind entry holds exactly the data_block_size bytes
+// at data
+static int same_block(uint64_t entry, const void *data)
+{
+    char *other;
+    int same;
+
+    if(!(entry & BMAP_COMPRESSED)){
+        other = (char *)heap_get(entry);
+        return other != NULL && memcmp(other, data, data_block_size) == 0;
+    }
+    other = (char *)malloc(data_block_size);
+    if(other == NULL){
+        return 0;
+    }
+    same = zblock_read(entry, other, 0, data_block_size) == 0 &&
+           memcmp(other, data, data_block_size) == 0;
+    free(other);
+    return same;
+}
+
+// Look for a block holding the same data_block_size bytes as data.
+// Returns its block map entry with a reference already taken for the
+// caller, who must either link it or share_unref() it, or 0.  *hash is
+// the fingerprint to hand to dedup_add() if the block gets stored, or
+// 0 when deduplication is off.
+uint64_t dedup_find(const void *data, uint64_t *hash)
+{
+    uint64_t start;
+    uint64_t entry = 0;
+
+    *hash = 0;
+    if(!dedup_on){
+        return 0;
+    }
+    start = now_ns();
+    *hash = dedup_hash(data, data_block_size);
+    __atomic_add_fetch(&hash_ns, now_ns() - start, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&blocks_seen, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&dedup_lock);
+    if(nph_map_get(&by_hash, *hash, &entry) && same_block(entry, data)){
+        share_ref(entry);
+        __atomic_add_fetch(&blocks_shared, 1, __ATOMIC_RELAXED);
+    }else{
+        entry = 0;
+    }
+    pthread_mutex_unlock(&dedup_lock);
+    return entry;
+}
+
+// Index the block just stored at entry under hash
+void dedup_add(uint64_t hash, uint64_t entry)
+{
+    uint64_t old;
+
+    if(hash == 0 || entry == 0){
+        return;
+    }
+    pthread_mutex_lock(&dedup_lock);
+    // One block per fingerprint, the newest
+    if(nph_map_get(&by_hash, hash, &old)){
+        nph_map_remove(&by_id, BMAP_ID(old));
+    }
+    if(nph_map_put(&by_hash, hash, entry) == 0 &&
+       nph_map_put(&by_id, BMAP_ID(entry), hash) != 0){
+        nph_map_remove(&by_hash, hash);
+    }
+    pthread_mutex_unlock(&dedup_lock);
+}
+
+// Block id is about to be written in place or lose a reference
+void dedup_forget(uint64_t id)
+{
+    uint64_t hash;
+
+    if(!dedup_on){
+        return;
+    }
+    id = BMAP_ID(id);
+    pthread_mutex_lock(&dedup_lock);
+    if(nph_map_get(&by_id, id, &hash)){
+        nph_map_remove(&by_id, id);
+        nph_map_remove(&by_hash, hash);
+    }
+    pthread_mutex_unlock(&dedup_lock);
+}
+
+void dedup_stats(struct nphfs_stats *out)
+{
+    out->dedup_blocks = __atomic_load_n(&blocks_seen, __ATOMIC_RELAXED);
+    out->dedup_shared = __atomic_load_n(&blocks_shared, __ATOMIC_RELAXED);
+    out->dedup_hash_ns = __atomic_load_n(&hash_ns, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&dedup_lock);
+    out->dedup_index = by_id.count;
+    pthread_mutex_unlock(&dedup_lock);
+}
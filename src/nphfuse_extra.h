@@ -1,4 +1,4 @@
-// Project 3: Sayali Godbole, ssgodbol; Animesh Sinsinwal, assinsin; Sameer Poudwal, spoudwa; 
+// Project 3: Sayali Godbole, ssgodbol; Animesh Sinsinwal, assinsin; Sameer Poudwal, spoudwa;
 
 /*
   Copyright (C) 2016 Hung-Wei Tseng, Ph.D. <hungwei_tseng@ncsu.edu>
@@ -6,19 +6,37 @@
   This program can be distributed under the terms of the GNU GPLv3.
   See the file COPYING.
 
-  You may extend this file if necessary  
+  You may extend this file if necessary
 */
+#ifndef _NPHFUSE_EXTRA_H_
+#define _NPHFUSE_EXTRA_H_
+
 #include <sys/stat.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <time.h>
 
 #define DIR_MAX 236
 #define FILE_MAX 128
 #define BLOCK_SIZE   8192
+#define XATTR_INLINE 64           // bytes of attributes kept in the inode
 
 struct nphfuse_state {
   FILE *logfile;
   char *device_name;
   int devfd;
+  char *checkpoint;
+  int compress;
+  unsigned int zcache_mb;
+  int dedup;
+  unsigned int scrub_secs;
+  char *spill;
+  unsigned long resident;
+  char *trace;
+  int atime_mode;
+  int lazytime;
 };
 
 
@@ -26,7 +44,494 @@ typedef struct {
   char filename[DIR_MAX];
   char dirname[FILE_MAX];
   uint64_t offset;
+  uint64_t height;
+  uint64_t flags;
+  uint64_t link;                  // st_ino this name is a hard link to, or 0
+  uint64_t xattr;                 // attribute block, or 0
+  uint64_t xattr_names;           // one bit per attribute name hash
+  unsigned char xattr_inline[XATTR_INLINE];
   struct stat mystat;
 }npheap_store;
 
+// npheap_store flags
+#define NPH_INODE_COMPRESS  0x1   // new data blocks are stored compressed
+
+// A symlink whose target fits in XATTR_INLINE keeps it there and has no
+// data block; a longer target is the contents of block 0
+#define INODE_FAST_SYMLINK(inode) \
+  (S_ISLNK((inode)->mystat.st_mode) && (inode)->offset == 0)
+
 #define TOTAL_BLOCKS  (BLOCK_SIZE/sizeof(npheap_store))
+
+// npheap object layout, written once by mkfs.nphfs:
+//   1                      superblock
+//   2 ..                   inode table, inode_blocks objects
+//   inode_bitmap ..        one bit per inode slot
+//   data_bitmap ..         one bit per data object
+//   share_table ..         extra reference count per data object
+//   csum_table ..          CRC32C per data object
+//   journal_start ..       metadata journal header and ring
+//   data_start ..          data blocks and block map nodes
+// Offset 0 is never used and means "no object".
+#define ROOT_BLOCK          1
+#define INODE_BLOCK_START   2
+#define INODE_BLOCK_END     (INODE_BLOCK_START + superblock->inode_blocks)
+
+// Superblock stored at the start of ROOT_BLOCK (nphfuse_super.c).  Data
+// blocks use the block size picked at format time; the inode table and
+// block map nodes always use BLOCK_SIZE.
+#define NPH_MAGIC   0x314b4c4253504e4eULL
+#define NPH_VERSION 11
+#define MIN_DATA_BLOCK_SIZE  BLOCK_SIZE
+#define MAX_DATA_BLOCK_SIZE  (2*1024*1024)
+
+struct nph_super {
+  uint64_t magic;
+  uint64_t version;
+  uint64_t block_size;
+  uint64_t inode_blocks;
+  uint64_t inode_count;
+  uint64_t inode_bitmap;
+  uint64_t data_bitmap;
+  uint64_t data_start;
+  uint64_t data_blocks;
+  uint64_t journal_start;
+  uint64_t journal_blocks;
+  uint64_t share_table;
+  uint64_t csum_table;
+  uint64_t inodes_used;     // set bits in the inode bitmap
+  uint64_t blocks_used;     // set bits in the data bitmap
+  uint64_t stripes;         // npheap devices the data area is spread over
+  uint64_t blocks_spilled;  // data objects out in the spill file
+};
+
+// Inode slot n holds st_ino n + ROOT_INO, so the root directory in slot 0 is 2
+#define ROOT_INO  2
+
+// A bitmap spread over consecutive npheap objects (nphfuse_bitmap.c)
+struct nph_bitmap {
+  uint64_t start;
+  uint64_t nbits;
+  uint64_t hint;
+  uint64_t *used;
+};
+
+void bitmap_attach(struct nph_bitmap *bm, uint64_t start, uint64_t nbits, uint64_t *used);
+uint64_t bitmap_objects(uint64_t nbits);
+int bitmap_test(struct nph_bitmap *bm, uint64_t bit);
+void bitmap_set(struct nph_bitmap *bm, uint64_t bit);
+void bitmap_clear(struct nph_bitmap *bm, uint64_t bit);
+int64_t bitmap_alloc(struct nph_bitmap *bm);
+uint64_t bitmap_alloc_many(struct nph_bitmap *bm, uint64_t n, uint64_t *bits);
+uint64_t bitmap_count(struct nph_bitmap *bm);
+uint64_t bitmap_next(struct nph_bitmap *bm, uint64_t bit);
+
+extern struct nph_super *superblock;
+extern uint64_t data_block_size;
+extern struct nph_bitmap inode_bitmap;
+extern struct nph_bitmap data_bitmap;
+
+int super_block_size_ok(uint64_t size);
+struct nph_super *super_load(void);
+npheap_store *inode_slot(uint64_t index);
+npheap_store *inode_resolve(npheap_store *entry);
+uint64_t inode_block(const npheap_store *inode);
+
+// Open-addressing hash map from 64-bit keys to 64-bit values (nphfuse_map.c)
+struct nph_map {
+  uint64_t *keys;
+  uint64_t *vals;
+  size_t cap;
+  size_t count;
+};
+
+void nph_map_init(struct nph_map *map);
+void nph_map_destroy(struct nph_map *map);
+int nph_map_get(const struct nph_map *map, uint64_t key, uint64_t *val);
+int nph_map_put(struct nph_map *map, uint64_t key, uint64_t val);
+int nph_map_remove(struct nph_map *map, uint64_t key);
+void nph_map_foreach(const struct nph_map *map,
+                     void (*fn)(uint64_t key, uint64_t val, void *arg), void *arg);
+
+// Whole-buffer pread/pwrite, a monotonic clock in nanoseconds and
+// relaxed counter adds (nphfuse_util.c)
+int write_full(int fd, const void *buf, size_t len, off_t off);
+int read_full(int fd, void *buf, size_t len, off_t off);
+uint64_t now_ns(void);
+void stat_add(uint64_t *counter, uint64_t n);
+
+// npheap object cache and data allocator (nphfuse_heap.c).  npheap_fd
+// is the first device, which holds everything before the data area.
+// Object sizes come from a table heap_scan starts once per mount.
+#define HEAP_MAX_DEVICES  16
+
+extern int npheap_fd;
+struct nphfs_stats;
+
+void heap_init(int fd);
+int heap_open(const char *names, const char **bad);
+void heap_close(void);
+int heap_devices(void);
+int heap_fd(uint64_t id);
+void heap_forget(void);
+void heap_scan(void);
+void *heap_map(uint64_t id, uint64_t size);
+void *heap_get(uint64_t id);
+uint64_t heap_new(uint64_t size, void **addr);
+uint64_t heap_new_many(uint64_t size, uint64_t n, uint64_t *ids);
+uint64_t heap_size(uint64_t id);
+void heap_delete(uint64_t id);
+void heap_drop(uint64_t id);
+void heap_free(uint64_t id);
+int heap_evict(uint64_t id);
+void heap_stats(struct nphfs_stats *out);
+
+// Per-file block map: a radix tree of npheap objects rooted at
+// inode->offset.  A tree of height 0 is a single data block of
+// data_block_size bytes; each level above it multiplies the reach by
+// BMAP_FANOUT (nphfuse_bmap.c)
+#define BMAP_FANOUT   (BLOCK_SIZE/sizeof(uint64_t))
+#define BMAP_MAX_HEIGHT 6
+
+uint64_t bmap_lookup(npheap_store *inode, uint64_t blkno);
+struct jtx;
+uint64_t bmap_alloc(npheap_store *inode, uint64_t blkno, struct jtx *tx);
+int bmap_share(npheap_store *inode, uint64_t blkno, uint64_t id, struct jtx *tx);
+int bmap_set(npheap_store *inode, uint64_t blkno, uint64_t entry, struct jtx *tx);
+void bmap_walk(npheap_store *inode, void (*fn)(uint64_t blkno, uint64_t id, void *arg), void *arg);
+
+// How bmap_release() hands a subtree back: unref drops one reference
+// to id and returns 1 if that was the last, freed reports each object
+// deleted
+struct bmap_releaser {
+  int (*unref)(uint64_t id, void *arg);
+  void (*freed)(uint64_t id, void *arg);
+  void *arg;
+};
+
+void bmap_release(uint64_t id, uint64_t height, const struct bmap_releaser *rel);
+
+// Metadata redo journal (nphfuse_journal.c).  Changes to live metadata
+// are logged into a jtx and only reach the heap through jtx_commit().
+struct jtx {
+  char *buf;
+  size_t len;
+  size_t cap;
+  int err;
+  int done;
+  struct jtx *next;
+};
+
+void jtx_begin(struct jtx *tx);
+void jtx_bytes(struct jtx *tx, uint64_t id, uint64_t off, const void *src, uint64_t len);
+void jtx_inode(struct jtx *tx, const npheap_store *inode, size_t off, const void *src, size_t len);
+void jtx_free(struct jtx *tx, uint64_t id, uint64_t height);
+void jtx_iclear(struct jtx *tx, uint64_t index);
+int jtx_commit(struct jtx *tx);
+void jtx_abort(struct jtx *tx);
+int journal_replay(int apply);
+int journal_open(void);
+void journal_format(void);
+void journal_pause(void);
+void journal_resume(void);
+
+// Log a new value for one field of a live inode
+#define jtx_field(tx, inode, field, value) do { \
+    __typeof__((inode)->field) jtx_value_ = (value); \
+    jtx_inode((tx), (inode), offsetof(npheap_store, field), &jtx_value_, sizeof(jtx_value_)); \
+  } while(0)
+
+void bmap_truncate(npheap_store *inode, uint64_t nblocks, struct jtx *tx);
+void bmap_punch(npheap_store *inode, uint64_t first, uint64_t count, struct jtx *tx);
+int bmap_fill(npheap_store *inode, uint64_t first, uint64_t count, struct jtx *tx);
+int bmap_zero(npheap_store *inode, uint64_t from, uint64_t to, struct jtx *tx);
+int bmap_is_zero(const void *buf, size_t len);
+
+// Data objects reachable from more than one place (nphfuse_share.c).
+// The table holds the references beyond the first, so a count of 0 is
+// an object with a single owner that may be changed in place.
+uint64_t share_objects(uint64_t nblocks);
+uint32_t share_count(uint64_t id);
+void share_ref(uint64_t id);
+void share_unref(uint64_t id, uint32_t n);
+void share_set(uint64_t id, uint32_t count);
+
+// Point-in-time snapshots, kept read-only under a hidden directory
+// (nphfuse_snapshot.c)
+#define SNAPSHOT_DIR  "/.snapshots"
+
+int snapshot_path(const char *path);
+int snapshot_inode(const npheap_store *inode);
+const char *snapshot_name(const char *path);
+int snapshot_create(const char *name, uint64_t *skipped);
+int snapshot_delete(const char *name);
+void snapshot_hold(void);
+void snapshot_unhold(void);
+
+// Clone ioctl, issued on the open destination file: length bytes of it
+// from dst_offset on become a copy of source from src_offset on, sharing
+// whole blocks (nphfuse_clone.c).  A length of 0 runs to the end of the
+// source.  Used by nphfs-clone.
+struct nphfs_clone_range {
+  char source[DIR_MAX + FILE_MAX];    // path of the source inside the filesystem
+  uint64_t src_offset;
+  uint64_t dst_offset;
+  uint64_t length;
+};
+
+#define NPHFS_IOC_CLONE  _IOW('N', 1, struct nphfs_clone_range)
+
+int clone_range(npheap_store *src, npheap_store *dst, uint64_t src_off,
+                uint64_t dst_off, uint64_t len);
+
+// Data block compression (nphfuse_compress.c).  A block map entry with
+// BMAP_COMPRESSED set is an object holding a struct nph_zblock followed
+// by LZ4 data that decodes to one whole data block.
+#define BMAP_COMPRESSED  (1ULL << 63)
+#define BMAP_ID(entry)   ((entry) & ~BMAP_COMPRESSED)
+#define NPH_ZMAGIC       0x4b4c425aU
+
+struct nph_zblock {
+  uint32_t magic;
+  uint32_t clen;
+};
+
+// Counters since mount, read with NPHFS_IOC_STATS (nphfs-stats).  The
+// bytes out of the compressor include blocks it had to leave as they were.
+// Blocks deduplicated are not compressed again and are not counted there.
+struct nphfs_stats {
+  uint64_t zblocks_written;     // blocks stored compressed
+  uint64_t zblocks_raw;         // blocks that did not compress well enough
+  uint64_t zblocks_read;        // blocks decoded
+  uint64_t zbytes_in;
+  uint64_t zbytes_out;
+  uint64_t compress_ns;
+  uint64_t decompress_ns;
+  uint64_t zcache_hits;
+  uint64_t zcache_misses;
+  uint64_t dedup_blocks;        // blocks looked up in the dedup index
+  uint64_t dedup_shared;        // of those, stored as a reference to an existing one
+  uint64_t dedup_index;         // blocks in the index now
+  uint64_t dedup_hash_ns;
+  uint64_t csum_verified;       // blocks checked against their checksum when read
+  uint64_t csum_errors;         // of those, found damaged
+  uint64_t csum_ns;             // time spent taking and checking checksums
+  uint64_t scrub_passes;        // passes of the scrub thread over the data area
+  uint64_t scrub_blocks;
+  uint64_t scrub_errors;
+  uint64_t tier_lookups;        // data objects looked up in the heap
+  uint64_t tier_faults;         // of those, brought back from the spill file
+  uint64_t tier_evictions;      // data objects moved out to the spill file
+  uint64_t tier_fault_ns;
+  uint64_t tier_evict_ns;
+  uint64_t tier_resident;       // data objects in the heap now
+  uint64_t tier_spilled;        // and in the spill file
+  uint64_t tier_limit;          // most the heap is kept to, 0 for no limit
+  uint64_t heap_scanned;        // objects sized when mounted
+  uint64_t heap_getsize;        // npheap_getsize calls since
+  uint64_t time_atime_skipped;  // atime updates noatime or relatime left out
+  uint64_t time_deferred;       // time updates lazytime kept in memory
+  uint64_t time_written;        // inodes whose times were written back
+  uint64_t time_batches;        // journal batches they took
+  uint64_t time_pending;        // inodes with times not written back now
+};
+
+#define NPHFS_IOC_STATS  _IOR('N', 2, struct nphfs_stats)
+
+size_t lz4_compress(const void *src, size_t len, void *dst, size_t cap);
+long lz4_decompress(const void *src, size_t len, void *dst, size_t cap);
+uint64_t zblock_size(const struct nph_zblock *hdr);
+void compress_init(int all, uint64_t cache_bytes);
+int compress_wanted(const npheap_store *inode);
+uint64_t zblock_store(const void *data);
+int zblock_read(uint64_t entry, void *dst, uint64_t off, uint64_t len);
+void zcache_forget(uint64_t id);
+void compress_stats(struct nphfs_stats *out);
+
+// Deduplication of identical data blocks written since mount
+// (nphfuse_dedup.c)
+uint64_t dedup_hash(const void *buf, size_t len);
+void dedup_init(int on);
+int dedup_wanted(void);
+uint64_t dedup_find(const void *data, uint64_t *hash);
+void dedup_add(uint64_t hash, uint64_t entry);
+void dedup_forget(uint64_t id);
+void dedup_stats(struct nphfs_stats *out);
+
+// CRC32C of every data block, kept in the checksum table and checked
+// whenever a block is read (nphfuse_csum.c).  A block changed in place
+// is locked from the check of its old contents to its new checksum.
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+uint64_t csum_objects(uint64_t nblocks);
+uint32_t csum_get(uint64_t id);
+void csum_set(uint64_t id, uint32_t sum);
+void csum_update(uint64_t id, const void *data, uint64_t len);
+void csum_zeroed(uint64_t id);
+int csum_check(uint64_t id, const void *data, uint64_t len);
+int csum_verify(uint64_t id, const void *data, uint64_t len);
+void csum_lock(uint64_t id);
+void csum_unlock(uint64_t id);
+void csum_forget(uint64_t id);
+int scrub_start(unsigned int interval, void (*bad)(uint64_t id));
+void scrub_stop(void);
+void csum_stats(struct nphfs_stats *out);
+
+// Cold data objects moved out of the heap to a disk file and brought
+// back when looked up (nphfuse_tier.c).  Operations that may hold
+// pointers into the data area run between tier_hold and tier_unhold,
+// and if tier_short says the heap was full they tier_reclaim and run
+// again.
+int tier_attach(const char *path, int bring_back, uint64_t limit);
+uint64_t tier_size(uint64_t id);
+void tier_touch(uint64_t id);
+void *tier_fault(int fd, uint64_t id);
+int tier_store(uint64_t id, const void *ptr, uint64_t size);
+void tier_forget(uint64_t id);
+int tier_copy(uint64_t id, int fd, off_t off);
+void tier_full(void);
+void tier_hold(void);
+void tier_unhold(void);
+int tier_short(void);
+uint64_t tier_reclaim(void);
+int tier_start(void);
+void tier_stop(void);
+void tier_close(void);
+void tier_stats(struct nphfs_stats *out);
+
+// Extended attributes, packed into the inode and one shared attribute
+// block per inode for the rest (nphfuse_xattr.c).  Attribute blocks are
+// BLOCK_SIZE objects in the data area and never change once written.
+#define NPH_XMAGIC  0x52545841U
+struct nph_xblock {
+  uint32_t magic;
+  uint32_t used;                  // bytes of entries after the header
+  uint64_t hash;                  // dedup_hash() of those bytes
+};
+#define XATTR_BLOCK_ROOM  (BLOCK_SIZE - sizeof(struct nph_xblock))
+
+int xblock_ok(const struct nph_xblock *blk, uint64_t size);
+int xattr_get(const npheap_store *inode, const char *name, void *value, size_t size);
+int xattr_list(const npheap_store *inode, char *list, size_t size);
+int xattr_set(npheap_store *inode, const char *name, const void *value, size_t size, int flags);
+int xattr_remove(npheap_store *inode, const char *name);
+void xattr_release(const npheap_store *inode, struct jtx *tx);
+void xattr_forget(uint64_t id);
+
+// Inode and byte usage per uid and gid with optional limits
+// (nphfuse_quota.c).  Usage is counted at mount and kept up to date in
+// memory; limits live in ROOT_BLOCK after the superblock.
+#define QUOTA_USER   1
+#define QUOTA_GROUP  2
+
+struct nph_quota_limit {
+  uint32_t type;                  // QUOTA_USER, QUOTA_GROUP or 0 for a free entry
+  uint32_t id;
+  uint64_t inodes;                // 0 for no limit
+  uint64_t bytes;
+};
+#define QUOTA_LIMITS_START  1024
+#define QUOTA_LIMITS_MAX    ((BLOCK_SIZE - QUOTA_LIMITS_START) / sizeof(struct nph_quota_limit))
+
+// One owner's usage and limits, as NPHFS_IOC_QUOTA reports them and
+// NPHFS_IOC_SETQUOTA takes them (nphfs-quota)
+struct nphfs_quota {
+  uint32_t type;
+  uint32_t id;                    // uid or gid
+  uint64_t inodes;
+  uint64_t bytes;
+  uint64_t inode_limit;           // 0 for no limit
+  uint64_t byte_limit;
+};
+
+// Up to QUOTA_REPORT_MAX entries from entry first on
+#define QUOTA_REPORT_MAX  64
+struct nphfs_quota_report {
+  uint32_t first;
+  uint32_t count;                 // entries filled in
+  uint32_t total;                 // entries there are
+  uint32_t unused;
+  struct nphfs_quota entries[QUOTA_REPORT_MAX];
+};
+
+#define NPHFS_IOC_QUOTA     _IOWR('N', 3, struct nphfs_quota_report)
+#define NPHFS_IOC_SETQUOTA  _IOW('N', 4, struct nphfs_quota)
+
+int quota_init(void);
+int quota_charge(uid_t uid, gid_t gid, int64_t inodes, int64_t bytes);
+int quota_resize(const npheap_store *inode, uint64_t from, uint64_t to);
+int quota_chown(const npheap_store *inode, uid_t uid, gid_t gid);
+int quota_set(const struct nphfs_quota *q);
+void quota_report(struct nphfs_quota_report *r);
+
+// Timestamps and the atime and lazytime mount options
+// (nphfuse_time.c)
+#define ATIME_STRICT    0         // every access updates atime
+#define ATIME_RELATIVE  1         // relatime
+#define ATIME_NEVER     2         // noatime
+
+#define TIME_ATIME  0x1
+#define TIME_MTIME  0x2
+#define TIME_CTIME  0x4
+
+void time_init(int atime, int lazytime);
+struct timespec time_now(void);
+void time_accessed(npheap_store *inode);
+void time_changed(npheap_store *inode, int which, struct jtx *tx);
+void time_stat(const npheap_store *inode, struct stat *st);
+void time_forget(const npheap_store *inode);
+int time_flush(npheap_store *inode);
+void time_stats(struct nphfs_stats *out);
+
+// Binary trace of every FUSE operation the mount serves, written with
+// -o trace=FILE (nphfuse_trace.c) and replayed by nphfs-replay.  The
+// file is a header followed by records, each thread's in the order it
+// ran them.  Paths are only kept as dedup_hash() values.
+#define TRACE_MAGIC    0x454341525448504eULL
+#define TRACE_VERSION  1
+
+enum {
+  TRACE_GETATTR = 1, TRACE_READLINK, TRACE_MKNOD, TRACE_MKDIR, TRACE_UNLINK,
+  TRACE_RMDIR, TRACE_SYMLINK, TRACE_RENAME, TRACE_LINK, TRACE_CHMOD,
+  TRACE_CHOWN, TRACE_TRUNCATE, TRACE_UTIME, TRACE_OPEN, TRACE_READ,
+  TRACE_WRITE, TRACE_STATFS, TRACE_FLUSH, TRACE_RELEASE, TRACE_FSYNC,
+  TRACE_SETXATTR, TRACE_GETXATTR, TRACE_LISTXATTR, TRACE_REMOVEXATTR,
+  TRACE_OPENDIR, TRACE_READDIR, TRACE_RELEASEDIR, TRACE_FSYNCDIR,
+  TRACE_ACCESS, TRACE_FTRUNCATE, TRACE_FGETATTR, TRACE_IOCTL,
+  TRACE_FALLOCATE, TRACE_OPS
+};
+
+struct nphfs_trace_header {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t record_size;           // sizeof(struct nphfs_trace_record)
+  uint64_t records;               // written after the header
+  uint64_t dropped;               // lost for want of memory or room
+  uint64_t start;                 // wall clock seconds when tracing began
+};
+
+struct nphfs_trace_record {
+  uint64_t start_ns;              // since tracing began
+  uint64_t latency_ns;
+  uint64_t path;                  // hash of the path
+  uint64_t path2;                 // of the new name of rename and link, else 0
+  uint64_t offset;                // file offset, or the new size of truncate
+  uint64_t size;                  // bytes asked for
+  uint32_t mode;                  // mode, open flags, access mask, ioctl cmd...
+  uint32_t thread;                // small number per serving thread
+  int32_t result;
+  uint32_t op;                    // TRACE_*
+};
+
+int trace_open(const char *path);
+void trace_close(void);
+
+// Incremental checkpoint of the heap to a backing file (nphfuse_ckpt.c).
+// Anything that changes an object's contents calls ckpt_dirty().
+int ckpt_restore(const char *path);
+int ckpt_attach(const char *path, int restored);
+void ckpt_dirty(uint64_t id);
+void ckpt_need_meta(void);
+int ckpt_sync(int datasync);
+void ckpt_close(void);
+
+#endif
@@ -21,30 +21,33 @@
 
 #include "nphfuse.h"
 #include <npheap.h>
-#include <sys/time.h>
+#include <time.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <libgen.h>
+#include <linux/falloc.h>
 
-#define BLOCK_SIZE 8192
-#define FIXED_VALUE 1000
-extern struct nphfuse_state *nphfuse_data;
+//The attribute flag ioctls of <linux/fs.h>, which cannot be included
+//as it has a BLOCK_SIZE of its own
+#ifndef FS_IOC_GETFLAGS
+#define FS_IOC_GETFLAGS  _IOR('f', 1, long)
+#define FS_IOC_SETFLAGS  _IOW('f', 2, long)
+#endif
+#ifndef FS_COMPR_FL
+#define FS_COMPR_FL  0x00000004
+#endif
 
-int npheap_fd = 1;
-uint64_t inode_off = 2;
-uint64_t data_off = 504;
-char *blk_array[9999];
-uint64_t dt_link[10000];
+extern struct nphfuse_state *nphfuse_data;
 
 //Getting the root directory
 static npheap_store *getRootDirectory(void){
     npheap_store *temp1 = NULL;
 
     log_msg("Get Root Directory function called.!");
-    temp1 = (npheap_store *)npheap_alloc(npheap_fd, 2, BLOCK_SIZE);
+    temp1 = (npheap_store *)heap_map(INODE_BLOCK_START, BLOCK_SIZE);
 
     if(temp1 == NULL){
         log_msg("\tRoot directory not found.\n");
@@ -54,7 +57,49 @@ static npheap_store *getRootDirectory(void){
     return &(temp1[0]);
 }
 
-static npheap_store *retrieve_inode(const char *path){
+//Where a path was last found: slot index + 1 by hash of the path,
+//filled by lookups and by readdir so the getattr that follows each
+//listed name does not scan the table.  A hint is only trusted after
+//the slot is seen to still carry the name.
+#define NAME_HINTS 65536
+static uint64_t name_hints[NAME_HINTS];
+
+static uint64_t name_hash(const char *dir, const char *filename){
+    uint64_t h = 0xcbf29ce484222325ULL;
+    const char *p;
+
+    for(p = dir; *p; p++){
+        h = (h ^ (unsigned char)*p) * 0x100000001b3ULL;
+    }
+    h = (h ^ '/') * 0x100000001b3ULL;
+    for(p = filename; *p; p++){
+        h = (h ^ (unsigned char)*p) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static npheap_store *hint_get(const char *dir, const char *filename){
+    npheap_store *entry = NULL;
+    uint64_t hint;
+
+    hint = __atomic_load_n(&name_hints[name_hash(dir, filename) % NAME_HINTS], __ATOMIC_RELAXED);
+    if(hint == 0){
+        return NULL;
+    }
+    entry = inode_slot(hint - 1);
+    if(entry == NULL || strcmp(entry->dirname, dir) != 0 || strcmp(entry->filename, filename) != 0){
+        return NULL;
+    }
+    return entry;
+}
+
+static void hint_put(const char *dir, const char *filename, uint64_t index){
+    __atomic_store_n(&name_hints[name_hash(dir, filename) % NAME_HINTS], index + 1,
+                     __ATOMIC_RELAXED);
+}
+
+//The slot holding the directory entry path, without following a hard link
+static npheap_store *retrieve_entry(const char *path){
     char dir[236];
     char filename[128];
     uint64_t offset = 2;
@@ -67,18 +112,23 @@ static npheap_store *retrieve_inode(const char *path){
     if(extract == 1){
         return NULL;
     }
+    start = hint_get(dir, filename);
+    if(start != NULL){
+        return start;
+    }
 
     //Iterate through the inodes
-    for(offset = 2; offset < 502; offset++){
-        start = (npheap_store *)npheap_alloc(npheap_fd, offset, BLOCK_SIZE);
+    for(offset = INODE_BLOCK_START; offset < INODE_BLOCK_END; offset++){
+        start = (npheap_store *)heap_map(offset, BLOCK_SIZE);
         //log_msg("Into inode loop for offset %d\n", offset);
         if(start == 0){
             log_msg("Couldn't allocate the memory for offset, something went wrong\n");
             return NULL;
         }
 
-        for(int i = 0; i < 16; i++){
+        for(int i = 0; i < TOTAL_BLOCKS; i++){
             if((strcmp(start[i].dirname, dir)==0) && (strcmp(start[i].filename, filename)==0)){
+                hint_put(dir, filename, (offset - INODE_BLOCK_START) * TOTAL_BLOCKS + i);
                 return &start[i];
             }
         }
@@ -87,45 +137,82 @@ static npheap_store *retrieve_inode(const char *path){
     return NULL;
 }
 
-static npheap_store *get_free_inode(uint64_t *ind_val){
-    uint64_t inode_index = 0;
-    int flag = 0;
-    npheap_store *temp = NULL;
-    uint64_t offset = 2;
-    uint64_t index = 0;
-    log_msg("Into get free inode function.\n");
+//The inode path names; a hard link stands for the inode it links to
+static npheap_store *retrieve_inode(const char *path){
+    npheap_store *entry = retrieve_entry(path);
 
-    for(offset = 2; offset < 502; offset++){
-        temp= (npheap_store *)npheap_alloc(npheap_fd, offset, BLOCK_SIZE);
-        log_msg("INODE main loop.\n");
-        //If returned value is null
-        if(!temp){
-            log_msg("NPheap alloc failed for offset : %d\n",offset);
-        }
-        // internal block check
-        for (index = 0; index < 16; index++){
-            log_msg("Search %d in offset %d for free inode\n", index, offset);
-            if (temp[index].dirname[0] == '\0' &&
-                temp[index].filename[0] == '\0'){
-                log_msg("Free inode found at %d in offset %d\n", index, offset);
-                flag = 1;
-                inode_index = index;
-                break;
-            }
-        }
-        //If value obtained in inner loop
-        if(flag==1){
-            break;
+    return entry != NULL ? inode_resolve(entry) : NULL;
+}
+
+//Some other name of inode, a slot linked to it, or NULL
+static npheap_store *find_link(const npheap_store *inode){
+    npheap_store *entry = NULL;
+    uint64_t index;
+
+    for(index = 1; index < superblock->inode_count; index++){
+        entry = inode_slot(index);
+        if(entry != NULL && entry->filename[0] != '\0' && entry->link == inode->mystat.st_ino){
+            return entry;
         }
     }
-    //Return inode
-    if(flag==1){
-        *ind_val = inode_index;
-        return &temp[inode_index];
+    return NULL;
+}
+
+//Take a free slot from the inode bitmap.  The new inode is built in
+//staged and only reaches the slot when it is committed to the journal.
+static npheap_store *get_free_inode(npheap_store *staged, uint64_t *ind_val){
+    int64_t index = 0;
+    log_msg("Into get free inode function.\n");
+
+    index = bitmap_alloc(&inode_bitmap);
+    if(index < 0){
+        log_msg("Couldn't find the free space.\n");
+        return NULL;
     }
 
-    log_msg("Couldn't find the free space.\n");
-    return NULL;
+    if(inode_slot(index) == NULL){
+        bitmap_clear(&inode_bitmap, index);
+        return NULL;
+    }
+    log_msg("Free inode found at %lld\n", (long long)index);
+    memset(staged, 0, sizeof(npheap_store));
+    staged->mystat.st_ino = index + ROOT_INO;
+    *ind_val = index;
+    return staged;
+}
+
+//Flags a new entry in dir takes over from it
+static uint64_t inherited_flags(const char *dir){
+    npheap_store *parent = NULL;
+
+    parent = strcmp(dir, "/") == 0 ? getRootDirectory() : retrieve_inode(dir);
+    if(parent == NULL){
+        return 0;
+    }
+    return parent->flags & NPH_INODE_COMPRESS;
+}
+
+//Write a staged inode into its slot
+static int commit_new_inode(npheap_store *staged){
+    struct jtx tx;
+
+    jtx_begin(&tx);
+    jtx_inode(&tx, staged, 0, staged, sizeof(npheap_store));
+    return jtx_commit(&tx);
+}
+
+//Log wiping an inode slot and giving it back to the bitmap
+static void put_free_inode(npheap_store *inode, struct jtx *tx){
+    npheap_store empty;
+
+    memset(&empty, 0, sizeof(npheap_store));
+    //A hard link's slot is only a name, its inode is charged elsewhere
+    if(inode->link == 0){
+        quota_charge(inode->mystat.st_uid, inode->mystat.st_gid, -1, -(int64_t)inode->mystat.st_size);
+    }
+    xattr_release(inode, tx);
+    jtx_inode(tx, inode, 0, &empty, sizeof(npheap_store));
+    jtx_iclear(tx, inode->mystat.st_ino - ROOT_INO);
 }
 
 int extract_directory_file(char *dir, char *filename, const char *path) {
@@ -146,6 +233,13 @@ int extract_directory_file(char *dir, char *filename, const char *path) {
     return 0;
 }
 
+//1 if dir and filename fit the name fields of an entry.  A parent path
+//can be longer than dirname holds.
+static int entry_name_fits(const char *dir, const char *filename){
+    return strlen(dir) < sizeof(((npheap_store *)0)->dirname) &&
+           strlen(filename) < sizeof(((npheap_store *)0)->filename);
+}
+
 int checkAccess(npheap_store *inode){
     //Temperory flag
     int flag = 0;
@@ -186,6 +280,7 @@ int nphfuse_getattr(const char *path, struct stat *stbuf){
         {
             log_msg("Assigning root stbuf in getattr\n");
             memcpy(stbuf, &inode->mystat, sizeof(struct stat));
+            time_stat(inode, stbuf);
             return 0;
         }
     }
@@ -199,6 +294,7 @@ int nphfuse_getattr(const char *path, struct stat *stbuf){
     // else return the proper value
     log_msg("Assigning normal stbuf in getattr\n");
     memcpy(stbuf, &inode->mystat, sizeof(struct stat));
+    time_stat(inode, stbuf);
     return 0;
 }
 
@@ -214,8 +310,36 @@ int nphfuse_getattr(const char *path, struct stat *stbuf){
 // null.  So, the size passed to to the system readlink() must be one
 // less than the size passed to nphfuse_readlink()
 // nphfuse_readlink() code by Bernardo F Costa (thanks!)
+// A fast symlink is answered from the inode; a longer target takes one
+// read of block 0
 int nphfuse_readlink(const char *path, char *link, size_t size){
-    return -1;
+    npheap_store *inode = NULL;
+    uint64_t len;
+
+    if(size == 0){
+        return -EINVAL;
+    }
+    inode = retrieve_inode(path);
+    if(inode == NULL){
+        return -ENOENT;
+    }
+    if(!S_ISLNK(inode->mystat.st_mode)){
+        return -EINVAL;
+    }
+    len = inode->mystat.st_size;
+    if(len > size - 1){
+        len = size - 1;
+    }
+    if(INODE_FAST_SYMLINK(inode)){
+        if(len > XATTR_INLINE){
+            return -EIO;
+        }
+        memcpy(link, inode->xattr_inline, len);
+    }else if(zblock_read(bmap_lookup(inode, 0), link, 0, len) != 0){
+        return -EIO;
+    }
+    link[len] = '\0';
+    return 0;
 }
 
 /** Create a file node
@@ -224,19 +348,17 @@ int nphfuse_readlink(const char *path, char *link, size_t size){
  * creation of all non-directory, non-symlink nodes.
  */
 int nphfuse_mknod(const char *path, mode_t mode, dev_t dev){
-    struct timeval currTime;
+    struct timespec now;
+    npheap_store staged;
     npheap_store *inode = NULL;
     char dir[236];
     char filename[128];
-    char *blk_data = NULL;
     uint64_t findex = -1;
     log_msg("Into mkdir functionality.\n");
-    inode = get_free_inode(&findex);
 
-    //If empty directory not found
-    if(inode == NULL){
-        log_msg("Empty Directory not found. \n");
-        return -ENOENT; 
+    //Snapshots are read-only
+    if(snapshot_path(path)){
+        return -EROFS;
     }
 
     //Get directory and filename
@@ -245,50 +367,53 @@ int nphfuse_mknod(const char *path, mode_t mode, dev_t dev){
         log_msg("Extraction failed. \n");
         return -EINVAL;
     }
+    if(!entry_name_fits(dir, filename)){
+        return -ENAMETOOLONG;
+    }
+
+    int err = quota_charge(getuid(), getgid(), 1, 0);
+    if(err != 0){
+        return err;
+    }
+    inode = get_free_inode(&staged, &findex);
+
+    //If empty directory not found
+    if(inode == NULL){
+        log_msg("Empty Directory not found. \n");
+        quota_charge(getuid(), getgid(), -1, 0);
+        return -ENOSPC;
+    }
 
     log_msg("Directory %s and Filename is %s \n", dir, filename);
 
-    memset(inode, 0, sizeof(npheap_store));
     strcpy(inode->dirname, dir);
     strcpy(inode->filename, filename);
+    inode->flags = inherited_flags(dir);
 
     // Set mystat
-    inode->mystat.st_ino = inode_off;
-    inode_off++;
     inode->mystat.st_mode = mode;
     inode->mystat.st_gid = getgid();
     inode->mystat.st_uid = getuid();
     inode->mystat.st_dev = dev;
     inode->mystat.st_nlink = 1;
-
-    gettimeofday(&currTime, NULL);
-    inode->mystat.st_atime = currTime.tv_sec;
-    inode->mystat.st_mtime = currTime.tv_sec;
-    inode->mystat.st_ctime = currTime.tv_sec;
-
-
-    //Set the offset for data object
-    while(npheap_getsize(npheap_fd, data_off) != 0 && data_off < 10000){
-        log_msg("Offset already in use - %d\n", data_off);
-        data_off++;
-    }
-
-    blk_data  = (char *)npheap_alloc(npheap_fd, data_off, BLOCK_SIZE);
-
-    //Check if allocated
-    if(blk_data == NULL){
-        log_msg("Data block, couldn't be allocated\n");
-        memset(inode, 0, sizeof(npheap_store));
-        inode_off--;
+    inode->mystat.st_blksize = data_block_size;
+
+    now = time_now();
+    inode->mystat.st_atim = now;
+    inode->mystat.st_mtim = now;
+    inode->mystat.st_ctim = now;
+
+    //No data block until something other than zeroes is written
+    inode->offset = 0;
+    inode->height = 0;
+    if(commit_new_inode(inode) != 0){
+        bitmap_clear(&inode_bitmap, findex);
+        quota_charge(getuid(), getgid(), -1, 0);
         return -ENOMEM;
     }
 
     //Everything worked fine
-    memset(blk_data, 0, BLOCK_SIZE);
-    blk_array[data_off] = blk_data;
-    inode->offset = data_off;
-    log_msg("mknod ran successfully in NPHeap for %d data offset\n", data_off);
-    data_off++;
+    log_msg("mknod ran successfully in NPHeap for %s\n", path);
     return 0;
 }
 
@@ -297,18 +422,29 @@ int nphfuse_mknod(const char *path, mode_t mode, dev_t dev){
 int nphfuse_mkdir(const char *path, mode_t mode){
     // char *filename, *dir;
     // extract_directory_file(&dir,&filename,path);
-    struct timeval currTime;
+    struct timespec now;
+    npheap_store staged;
     npheap_store *inode = NULL;
     char dir[236];
     char filename[128];
     uint64_t findex = -1;
+    uint64_t skipped = 0;
+    int err = 0;
     log_msg("Into mkdir functionality.\n");
-    inode = get_free_inode(&findex);
 
-    //If empty directory not found
-    if(inode == NULL){
-        log_msg("Empty Directory not found. \n");
-        return -ENOENT; 
+    //A directory made in the snapshot directory takes a snapshot, with
+    //the times lazytime kept back
+    if(snapshot_name(path) != NULL){
+        time_flush(NULL);
+        err = snapshot_create(snapshot_name(path), &skipped);
+        if(skipped != 0){
+            log_msg("Snapshot %s left out %llu entries with paths too long.\n",
+                    path, (unsigned long long)skipped);
+        }
+        return err;
+    }
+    if(snapshot_path(path)){
+        return -EROFS;
     }
 
     //Get directory and filename
@@ -317,25 +453,46 @@ int nphfuse_mkdir(const char *path, mode_t mode){
         log_msg("Extraction failed. \n");
         return -EINVAL;
     }
+    if(!entry_name_fits(dir, filename)){
+        return -ENAMETOOLONG;
+    }
+
+    err = quota_charge(getuid(), getgid(), 1, BLOCK_SIZE/2);
+    if(err != 0){
+        return err;
+    }
+    inode = get_free_inode(&staged, &findex);
+
+    //If empty directory not found
+    if(inode == NULL){
+        log_msg("Empty Directory not found. \n");
+        quota_charge(getuid(), getgid(), -1, -(BLOCK_SIZE/2));
+        return -ENOSPC;
+    }
 
     log_msg("Directory %s and Filename is %s \n", dir, filename);
 
-    memset(inode, 0, sizeof(npheap_store));
     strcpy(inode->dirname, dir);
     strcpy(inode->filename, filename);
+    inode->flags = inherited_flags(dir);
 
-    inode->mystat.st_ino = inode_off;
-    inode_off++;
     inode->mystat.st_mode = S_IFDIR | mode;
     inode->mystat.st_gid = getgid();
     inode->mystat.st_uid = getuid();
     inode->mystat.st_size = BLOCK_SIZE/2;
     inode->mystat.st_nlink = 2;
+    inode->mystat.st_blksize = data_block_size;
 
-    gettimeofday(&currTime, NULL);
-    inode->mystat.st_atime = currTime.tv_sec;
-    inode->mystat.st_mtime = currTime.tv_sec;
-    inode->mystat.st_ctime = currTime.tv_sec;
+    now = time_now();
+    inode->mystat.st_atim = now;
+    inode->mystat.st_mtim = now;
+    inode->mystat.st_ctim = now;
+
+    if(commit_new_inode(inode) != 0){
+        bitmap_clear(&inode_bitmap, findex);
+        quota_charge(getuid(), getgid(), -1, -(BLOCK_SIZE/2));
+        return -ENOMEM;
+    }
 
     log_msg("mkdir executed successfully.! %d st_ino\n", inode->mystat.st_ino);
 
@@ -345,39 +502,59 @@ int nphfuse_mkdir(const char *path, mode_t mode){
 /** Remove a file */
 int nphfuse_unlink(const char *path){
     //Individual file delete
+    npheap_store *entry = NULL;
     npheap_store *inode = NULL;
+    npheap_store *other = NULL;
+    struct timespec now;
+    struct jtx tx;
     log_msg("Into UNLINK for %s\n", path);
 
     //Root directory cannot be deleted.
     if(strcmp(path,"/")==0){
         return -EACCES;
     }
+    if(snapshot_path(path)){
+        return -EROFS;
+    }
 
-    inode = retrieve_inode(path);
-
-    if(inode==NULL){
+    entry = retrieve_entry(path);
+    if(entry==NULL){
         return -ENOENT;
     }
+    inode = inode_resolve(entry);
 
     //Check for permission
-    int flag = checkAccess(inode);
+    int flag = checkAccess(inode != NULL ? inode : entry);
     if(flag==0){
         log_msg("Cannot access the directory\n");
         return - EACCES;
     }
 
-    //Check for dirname and filename
-    if(npheap_getsize(npheap_fd, inode->offset) != 0){
-        log_msg("Data offset exist. for %d data off\n", inode->offset);
-        npheap_delete(npheap_fd, inode->offset);
+    now = time_now();
+    jtx_begin(&tx);
+    if(inode != entry){
+        //A second name goes; the inode only loses a link
+        put_free_inode(entry, &tx);
+        if(inode != NULL){
+            jtx_field(&tx, inode, mystat.st_nlink, inode->mystat.st_nlink - 1);
+            jtx_field(&tx, inode, mystat.st_ctim, now);
+        }
+    }else if(inode->mystat.st_nlink > 1 && (other = find_link(inode)) != NULL){
+        //The inode keeps its slot and number and takes over the name of
+        //one of its links, whose slot is given back
+        log_msg("%s still has %llu links\n", path, (unsigned long long)inode->mystat.st_nlink - 1);
+        jtx_inode(&tx, inode, 0, other, offsetof(npheap_store, offset));
+        jtx_field(&tx, inode, mystat.st_nlink, inode->mystat.st_nlink - 1);
+        jtx_field(&tx, inode, mystat.st_ctim, now);
+        put_free_inode(other, &tx);
+    }else{
+        //Release every data block and block map node of the file
+        log_msg("Freeing data blocks under %llu data off\n", (unsigned long long)inode->offset);
+        jtx_free(&tx, inode->offset, inode->height);
+        put_free_inode(inode, &tx);
     }
-
-    inode->dirname[0] = '\0';
-    inode->filename[0] = '\0';
-    blk_array[inode->offset] == NULL;
-    memset(inode, 0, sizeof(npheap_store));
     log_msg("Exiting UNLINK.\n");
-    return 0;
+    return jtx_commit(&tx);
 }
 
 /** Remove a directory */
@@ -387,9 +564,18 @@ int nphfuse_rmdir(const char *path){
     char dir[236];
     char filename[128];
     npheap_store *inode = NULL;
+    struct jtx tx;
     uint64_t offset = 2;
     int index = 0;
 
+    //Removing a directory from the snapshot directory deletes that snapshot
+    if(snapshot_name(path) != NULL){
+        return snapshot_delete(snapshot_name(path));
+    }
+    if(snapshot_path(path)){
+        return -EROFS;
+    }
+
     int extract = extract_directory_file(dir,filename,path);
 
     if(extract==1){
@@ -397,29 +583,29 @@ int nphfuse_rmdir(const char *path){
         return -ENOENT;
     }
 
-    for(offset = 2; offset < 502; offset++){
-        inode= (npheap_store *)npheap_alloc(npheap_fd, offset, BLOCK_SIZE);
+    for(offset = INODE_BLOCK_START; offset < INODE_BLOCK_END; offset++){
+        inode= (npheap_store *)heap_map(offset, BLOCK_SIZE);
         if(inode==NULL)
         {
             log_msg("NPheap alloc failed for offset : %d",offset);
+            continue;
         }
-        for (index = 0; index <16; index++)
+        for (index = 0; index < TOTAL_BLOCKS; index++)
         {
             if ((!strcmp (inode[index].dirname, dir)) &&
                 (!strcmp (inode[index].filename, filename))){
                     log_msg("%s directory and %s filename \n", dir, filename);
 
-                    int flag = checkAccess(inode);
+                    int flag = checkAccess(&inode[index]);
                     if(flag==0){
                         log_msg("Cannot access the directory\n");
                         return - EACCES;
                     }
                     
-                    inode[index].dirname[0] = '\0';
-                    inode[index].filename[0] = '\0';
-                    memset(&inode[index], 0, sizeof(npheap_store));
+                    jtx_begin(&tx);
+                    put_free_inode(&inode[index], &tx);
                     log_msg("Directory deleted\n");
-                    return 0;
+                    return jtx_commit(&tx);
             }
         }
     }
@@ -431,9 +617,86 @@ int nphfuse_rmdir(const char *path){
 // to the symlink() system call.  The 'path' is where the link points,
 // while the 'link' is the link itself.  So we need to leave the path
 // unaltered, but insert the link into the mounted directory.
+// A target that fits in XATTR_INLINE is kept in the inode, so readlink
+// never touches a data block for it; a longer one goes in block 0
 int nphfuse_symlink(const char *path, const char *link)
 {
-    return -1;
+    struct timespec now;
+    npheap_store staged;
+    npheap_store *inode = NULL;
+    char dir[236];
+    char filename[128];
+    uint64_t findex = -1;
+    uint64_t blk_id;
+    size_t len = strlen(path);
+    char *data;
+    int err;
+    log_msg("Into SYMLINK for %s to %s\n", link, path);
+
+    if(snapshot_path(link)){
+        return -EROFS;
+    }
+    if(len == 0){
+        return -ENOENT;
+    }
+    if(len >= PATH_MAX || len > data_block_size){
+        return -ENAMETOOLONG;
+    }
+    int extract = extract_directory_file(dir, filename, link);
+    if(extract == 1){
+        return -EINVAL;
+    }
+    if(!entry_name_fits(dir, filename)){
+        return -ENAMETOOLONG;
+    }
+
+    err = quota_charge(getuid(), getgid(), 1, len);
+    if(err != 0){
+        return err;
+    }
+    inode = get_free_inode(&staged, &findex);
+    if(inode == NULL){
+        quota_charge(getuid(), getgid(), -1, -(int64_t)len);
+        return -ENOSPC;
+    }
+    strcpy(inode->dirname, dir);
+    strcpy(inode->filename, filename);
+    inode->mystat.st_mode = S_IFLNK | 0777;
+    inode->mystat.st_gid = getgid();
+    inode->mystat.st_uid = getuid();
+    inode->mystat.st_nlink = 1;
+    inode->mystat.st_size = len;
+    inode->mystat.st_blksize = data_block_size;
+    now = time_now();
+    inode->mystat.st_atim = now;
+    inode->mystat.st_mtim = now;
+    inode->mystat.st_ctim = now;
+
+    if(len <= XATTR_INLINE){
+        memcpy(inode->xattr_inline, path, len);
+    }else{
+        //The new block is not reachable until the inode is committed
+        blk_id = bmap_alloc(inode, 0, NULL);
+        data = (char *)heap_get(blk_id);
+        if(data == NULL){
+            heap_free(blk_id);
+            bitmap_clear(&inode_bitmap, findex);
+            quota_charge(getuid(), getgid(), -1, -(int64_t)len);
+            return -ENOSPC;
+        }
+        memcpy(data, path, len);
+        ckpt_dirty(blk_id);
+        csum_update(blk_id, data, data_block_size);
+    }
+    if(commit_new_inode(inode) != 0){
+        //Block 0 of a new inode is its root, so it is the only object
+        //a slow symlink has
+        heap_free(inode->offset);
+        bitmap_clear(&inode_bitmap, findex);
+        quota_charge(getuid(), getgid(), -1, -(int64_t)len);
+        return -ENOMEM;
+    }
+    return 0;
 }
 
 /** Rename a file */
@@ -441,8 +704,11 @@ int nphfuse_symlink(const char *path, const char *link)
 int nphfuse_rename(const char *path, const char *newpath)
 {
     log_msg("RENAME called for %s path to %s newpath\n", path, newpath);
-    struct timeval currTime;
+    struct timespec now;
     npheap_store *inode = NULL;
+    npheap_store *target = NULL;
+    npheap_store staged;
+    struct jtx tx;
     char dir[236];
     char filename[128];
 
@@ -450,13 +716,20 @@ int nphfuse_rename(const char *path, const char *newpath)
     if(strcmp(path,"/")==0){
         return -EACCES;
     }
+    if(snapshot_path(path) || snapshot_path(newpath)){
+        return -EROFS;
+    }
 
-    //Get inode into path
-    inode = retrieve_inode(path);
+    //Get the entry for path; a hard link is renamed, not what it links to
+    inode = retrieve_entry(path);
     if(inode == NULL){
         log_msg("Inode was not found in rename.\n");
         return -ENOENT;
     }
+    target = inode_resolve(inode);
+    if(target == NULL){
+        target = inode;
+    }
 
     //Check if newpath is valid
     int extract = extract_directory_file(dir, filename, newpath);
@@ -464,41 +737,99 @@ int nphfuse_rename(const char *path, const char *newpath)
         log_msg("Newpath is invalid.\n");
         return -EINVAL;
     }
+    if(!entry_name_fits(dir, filename)){
+        return -ENAMETOOLONG;
+    }
 
     //Check if user has access
-    int flag = checkAccess(inode);
+    int flag = checkAccess(target);
     if(flag==0){
         log_msg("Cannot access the directory.\n");
         return - EACCES;
     }
 
-    //memset the dirname and filename
-    //memset(inode->dirname, 0, 236);
-    //memset(inode->filename, 0, 128);
-
-    //copy the new path
-    strcpy(inode->dirname, dir);
-    strcpy(inode->filename, filename);
+    //copy the new path; both names sit at the front of the slot
+    memset(&staged, 0, sizeof(staged));
+    strcpy(staged.dirname, dir);
+    strcpy(staged.filename, filename);
 
     //Change the changetime
-    gettimeofday(&currTime, NULL);
-    inode->mystat.st_ctime = currTime.tv_sec;
+    now = time_now();
+    jtx_begin(&tx);
+    jtx_inode(&tx, inode, 0, &staged, offsetof(npheap_store, offset));
+    jtx_field(&tx, target, mystat.st_ctim, now);
 
     log_msg("Exiting from RENAME.\n");
-    return 0;
+    return jtx_commit(&tx);
 }
 
 /** Create a hard link to a file */
+// The new name is a slot of its own that stands for the inode through
+// its link field; the data, attributes and inode number stay shared
 int nphfuse_link(const char *path, const char *newpath)
 {
-    return -1;
+    struct timespec now;
+    npheap_store staged;
+    npheap_store *inode = NULL;
+    npheap_store *entry = NULL;
+    struct jtx tx;
+    char dir[236];
+    char filename[128];
+    uint64_t findex = -1;
+    int err;
+    log_msg("Into LINK for %s to %s\n", newpath, path);
+
+    if(snapshot_path(newpath)){
+        return -EROFS;
+    }
+    if(snapshot_path(path)){
+        return -EXDEV;
+    }
+    inode = retrieve_inode(path);
+    if(inode == NULL){
+        return -ENOENT;
+    }
+    if(S_ISDIR(inode->mystat.st_mode)){
+        return -EPERM;
+    }
+    if(checkAccess(inode) == 0){
+        return -EACCES;
+    }
+    int extract = extract_directory_file(dir, filename, newpath);
+    if(extract == 1){
+        return -EINVAL;
+    }
+    if(!entry_name_fits(dir, filename)){
+        return -ENAMETOOLONG;
+    }
+
+    entry = get_free_inode(&staged, &findex);
+    if(entry == NULL){
+        return -ENOSPC;
+    }
+    strcpy(entry->dirname, dir);
+    strcpy(entry->filename, filename);
+    entry->link = inode->mystat.st_ino;
+    entry->mystat.st_mode = inode->mystat.st_mode & S_IFMT;
+
+    now = time_now();
+    jtx_begin(&tx);
+    jtx_inode(&tx, entry, 0, entry, sizeof(npheap_store));
+    jtx_field(&tx, inode, mystat.st_nlink, inode->mystat.st_nlink + 1);
+    jtx_field(&tx, inode, mystat.st_ctim, now);
+    err = jtx_commit(&tx);
+    if(err != 0){
+        bitmap_clear(&inode_bitmap, findex);
+    }
+    return err;
 }
 
 /** Change the permission bits of a file */
 int nphfuse_chmod(const char *path, mode_t mode){
     log_msg("Entry into CHMOD.\n");
     npheap_store *inode = NULL;
-    struct timeval currTime;
+    struct timespec now;
+    struct jtx tx;
 
     if(strcmp (path,"/")==0){
         log_msg("Calling getRootDirectory() in CHOWN.\n");
@@ -520,14 +851,18 @@ int nphfuse_chmod(const char *path, mode_t mode){
             }
             //else set correct value
             log_msg("Owner of root  changed in CHOWN.\n", path);
-            gettimeofday(&currTime, NULL);
-            inode->mystat.st_mode = mode;
-            inode->mystat.st_ctime = currTime.tv_sec;
+            now = time_now();
+            jtx_begin(&tx);
+            jtx_field(&tx, inode, mystat.st_mode, mode);
+            jtx_field(&tx, inode, mystat.st_ctim, now);
             log_msg("Exit from CHMOD.\n");
-            return 0;
+            return jtx_commit(&tx);
         }
     }
     
+    if(snapshot_path(path)){
+        return -EROFS;
+    }
     inode = retrieve_inode(path);
     
     if(inode == NULL){
@@ -544,18 +879,51 @@ int nphfuse_chmod(const char *path, mode_t mode){
     
     //else set correct value
     log_msg("Owner of path - %s - changed in CHOWN.\n", path);
-    gettimeofday(&currTime, NULL);
-    inode->mystat.st_mode = mode;
-    inode->mystat.st_ctime = currTime.tv_sec;
+    now = time_now();
+    jtx_begin(&tx);
+    jtx_field(&tx, inode, mystat.st_mode, mode);
+    jtx_field(&tx, inode, mystat.st_ctim, now);
     log_msg("Exit from CHMOD.\n");
-    return 0;
+    return jtx_commit(&tx);
+}
+
+//Give inode to uid and gid, moving what it uses over to their quotas;
+//-1 leaves the owner or group as it is
+static int chown_inode(npheap_store *inode, uid_t uid, gid_t gid){
+    npheap_store moved;
+    struct timespec now;
+    struct jtx tx;
+    int err;
+
+    if(uid == (uid_t)-1){
+        uid = inode->mystat.st_uid;
+    }
+    if(gid == (gid_t)-1){
+        gid = inode->mystat.st_gid;
+    }
+    err = quota_chown(inode, uid, gid);
+    if(err != 0){
+        return err;
+    }
+    now = time_now();
+    jtx_begin(&tx);
+    jtx_field(&tx, inode, mystat.st_uid, uid);
+    jtx_field(&tx, inode, mystat.st_gid, gid);
+    jtx_field(&tx, inode, mystat.st_ctim, now);
+    err = jtx_commit(&tx);
+    if(err != 0){
+        moved = *inode;
+        moved.mystat.st_uid = uid;
+        moved.mystat.st_gid = gid;
+        quota_chown(&moved, inode->mystat.st_uid, inode->mystat.st_gid);
+    }
+    return err;
 }
 
 /** Change the owner and group of a file */
 int nphfuse_chown(const char *path, uid_t uid, gid_t gid){
     log_msg("Entry into CHOWN.\n");
     npheap_store *inode = NULL;
-    struct timeval currTime;
 
     if(strcmp (path,"/")==0){
         log_msg("Calling getRootDirectory() in CHOWN.\n");
@@ -577,15 +945,14 @@ int nphfuse_chown(const char *path, uid_t uid, gid_t gid){
             }
             //else set correct value
             log_msg("Owner of root  changed in CHOWN.\n", path);
-            gettimeofday(&currTime, NULL);
-            inode->mystat.st_uid = uid;
-            inode->mystat.st_gid = gid;
-            inode->mystat.st_ctime = currTime.tv_sec;
             log_msg("Exit from CHOWN.\n");
-            return 0;
+            return chown_inode(inode, uid, gid);
         }
     }
     
+    if(snapshot_path(path)){
+        return -EROFS;
+    }
     inode = retrieve_inode(path);
     
     if(inode == NULL){
@@ -602,24 +969,97 @@ int nphfuse_chown(const char *path, uid_t uid, gid_t gid){
     
     //else set correct value
     log_msg("Owner of path - %s - changed in CHOWN.\n", path);
-    gettimeofday(&currTime, NULL);
-    inode->mystat.st_uid = uid;
-    inode->mystat.st_gid = gid;
-    inode->mystat.st_ctime = currTime.tv_sec;
     log_msg("Exit from CHOWN.\n");
-    return 0;
+    return chown_inode(inode, uid, gid);
 }
 
 /** Change the size of a file */
 int nphfuse_truncate(const char *path, off_t newsize)
 {
+    log_msg("Into TRUNCATE for %s\n", path);
+    npheap_store *inode = NULL;
+    npheap_store staged;
+    struct jtx tx;
+    struct timespec now;
+    size_t rem = 0;
+    uint64_t oldsize = 0;
+    int err = 0;
+
+    if(strcmp(path,"/")==0){
+        return -EISDIR;
+    }
+    if(newsize < 0){
+        return -EINVAL;
+    }
+    if(snapshot_path(path)){
+        return -EROFS;
+    }
+
+    inode = retrieve_inode(path);
+    if(inode == NULL){
         return -ENOENT;
+    }
+
+    int flag = checkAccess(inode);
+    if(flag==0){
+        log_msg("Cannot access the file in truncate.\n");
+        return -EACCES;
+    }
+
+    //Growing is charged up front, shrinking given back once it is done
+    oldsize = inode->mystat.st_size;
+    if((uint64_t)newsize > oldsize){
+        err = quota_resize(inode, oldsize, newsize);
+        if(err != 0){
+            return err;
+        }
+    }
+
+    //Free every whole block past the new end
+    snapshot_hold();
+    jtx_begin(&tx);
+    staged = *inode;
+    bmap_truncate(&staged, (newsize + data_block_size - 1)/data_block_size, &tx);
+
+    //Zero the tail of the last block so growing the file again reads
+    //zeroes; a block shared with a snapshot is copied first
+    rem = newsize % data_block_size;
+    if(rem != 0 && newsize < inode->mystat.st_size){
+        bmap_zero(&staged, newsize, newsize - rem + data_block_size, &tx);
+    }
+
+    now = time_now();
+    jtx_field(&tx, inode, offset, staged.offset);
+    jtx_field(&tx, inode, height, staged.height);
+    jtx_field(&tx, inode, mystat.st_size, newsize);
+    ckpt_need_meta();
+    jtx_field(&tx, inode, mystat.st_mtim, now);
+    jtx_field(&tx, inode, mystat.st_ctim, now);
+    log_msg("Exiting TRUNCATE.\n");
+    err = jtx_commit(&tx);
+    snapshot_unhold();
+    if(err != 0 && (uint64_t)newsize > oldsize){
+        quota_resize(inode, newsize, oldsize);
+    }else if(err == 0 && (uint64_t)newsize < oldsize){
+        quota_resize(inode, oldsize, newsize);
+    }
+    return err;
 }
 
 /** Change the access and/or modification times of a file */
+//utime() only gives whole seconds
+static struct timespec utime_spec(time_t t){
+    struct timespec ts;
+
+    ts.tv_sec = t;
+    ts.tv_nsec = 0;
+    return ts;
+}
+
 int nphfuse_utime(const char *path, struct utimbuf *ubuf){
     log_msg("Into utime.\n");
     npheap_store *temp = NULL;
+    struct jtx tx;
 
     if(strcmp(path,"/")==0){
         temp = getRootDirectory();
@@ -637,17 +1077,22 @@ int nphfuse_utime(const char *path, struct utimbuf *ubuf){
             }
 
             // Set from ubuf
+            time_forget(temp);
+            jtx_begin(&tx);
             if(ubuf->actime){
-                temp->mystat.st_atime = ubuf->actime;
+                jtx_field(&tx, temp, mystat.st_atim, utime_spec(ubuf->actime));
             }
             if(ubuf->modtime){
-                temp->mystat.st_mtime = ubuf->modtime;
+                jtx_field(&tx, temp, mystat.st_mtim, utime_spec(ubuf->modtime));
             }
             log_msg("Ubuf ran successfully.! \n");
-            return 0;
+            return jtx_commit(&tx);
         }
     }
 
+    if(snapshot_path(path)){
+        return -EROFS;
+    }
     temp = retrieve_inode(path);
 
     if(temp==0){
@@ -661,14 +1106,16 @@ int nphfuse_utime(const char *path, struct utimbuf *ubuf){
         return - EACCES;
     }
 
+    time_forget(temp);
+    jtx_begin(&tx);
     if(ubuf->actime){
-        temp->mystat.st_atime = ubuf->actime;
+        jtx_field(&tx, temp, mystat.st_atim, utime_spec(ubuf->actime));
     }
     if(ubuf->modtime){
-        temp->mystat.st_mtime = ubuf->modtime;
+        jtx_field(&tx, temp, mystat.st_mtim, utime_spec(ubuf->modtime));
     }
     log_msg("Ubuf ran successfully.! \n");
-    return 0;
+    return jtx_commit(&tx);
 
 }
 
@@ -683,7 +1130,6 @@ int nphfuse_utime(const char *path, struct utimbuf *ubuf){
  * Changed in version 2.2
  */
 int nphfuse_open(const char *path, struct fuse_file_info *fi){
-    struct timeval currTime;
     npheap_store *temp = NULL;
 
     //Check for root directory
@@ -721,10 +1167,12 @@ int nphfuse_open(const char *path, struct fuse_file_info *fi){
         log_msg("Access denied.\n");
         return -EACCES;
     }
+    if((fi->flags & O_ACCMODE) != O_RDONLY && snapshot_path(path)){
+        return -EROFS;
+    }
     //Everything worked fine
     fi->fh = temp->mystat.st_ino;
-    gettimeofday(&currTime, NULL);
-    temp->mystat.st_atime = currTime.tv_sec;
+    time_accessed(temp);
     return 0;
 }
 
@@ -748,8 +1196,6 @@ int nphfuse_read(const char *path, char *buf, size_t size, off_t offset, struct
     log_msg("Into READ function.\n");
     //Variables needed
     npheap_store *inode = NULL;
-    struct timeval currTime;
-    char *blk_data = NULL;
 
     //Root is not the file, so throw error
     if(strcmp(path,"/")==0){
@@ -769,65 +1215,44 @@ int nphfuse_read(const char *path, char *buf, size_t size, off_t offset, struct
         return - EACCES;
     }
 
-    blk_data = (char *)blk_array[inode->offset];
-    if(blk_data==NULL){
-        return -ENOENT;
-    }
-
     size_t left_to_read = size;
     size_t offset_read = offset;
     size_t rem = 0;
+    size_t chunk = 0;
     size_t curr_buff = 0;
     uint64_t curr_offset = 0;
-    uint64_t pos_in_offset = 0;
-    size_t curr_size = 0;
 
-    curr_size = npheap_getsize(npheap_fd, inode->offset);
-    if(curr_size == 0){
+    //Nothing to read at or past the end of the file
+    if(offset >= inode->mystat.st_size){
         return 0;
     }
+    if(left_to_read > inode->mystat.st_size - offset){
+        left_to_read = inode->mystat.st_size - offset;
+    }
 
     log_msg("Reading started.\n");
 
     while(left_to_read != 0){
-        //log_msg("Reached here\n");
-        pos_in_offset = offset_read/BLOCK_SIZE;
-        curr_offset = inode->offset;
-
-        while(pos_in_offset != 0){
-            curr_offset = dt_link[curr_offset-FIXED_VALUE];
-            pos_in_offset--;
+        curr_offset = bmap_lookup(inode, offset_read/data_block_size);
+        rem = offset_read % data_block_size;
+        chunk = data_block_size - rem;
+        if(chunk > left_to_read){
+            chunk = left_to_read;
         }
 
-        blk_data = blk_array[curr_offset];  
-        if(blk_data==NULL){
-            return -ENOENT;
-        }
-        log_msg("Reached with %s block data\n", blk_data);
-        if(npheap_getsize(npheap_fd, curr_offset) == 0){
-           return -EINVAL;
-        }
-
-        curr_size = npheap_getsize(npheap_fd, curr_offset);
-        rem = offset_read % BLOCK_SIZE;
-
-        if(curr_size <= left_to_read + rem){
-            log_msg("Reading still left.\n");
-            memcpy(buf + curr_buff, blk_data + rem, curr_size - rem);
-            offset_read = offset_read + curr_size - rem;
-            curr_buff = curr_buff + curr_size - rem;
-            left_to_read = left_to_read - curr_size + rem;
-        }else{
-            log_msg("Last read in the data block.\n");
-            memcpy(buf + curr_buff, blk_data + rem, left_to_read);
-            offset_read = offset_read + left_to_read;
-            curr_buff = curr_buff + left_to_read;
-            left_to_read = 0;
+        if(curr_offset == 0){
+            //Block was never written, it reads back as zeroes
+            memset(buf + curr_buff, 0, chunk);
+        }else if(zblock_read(curr_offset, buf + curr_buff, rem, chunk) != 0){
+            log_msg("Data block %llx is missing or damaged.\n", (unsigned long long)curr_offset);
+            return -EIO;
         }
+        offset_read = offset_read + chunk;
+        curr_buff = curr_buff + chunk;
+        left_to_read = left_to_read - chunk;
     }
 
-    gettimeofday(&currTime, NULL);
-    inode->mystat.st_atime = currTime.tv_sec;
+    time_accessed(inode);
 
     return curr_buff;
 }
@@ -841,16 +1266,20 @@ int nphfuse_read(const char *path, char *buf, size_t size, off_t offset, struct
  */
 int nphfuse_write(const char *path, const char *buf, size_t size, off_t offset,
 	     struct fuse_file_info *fi){
-/*    
     log_msg("Into WRITE function.\n");
     npheap_store *inode = NULL;
-    struct timeval currTime;
+    npheap_store staged;
+    struct jtx tx;
     char *blk_data = NULL;
+    char *zbuf = NULL;
 
     //Root is not the file, so throw error
     if(strcmp(path,"/")==0){
         return -ENOENT;
     }
+    if(snapshot_path(path)){
+        return -EROFS;
+    }
 
     inode = retrieve_inode(path);
     if(inode==NULL){
@@ -865,92 +1294,161 @@ int nphfuse_write(const char *path, const char *buf, size_t size, off_t offset,
         return - EACCES;
     }
 
-    size_t curr_size = 0;
-    char *temp = NULL;
-
-    if(npheap_getsize(npheap_fd, inode->offset) == 0){
-        return 0;
-    }
-    curr_size = npheap_getsize(npheap_fd, inode->offset);
-
-    blk_data = blk_array[inode->offset];
-    if(blk_data == NULL){
-        log_msg("Cannot allocate for block %lu\n", inode->offset);
-        return -ENOENT;
-    }
-
     size_t curr_buff = 0;
     size_t left_to_write = size;
     size_t offset_write = offset;
     size_t rem = 0;
-    size_t pos_in_offset = 0;
-    char *next_link = NULL;
-    size_t curr_offset = 0;
-    int ret = 0;
+    size_t chunk = 0;
+    uint64_t curr_offset = 0;
+    uint64_t prev = 0;
+    uint64_t hash = 0;
+    uint64_t oldsize = inode->mystat.st_size;
+    uint64_t end = oldsize;
+    int compress = 0;
+    int err = 0;
+
+    //Growth is charged for the whole write and what did not get
+    //written is given back at the end
+    if(offset + size > oldsize){
+        end = offset + size;
+        err = quota_resize(inode, oldsize, end);
+        if(err != 0){
+            return err;
+        }
+    }
+
+    compress = compress_wanted(inode);
+    if(compress || dedup_wanted()){
+        zbuf = (char *)malloc(data_block_size);
+    }
+
+    //New blocks are hung off a copy; the root and height are journaled
+    //below, along with the references given up by copying shared blocks
+    snapshot_hold();
+    jtx_begin(&tx);
+    staged = *inode;
 
     log_msg("Writing started.\n");
     while(left_to_write != 0){
-        pos_in_offset = offset_write/BLOCK_SIZE;
-        curr_offset = inode->offset;
-
-        while(pos_in_offset != 0){
-            curr_offset = dt_link[curr_offset-FIXED_VALUE];
-            pos_in_offset--;
+        rem = offset_write % data_block_size;
+        chunk = data_block_size - rem;
+        if(chunk > left_to_write){
+            chunk = left_to_write;
         }
 
-        blk_data = (char *)blk_array[curr_offset];
-        if(blk_data==NULL){
-            dt_link[curr_offset];
-            return -ENOENT;
+        //Zeroes written over a hole leave it a hole
+        if(bmap_is_zero(buf + curr_buff, chunk) &&
+           bmap_lookup(&staged, offset_write/data_block_size) == 0){
+            offset_write = offset_write + chunk;
+            curr_buff = curr_buff + chunk;
+            left_to_write = left_to_write - chunk;
+            continue;
         }
-        log_msg("Write in progress\n");
 
-        if(npheap_getsize(npheap_fd, curr_offset) == 0){
-           return -EINVAL;
+        //The block is put together whole, then shared with an identical
+        //one if there is one or stored again compressed if that saves
+        //space, and stored as it is otherwise
+        if(zbuf != NULL){
+            prev = bmap_lookup(&staged, offset_write/data_block_size);
+            if(prev == 0 || chunk == data_block_size){
+                memset(zbuf, 0, data_block_size);
+            }else if(zblock_read(prev, zbuf, 0, data_block_size) != 0){
+                log_msg("Data block %llx is missing or damaged.\n", (unsigned long long)prev);
+                err = -EIO;
+                break;
+            }
+            memcpy(zbuf + rem, buf + curr_buff, chunk);
+            curr_offset = dedup_find(zbuf, &hash);
+            if(curr_offset == prev && prev != 0){
+                //Rewritten with what it already held
+                share_unref(curr_offset, 1);
+            }else if(curr_offset != 0){
+                if(bmap_set(&staged, offset_write/data_block_size, curr_offset, &tx) != 0){
+                    share_unref(curr_offset, 1);
+                    log_msg("Couldn't allocate block for %llu file offset\n", (unsigned long long)offset_write);
+                    break;
+                }
+            }else if(compress && (curr_offset = zblock_store(zbuf)) != 0){
+                if(bmap_set(&staged, offset_write/data_block_size, curr_offset, &tx) != 0){
+                    heap_free(BMAP_ID(curr_offset));
+                    log_msg("Couldn't allocate block for %llu file offset\n", (unsigned long long)offset_write);
+                    break;
+                }
+                dedup_add(hash, curr_offset);
+            }
+            if(curr_offset != 0){
+                offset_write = offset_write + chunk;
+                curr_buff = curr_buff + chunk;
+                left_to_write = left_to_write - chunk;
+                continue;
+            }
         }
 
-        curr_size = npheap_getsize(npheap_fd, curr_offset);
-        rem = offset_write % BLOCK_SIZE;
+        curr_offset = bmap_alloc(&staged, offset_write/data_block_size, &tx);
+        if(curr_offset == 0){
+            log_msg("Couldn't allocate block for %llu file offset\n", (unsigned long long)offset_write);
+            break;
+        }
 
-        if(curr_size <= left_to_write + rem){
-            log_msg("Multiple write for %d curr_size\n", curr_size);
+        blk_data = (char *)heap_get(curr_offset);
+        if(blk_data==NULL){
+            log_msg("Data block %llu is missing.\n", (unsigned long long)curr_offset);
+            break;
+        }
 
-            next_link = (char *)npheap_alloc(npheap_fd,data_off,BLOCK_SIZE);
-            if(next_link==NULL){
-                log_msg("Couldn't allocate memory for %d offset\n", data_off);
-                return -ENOMEM;
-            }
-            log_msg("Write after new link\n");
-            blk_array[data_off] = next_link;
-            dt_link[curr_offset - FIXED_VALUE] = data_off;
-            data_off++;
-            memset(next_link, 0, npheap_getsize(npheap_fd, dt_link[curr_offset - FIXED_VALUE]));
-            memcpy(blk_data + rem, buf + curr_buff, curr_size - rem);
+        //The checksum covers the whole block, so what a partial write
+        //leaves alone is checked before it goes under the new one
+        csum_lock(curr_offset);
+        if(chunk != data_block_size &&
+           csum_check(curr_offset, blk_data, data_block_size) != 0){
+            csum_unlock(curr_offset);
+            log_msg("Data block %llu is damaged.\n", (unsigned long long)curr_offset);
+            err = -EIO;
+            break;
+        }
+        memcpy(blk_data + rem, buf + curr_buff, chunk);
+        ckpt_dirty(curr_offset);
+        csum_update(curr_offset, blk_data, data_block_size);
+        csum_unlock(curr_offset);
+        if(zbuf != NULL){
+            dedup_add(hash, curr_offset);
+        }
 
-            offset_write = offset_write + curr_size - rem;
-            curr_buff = curr_buff + curr_size - rem;
-            left_to_write = left_to_write - curr_size + rem;
+        offset_write = offset_write + chunk;
+        curr_buff = curr_buff + chunk;
+        left_to_write = left_to_write - chunk;
+    }
 
-        }else{
-            log_msg("Last Write.\n");
-            memcpy(blk_data + rem, buf + curr_buff, left_to_write);
+    free(zbuf);
 
-            offset_write = offset_write + left_to_write;
-            curr_buff = curr_buff + left_to_write;
-            left_to_write = 0;
-        }
-        ret = curr_buff;
+    //Nothing could be written at all
+    if(curr_buff == 0 && size != 0){
+        jtx_abort(&tx);
+        snapshot_unhold();
+        quota_resize(inode, end, oldsize);
+        return err != 0 ? err : -ENOMEM;
     }
 
-    gettimeofday(&currTime, NULL);
-    inode->mystat.st_atime = currTime.tv_sec;
-    inode->mystat.st_mtime = currTime.tv_sec;
-    inode->mystat.st_ctime = currTime.tv_sec;
-    inode->mystat.st_size = inode->mystat.st_size + ret;
+    if(staged.offset != inode->offset || staged.height != inode->height){
+        jtx_field(&tx, inode, offset, staged.offset);
+        jtx_field(&tx, inode, height, staged.height);
+    }
+    time_changed(inode, TIME_ATIME | TIME_MTIME | TIME_CTIME, &tx);
+    if(offset + curr_buff > inode->mystat.st_size){
+        jtx_field(&tx, inode, mystat.st_size, offset + curr_buff);
+        ckpt_need_meta();
+    }
+    err = jtx_commit(&tx);
+    snapshot_unhold();
+    if(err != 0){
+        quota_resize(inode, end, oldsize);
+        return -ENOMEM;
+    }
+    if(offset + curr_buff < end){
+        quota_resize(inode, end, offset + curr_buff > oldsize ? offset + curr_buff : oldsize);
+    }
 
-    return ret;
-    */
-    return -ENOENT;
+    return curr_buff;
 }
 
 /** Get file system statistics
@@ -962,36 +1460,19 @@ int nphfuse_write(const char *path, const char *buf, size_t size, off_t offset,
  */
 int nphfuse_statfs(const char *path, struct statvfs *statv){
     log_msg("Entry into STATFS\n");
-    npheap_store *inode = NULL;
-    uint64_t offset = 2;
-    uint64_t index = 0;
-    uint8_t count = 0;
-    //Fill random data into statv
-    memset(statv, 0, sizeof(struct statvfs));
-
-    for(offset = 2; offset < 502; offset++){
-        inode= (npheap_store *)npheap_alloc(npheap_fd, offset, BLOCK_SIZE);
-        if(inode==NULL)
-        {
-            log_msg("NPheap alloc failed for offset : %d",offset);
-        }
-        for (index = 0; index <16; index++)
-        {
-            if ((inode[index].dirname[0] != '\0') &&
-                (inode[index].filename[0] != '\0')){
-                count++;
-            }
-        }
-    }
 
-    statv->f_bsize = 1024;
-    statv->f_frsize = 1024;
-    statv->f_blocks = 8192;
-    statv->f_bfree = statv->f_blocks - (count/2) - 1;
+    // The allocators keep both counts in the superblock, so this is
+    // a read of a few words however big the filesystem is
+    memset(statv, 0, sizeof(struct statvfs));
+    statv->f_bsize = data_block_size;
+    statv->f_frsize = data_block_size;
+    statv->f_blocks = superblock->data_blocks;
+    statv->f_bfree = superblock->data_blocks - superblock->blocks_used;
     statv->f_bavail = statv->f_bfree;
-    statv->f_files = 7998;
-    statv->f_ffree = statv->f_files - count;
-    statv->f_favail = statv->f_ffree - 1;
+    statv->f_files = superblock->inode_count;
+    statv->f_ffree = superblock->inode_count - superblock->inodes_used;
+    statv->f_favail = statv->f_ffree;
+    statv->f_namemax = sizeof(((npheap_store *)0)->filename) - 1;
     log_msg("Exiting from STATFS\n");
     return 0;
 }
@@ -1055,37 +1536,174 @@ int nphfuse_release(const char *path, struct fuse_file_info *fi)
  *
  * Changed in version 2.2
  */
+// The heap itself needs no syncing; with a checkpoint file every
+// object changed since the last sync is written out to it, after the
+// times lazytime kept back for the file
 int nphfuse_fsync(const char *path, int datasync, struct fuse_file_info *fi)
 {
-    return -1;
+    npheap_store *inode = NULL;
+
+    log_msg("Into FSYNC for %s, datasync %d\n", path, datasync);
+    if(!datasync){
+        inode = strcmp(path, "/") == 0 ? getRootDirectory() : retrieve_inode(path);
+        if(inode != NULL && time_flush(inode) != 0){
+            log_msg("Couldn't write the times of %s back.\n", path);
+        }
+    }
+    return ckpt_sync(datasync);
 }
 
 #ifdef HAVE_SYS_XATTR_H
+//The inode whose attributes path names, root included
+static npheap_store *xattr_inode(const char *path){
+    return strcmp(path, "/") == 0 ? getRootDirectory() : retrieve_inode(path);
+}
+
 /** Set extended attributes */
 int nphfuse_setxattr(const char *path, const char *name, const char *value, size_t size, int flags)
 {
-    return -61;
+    npheap_store *inode = NULL;
+
+    log_msg("Into SETXATTR for %s, %s (%zu bytes)\n", path, name, size);
+    if(snapshot_path(path)){
+        return -EROFS;
+    }
+    inode = xattr_inode(path);
+    if(inode == NULL){
+        return -ENOENT;
+    }
+    if(checkAccess(inode) == 0){
+        return -EACCES;
+    }
+    return xattr_set(inode, name, value, size, flags);
 }
 
 /** Get extended attributes */
+// Called by the kernel ahead of every write for security.capability;
+// an attribute the inode never had is answered without a lock
 int nphfuse_getxattr(const char *path, const char *name, char *value, size_t size)
 {
-    return -61;
+    npheap_store *inode = xattr_inode(path);
+
+    if(inode == NULL){
+        return -ENOENT;
+    }
+    return xattr_get(inode, name, value, size);
 }
 
 /** List extended attributes */
 int nphfuse_listxattr(const char *path, char *list, size_t size)
 {
-    return -61;
+    npheap_store *inode = xattr_inode(path);
+
+    if(inode == NULL){
+        return -ENOENT;
+    }
+    return xattr_list(inode, list, size);
 }
 
 /** Remove extended attributes */
 int nphfuse_removexattr(const char *path, const char *name)
 {
-    return -61;
+    npheap_store *inode = NULL;
+
+    log_msg("Into REMOVEXATTR for %s, %s\n", path, name);
+    if(snapshot_path(path)){
+        return -EROFS;
+    }
+    inode = xattr_inode(path);
+    if(inode == NULL){
+        return -ENOENT;
+    }
+    if(checkAccess(inode) == 0){
+        return -EACCES;
+    }
+    return xattr_remove(inode, name);
 }
 #endif
 
+//Slots of the entries of an open directory in table order, gathered
+//by one scan when it is read from the start.  readdir hands out slot
+//index + DIR_COOKIE_BASE as the offset of each entry, so a listing
+//picks up where the kernel left off with a binary search of slots.
+//Offsets 1 and 2 are "." and "..".
+#define DIR_COOKIE_BASE 3
+
+struct dir_cursor {
+    int filled;
+    uint64_t count;
+    uint64_t cap;
+    uint64_t *slots;
+};
+
+static void dir_cursor_free(struct dir_cursor *cur){
+    if(cur != NULL){
+        free(cur->slots);
+        free(cur);
+    }
+}
+
+//Gather the slots of the entries in directory path; 0 or -ENOMEM
+static int dir_cursor_fill(struct dir_cursor *cur, const char *path){
+    npheap_store *temp = NULL;
+    uint64_t *grown = NULL;
+    uint64_t u_offset = 2;
+    uint64_t index = 0;
+
+    cur->count = 0;
+    cur->filled = 0;
+    for(u_offset = INODE_BLOCK_START; u_offset < INODE_BLOCK_END; u_offset++){
+        temp= (npheap_store *)heap_map(u_offset, BLOCK_SIZE);
+        if(temp==NULL){
+            log_msg("NPheap alloc failed for offset : %d\n",u_offset);
+            continue;
+        }
+
+        for (index = 0; index < TOTAL_BLOCKS; index++){
+            if ((strcmp(temp[index].dirname, path) != 0) || (strcmp(temp[index].filename, "/")==0)){
+                continue;
+            }
+            //The snapshot directory is reached by name only
+            if(strcmp(path, "/") == 0 && snapshot_inode(&temp[index])){
+                continue;
+            }
+            if(cur->count == cur->cap){
+                grown = realloc(cur->slots, (cur->cap ? cur->cap * 2 : 64) * sizeof(uint64_t));
+                if(grown == NULL){
+                    return -ENOMEM;
+                }
+                cur->slots = grown;
+                cur->cap = cur->cap ? cur->cap * 2 : 64;
+            }
+            cur->slots[cur->count++] = (u_offset - INODE_BLOCK_START) * TOTAL_BLOCKS + index;
+        }
+    }
+    cur->filled = 1;
+    return 0;
+}
+
+//Position in the cursor of the first slot after the one offset names
+static uint64_t dir_cursor_seek(const struct dir_cursor *cur, off_t offset){
+    uint64_t lo = 0;
+    uint64_t hi = cur->count;
+    uint64_t mid;
+    uint64_t after;
+
+    if(offset < DIR_COOKIE_BASE){
+        return 0;
+    }
+    after = (uint64_t)offset - DIR_COOKIE_BASE;
+    while(lo < hi){
+        mid = lo + (hi - lo) / 2;
+        if(cur->slots[mid] <= after){
+            lo = mid + 1;
+        }else{
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
 /** Open directory
  *
  * This method should check if the open operation is permitted for
@@ -1093,10 +1711,12 @@ int nphfuse_removexattr(const char *path, const char *name)
  *
  * Introduced in version 2.3
  */
+// The cursor readdir lists from is kept in fi->fh until releasedir
 int nphfuse_opendir(const char *path, struct fuse_file_info *fi){
     // char *filename, *dir;
     // extract_directory_file(&dir,&filename,path);
     npheap_store *inode = NULL;
+    struct dir_cursor *cur = NULL;
     log_msg("Entry into OPENDIR.\n");
     if(strcmp (path,"/")==0){
         inode = getRootDirectory();
@@ -1105,24 +1725,15 @@ int nphfuse_opendir(const char *path, struct fuse_file_info *fi){
             log_msg("Root directory not found in opendir.\n");
             return -ENOENT;
         }
-        else
-        {
-            //Check if accessibilty can be given
-            int flag = checkAccess(inode);
-            //Deny the access
-            log_msg("Root access %d (if 1 then yes)",flag);
-            if(flag == 0){
-                return -EACCES;
-            }
-            return 0;
-        }
     }
+    else
+    {
+        inode = retrieve_inode(path);
 
-    inode = retrieve_inode(path);
-
-    if(inode == NULL){
-        log_msg("Couldn't find path - %s - in OPENDIR.\n", path);
-        return -ENOENT;
+        if(inode == NULL){
+            log_msg("Couldn't find path - %s - in OPENDIR.\n", path);
+            return -ENOENT;
+        }
     }
     //Check Accessibility
     int flag1 = checkAccess(inode);
@@ -1132,6 +1743,12 @@ int nphfuse_opendir(const char *path, struct fuse_file_info *fi){
     if(flag1 == 0){
         return -EACCES;
     }
+
+    cur = calloc(1, sizeof(struct dir_cursor));
+    if(cur == NULL){
+        return -ENOMEM;
+    }
+    fi->fh = (uint64_t)(uintptr_t)cur;
     //else return correct value
     log_msg("Exit into OPENDIR.\n");
     return 0;
@@ -1158,54 +1775,79 @@ int nphfuse_opendir(const char *path, struct fuse_file_info *fi){
  *
  * Introduced in version 2.3
  */
-
+// Mode 2: each call lists one buffer's worth from the opendir cursor.
+// Reading from offset 0 gathers the entries, so a rewound listing
+// also sees the names created since.
 int nphfuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
 	       struct fuse_file_info *fi){
     
     npheap_store *temp = NULL;
-    struct dirent de;
-    uint64_t u_offset = 2;
-    uint64_t index = 0;
-    char dir[236];
-    char filename[128];
+    npheap_store *inode = NULL;
+    struct dir_cursor *cur = NULL;
+    struct dir_cursor once;
+    struct stat st;
+    uint64_t pos = 0;
+    uint64_t slot = 0;
+    int err = 0;
 
     log_msg("Into READDIR function.\n");
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
-
-    int extract = extract_directory_file(dir, filename, path);
-    log_msg("In readdir: directory - %s and file - %s for path %s \n", dir, filename,path);
-    if(extract == 1){
-        return -ENOENT;
+    cur = (struct dir_cursor *)(uintptr_t)fi->fh;
+    if(cur == NULL){
+        //Not opened through opendir; gather the entries for this call
+        memset(&once, 0, sizeof(once));
+        cur = &once;
+    }
+    if(offset == 0 || !cur->filled){
+        err = dir_cursor_fill(cur, path);
+        if(err != 0){
+            goto out;
+        }
     }
 
-    for(u_offset = 2; u_offset < 502; u_offset++){
-        temp= (npheap_store *)npheap_alloc(npheap_fd, u_offset, BLOCK_SIZE);
-        if(temp==NULL){
-            log_msg("NPheap alloc failed for offset : %d\n",u_offset);
+    if(offset < 1){
+        inode = strcmp(path, "/") == 0 ? getRootDirectory() : retrieve_inode(path);
+        if(filler(buf, ".", inode != NULL ? &inode->mystat : NULL, 1) != 0){
+            goto out;
         }
+    }
+    if(offset < 2 && filler(buf, "..", NULL, 2) != 0){
+        goto out;
+    }
 
-        for (index = 0; index < 16; index++){
-            //log_msg("Search directory %s and file %s\n", dir, filename);
-            //log_msg("Current directory %s and file %s\n", temp[index].dirname, temp[index].filename);
-            if ((strcmp(temp[index].dirname, path) == 0) && (strcmp(temp[index].filename, "/")!=0)){
-                /* Entry found in inode block */
-                log_msg("Adding %s into dirent.\n", temp[index].filename);
-                memset(&de, 0, sizeof(de));
-                strcpy(de.d_name, temp[index].filename);
-                if(filler(buf, temp[index].filename, NULL, 0) !=0){
-                    return -ENOMEM;
-                }
-            }
+    for(pos = dir_cursor_seek(cur, offset); pos < cur->count; pos++){
+        slot = cur->slots[pos];
+        temp = inode_slot(slot);
+        //Gone or moved away since the listing was gathered
+        if(temp == NULL || strcmp(temp->dirname, path) != 0 || temp->filename[0] == '\0'){
+            continue;
+        }
+        log_msg("Adding %s into dirent.\n", temp->filename);
+        //Hand the attributes over with the name, and remember the
+        //slot for the getattr that usually follows
+        inode = inode_resolve(temp);
+        if(inode != NULL){
+            memcpy(&st, &inode->mystat, sizeof(struct stat));
+            time_stat(inode, &st);
+        }
+        hint_put(path, temp->filename, slot);
+        if(filler(buf, temp->filename, inode != NULL ? &st : NULL,
+                  (off_t)(slot + DIR_COOKIE_BASE)) != 0){
+            break;
         }
     }
-    return 0;
+out:
+    if(cur == &once){
+        free(once.slots);
+    }
+    return err;
 }
 
 /** Release directory
  */
 int nphfuse_releasedir(const char *path, struct fuse_file_info *fi){
     log_msg("Into release dir \n");
+    dir_cursor_free((struct dir_cursor *)(uintptr_t)fi->fh);
+    fi->fh = 0;
     return 0;
 }
 
@@ -1218,8 +1860,10 @@ int nphfuse_releasedir(const char *path, struct fuse_file_info *fi){
  */
 // when exactly is this called?  when a user calls fsync and it
 // happens to be a directory? ??? 
+// A directory's contents are inode slots, so even datasync needs metadata
 int nphfuse_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi){
-    return 0;
+    log_msg("Into FSYNCDIR for %s\n", path);
+    return ckpt_sync(0);
 }
 
 int nphfuse_access(const char *path, int mask){
@@ -1272,7 +1916,7 @@ int nphfuse_access(const char *path, int mask){
  * Introduced in version 2.5
  */
 int nphfuse_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi){
-    return -1;
+    return nphfuse_truncate(path, offset);
 }
 
 /**
@@ -1302,6 +1946,7 @@ int nphfuse_fgetattr(const char *path, struct stat *statbuf, struct fuse_file_in
         }else{
             log_msg("Everything worked fine\n");
             memcpy(statbuf, &inode->mystat, sizeof(struct stat));
+            time_stat(inode, statbuf);
             return 0;
         }
     }
@@ -1313,65 +1958,258 @@ int nphfuse_fgetattr(const char *path, struct stat *statbuf, struct fuse_file_in
 
     log_msg("Worked fine\n");
     memcpy(statbuf, &inode->mystat, sizeof(struct stat));
+    time_stat(inode, statbuf);
     return 0;
 }
 
-//Allocate the superblock and the inode
-static void initialAllocationNPheap(void){
-    uint64_t offset = 1;
-    npheap_store *npheap_dt = NULL;
-    char *block_dt = NULL;
-    npheap_store *head_dir = NULL;
+/**
+ * Allocates space for an open file
+ *
+ * This function ensures that required space is allocated for specified
+ * file.  If this function returns success then any subsequent write
+ * request to specified range is guaranteed not to fail because of lack
+ * of space on the file system media.
+ *
+ * Introduced in version 2.9.1
+ */
+// Besides plain preallocation, FALLOC_FL_KEEP_SIZE reserves blocks past
+// the end of the file and FALLOC_FL_PUNCH_HOLE gives blocks back
+int nphfuse_fallocate(const char *path, int mode, off_t offset, off_t length,
+                      struct fuse_file_info *fi){
+    npheap_store *inode = NULL;
+    npheap_store staged;
+    struct jtx tx;
+    struct timespec now;
+    uint64_t end = offset + length;
+    uint64_t oldsize = 0;
+    uint64_t first = 0;
+    uint64_t last = 0;
+    int commit_err = 0;
+    int err = 0;
+
+    log_msg("Into FALLOCATE for %s, mode %x\n", path, mode);
+    if(offset < 0 || length <= 0){
+        return -EINVAL;
+    }
+    if((mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) != 0 ||
+       (mode & FALLOC_FL_PUNCH_HOLE && !(mode & FALLOC_FL_KEEP_SIZE))){
+        return -EOPNOTSUPP;
+    }
+    if(snapshot_path(path)){
+        return -EROFS;
+    }
+
+    inode = retrieve_inode(path);
+    if(inode == NULL){
+        return -ENOENT;
+    }
+    if(!S_ISREG(inode->mystat.st_mode)){
+        return -ENODEV;
+    }
+    if(checkAccess(inode) == 0){
+        log_msg("Cannot access the file in fallocate.\n");
+        return -EACCES;
+    }
+    oldsize = inode->mystat.st_size;
+    if(!(mode & FALLOC_FL_KEEP_SIZE) && end > oldsize){
+        err = quota_resize(inode, oldsize, end);
+        if(err != 0){
+            return err;
+        }
+    }
+
+    snapshot_hold();
+    jtx_begin(&tx);
+    staged = *inode;
+    now = time_now();
+
+    if(mode & FALLOC_FL_PUNCH_HOLE){
+        //Whole blocks become holes, the ragged ends are zeroed in place
+        first = (offset + data_block_size - 1)/data_block_size;
+        last = end/data_block_size;
+        //Zeroing is not undone if tx fails, so stop at the first error
+        if(first < last){
+            err = bmap_zero(&staged, offset, first*data_block_size, &tx);
+            if(err == 0){
+                bmap_punch(&staged, first, last - first, &tx);
+                err = tx.err;
+            }
+            if(err == 0){
+                err = bmap_zero(&staged, last*data_block_size, end, &tx);
+            }
+        }else{
+            err = bmap_zero(&staged, offset, end, &tx);
+        }
+        jtx_field(&tx, inode, mystat.st_mtim, now);
+    }else{
+        //Every block of the range in one batched allocation
+        err = bmap_fill(&staged, offset/data_block_size,
+                        (end - 1)/data_block_size - offset/data_block_size + 1, &tx);
+        if(err == 0 && !(mode & FALLOC_FL_KEEP_SIZE) && end > inode->mystat.st_size){
+            jtx_field(&tx, inode, mystat.st_size, end);
+            ckpt_need_meta();
+        }
+    }
+
+    if(staged.offset != inode->offset || staged.height != inode->height){
+        jtx_field(&tx, inode, offset, staged.offset);
+        jtx_field(&tx, inode, height, staged.height);
+    }
+    jtx_field(&tx, inode, mystat.st_ctim, now);
+    //A failed punch left its error in tx, so nothing of it commits
+    commit_err = jtx_commit(&tx);
+    if(err == 0){
+        err = commit_err;
+    }
+    snapshot_unhold();
+    if(err != 0 && !(mode & FALLOC_FL_KEEP_SIZE) && end > oldsize){
+        quota_resize(inode, end, oldsize);
+    }
+    log_msg("Exiting FALLOCATE.\n");
+    return err;
+}
+
+/**
+ * Ioctl
+ *
+ * flags will have FUSE_IOCTL_COMPAT set for 32bit ioctls in
+ * 64bit environment.  The size and direction of data is
+ * determined by _IOC_*() decoding of cmd.  For _IOC_NONE,
+ * data will be NULL, for _IOC_WRITE data is out area, for
+ * _IOC_READ in area and if both are set in/out area.  In all
+ * non-NULL cases, the area is of _IOC_SIZE(cmd) bytes.
+ *
+ * Introduced in version 2.8
+ */
+// Make the file at path a copy of part of another, see NPHFS_IOC_CLONE
+static int ioctl_clone(const char *path, struct nphfs_clone_range *req){
+    npheap_store *src = NULL;
+    npheap_store *dst = NULL;
 
+    if(snapshot_path(path)){
+        return -EROFS;
+    }
 
-    npheap_fd = open(nphfuse_data->device_name, O_RDWR);
-    log_msg("Allocation started for %d.\n", offset);
+    req->source[sizeof(req->source) - 1] = '\0';
+    dst = retrieve_inode(path);
+    src = retrieve_inode(req->source);
+    if(dst == NULL || src == NULL){
+        return -ENOENT;
+    }
+    if(checkAccess(dst) == 0 || checkAccess(src) == 0){
+        log_msg("Cannot access the files to clone.\n");
+        return -EACCES;
+    }
+    return clone_range(src, dst, req->src_offset, req->dst_offset, req->length);
+}
 
-    if(npheap_getsize(npheap_fd, offset) == 0){
-        log_msg("Allocating root block into NPHeap!\n");
-        block_dt = (char *)npheap_alloc(npheap_fd,offset, 8192);
+//The inode attribute flags of lsattr and chattr; only FS_COMPR_FL is
+//kept, as NPH_INODE_COMPRESS
+static int ioctl_flags(const char *path, unsigned int cmd, void *data){
+    npheap_store *inode = NULL;
+    struct jtx tx;
+    struct timespec now;
+    uint64_t flags = 0;
+    int attr = 0;
 
-        if(block_dt == NULL){
-            log_msg("Allocation of root block failed.\n");
-            return;
-        }
-        memset(block_dt,0, npheap_getsize(npheap_fd, offset));
-        memset(blk_array,0, sizeof(char *) * 9999);
-        memset(&dt_link,0,sizeof(dt_link));
+    inode = strcmp(path, "/") == 0 ? getRootDirectory() : retrieve_inode(path);
+    if(inode == NULL){
+        return -ENOENT;
+    }
+    //chattr passes an int, whatever size the ioctl number says
+    if(cmd == FS_IOC_GETFLAGS){
+        attr = inode->flags & NPH_INODE_COMPRESS ? FS_COMPR_FL : 0;
+        memcpy(data, &attr, sizeof(attr));
+        return 0;
+    }
+
+    if(snapshot_path(path)){
+        return -EROFS;
+    }
+    if(checkAccess(inode) == 0){
+        log_msg("Cannot access the file to change its flags.\n");
+        return -EACCES;
+    }
+    memcpy(&attr, data, sizeof(attr));
+    if(attr & ~FS_COMPR_FL){
+        return -EOPNOTSUPP;
+    }
+    flags = inode->flags & ~(uint64_t)NPH_INODE_COMPRESS;
+    if(attr & FS_COMPR_FL){
+        flags |= NPH_INODE_COMPRESS;
+    }
+    if(flags == inode->flags){
+        return 0;
     }
 
-    log_msg("Allocation done for npheap %d.\n", npheap_getsize(npheap_fd, offset));
-    for(offset = 2; offset < 502; offset++){
-        //log_msg("Inode allocation for %d offset\n", offset);
-        if(npheap_getsize(npheap_fd, offset)==0){
-            block_dt = npheap_alloc(npheap_fd, offset, BLOCK_SIZE);
-            memset(block_dt, 0, npheap_getsize(npheap_fd, offset));
+    now = time_now();
+    jtx_begin(&tx);
+    jtx_field(&tx, inode, flags, flags);
+    jtx_field(&tx, inode, mystat.st_ctim, now);
+    if(jtx_commit(&tx) != 0){
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+// FUSE 2.9 has no copy_file_range, and the kernel keeps FICLONE to
+// itself, so block sharing copies come in through NPHFS_IOC_CLONE.
+// chattr +c and -c reach the compression flag through the generic
+// flags ioctls, and NPHFS_IOC_STATS hands out the counters.
+int nphfuse_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+                  unsigned int flags, void *data){
+    log_msg("Into IOCTL %x for %s\n", cmd, path);
+    switch((unsigned int)cmd){
+    case NPHFS_IOC_CLONE:
+        return ioctl_clone(path, (struct nphfs_clone_range *)data);
+    case FS_IOC_GETFLAGS:
+    case FS_IOC_SETFLAGS:
+        return ioctl_flags(path, (unsigned int)cmd, data);
+    case NPHFS_IOC_STATS:
+        compress_stats((struct nphfs_stats *)data);
+        dedup_stats((struct nphfs_stats *)data);
+        csum_stats((struct nphfs_stats *)data);
+        tier_stats((struct nphfs_stats *)data);
+        heap_stats((struct nphfs_stats *)data);
+        time_stats((struct nphfs_stats *)data);
+        return 0;
+    case NPHFS_IOC_QUOTA:
+        quota_report((struct nphfs_quota_report *)data);
+        return 0;
+    case NPHFS_IOC_SETQUOTA:
+        //Only the user who mounted the filesystem sets limits
+        if(fuse_get_context()->uid != getuid()){
+            return -EPERM;
         }
-        log_msg("Inode allocation for %d offset and %d size\n", offset,(npheap_getsize(npheap_fd, offset)));
-    }
-
-    head_dir = getRootDirectory();
-    log_msg("Assigning stat values\n");
-    strcpy(head_dir->dirname, "/");
-    strcpy(head_dir->filename, "/");
-    head_dir->mystat.st_ino = inode_off;
-    inode_off++;
-    head_dir->mystat.st_mode = S_IFDIR | 0755;
-    head_dir->mystat.st_nlink = 2;
-    head_dir->mystat.st_size = npheap_getsize(npheap_fd,1);
-    head_dir->mystat.st_uid = getuid();
-    head_dir->mystat.st_gid = getgid();
-
-    return;
+        return quota_set((const struct nphfs_quota *)data);
+    }
+    return -ENOTTY;
 }
 
+//The scrub thread found data block id damaged
+static void scrub_report(uint64_t id){
+    log_msg("Scrub: data block %llu does not match its checksum.\n", (unsigned long long)id);
+}
 
 void *nphfuse_init(struct fuse_conn_info *conn){
     log_msg("\nnphfuse_init()\n");
     log_conn(conn);
     log_fuse_context(fuse_get_context());
     log_msg("Into init function \n");
-    initialAllocationNPheap();
+
+    //main() already mapped the superblock mkfs.nphfs wrote
+    log_msg("Data block size is %llu, %llu inodes, %llu data blocks.\n",
+            (unsigned long long)data_block_size,
+            (unsigned long long)superblock->inode_count,
+            (unsigned long long)superblock->data_blocks);
+
+    //Started here, after fuse_main() has daemonized
+    if(scrub_start(NPHFS_DATA->scrub_secs, scrub_report) != 0){
+        log_msg("Couldn't start the scrub thread.\n");
+    }
+    if(tier_start() != 0){
+        log_msg("Couldn't start the spill thread.\n");
+    }
 
     return NPHFS_DATA;
 }
@@ -1385,4 +2223,12 @@ void *nphfuse_init(struct fuse_conn_info *conn){
  */
 void nphfuse_destroy(void *userdata){
     log_msg("\nnphfuse_destroy(userdata=0x%08x)\n", userdata);
+    scrub_stop();
+    tier_stop();
+    if(time_flush(NULL) != 0){
+        log_msg("Couldn't write every time lazytime kept back.\n");
+    }
+    //Leave an up to date recovery point behind
+    ckpt_close();
+    tier_close();
 }
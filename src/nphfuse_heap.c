@@ -0,0 +1,497 @@
+/*
+  NPHeap File System - npheap object cache and data allocator
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Every npheap_alloc() call maps the object again, so the filesystem
+  keeps the address of each object it has touched in a sparse map and
+  hands that out instead.  New data objects are handed out from the
+  data bitmap, so allocation never has to probe the device to find a
+  free offset.
+
+  A filesystem can span several npheap devices.  Everything before the
+  data area lives on the first one; data objects go round-robin over
+  all of them by their place in the data area, so a file's consecutive
+  blocks land on different devices and so does its block map.  Each
+  device has its own object cache and lock.
+
+  Data objects moved out to the spill file (nphfuse_tier.c) are brought
+  back here, the first time they are looked up.
+
+  npheap_getsize is an ioctl, so the size of each object up to the end
+  of the data area is asked for at most once and kept in a table.
+  When super_load calls heap_scan only the objects the bitmaps say are
+  in use are sized; the rest are asked for the first time they are
+  looked up, so a mount costs what the filesystem holds rather than
+  what it could.  Every object the filesystem makes or deletes goes
+  through here and updates the table, so nothing needs to ask the
+  device twice.
+*/
+
+#include "nphfuse_extra.h"
+#include <npheap.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+int npheap_fd = -1;
+
+struct heap_device {
+    int fd;
+    struct nph_map mapped;
+    pthread_mutex_t lock;
+};
+
+static struct heap_device devices[HEAP_MAX_DEVICES] = {
+    [0 ... HEAP_MAX_DEVICES - 1] = { .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER },
+};
+static int device_count = 1;
+
+// Size of every object below table_end as npheap_getsize reports it,
+// 0 for one that does not exist and SIZE_UNKNOWN for one not asked
+// about yet.  Each entry changes under the lock of the object's
+// device, apart from an unknown one being filled in.
+#define SIZE_UNKNOWN  UINT32_MAX
+
+static uint32_t *sizes = NULL;
+static uint64_t table_end = 0;
+
+static struct {
+    uint64_t scanned;
+    uint64_t getsize;
+} stats;
+
+// Forget every mapping and size; the objects stay on their devices
+void heap_forget(void)
+{
+    int i;
+
+    for(i = 0; i < HEAP_MAX_DEVICES; i++){
+        pthread_mutex_lock(&devices[i].lock);
+        nph_map_destroy(&devices[i].mapped);
+        pthread_mutex_unlock(&devices[i].lock);
+    }
+    free(sizes);
+    sizes = NULL;
+    table_end = 0;
+}
+
+// Work on the single device fd
+void heap_init(int fd)
+{
+    heap_forget();
+    npheap_fd = fd;
+    devices[0].fd = fd;
+    device_count = 1;
+}
+
+// Open a comma separated list of npheap devices, the first of which
+// holds the metadata.  Returns how many there are, or -1 with errno
+// set and *bad naming the device that could not be opened.
+int heap_open(const char *names, const char **bad)
+{
+    static char name[PATH_MAX];
+    int fds[HEAP_MAX_DEVICES];
+    size_t len;
+    int count = 0;
+    int err = 0;
+    int i;
+
+    do{
+        len = strcspn(names, ",");
+        snprintf(name, sizeof(name), "%.*s", (int)len, names);
+        if(count == HEAP_MAX_DEVICES){
+            err = E2BIG;
+        }else if(len == 0 || len >= sizeof(name)){
+            err = len == 0 ? ENOENT : ENAMETOOLONG;
+        }else if((fds[count] = open(name, O_RDWR)) < 0){
+            err = errno;
+        }
+        if(err != 0){
+            while(count > 0){
+                close(fds[--count]);
+            }
+            if(bad != NULL){
+                *bad = name;
+            }
+            errno = err;
+            return -1;
+        }
+        count++;
+        names += len;
+    }while(*names++ == ',');
+
+    heap_init(fds[0]);
+    for(i = 1; i < count; i++){
+        devices[i].fd = fds[i];
+    }
+    device_count = count;
+    return count;
+}
+
+// Close every device opened by heap_open
+void heap_close(void)
+{
+    int i;
+
+    heap_forget();
+    for(i = 0; i < device_count; i++){
+        close(devices[i].fd);
+        devices[i].fd = -1;
+    }
+    npheap_fd = -1;
+    device_count = 1;
+}
+
+int heap_devices(void)
+{
+    return device_count;
+}
+
+// Device holding object id
+static struct heap_device *heap_device(uint64_t id)
+{
+    if(device_count == 1 || superblock == NULL || id < superblock->data_start){
+        return &devices[0];
+    }
+    return &devices[(id - superblock->data_start) % device_count];
+}
+
+// npheap file descriptor to pass for object id
+int heap_fd(uint64_t id)
+{
+    return heap_device(id)->fd;
+}
+
+// npheap hands out whole pages, and reports the size it mapped
+static uint64_t page_round(uint64_t size)
+{
+    uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+
+    return (size + page - 1) / page * page;
+}
+
+// Bytes in object id on its device, 0 if it is not there
+static uint64_t object_size(struct heap_device *dev, uint64_t id)
+{
+    uint32_t unknown = SIZE_UNKNOWN;
+    uint32_t size;
+
+    if(id < table_end){
+        size = __atomic_load_n(&sizes[id], __ATOMIC_RELAXED);
+        if(size != SIZE_UNKNOWN){
+            return size;
+        }
+    }
+    stat_add(&stats.getsize, 1);
+    size = (uint32_t)npheap_getsize(dev->fd, id);
+    // Anything the table learnt since the ioctl is newer than its answer
+    if(id < table_end &&
+       !__atomic_compare_exchange_n(&sizes[id], &unknown, size, 0, __ATOMIC_RELAXED,
+                                    __ATOMIC_RELAXED)){
+        return unknown;
+    }
+    return size;
+}
+
+static void object_sized(uint64_t id, uint64_t size)
+{
+    if(id < table_end){
+        __atomic_store_n(&sizes[id], (uint32_t)size, __ATOMIC_RELAXED);
+    }
+}
+
+// Start the size table, asking the devices only about the objects in
+// use: inode table objects holding a live inode and data objects whose
+// bit is set.  Without the memory for the table each lookup goes to
+// the device as before.
+void heap_scan(void)
+{
+    uint64_t end = superblock->data_start + superblock->data_blocks;
+    uint32_t *table;
+    uint64_t scanned = 0;
+    uint64_t bit;
+    uint64_t id;
+
+    free(sizes);
+    sizes = NULL;
+    table_end = 0;
+    table = (uint32_t *)malloc(end * sizeof(uint32_t));
+    if(table == NULL){
+        return;
+    }
+    memset(table, 0xff, end * sizeof(uint32_t));
+    table[0] = 0;
+    sizes = table;
+    table_end = end;
+
+    for(bit = bitmap_next(&inode_bitmap, 0); bit < superblock->inode_count;
+        bit = bitmap_next(&inode_bitmap, (bit / TOTAL_BLOCKS + 1) * TOTAL_BLOCKS)){
+        id = INODE_BLOCK_START + bit / TOTAL_BLOCKS;
+        if(table[id] == SIZE_UNKNOWN){
+            table[id] = npheap_getsize(heap_fd(id), id);
+            scanned++;
+        }
+    }
+    for(bit = bitmap_next(&data_bitmap, 0); bit < superblock->data_blocks;
+        bit = bitmap_next(&data_bitmap, bit + 1)){
+        id = superblock->data_start + bit;
+        table[id] = npheap_getsize(heap_fd(id), id);
+        scanned++;
+    }
+    // The bitmap objects read on the way were sized by lookups
+    stats.scanned = scanned + stats.getsize;
+    stats.getsize = 0;
+}
+
+static void *heap_map_locked(struct heap_device *dev, uint64_t id, uint64_t size)
+{
+    uint64_t addr = 0;
+    uint64_t spilled;
+    uint64_t had;
+    void *ptr;
+
+    if(nph_map_get(&dev->mapped, id, &addr)){
+        return (void *)(uintptr_t)addr;
+    }
+    spilled = tier_size(id);
+    if(spilled != 0){
+        ptr = tier_fault(dev->fd, id);
+        // Brought back into the heap, or only mapped from the file
+        if(ptr != NULL && tier_size(id) == 0){
+            object_sized(id, page_round(spilled));
+        }
+    }else{
+        had = object_size(dev, id);
+        ptr = npheap_alloc(dev->fd, id, size);
+        if(ptr == NULL && superblock != NULL && id >= superblock->data_start){
+            tier_full();
+        }
+        if(ptr != NULL && had == 0){
+            object_sized(id, page_round(size));
+        }
+    }
+    if(ptr == NULL){
+        return NULL;
+    }
+    // If the cache cannot grow the mapping is still usable, just not remembered
+    nph_map_put(&dev->mapped, id, (uint64_t)(uintptr_t)ptr);
+    return ptr;
+}
+
+// Map object id, creating it with the given size if it does not exist yet
+void *heap_map(uint64_t id, uint64_t size)
+{
+    struct heap_device *dev;
+    void *ptr;
+
+    if(id == 0){
+        return NULL;
+    }
+    dev = heap_device(id);
+    pthread_mutex_lock(&dev->lock);
+    ptr = heap_map_locked(dev, id, size);
+    pthread_mutex_unlock(&dev->lock);
+    tier_touch(id);
+    return ptr;
+}
+
+// Map an object that must already exist; returns NULL if it does not
+void *heap_get(uint64_t id)
+{
+    struct heap_device *dev;
+    uint64_t addr = 0;
+    uint64_t size;
+    void *ptr = NULL;
+
+    if(id == 0){
+        return NULL;
+    }
+    tier_touch(id);
+    dev = heap_device(id);
+    pthread_mutex_lock(&dev->lock);
+    if(nph_map_get(&dev->mapped, id, &addr)){
+        pthread_mutex_unlock(&dev->lock);
+        return (void *)(uintptr_t)addr;
+    }
+    size = object_size(dev, id);
+    if(size != 0 || tier_size(id) != 0){
+        ptr = heap_map_locked(dev, id, size);
+    }
+    pthread_mutex_unlock(&dev->lock);
+    return ptr;
+}
+
+// Bytes in object id, wherever it is; 0 if it does not exist
+uint64_t heap_size(uint64_t id)
+{
+    uint64_t size = object_size(heap_device(id), id);
+
+    return size != 0 ? size : tier_size(id);
+}
+
+// Make object id at a bit just taken from the data bitmap.  A replayed
+// journal or a crash can leave an object behind at a free bit, of
+// any size, so one that is there is deleted first.
+static void *heap_fresh(uint64_t id, uint64_t size)
+{
+    if(heap_size(id) != 0){
+        heap_drop(id);
+    }
+    return heap_map(id, size);
+}
+
+// Allocate a fresh zeroed object from the data area; returns its id or 0
+uint64_t heap_new(uint64_t size, void **addr)
+{
+    int64_t bit;
+    uint64_t id;
+    void *ptr;
+
+    bit = bitmap_alloc(&data_bitmap);
+    if(bit < 0){
+        return 0;
+    }
+    id = superblock->data_start + (uint64_t)bit;
+
+    ptr = heap_fresh(id, size);
+    if(ptr == NULL){
+        bitmap_clear(&data_bitmap, (uint64_t)bit);
+        return 0;
+    }
+
+    memset(ptr, 0, size);
+    ckpt_dirty(id);
+    csum_set(id, 0);
+    if(addr != NULL){
+        *addr = ptr;
+    }
+    return id;
+}
+
+// Allocate up to n fresh zeroed objects from the data area with a
+// single pass over the data bitmap; returns how many ids were stored
+uint64_t heap_new_many(uint64_t size, uint64_t n, uint64_t *ids)
+{
+    uint64_t got;
+    uint64_t i;
+    uint64_t kept = 0;
+    void *ptr;
+
+    got = bitmap_alloc_many(&data_bitmap, n, ids);
+    for(i = 0; i < got; i++){
+        ptr = heap_fresh(superblock->data_start + ids[i], size);
+        if(ptr == NULL){
+            bitmap_clear(&data_bitmap, ids[i]);
+            continue;
+        }
+        memset(ptr, 0, size);
+        ids[kept] = superblock->data_start + ids[i];
+        ckpt_dirty(ids[kept]);
+        csum_set(ids[kept], 0);
+        kept++;
+    }
+    return kept;
+}
+
+// Unmap object id and delete it from its device.  Called with the
+// device lock held.
+static void delete_locked(struct heap_device *dev, uint64_t id)
+{
+    uint64_t addr = 0;
+    uint64_t size;
+    uint64_t spilled;
+
+    size = object_size(dev, id);
+    spilled = tier_size(id);
+    if(nph_map_get(&dev->mapped, id, &addr)){
+        nph_map_remove(&dev->mapped, id);
+        if(size != 0 || spilled != 0){
+            munmap((void *)(uintptr_t)addr, size != 0 ? size : spilled);
+        }
+    }
+    if(size != 0){
+        npheap_delete(dev->fd, id);
+        object_sized(id, 0);
+    }
+    if(spilled != 0){
+        tier_forget(id);
+    }
+}
+
+// Delete object id and nothing else; for laying out or restoring a
+// heap, where no checksum or cache refers to it yet
+void heap_delete(uint64_t id)
+{
+    struct heap_device *dev = heap_device(id);
+
+    pthread_mutex_lock(&dev->lock);
+    delete_locked(dev, id);
+    pthread_mutex_unlock(&dev->lock);
+}
+
+// Unmap and delete object id but leave its data bitmap bit set
+void heap_drop(uint64_t id)
+{
+    if(id == 0){
+        return;
+    }
+    // The id may come back as a different block; the scrub thread holds
+    // the checksum lock while it looks at one, so it is done first
+    zcache_forget(id);
+    csum_forget(id);
+    heap_delete(id);
+}
+
+// Move data object id out to the spill file.  Only the tier's thread
+// calls this, while no operation can hold a pointer into the object.
+int heap_evict(uint64_t id)
+{
+    struct heap_device *dev;
+    uint64_t size;
+    void *ptr;
+    int err;
+
+    dev = heap_device(id);
+    pthread_mutex_lock(&dev->lock);
+    size = object_size(dev, id);
+    ptr = size != 0 ? heap_map_locked(dev, id, size) : NULL;
+    if(ptr == NULL){
+        pthread_mutex_unlock(&dev->lock);
+        return -ENOENT;
+    }
+    err = tier_store(id, ptr, size);
+    if(err == 0){
+        nph_map_remove(&dev->mapped, id);
+        munmap(ptr, size);
+        npheap_delete(dev->fd, id);
+        object_sized(id, 0);
+    }
+    pthread_mutex_unlock(&dev->lock);
+    return err;
+}
+
+void heap_free(uint64_t id)
+{
+    if(id == 0){
+        return;
+    }
+    heap_drop(id);
+    if(id >= superblock->data_start){
+        bitmap_clear(&data_bitmap, id - superblock->data_start);
+    }
+}
+
+// Copy out the counters since the scan
+void heap_stats(struct nphfs_stats *out)
+{
+    out->heap_scanned = stats.scanned;
+    out->heap_getsize = __atomic_load_n(&stats.getsize, __ATOMIC_RELAXED);
+}
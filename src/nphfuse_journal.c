@@ -0,0 +1,572 @@
+/*
+  NPHeap File System - metadata journal
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Metadata updates are collected into a transaction in process memory
+  (inode slot bytes, block map slots, objects to free and inode slots
+  to release), appended to a redo log held in the npheap objects mkfs
+  reserved for it, and only applied in place once the batch holding
+  them has a commit record behind it.  After a crash the log is
+  replayed from the last applied batch, so an operation is either seen
+  whole or not at all.
+
+  Commits are grouped: the first thread to reach jtx_commit() while no
+  commit is running becomes the leader, seals every transaction queued
+  so far behind a single commit record, applies them in order and
+  wakes the others.  Threads that arrive while it works queue up for
+  the next batch, so concurrent operations share one commit.
+
+  Freed objects and released inode slots only go back to their bitmaps
+  after the batch is marked applied, and the same goes for references
+  dropped from shared objects.  Until then nothing can reuse them and
+  no count has moved, which keeps replaying a half-applied batch
+  harmless.
+
+  Allocations are not journaled: a bit set by an operation that never
+  commits is only a leaked block or slot, which fsck.nphfs gives back.
+*/
+
+#include "nphfuse_extra.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define JOURNAL_MAGIC  0x4c4e524a5048504eULL
+#define JREC_MAGIC     0x4a524543
+
+enum {
+    JREC_BYTES = 1,     // id, arg = byte offset, payload = new contents
+    JREC_FREE,          // id = subtree root, arg = height
+    JREC_ICLEAR,        // id = inode slot to release
+    JREC_COMMIT         // id = bytes in the batch, arg = checksum of them
+};
+
+// Journal header, at the start of superblock->journal_start.  The ring
+// itself fills the remaining journal objects.
+struct jheader {
+  uint64_t magic;
+  uint64_t head;        // ring position of the first batch not yet applied
+  uint64_t seq;         // sequence number expected at head
+};
+
+struct jrec {
+  uint32_t magic;
+  uint32_t type;
+  uint64_t seq;
+  uint64_t id;
+  uint64_t arg;
+  uint64_t len;         // payload bytes, padded to 8 in the ring
+};
+
+// Slots released by a batch, bit 63 marks an inode slot
+#define JREL_INODE  (1ULL << 63)
+
+struct jrelease {
+  uint64_t *v;
+  size_t n;
+  size_t cap;
+  struct nph_map unref;   // shared object -> references dropped so far
+};
+
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_cond = PTHREAD_COND_INITIALIZER;
+static struct jheader *jhdr = NULL;
+static uint64_t ring_size = 0;
+static uint64_t tail;               // next free ring position
+static uint64_t open_seq;           // sequence number of the batch being filled
+static uint64_t open_start;         // where that batch starts in the ring
+static uint64_t open_sum;           // running checksum of that batch
+static struct jtx *open_first = NULL;
+static struct jtx *open_last = NULL;
+static int committing = 0;
+static struct jrelease released;
+static const char zero_pad[8];
+
+static uint64_t jrec_stride(uint64_t len)
+{
+    return sizeof(struct jrec) + ((len + 7) & ~7ULL);
+}
+
+static uint64_t fnv_add(uint64_t sum, const void *buf, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+
+    while(len-- > 0){
+        sum ^= *p++;
+        sum *= 0x100000001b3ULL;
+    }
+    return sum;
+}
+
+#define FNV_INIT  0xcbf29ce484222325ULL
+
+// Copy len bytes between buf and the ring at logical position pos
+static int ring_copy(uint64_t pos, void *buf, uint64_t len, int to_ring)
+{
+    char *p = (char *)buf;
+    uint64_t phys;
+    uint64_t chunk;
+    char *obj;
+
+    while(len > 0){
+        phys = pos % ring_size;
+        chunk = BLOCK_SIZE - phys % BLOCK_SIZE;
+        if(chunk > len){
+            chunk = len;
+        }
+        obj = (char *)heap_map(superblock->journal_start + 1 + phys / BLOCK_SIZE, BLOCK_SIZE);
+        if(obj == NULL){
+            return -1;
+        }
+        if(to_ring){
+            memcpy(obj + phys % BLOCK_SIZE, p, chunk);
+        }else{
+            memcpy(p, obj + phys % BLOCK_SIZE, chunk);
+        }
+        pos += chunk;
+        p += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+static void release_add(struct jrelease *rel, uint64_t v)
+{
+    uint64_t *grown;
+
+    if(rel->n == rel->cap){
+        grown = realloc(rel->v, (rel->cap ? rel->cap * 2 : 64) * sizeof(uint64_t));
+        if(grown == NULL){
+            // The slot stays marked in use; fsck.nphfs will find it
+            return;
+        }
+        rel->v = grown;
+        rel->cap = rel->cap ? rel->cap * 2 : 64;
+    }
+    rel->v[rel->n++] = v;
+}
+
+static void release_freed(uint64_t id, void *arg)
+{
+    release_add((struct jrelease *)arg, id);
+}
+
+// The share table is only updated in release_flush(), so references
+// this batch already dropped are counted off here
+static int release_unref(uint64_t id, void *arg)
+{
+    struct jrelease *rel = (struct jrelease *)arg;
+    uint64_t dropped = 0;
+
+    nph_map_get(&rel->unref, id, &dropped);
+    if(share_count(id) <= dropped){
+        return 1;
+    }
+    // If the map cannot grow the count stays high; fsck.nphfs lowers it
+    nph_map_put(&rel->unref, id, dropped + 1);
+    return 0;
+}
+
+static void release_unref_flush(uint64_t id, uint64_t dropped, void *arg)
+{
+    share_unref(id, dropped);
+}
+
+// Hand every slot a batch released back to its bitmap and drop its
+// references to shared objects
+static void release_flush(struct jrelease *rel)
+{
+    size_t i;
+    uint64_t v;
+
+    nph_map_foreach(&rel->unref, release_unref_flush, NULL);
+    nph_map_destroy(&rel->unref);
+
+    for(i = 0; i < rel->n; i++){
+        v = rel->v[i];
+        if(v & JREL_INODE){
+            bitmap_clear(&inode_bitmap, v & ~JREL_INODE);
+        }else if(v >= superblock->data_start){
+            bitmap_clear(&data_bitmap, v - superblock->data_start);
+        }
+    }
+    rel->n = 0;
+}
+
+// Apply one record in place.  Every record is idempotent so a batch
+// can be replayed any number of times.
+static void apply_record(const struct jrec *rec, const void *payload, struct jrelease *rel)
+{
+    struct bmap_releaser releaser = { release_unref, release_freed, rel };
+    char *obj;
+
+    switch(rec->type){
+    case JREC_BYTES:
+        if(rec->arg + rec->len > BLOCK_SIZE){
+            return;
+        }
+        obj = (char *)heap_get(rec->id);
+        if(obj != NULL){
+            memcpy(obj + rec->arg, payload, rec->len);
+            ckpt_dirty(rec->id);
+        }
+        break;
+    case JREC_FREE:
+        bmap_release(rec->id, rec->arg, &releaser);
+        break;
+    case JREC_ICLEAR:
+        release_add(rel, rec->id | JREL_INODE);
+        break;
+    }
+}
+
+static void apply_tx(struct jtx *tx, struct jrelease *rel)
+{
+    size_t pos = 0;
+    const struct jrec *rec;
+
+    while(pos < tx->len){
+        rec = (const struct jrec *)(tx->buf + pos);
+        apply_record(rec, rec + 1, rel);
+        pos += jrec_stride(rec->len);
+    }
+}
+
+void jtx_begin(struct jtx *tx)
+{
+    memset(tx, 0, sizeof(*tx));
+}
+
+static void jtx_add(struct jtx *tx, uint32_t type, uint64_t id, uint64_t arg,
+                    const void *payload, uint64_t len)
+{
+    uint64_t stride = jrec_stride(len);
+    struct jrec *rec;
+    char *grown;
+    size_t cap;
+
+    if(tx->err){
+        return;
+    }
+    if(tx->len + stride > tx->cap){
+        cap = tx->cap ? tx->cap : 1024;
+        while(cap < tx->len + stride){
+            cap *= 2;
+        }
+        grown = realloc(tx->buf, cap);
+        if(grown == NULL){
+            tx->err = -ENOMEM;
+            return;
+        }
+        tx->buf = grown;
+        tx->cap = cap;
+    }
+    rec = (struct jrec *)(tx->buf + tx->len);
+    memset(rec, 0, stride);
+    rec->magic = JREC_MAGIC;
+    rec->type = type;
+    rec->id = id;
+    rec->arg = arg;
+    rec->len = len;
+    if(len != 0){
+        memcpy(rec + 1, payload, len);
+    }
+    tx->len += stride;
+}
+
+// New contents for len bytes at offset off of metadata object id
+void jtx_bytes(struct jtx *tx, uint64_t id, uint64_t off, const void *src, uint64_t len)
+{
+    jtx_add(tx, JREC_BYTES, id, off, src, len);
+}
+
+// New contents for len bytes at offset off inside the slot of inode
+void jtx_inode(struct jtx *tx, const npheap_store *inode, size_t off, const void *src, size_t len)
+{
+    uint64_t index = inode->mystat.st_ino - ROOT_INO;
+
+    jtx_bytes(tx, inode_block(inode), (index % TOTAL_BLOCKS) * sizeof(npheap_store) + off, src, len);
+}
+
+// Drop a reference to the block map subtree of the given height rooted
+// at id, freeing it if that was the last
+void jtx_free(struct jtx *tx, uint64_t id, uint64_t height)
+{
+    if(id != 0){
+        jtx_add(tx, JREC_FREE, id, height, NULL, 0);
+    }
+}
+
+// Give inode slot index back to the inode bitmap
+void jtx_iclear(struct jtx *tx, uint64_t index)
+{
+    jtx_add(tx, JREC_ICLEAR, index, 0, NULL, 0);
+}
+
+// Throw away a transaction that will not be committed
+void jtx_abort(struct jtx *tx)
+{
+    free(tx->buf);
+    memset(tx, 0, sizeof(*tx));
+}
+
+// Seal the open batch behind a commit record, apply it and mark it
+// applied.  Called with journal_lock held and no commit running; the
+// lock is dropped while the batch is applied.
+static void journal_flush_locked(void)
+{
+    struct jtx *batch = open_first;
+    struct jtx *tx;
+    struct jrec commit;
+    uint64_t seq = open_seq;
+    uint64_t end;
+
+    committing = 1;
+    open_first = open_last = NULL;
+
+    memset(&commit, 0, sizeof(commit));
+    commit.magic = JREC_MAGIC;
+    commit.type = JREC_COMMIT;
+    commit.seq = seq;
+    commit.id = tail - open_start;
+    commit.arg = open_sum;
+    ring_copy(tail, &commit, sizeof(commit), 1);
+    tail += sizeof(commit);
+    end = tail;
+
+    open_seq = seq + 1;
+    open_start = tail;
+    open_sum = FNV_INIT;
+    pthread_mutex_unlock(&journal_lock);
+
+    // Everything before this point is the commit; applying may start
+    __sync_synchronize();
+    for(tx = batch; tx != NULL; tx = tx->next){
+        apply_tx(tx, &released);
+    }
+    __sync_synchronize();
+
+    // Bump seq before head: a crash in between skips a batch that was
+    // already applied instead of losing one that was not
+    jhdr->seq = seq + 1;
+    __sync_synchronize();
+    jhdr->head = end;
+    __sync_synchronize();
+    release_flush(&released);
+
+    pthread_mutex_lock(&journal_lock);
+    for(tx = batch; tx != NULL; tx = tx->next){
+        tx->done = 1;
+    }
+    committing = 0;
+    pthread_cond_broadcast(&journal_cond);
+}
+
+// Log tx, wait for its batch to commit and be applied.  Returns 0 or a
+// negative errno if the transaction could not be built.
+int jtx_commit(struct jtx *tx)
+{
+    uint64_t need = tx->len + sizeof(struct jrec);
+    struct jrelease direct;
+    struct jrec *rec;
+    size_t pos;
+    int err = tx->err;
+
+    if(err != 0 || tx->len == 0){
+        free(tx->buf);
+        return err;
+    }
+
+    if(jhdr == NULL || need > ring_size){
+        // No journal, or a transaction bigger than all of it: apply in place
+        memset(&direct, 0, sizeof(direct));
+        apply_tx(tx, &direct);
+        release_flush(&direct);
+        free(direct.v);
+        free(tx->buf);
+        return 0;
+    }
+
+    pthread_mutex_lock(&journal_lock);
+    while(tail + need - jhdr->head > ring_size){
+        // Ring is full of committed or queued records; push them through
+        if(!committing && open_first != NULL){
+            journal_flush_locked();
+        }else{
+            pthread_cond_wait(&journal_cond, &journal_lock);
+        }
+    }
+
+    for(pos = 0; pos < tx->len; pos += jrec_stride(rec->len)){
+        rec = (struct jrec *)(tx->buf + pos);
+        rec->seq = open_seq;
+    }
+    ring_copy(tail, tx->buf, tx->len, 1);
+    open_sum = fnv_add(open_sum, tx->buf, tx->len);
+    tail += tx->len;
+
+    tx->next = NULL;
+    if(open_last != NULL){
+        open_last->next = tx;
+    }else{
+        open_first = tx;
+    }
+    open_last = tx;
+
+    while(!tx->done){
+        if(!committing){
+            journal_flush_locked();
+        }else{
+            pthread_cond_wait(&journal_cond, &journal_lock);
+        }
+    }
+    pthread_mutex_unlock(&journal_lock);
+
+    free(tx->buf);
+    return 0;
+}
+
+// Hold off new batches, once the one in flight is applied, so the
+// metadata can be copied in a consistent state
+void journal_pause(void)
+{
+    pthread_mutex_lock(&journal_lock);
+    while(committing){
+        pthread_cond_wait(&journal_cond, &journal_lock);
+    }
+    committing = 1;
+    pthread_mutex_unlock(&journal_lock);
+}
+
+void journal_resume(void)
+{
+    pthread_mutex_lock(&journal_lock);
+    committing = 0;
+    pthread_cond_broadcast(&journal_cond);
+    pthread_mutex_unlock(&journal_lock);
+}
+
+// Read the record at pos into rec and payload (BLOCK_SIZE bytes);
+// returns 0 if it is a well-formed record of batch seq
+static int read_record(uint64_t pos, uint64_t seq, struct jrec *rec, void *payload)
+{
+    if(ring_copy(pos, rec, sizeof(*rec), 0) != 0){
+        return -1;
+    }
+    if(rec->magic != JREC_MAGIC || rec->seq != seq || rec->len > BLOCK_SIZE){
+        return -1;
+    }
+    if(rec->len != 0 && ring_copy(pos + sizeof(*rec), payload, rec->len, 0) != 0){
+        return -1;
+    }
+    return 0;
+}
+
+// Find committed batches that were never marked applied.  With apply
+// set they are applied and the journal is left empty.  Returns the
+// number of such batches, or -1 if the journal header is damaged.
+int journal_replay(int apply)
+{
+    struct jheader *hdr;
+    struct jrec rec;
+    struct jrelease rel;
+    char *payload;
+    uint64_t pos;
+    uint64_t start;
+    uint64_t seq;
+    uint64_t sum;
+    int batches = 0;
+
+    hdr = (struct jheader *)heap_get(superblock->journal_start);
+    if(hdr == NULL || hdr->magic != JOURNAL_MAGIC){
+        return -1;
+    }
+    ring_size = (superblock->journal_blocks - 1) * BLOCK_SIZE;
+    payload = malloc(BLOCK_SIZE);
+    if(payload == NULL){
+        return -1;
+    }
+    memset(&rel, 0, sizeof(rel));
+
+    pos = hdr->head;
+    seq = hdr->seq;
+    for(;;){
+        // Walk one batch up to its commit record
+        start = pos;
+        sum = FNV_INIT;
+        while(pos - start < ring_size && read_record(pos, seq, &rec, payload) == 0 &&
+              rec.type != JREC_COMMIT){
+            sum = fnv_add(sum, &rec, sizeof(rec));
+            sum = fnv_add(sum, payload, rec.len);
+            if(rec.len % 8 != 0){
+                // Padding was zeroed when the record was built
+                sum = fnv_add(sum, zero_pad, 8 - rec.len % 8);
+            }
+            pos += jrec_stride(rec.len);
+        }
+        if(pos - start >= ring_size || read_record(pos, seq, &rec, payload) != 0 ||
+           rec.type != JREC_COMMIT || rec.id != pos - start || rec.arg != sum){
+            // Uncommitted or torn tail: everything from start on is discarded
+            break;
+        }
+        batches++;
+
+        if(apply){
+            for(pos = start; read_record(pos, seq, &rec, payload) == 0 &&
+                    rec.type != JREC_COMMIT; pos += jrec_stride(rec.len)){
+                apply_record(&rec, payload, &rel);
+            }
+        }
+        pos += sizeof(struct jrec);
+        seq++;
+    }
+
+    if(apply){
+        __sync_synchronize();
+        // Skip the seq of any torn batch so its leftovers never match again
+        hdr->seq = seq + 1;
+        __sync_synchronize();
+        hdr->head = start;
+        __sync_synchronize();
+        release_flush(&rel);
+    }
+    free(rel.v);
+    free(payload);
+    return batches;
+}
+
+// Replay whatever the last run left behind and start logging.  Returns
+// the number of batches replayed, or -1 if there is no usable journal.
+int journal_open(void)
+{
+    int batches;
+
+    batches = journal_replay(1);
+    if(batches < 0){
+        return -1;
+    }
+    pthread_mutex_lock(&journal_lock);
+    jhdr = (struct jheader *)heap_get(superblock->journal_start);
+    tail = jhdr->head;
+    open_seq = jhdr->seq;
+    open_start = tail;
+    open_sum = FNV_INIT;
+    pthread_mutex_unlock(&journal_lock);
+    return batches;
+}
+
+// Lay down an empty journal; used by mkfs.nphfs on zeroed objects
+void journal_format(void)
+{
+    struct jheader *hdr;
+
+    hdr = (struct jheader *)heap_map(superblock->journal_start, BLOCK_SIZE);
+    if(hdr != NULL){
+        hdr->magic = JOURNAL_MAGIC;
+        hdr->head = 0;
+        hdr->seq = 1;
+    }
+}
@@ -0,0 +1,164 @@
+/*
+  NPHeap File System - sparse 64-bit maps
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  A small open-addressing hash table from 64-bit keys to 64-bit
+  values.  It replaces the fixed static arrays that used to be indexed
+  directly by npheap offset, so memory grows with the number of
+  objects actually in use rather than with the largest offset.
+
+  Key 0 is reserved to mark an empty slot; npheap offset 0 is never
+  handed out by the filesystem, so callers never need to store it.
+*/
+
+#include "nphfuse_extra.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAP_MIN_CAPACITY 64
+
+static size_t map_slot(uint64_t key, size_t cap)
+{
+    // Fibonacci hashing; cap is always a power of two
+    return (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 17) & (cap - 1);
+}
+
+void nph_map_init(struct nph_map *map)
+{
+    memset(map, 0, sizeof(struct nph_map));
+}
+
+void nph_map_destroy(struct nph_map *map)
+{
+    free(map->keys);
+    free(map->vals);
+    memset(map, 0, sizeof(struct nph_map));
+}
+
+static int map_resize(struct nph_map *map, size_t cap)
+{
+    uint64_t *keys = calloc(cap, sizeof(uint64_t));
+    uint64_t *vals = calloc(cap, sizeof(uint64_t));
+    size_t i, slot;
+
+    if(keys == NULL || vals == NULL){
+        free(keys);
+        free(vals);
+        return -ENOMEM;
+    }
+
+    for(i = 0; i < map->cap; i++){
+        if(map->keys[i] == 0){
+            continue;
+        }
+        slot = map_slot(map->keys[i], cap);
+        while(keys[slot] != 0){
+            slot = (slot + 1) & (cap - 1);
+        }
+        keys[slot] = map->keys[i];
+        vals[slot] = map->vals[i];
+    }
+
+    free(map->keys);
+    free(map->vals);
+    map->keys = keys;
+    map->vals = vals;
+    map->cap = cap;
+    return 0;
+}
+
+int nph_map_get(const struct nph_map *map, uint64_t key, uint64_t *val)
+{
+    size_t slot;
+
+    if(map->cap == 0 || key == 0){
+        return 0;
+    }
+    slot = map_slot(key, map->cap);
+    while(map->keys[slot] != 0){
+        if(map->keys[slot] == key){
+            if(val != NULL){
+                *val = map->vals[slot];
+            }
+            return 1;
+        }
+        slot = (slot + 1) & (map->cap - 1);
+    }
+    return 0;
+}
+
+int nph_map_put(struct nph_map *map, uint64_t key, uint64_t val)
+{
+    size_t slot;
+
+    if(key == 0){
+        return -EINVAL;
+    }
+    // Keep the load factor under 3/4
+    if((map->count + 1) * 4 > map->cap * 3){
+        if(map_resize(map, map->cap ? map->cap * 2 : MAP_MIN_CAPACITY) != 0){
+            return -ENOMEM;
+        }
+    }
+
+    slot = map_slot(key, map->cap);
+    while(map->keys[slot] != 0 && map->keys[slot] != key){
+        slot = (slot + 1) & (map->cap - 1);
+    }
+    if(map->keys[slot] == 0){
+        map->keys[slot] = key;
+        map->count++;
+    }
+    map->vals[slot] = val;
+    return 0;
+}
+
+int nph_map_remove(struct nph_map *map, uint64_t key)
+{
+    size_t slot, next, home;
+
+    if(map->cap == 0 || key == 0){
+        return 0;
+    }
+    slot = map_slot(key, map->cap);
+    while(map->keys[slot] != key){
+        if(map->keys[slot] == 0){
+            return 0;
+        }
+        slot = (slot + 1) & (map->cap - 1);
+    }
+
+    // Backward-shift deletion keeps probe chains intact without tombstones
+    next = slot;
+    for(;;){
+        next = (next + 1) & (map->cap - 1);
+        if(map->keys[next] == 0){
+            break;
+        }
+        home = map_slot(map->keys[next], map->cap);
+        if(((next - home) & (map->cap - 1)) >= ((next - slot) & (map->cap - 1))){
+            map->keys[slot] = map->keys[next];
+            map->vals[slot] = map->vals[next];
+            slot = next;
+        }
+    }
+    map->keys[slot] = 0;
+    map->vals[slot] = 0;
+    map->count--;
+    return 1;
+}
+
+void nph_map_foreach(const struct nph_map *map,
+                     void (*fn)(uint64_t key, uint64_t val, void *arg), void *arg)
+{
+    size_t i;
+
+    for(i = 0; i < map->cap; i++){
+        if(map->keys[i] != 0){
+            fn(map->keys[i], map->vals[i], arg);
+        }
+    }
+}
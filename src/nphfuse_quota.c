@@ -0,0 +1,267 @@
+/*
+  NPHeap File System - quotas
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Inodes and bytes in use per uid and per gid, with optional limits
+  past which creating or growing a file fails with EDQUOT.  Bytes are
+  file sizes; a hard link adds nothing and snapshots are not charged
+  to anyone.
+
+  Usage is not stored.  quota_init counts it with one pass over the
+  inode table at mount, and from then on the operations that create,
+  free, resize or chown an inode charge the difference here, so no
+  operation has to scan anything.  Limits are set with
+  NPHFS_IOC_SETQUOTA and kept in ROOT_BLOCK after the superblock.
+*/
+
+#include "nphfuse_extra.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Usage entries, in the order their owners were first seen, and where
+// each one is by owner
+static struct nphfs_quota *owners = NULL;
+static uint64_t owner_count = 0;
+static uint64_t owner_cap = 0;
+static struct nph_map by_owner;
+static pthread_mutex_t quota_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t owner_key(uint32_t type, uint32_t id)
+{
+    return (uint64_t)type << 32 | id;
+}
+
+static struct nph_quota_limit *quota_limits(void)
+{
+    char *root = (char *)heap_map(ROOT_BLOCK, BLOCK_SIZE);
+
+    return root != NULL ? (struct nph_quota_limit *)(root + QUOTA_LIMITS_START) : NULL;
+}
+
+// Index of the usage entry of an owner, added if it has none; -1
+// without memory.  Adding may move the entries, so pointers into them
+// are only taken once every owner an operation needs is looked up.
+// Called with quota_lock held.
+static int64_t owner_get(uint32_t type, uint32_t id)
+{
+    struct nphfs_quota *grown;
+    uint64_t index;
+    uint64_t cap;
+
+    if(nph_map_get(&by_owner, owner_key(type, id), &index)){
+        return (int64_t)index;
+    }
+    if(owner_count == owner_cap){
+        cap = owner_cap ? owner_cap * 2 : 16;
+        grown = realloc(owners, cap * sizeof(struct nphfs_quota));
+        if(grown == NULL){
+            return -1;
+        }
+        owners = grown;
+        owner_cap = cap;
+    }
+    if(nph_map_put(&by_owner, owner_key(type, id), owner_count) != 0){
+        return -1;
+    }
+    memset(&owners[owner_count], 0, sizeof(struct nphfs_quota));
+    owners[owner_count].type = type;
+    owners[owner_count].id = id;
+    return (int64_t)owner_count++;
+}
+
+// 1 if adding inodes and bytes takes q past one of its limits
+static int over(const struct nphfs_quota *q, int64_t inodes, int64_t bytes)
+{
+    if(inodes > 0 && q->inode_limit != 0 && q->inodes + inodes > q->inode_limit){
+        return 1;
+    }
+    return bytes > 0 && q->byte_limit != 0 && q->bytes + bytes > q->byte_limit;
+}
+
+static void add(struct nphfs_quota *q, int64_t inodes, int64_t bytes)
+{
+    q->inodes = inodes < 0 && (uint64_t)-inodes > q->inodes ? 0 : q->inodes + inodes;
+    q->bytes = bytes < 0 && (uint64_t)-bytes > q->bytes ? 0 : q->bytes + bytes;
+}
+
+// Count what every live inode uses and pick up the stored limits
+int quota_init(void)
+{
+    struct nph_quota_limit *limits;
+    npheap_store *inode;
+    int64_t u;
+    int64_t g;
+    uint64_t index;
+    uint64_t i;
+    int err = 0;
+
+    pthread_mutex_lock(&quota_lock);
+    nph_map_destroy(&by_owner);
+    nph_map_init(&by_owner);
+    owner_count = 0;
+
+    for(index = 0; index < superblock->inode_count; index++){
+        inode = inode_slot(index);
+        if(inode == NULL || inode->filename[0] == '\0' || inode->link != 0 ||
+           snapshot_inode(inode)){
+            continue;
+        }
+        u = owner_get(QUOTA_USER, inode->mystat.st_uid);
+        g = owner_get(QUOTA_GROUP, inode->mystat.st_gid);
+        if(u < 0 || g < 0){
+            err = -ENOMEM;
+            break;
+        }
+        add(&owners[u], 1, inode->mystat.st_size);
+        add(&owners[g], 1, inode->mystat.st_size);
+    }
+
+    limits = quota_limits();
+    for(i = 0; err == 0 && limits != NULL && i < QUOTA_LIMITS_MAX; i++){
+        if(limits[i].type == 0){
+            continue;
+        }
+        u = owner_get(limits[i].type, limits[i].id);
+        if(u < 0){
+            err = -ENOMEM;
+            break;
+        }
+        owners[u].inode_limit = limits[i].inodes;
+        owners[u].byte_limit = limits[i].bytes;
+    }
+    pthread_mutex_unlock(&quota_lock);
+    return err;
+}
+
+// Charge inodes and bytes to a uid and a gid, negative to give them
+// back.  Returns -EDQUOT, charging nothing, if either would go over a
+// limit; giving back never fails.
+int quota_charge(uid_t uid, gid_t gid, int64_t inodes, int64_t bytes)
+{
+    int64_t u;
+    int64_t g;
+    int err = 0;
+
+    if(inodes == 0 && bytes == 0){
+        return 0;
+    }
+    pthread_mutex_lock(&quota_lock);
+    u = owner_get(QUOTA_USER, uid);
+    g = owner_get(QUOTA_GROUP, gid);
+    if(u < 0 || g < 0){
+        err = inodes > 0 || bytes > 0 ? -ENOMEM : 0;
+    }else if(over(&owners[u], inodes, bytes) || over(&owners[g], inodes, bytes)){
+        err = -EDQUOT;
+    }else{
+        add(&owners[u], inodes, bytes);
+        add(&owners[g], inodes, bytes);
+    }
+    pthread_mutex_unlock(&quota_lock);
+    return err;
+}
+
+// A file of inode's owners goes from size from to size to
+int quota_resize(const npheap_store *inode, uint64_t from, uint64_t to)
+{
+    return quota_charge(inode->mystat.st_uid, inode->mystat.st_gid, 0,
+                        (int64_t)to - (int64_t)from);
+}
+
+// inode is given to uid and gid; -EDQUOT if a new owner has no room for it
+int quota_chown(const npheap_store *inode, uid_t uid, gid_t gid)
+{
+    int64_t from[2];
+    int64_t to[2];
+    int64_t bytes = inode->mystat.st_size;
+    int err = 0;
+    int i;
+
+    pthread_mutex_lock(&quota_lock);
+    from[0] = owner_get(QUOTA_USER, inode->mystat.st_uid);
+    from[1] = owner_get(QUOTA_GROUP, inode->mystat.st_gid);
+    to[0] = owner_get(QUOTA_USER, uid);
+    to[1] = owner_get(QUOTA_GROUP, gid);
+    for(i = 0; i < 2; i++){
+        if(from[i] < 0 || to[i] < 0){
+            err = -ENOMEM;
+        }else if(from[i] != to[i] && over(&owners[to[i]], 1, bytes)){
+            err = -EDQUOT;
+        }
+    }
+    for(i = 0; err == 0 && i < 2; i++){
+        if(from[i] != to[i]){
+            add(&owners[from[i]], -1, -bytes);
+            add(&owners[to[i]], 1, bytes);
+        }
+    }
+    pthread_mutex_unlock(&quota_lock);
+    return err;
+}
+
+// Set or, with both limits 0, remove the limits of q->type and q->id.
+// Returns -ENOSPC when every stored limit is taken.
+int quota_set(const struct nphfs_quota *q)
+{
+    struct nph_quota_limit *limits;
+    int64_t entry;
+    uint64_t i;
+    uint64_t slot = QUOTA_LIMITS_MAX;
+
+    if(q->type != QUOTA_USER && q->type != QUOTA_GROUP){
+        return -EINVAL;
+    }
+    limits = quota_limits();
+    if(limits == NULL){
+        return -EIO;
+    }
+
+    pthread_mutex_lock(&quota_lock);
+    for(i = 0; i < QUOTA_LIMITS_MAX; i++){
+        if(limits[i].type == q->type && limits[i].id == q->id){
+            slot = i;
+            break;
+        }
+        if(limits[i].type == 0 && slot == QUOTA_LIMITS_MAX){
+            slot = i;
+        }
+    }
+    entry = owner_get(q->type, q->id);
+    if(entry < 0 || (slot == QUOTA_LIMITS_MAX && (q->inode_limit || q->byte_limit))){
+        pthread_mutex_unlock(&quota_lock);
+        return entry < 0 ? -ENOMEM : -ENOSPC;
+    }
+    owners[entry].inode_limit = q->inode_limit;
+    owners[entry].byte_limit = q->byte_limit;
+    if(slot != QUOTA_LIMITS_MAX){
+        if(q->inode_limit == 0 && q->byte_limit == 0){
+            memset(&limits[slot], 0, sizeof(struct nph_quota_limit));
+        }else{
+            limits[slot].type = q->type;
+            limits[slot].id = q->id;
+            limits[slot].inodes = q->inode_limit;
+            limits[slot].bytes = q->byte_limit;
+        }
+        ckpt_dirty(ROOT_BLOCK);
+        ckpt_need_meta();
+    }
+    pthread_mutex_unlock(&quota_lock);
+    return 0;
+}
+
+// Copy out the usage entries from r->first on, as many as fit
+void quota_report(struct nphfs_quota_report *r)
+{
+    uint64_t i;
+
+    pthread_mutex_lock(&quota_lock);
+    r->count = 0;
+    r->total = owner_count;
+    for(i = r->first; i < owner_count && r->count < QUOTA_REPORT_MAX; i++){
+        r->entries[r->count++] = owners[i];
+    }
+    pthread_mutex_unlock(&quota_lock);
+}
@@ -0,0 +1,99 @@
+/*
+  NPHeap File System - data object share counts
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Snapshots let several block maps point at the same data blocks and
+  block map nodes.  The share table, laid down by mkfs.nphfs after the
+  data bitmap, holds one 32-bit count per data object of the references
+  it has beyond its first one.  Counts are hierarchical: sharing a
+  subtree only counts a reference on its root, and the children gain
+  references of their own when a writer copies the node above them.
+
+  New references are taken straight away, before anything points at
+  them, while references are only dropped by the metadata journal
+  once the batch dropping them is applied.  A crash therefore leaves a
+  count too high, never too low.
+*/
+
+#include "nphfuse_extra.h"
+
+#define COUNTS_PER_OBJECT  (BLOCK_SIZE / sizeof(uint32_t))
+
+// Number of npheap objects needed to count nblocks data objects
+uint64_t share_objects(uint64_t nblocks)
+{
+    return (nblocks + COUNTS_PER_OBJECT - 1) / COUNTS_PER_OBJECT;
+}
+
+static uint32_t *share_slot(uint64_t id, uint64_t *obj)
+{
+    uint64_t bit;
+    uint32_t *counts;
+
+    id = BMAP_ID(id);
+    if(id < superblock->data_start || id >= superblock->data_start + superblock->data_blocks){
+        return NULL;
+    }
+    bit = id - superblock->data_start;
+    *obj = superblock->share_table + bit / COUNTS_PER_OBJECT;
+    counts = (uint32_t *)heap_map(*obj, BLOCK_SIZE);
+    if(counts == NULL){
+        return NULL;
+    }
+    return &counts[bit % COUNTS_PER_OBJECT];
+}
+
+// References to id beyond the first
+uint32_t share_count(uint64_t id)
+{
+    uint64_t obj;
+    uint32_t *count = share_slot(id, &obj);
+
+    return count != NULL ? __atomic_load_n(count, __ATOMIC_ACQUIRE) : 0;
+}
+
+void share_ref(uint64_t id)
+{
+    uint64_t obj;
+    uint32_t *count = share_slot(id, &obj);
+
+    if(count != NULL){
+        __atomic_add_fetch(count, 1, __ATOMIC_ACQ_REL);
+        ckpt_dirty(obj);
+        ckpt_need_meta();
+    }
+}
+
+void share_unref(uint64_t id, uint32_t n)
+{
+    uint64_t obj;
+    uint32_t *count = share_slot(id, &obj);
+    uint32_t old;
+
+    if(count == NULL){
+        return;
+    }
+    old = __atomic_load_n(count, __ATOMIC_ACQUIRE);
+    do{
+        if(old == 0){
+            return;
+        }
+    }while(!__atomic_compare_exchange_n(count, &old, old > n ? old - n : 0, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    ckpt_dirty(obj);
+    ckpt_need_meta();
+}
+
+// Overwrite the count of id; fsck.nphfs uses it to repair the table
+void share_set(uint64_t id, uint32_t count)
+{
+    uint64_t obj;
+    uint32_t *slot = share_slot(id, &obj);
+
+    if(slot != NULL){
+        __atomic_store_n(slot, count, __ATOMIC_RELEASE);
+        ckpt_dirty(obj);
+    }
+}
@@ -0,0 +1,290 @@
+/*
+  NPHeap File System - snapshots
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  A snapshot is a read-only copy of every live inode, filed under
+  SNAPSHOT_DIR/<name> with its path otherwise unchanged.  Only the
+  inode slots are copied: each copy takes a reference on its block map
+  root (nphfuse_share.c) and the data stays where it is until a writer
+  changes it, at which point the writer gets a private copy.
+
+  SNAPSHOT_DIR is made by mkfs.nphfs, is left out of listings of the
+  root directory and is the control interface too:
+
+      mkdir /mnt/.snapshots/NAME     take a snapshot called NAME
+      ls /mnt/.snapshots             list them
+      rmdir /mnt/.snapshots/NAME     delete one
+
+  Taking a snapshot waits for data writes in flight and holds the
+  journal for as long as the inode table takes to copy; metadata
+  operations queue up meanwhile but nothing has to be unmounted.  The
+  copies are written in place rather than journaled, so a crash in the
+  middle leaves a partial snapshot behind which can simply be deleted.
+*/
+
+#include "nphfuse_extra.h"
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#define SNAPSHOT_DELETE_BATCH  64
+
+// Writers of file data hold this shared; snapshots take it exclusively
+static pthread_rwlock_t snapshot_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static int under(const char *path, const char *dir)
+{
+    size_t len = strlen(dir);
+
+    return strncmp(path, dir, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+// 1 if path is SNAPSHOT_DIR or anything under it, all of it read-only
+int snapshot_path(const char *path)
+{
+    return under(path, SNAPSHOT_DIR);
+}
+
+// 1 if inode is SNAPSHOT_DIR or lives under it
+int snapshot_inode(const npheap_store *inode)
+{
+    return (strcmp(inode->dirname, "/") == 0 && strcmp(inode->filename, SNAPSHOT_DIR + 1) == 0) ||
+           under(inode->dirname, SNAPSHOT_DIR);
+}
+
+// The snapshot name if path is SNAPSHOT_DIR/name, otherwise NULL
+const char *snapshot_name(const char *path)
+{
+    const char *name;
+
+    if(strncmp(path, SNAPSHOT_DIR "/", sizeof(SNAPSHOT_DIR)) != 0){
+        return NULL;
+    }
+    name = path + sizeof(SNAPSHOT_DIR);
+    if(name[0] == '\0' || strchr(name, '/') != NULL){
+        return NULL;
+    }
+    return name;
+}
+
+void snapshot_hold(void)
+{
+    pthread_rwlock_rdlock(&snapshot_lock);
+}
+
+void snapshot_unhold(void)
+{
+    pthread_rwlock_unlock(&snapshot_lock);
+}
+
+static npheap_store *find_inode(const char *dir, const char *name)
+{
+    npheap_store *inode;
+    uint64_t i;
+
+    for(i = 0; i < superblock->inode_count; i++){
+        inode = inode_slot(i);
+        if(inode != NULL && strcmp(inode->dirname, dir) == 0 &&
+           strcmp(inode->filename, name) == 0){
+            return inode;
+        }
+    }
+    return NULL;
+}
+
+struct link_fixup {
+    struct nph_map copies;          // live inode number -> its copy's
+    struct nph_map links;           // copied slot -> live inode it links to
+    uint64_t *skipped;
+};
+
+// Point a copied hard link at the copy of its inode, or drop it if
+// that inode was left out
+static void fix_link(uint64_t slot, uint64_t target, void *arg)
+{
+    struct link_fixup *fix = (struct link_fixup *)arg;
+    npheap_store *copy = inode_slot(slot);
+    uint64_t ino;
+
+    if(copy == NULL){
+        return;
+    }
+    if(nph_map_get(&fix->copies, target, &ino)){
+        copy->link = ino;
+    }else{
+        memset(copy, 0, sizeof(npheap_store));
+        bitmap_clear(&inode_bitmap, slot);
+        (*fix->skipped)++;
+    }
+    ckpt_dirty(INODE_BLOCK_START + slot / TOTAL_BLOCKS);
+}
+
+// Copy every live inode outside SNAPSHOT_DIR under prefix.  Called with
+// the snapshot lock held exclusively and the journal paused.
+static int snapshot_copy(const char *prefix, uint64_t *skipped)
+{
+    struct link_fixup fix;
+    npheap_store *src;
+    npheap_store *copy;
+    char dir[FILE_MAX];
+    uint64_t index;
+    int64_t slot;
+    int len;
+    int err = 0;
+
+    nph_map_init(&fix.copies);
+    nph_map_init(&fix.links);
+    fix.skipped = skipped;
+
+    // Slot 0 is the root, which the snapshot directory itself stands for
+    for(index = 1; index < superblock->inode_count; index++){
+        src = inode_slot(index);
+        if(src == NULL || !bitmap_test(&inode_bitmap, index) || src->filename[0] == '\0' ||
+           snapshot_inode(src)){
+            continue;
+        }
+        len = snprintf(dir, sizeof(dir), "%s%s", prefix,
+                       strcmp(src->dirname, "/") == 0 ? "" : src->dirname);
+        if(len < 0 || (size_t)len >= sizeof(dir)){
+            // The path no longer fits a dirname; its children will not either
+            (*skipped)++;
+            continue;
+        }
+        slot = bitmap_alloc(&inode_bitmap);
+        if(slot < 0 || (copy = inode_slot(slot)) == NULL){
+            err = -ENOSPC;
+            break;
+        }
+        // Reference first: a crash before the copy is only a leak
+        if(src->offset != 0){
+            share_ref(src->offset);
+        }
+        if(src->xattr != 0){
+            share_ref(src->xattr);
+        }
+        memcpy(copy, src, sizeof(npheap_store));
+        strcpy(copy->dirname, dir);
+        copy->mystat.st_ino = slot + ROOT_INO;
+        ckpt_dirty(inode_block(copy));
+        nph_map_put(&fix.copies, src->mystat.st_ino, copy->mystat.st_ino);
+        if(copy->link != 0 && nph_map_put(&fix.links, slot, copy->link) != 0){
+            memset(copy, 0, sizeof(npheap_store));
+            bitmap_clear(&inode_bitmap, slot);
+            (*skipped)++;
+        }
+    }
+    // Hard links can only be pointed at their inode's copy once it exists
+    nph_map_foreach(&fix.links, fix_link, &fix);
+    nph_map_destroy(&fix.copies);
+    nph_map_destroy(&fix.links);
+    return err;
+}
+
+// Take a snapshot of the whole filesystem called name.  Entries whose
+// path would not fit under SNAPSHOT_DIR are left out and counted in
+// *skipped.
+int snapshot_create(const char *name, uint64_t *skipped)
+{
+    npheap_store *root;
+    npheap_store *dir;
+    struct timespec now;
+    char prefix[FILE_MAX];
+    int64_t slot;
+    int len;
+    int err;
+
+    len = snprintf(prefix, sizeof(prefix), "%s/%s", SNAPSHOT_DIR, name);
+    if(len < 0 || (size_t)len >= sizeof(prefix) || strlen(name) >= sizeof(dir->filename)){
+        return -ENAMETOOLONG;
+    }
+
+    *skipped = 0;
+    pthread_rwlock_wrlock(&snapshot_lock);
+    journal_pause();
+
+    if(find_inode(SNAPSHOT_DIR, name) != NULL){
+        err = -EEXIST;
+        goto out;
+    }
+    slot = bitmap_alloc(&inode_bitmap);
+    if(slot < 0 || (dir = inode_slot(slot)) == NULL || (root = inode_slot(0)) == NULL){
+        err = -ENOSPC;
+        goto out;
+    }
+    memset(dir, 0, sizeof(npheap_store));
+    strcpy(dir->dirname, SNAPSHOT_DIR);
+    strcpy(dir->filename, name);
+    dir->mystat = root->mystat;
+    dir->mystat.st_ino = slot + ROOT_INO;
+    dir->mystat.st_mode = S_IFDIR | (root->mystat.st_mode & 0555);
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    dir->mystat.st_mtim = now;
+    dir->mystat.st_ctim = now;
+    ckpt_dirty(inode_block(dir));
+
+    err = snapshot_copy(prefix, skipped);
+out:
+    journal_resume();
+    pthread_rwlock_unlock(&snapshot_lock);
+
+    if(err == -ENOSPC){
+        snapshot_delete(name);
+    }
+    return err;
+}
+
+static void drop_inode(npheap_store *inode, struct jtx *tx)
+{
+    npheap_store empty;
+
+    memset(&empty, 0, sizeof(npheap_store));
+    jtx_free(tx, inode->offset, inode->height);
+    xattr_release(inode, tx);
+    jtx_inode(tx, inode, 0, &empty, sizeof(npheap_store));
+    jtx_iclear(tx, inode->mystat.st_ino - ROOT_INO);
+}
+
+// Delete snapshot name, giving back every block only it still uses
+int snapshot_delete(const char *name)
+{
+    npheap_store *dir;
+    npheap_store *inode;
+    struct jtx tx;
+    char prefix[FILE_MAX];
+    uint64_t index;
+    uint64_t pending = 0;
+    int len;
+    int err;
+
+    len = snprintf(prefix, sizeof(prefix), "%s/%s", SNAPSHOT_DIR, name);
+    if(len < 0 || (size_t)len >= sizeof(prefix)){
+        return -ENOENT;
+    }
+    dir = find_inode(SNAPSHOT_DIR, name);
+    if(dir == NULL){
+        return -ENOENT;
+    }
+
+    // Spread over several transactions so none outgrows the journal
+    jtx_begin(&tx);
+    for(index = 1; index < superblock->inode_count; index++){
+        inode = inode_slot(index);
+        if(inode == NULL || inode->filename[0] == '\0' || !under(inode->dirname, prefix)){
+            continue;
+        }
+        drop_inode(inode, &tx);
+        if(++pending == SNAPSHOT_DELETE_BATCH){
+            err = jtx_commit(&tx);
+            if(err != 0){
+                return err;
+            }
+            jtx_begin(&tx);
+            pending = 0;
+        }
+    }
+    drop_inode(dir, &tx);
+    return jtx_commit(&tx);
+}
@@ -0,0 +1,101 @@
+/*
+  NPHeap File System - superblock
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  The superblock lives at the start of ROOT_BLOCK and records the
+  geometry mkfs.nphfs chose: data block size, inode table size and
+  where the allocation bitmaps, the share and checksum tables, the
+  journal and the data area start, and how many npheap devices the
+  data area is striped over.  Mounting only maps it and attaches the
+  bitmaps; nothing is laid out here.
+*/
+
+#include "nphfuse_extra.h"
+#include <string.h>
+
+struct nph_super *superblock = NULL;
+uint64_t data_block_size = BLOCK_SIZE;
+struct nph_bitmap inode_bitmap;
+struct nph_bitmap data_bitmap;
+
+// Data blocks must be a power of two between 8 KB and 2 MB
+int super_block_size_ok(uint64_t size)
+{
+    if(size < MIN_DATA_BLOCK_SIZE || size > MAX_DATA_BLOCK_SIZE){
+        return 0;
+    }
+    return (size & (size - 1)) == 0;
+}
+
+// Map the superblock and attach the bitmaps; returns NULL if the heap
+// does not hold a filesystem made by mkfs.nphfs
+struct nph_super *super_load(void)
+{
+    struct nph_super *sb;
+
+    if(heap_size(ROOT_BLOCK) == 0){
+        return NULL;
+    }
+    sb = (struct nph_super *)heap_map(ROOT_BLOCK, BLOCK_SIZE);
+    if(sb == NULL || sb->magic != NPH_MAGIC || sb->version != NPH_VERSION){
+        return NULL;
+    }
+    if(!super_block_size_ok(sb->block_size) || sb->inode_blocks == 0 ||
+       sb->journal_blocks < 2 || sb->share_table == 0 || sb->csum_table == 0){
+        return NULL;
+    }
+    // Data objects are found by which device they were striped to
+    if(sb->stripes != (uint64_t)heap_devices()){
+        return NULL;
+    }
+
+    superblock = sb;
+    data_block_size = sb->block_size;
+    bitmap_attach(&inode_bitmap, sb->inode_bitmap, sb->inode_count, &sb->inodes_used);
+    bitmap_attach(&data_bitmap, sb->data_bitmap, sb->data_blocks, &sb->blocks_used);
+    heap_scan();
+    return sb;
+}
+
+// Address of inode table slot index, or NULL if it is out of range
+npheap_store *inode_slot(uint64_t index)
+{
+    npheap_store *block;
+
+    if(superblock == NULL || index >= superblock->inode_count){
+        return NULL;
+    }
+    block = (npheap_store *)heap_map(INODE_BLOCK_START + index / TOTAL_BLOCKS, BLOCK_SIZE);
+    if(block == NULL){
+        return NULL;
+    }
+    return &block[index % TOTAL_BLOCKS];
+}
+
+// The inode a directory entry names: the entry itself, or for a hard
+// link the inode it links to.  NULL if a link points at nothing usable.
+npheap_store *inode_resolve(npheap_store *entry)
+{
+    npheap_store *inode;
+
+    if(entry->link == 0){
+        return entry;
+    }
+    if(entry->link < ROOT_INO){
+        return NULL;
+    }
+    inode = inode_slot(entry->link - ROOT_INO);
+    if(inode == NULL || inode->filename[0] == '\0' || inode->link != 0 ||
+       inode->mystat.st_ino != entry->link){
+        return NULL;
+    }
+    return inode;
+}
+
+// Inode table object holding inode's slot
+uint64_t inode_block(const npheap_store *inode)
+{
+    return INODE_BLOCK_START + (inode->mystat.st_ino - ROOT_INO) / TOTAL_BLOCKS;
+}
@@ -0,0 +1,520 @@
+/*
+  NPHeap File System - spill tier
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  mkfs.nphfs can give a filesystem more data blocks than the npheap
+  devices have memory for.  With -o spill=FILE, data objects nobody has
+  used for a while are moved out to FILE when the heap fills up, and
+  are brought back the next time something looks them up, so only the
+  blocks in use have to fit in the heap.  The filesystem's ids do not
+  change: a spilled object keeps its bit in the data bitmap and its
+  slot in the file is found from its place in the data area.
+
+  The file starts with a header naming the filesystem it belongs to
+  and a table of the size of every spilled object, 0 for one that is
+  in the heap, followed by one data_block_size slot per data object.
+  An object is written to its slot and the table before it is deleted
+  from the heap, and one found in both after a crash is taken from the
+  heap.  The superblock counts the spilled objects, so the filesystem
+  is never used without the file while some are out there.
+
+  Cold objects are picked by a clock over the data area: a lookup sets
+  an object's bit and the hand clears it in passing, so it only takes
+  objects that were not looked up for a whole turn.  A thread keeps
+  the heap under -o resident=BLOCKS, or when that is not given under
+  the number of objects it held when an allocation first failed.  It
+  shuts out every operation that could hold a pointer into the data
+  area (tier_hold) while it moves a batch out.  An operation that
+  finds the heap full does not wait for it: once the operation has let
+  go of the tier it moves a batch out itself and runs again, and only
+  fails, with ENOSPC, when there is nothing left to move.
+
+  Programs that work on an unmounted filesystem attach the file
+  without bringing objects back: a spilled object is mapped straight
+  from its slot instead.
+*/
+
+#include "nphfuse_extra.h"
+#include <npheap.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SPILL_MAGIC     0x4c4c495053504e4eULL
+#define SPILL_TABLE     4096            // offset of the size table
+#define TIER_BATCH      256             // objects moved out per hold
+#define TIER_SLACK      16              // room left, as a fraction of the limit
+#define TIER_PERIOD_MS  1000
+
+struct spill_header {
+  uint64_t magic;
+  uint64_t data_start;
+  uint64_t data_blocks;
+  uint64_t block_size;
+};
+
+static int spill_fd = -1;
+static uint32_t *spilled = NULL;        // size of each spilled object, by data bit
+static uint8_t *referenced = NULL;      // clock bits, by data bit
+static uint64_t slots_start = 0;
+static int promote = 0;
+static uint64_t hand = 0;
+static uint64_t resident_max = 0;
+static int pressed = 0;                 // an allocation failed since the last sweep
+static __thread int short_of_heap = 0;  // one failed in this thread's operation
+
+static pthread_rwlock_t tier_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_t tier_thread;
+static pthread_mutex_t thread_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t thread_cond = PTHREAD_COND_INITIALIZER;
+static int tier_running = 0;
+static int tier_quit = 0;
+
+static struct {
+    uint64_t lookups;
+    uint64_t faults;
+    uint64_t evictions;
+    uint64_t fault_ns;
+    uint64_t evict_ns;
+} stats;
+
+static off_t slot_offset(uint64_t bit)
+{
+    return slots_start + bit * data_block_size;
+}
+
+// Record in memory and in the file that data bit holds size bytes out
+// here, 0 for none, and keep the superblock's count
+static int table_set(uint64_t bit, uint32_t size)
+{
+    uint32_t old = spilled[bit];
+    int err;
+
+    err = write_full(spill_fd, &size, sizeof(size), SPILL_TABLE + bit * sizeof(uint32_t));
+    if(err != 0){
+        return err;
+    }
+    __atomic_store_n(&spilled[bit], size, __ATOMIC_RELEASE);
+    if((old == 0) != (size == 0)){
+        __atomic_add_fetch(&superblock->blocks_spilled, size != 0 ? 1 : (uint64_t)-1,
+                           __ATOMIC_RELAXED);
+        ckpt_dirty(ROOT_BLOCK);
+    }
+    return 0;
+}
+
+// Data objects in the heap now
+static uint64_t resident(void)
+{
+    uint64_t used = __atomic_load_n(&superblock->blocks_used, __ATOMIC_RELAXED);
+    uint64_t out = __atomic_load_n(&superblock->blocks_spilled, __ATOMIC_RELAXED);
+
+    return used > out ? used - out : 0;
+}
+
+// Use the spill file at path.  With bring_back set, spilled objects
+// come back into the heap when looked up; otherwise they are mapped
+// from the file.  A file that belongs to some other filesystem is
+// started over, unless this one has objects spilled, which fails with
+// -ENOENT.
+int tier_attach(const char *path, int bring_back, uint64_t limit)
+{
+    struct spill_header hdr;
+    uint64_t blocks = superblock->data_blocks;
+    uint64_t table = blocks * sizeof(uint32_t);
+    uint64_t out = 0;
+    uint64_t bit;
+    uint64_t id;
+    int err;
+
+    spill_fd = open(path, O_RDWR | O_CREAT, 0600);
+    if(spill_fd < 0){
+        return -errno;
+    }
+    spilled = calloc(blocks, sizeof(uint32_t));
+    referenced = bring_back ? calloc(blocks, 1) : NULL;
+    if(spilled == NULL || (bring_back && referenced == NULL)){
+        err = -ENOMEM;
+        goto fail;
+    }
+    slots_start = (SPILL_TABLE + table + data_block_size - 1) / data_block_size * data_block_size;
+
+    err = read_full(spill_fd, &hdr, sizeof(hdr), 0);
+    if(err != 0){
+        goto fail;
+    }
+    if(hdr.magic != SPILL_MAGIC || hdr.data_start != superblock->data_start ||
+       hdr.data_blocks != blocks || hdr.block_size != data_block_size ||
+       superblock->blocks_spilled == 0){
+        if(superblock->blocks_spilled != 0){
+            err = -ENOENT;
+            goto fail;
+        }
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.magic = SPILL_MAGIC;
+        hdr.data_start = superblock->data_start;
+        hdr.data_blocks = blocks;
+        hdr.block_size = data_block_size;
+        if(ftruncate(spill_fd, 0) != 0){
+            err = -errno;
+            goto fail;
+        }
+        err = write_full(spill_fd, &hdr, sizeof(hdr), 0);
+        if(err != 0){
+            goto fail;
+        }
+    }else{
+        err = read_full(spill_fd, spilled, table, SPILL_TABLE);
+        if(err != 0){
+            goto fail;
+        }
+        // What a crash left in both places, or a free block still
+        // listed, is dropped from the table
+        for(bit = 0; bit < blocks; bit++){
+            if(spilled[bit] == 0){
+                continue;
+            }
+            id = superblock->data_start + bit;
+            if(!bitmap_test(&data_bitmap, bit) || npheap_getsize(heap_fd(id), id) != 0 ||
+               spilled[bit] > data_block_size){
+                spilled[bit] = 0;
+                err = write_full(spill_fd, &spilled[bit], sizeof(uint32_t),
+                                 SPILL_TABLE + bit * sizeof(uint32_t));
+                if(err != 0){
+                    goto fail;
+                }
+            }else{
+                out++;
+            }
+        }
+    }
+    if(superblock->blocks_spilled != out){
+        superblock->blocks_spilled = out;
+        ckpt_dirty(ROOT_BLOCK);
+    }
+    promote = bring_back;
+    resident_max = limit;
+    hand = 0;
+    return 0;
+
+fail:
+    free(spilled);
+    free(referenced);
+    spilled = NULL;
+    referenced = NULL;
+    close(spill_fd);
+    spill_fd = -1;
+    return err;
+}
+
+// Bytes of object id in the spill file, 0 if it is not spilled
+uint64_t tier_size(uint64_t id)
+{
+    if(spilled == NULL || superblock == NULL || id < superblock->data_start ||
+       id >= superblock->data_start + superblock->data_blocks){
+        return 0;
+    }
+    return __atomic_load_n(&spilled[id - superblock->data_start], __ATOMIC_ACQUIRE);
+}
+
+// Object id was looked up
+void tier_touch(uint64_t id)
+{
+    uint64_t bit;
+
+    if(referenced == NULL || id < superblock->data_start){
+        return;
+    }
+    bit = id - superblock->data_start;
+    if(bit < superblock->data_blocks){
+        if(!referenced[bit]){
+            __atomic_store_n(&referenced[bit], 1, __ATOMIC_RELAXED);
+        }
+        stat_add(&stats.lookups, 1);
+    }
+}
+
+// Bring spilled object id back into the heap through device fd, or map
+// it from its slot.  Called by the heap with the device locked.
+void *tier_fault(int fd, uint64_t id)
+{
+    uint64_t bit = id - superblock->data_start;
+    uint64_t size = tier_size(id);
+    uint64_t start = now_ns();
+    void *ptr;
+
+    if(size == 0){
+        return NULL;
+    }
+    if(!promote){
+        ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, spill_fd, slot_offset(bit));
+        return ptr != MAP_FAILED ? ptr : NULL;
+    }
+    ptr = npheap_alloc(fd, id, size);
+    if(ptr == NULL){
+        tier_full();
+        return NULL;
+    }
+    if(read_full(spill_fd, ptr, size, slot_offset(bit)) != 0 || table_set(bit, 0) != 0){
+        munmap(ptr, size);
+        npheap_delete(fd, id);
+        return NULL;
+    }
+    stat_add(&stats.faults, 1);
+    stat_add(&stats.fault_ns, now_ns() - start);
+    return ptr;
+}
+
+// Write the size bytes of object id at ptr out to its slot.  The heap
+// deletes the object once this returns 0.
+int tier_store(uint64_t id, const void *ptr, uint64_t size)
+{
+    uint64_t bit = id - superblock->data_start;
+    uint64_t start = now_ns();
+    int err;
+
+    if(spill_fd < 0 || size > data_block_size){
+        return -EINVAL;
+    }
+    err = write_full(spill_fd, ptr, size, slot_offset(bit));
+    if(err == 0){
+        err = table_set(bit, (uint32_t)size);
+    }
+    if(err == 0){
+        stat_add(&stats.evictions, 1);
+        stat_add(&stats.evict_ns, now_ns() - start);
+    }
+    return err;
+}
+
+// Object id is being deleted; its slot is free again
+void tier_forget(uint64_t id)
+{
+    if(tier_size(id) != 0){
+        table_set(id - superblock->data_start, 0);
+    }
+}
+
+// Copy spilled object id to fd at off without bringing it back
+int tier_copy(uint64_t id, int fd, off_t off)
+{
+    uint64_t size = tier_size(id);
+    char *buf;
+    int err;
+
+    if(size == 0){
+        return -ENOENT;
+    }
+    buf = malloc(size);
+    if(buf == NULL){
+        return -ENOMEM;
+    }
+    err = read_full(spill_fd, buf, size, slot_offset(id - superblock->data_start));
+    if(err == 0){
+        err = write_full(fd, buf, size, off);
+    }
+    free(buf);
+    return err;
+}
+
+// An operation that may look up data objects starts or ends
+void tier_hold(void)
+{
+    short_of_heap = 0;
+    pthread_rwlock_rdlock(&tier_lock);
+}
+
+void tier_unhold(void)
+{
+    pthread_rwlock_unlock(&tier_lock);
+}
+
+// The heap could not make a data object.  Without a limit of our own,
+// what it holds now is taken as all it can.
+void tier_full(void)
+{
+    uint64_t have;
+
+    short_of_heap = 1;
+    if(!promote){
+        return;
+    }
+    have = resident();
+    if(resident_max == 0 || have < resident_max){
+        __atomic_store_n(&resident_max, have, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&pressed, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&thread_lock);
+    pthread_cond_broadcast(&thread_cond);
+    pthread_mutex_unlock(&thread_lock);
+}
+
+// Move up to TIER_BATCH cold objects out while the heap holds more
+// than target.  Called with the tier held exclusively.
+static uint64_t evict_some(uint64_t target)
+{
+    uint64_t blocks = superblock->data_blocks;
+    uint64_t moved = 0;
+    uint64_t steps;
+    uint64_t bit;
+
+    for(steps = 0; steps < 2 * blocks && moved < TIER_BATCH && resident() > target; steps++){
+        bit = hand;
+        hand = hand + 1 < blocks ? hand + 1 : 0;
+        if(spilled[bit] != 0 || !bitmap_test(&data_bitmap, bit)){
+            continue;
+        }
+        if(referenced[bit]){
+            referenced[bit] = 0;
+            continue;
+        }
+        if(heap_evict(superblock->data_start + bit) == 0){
+            moved++;
+        }
+    }
+    return moved;
+}
+
+// Whether the heap was full for something this thread's operation
+// needed since it took the tier
+int tier_short(void)
+{
+    return short_of_heap;
+}
+
+// Make room for an operation that found the heap full, without waiting
+// for the thread.  Called with the tier not held.  Moves at least one
+// object out if any is left in the heap; returns how many it moved.
+uint64_t tier_reclaim(void)
+{
+    uint64_t limit;
+    uint64_t target;
+    uint64_t have;
+    uint64_t moved;
+
+    if(!promote){
+        return 0;
+    }
+    pthread_rwlock_wrlock(&tier_lock);
+    limit = __atomic_load_n(&resident_max, __ATOMIC_RELAXED);
+    target = limit - limit / TIER_SLACK;
+    have = resident();
+    if(target >= have){
+        target = have > 0 ? have - 1 : 0;
+    }
+    moved = evict_some(target);
+    pthread_rwlock_unlock(&tier_lock);
+    return moved;
+}
+
+// Sleep ms milliseconds or until woken; returns 1 if told to stop
+static int tier_sleep(uint64_t ms)
+{
+    struct timespec until;
+    int quit;
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += ms / 1000;
+    until.tv_nsec += (ms % 1000) * 1000000;
+    if(until.tv_nsec >= 1000000000){
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&thread_lock);
+    if(!tier_quit){
+        pthread_cond_timedwait(&thread_cond, &thread_lock, &until);
+    }
+    quit = tier_quit;
+    pthread_mutex_unlock(&thread_lock);
+    return quit;
+}
+
+static void *tier_main(void *arg)
+{
+    uint64_t limit;
+    uint64_t moved;
+
+    while(!tier_sleep(TIER_PERIOD_MS)){
+        limit = __atomic_load_n(&resident_max, __ATOMIC_RELAXED);
+        // The failed allocation may have been rolled back, leaving the
+        // heap at the limit rather than over it; make room all the same
+        if(limit == 0 || (resident() <= limit &&
+                          !__atomic_exchange_n(&pressed, 0, __ATOMIC_RELAXED))){
+            continue;
+        }
+        // Down to a little under the limit, a batch at a time so that
+        // operations get in between
+        do{
+            pthread_rwlock_wrlock(&tier_lock);
+            moved = evict_some(limit - limit / TIER_SLACK);
+            pthread_rwlock_unlock(&tier_lock);
+        }while(moved == TIER_BATCH && !__atomic_load_n(&tier_quit, __ATOMIC_RELAXED));
+    }
+    return NULL;
+}
+
+// Keep the heap under its limit from a thread of its own
+int tier_start(void)
+{
+    int err;
+
+    if(!promote || tier_running){
+        return 0;
+    }
+    tier_quit = 0;
+    err = pthread_create(&tier_thread, NULL, tier_main, NULL);
+    if(err != 0){
+        return -err;
+    }
+    tier_running = 1;
+    return 0;
+}
+
+void tier_stop(void)
+{
+    if(!tier_running){
+        return;
+    }
+    pthread_mutex_lock(&thread_lock);
+    tier_quit = 1;
+    pthread_cond_broadcast(&thread_cond);
+    pthread_mutex_unlock(&thread_lock);
+    pthread_join(tier_thread, NULL);
+    tier_running = 0;
+}
+
+// Let go of the spill file; what is in it stays there
+void tier_close(void)
+{
+    tier_stop();
+    if(spill_fd >= 0){
+        close(spill_fd);
+        spill_fd = -1;
+    }
+    free(spilled);
+    free(referenced);
+    spilled = NULL;
+    referenced = NULL;
+    resident_max = 0;
+    pressed = 0;
+}
+
+// Copy out the counters since mount
+void tier_stats(struct nphfs_stats *out)
+{
+    out->tier_lookups = __atomic_load_n(&stats.lookups, __ATOMIC_RELAXED);
+    out->tier_faults = __atomic_load_n(&stats.faults, __ATOMIC_RELAXED);
+    out->tier_evictions = __atomic_load_n(&stats.evictions, __ATOMIC_RELAXED);
+    out->tier_fault_ns = __atomic_load_n(&stats.fault_ns, __ATOMIC_RELAXED);
+    out->tier_evict_ns = __atomic_load_n(&stats.evict_ns, __ATOMIC_RELAXED);
+    out->tier_resident = superblock != NULL ? resident() : 0;
+    out->tier_spilled = superblock != NULL ? superblock->blocks_spilled : 0;
+    out->tier_limit = __atomic_load_n(&resident_max, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,442 @@
+/*
+  NPHeap File System - timestamps
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Timestamps are taken from CLOCK_REALTIME_COARSE, which is read from
+  the vDSO without a system call and is as fine as the scheduler tick,
+  and are kept to the nanosecond in the inode.
+
+  By default every open and read updates atime.  With -o noatime
+  nothing does, and with -o relatime only the first access after the
+  file changed does, or one when atime is a day old, as on Linux.
+
+  With -o lazytime the times reads and writes change are kept in a
+  table here instead of in the inode, and getattr and readdir lay them
+  over the inode's.  They are written back, TIME_BATCH inodes per
+  journal batch, once the table holds TIME_PENDING_MAX inodes or
+  TIME_WRITEBACK seconds after the last write back, on fsync of the
+  inode, before a snapshot is taken and at unmount.  A crash loses
+  only the times not written back yet.  Operations that change more
+  than the times still write them to the inode themselves.  A time
+  from the table never replaces a newer one in the inode, so one left
+  behind for a freed slot is not given to the next file in it.
+*/
+
+#include "nphfuse_extra.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TIME_SHARDS       64
+#define TIME_BATCH        256           // inodes per journal batch
+#define TIME_PENDING_MAX  4096          // inodes in the table before a write back
+#define TIME_WRITEBACK    30            // most seconds between write backs
+#define TIME_RELATIME     (24 * 60 * 60)
+
+struct pending {
+  npheap_store *inode;
+  struct timespec atime;          // tv_sec 0 for unchanged
+  struct timespec mtime;
+  struct timespec ctime;
+};
+
+struct shard {
+  pthread_mutex_t lock;
+  struct nph_map index;           // inode address to entry
+  struct pending *entries;
+  uint64_t count;
+  uint64_t cap;
+};
+
+static struct shard shards[TIME_SHARDS];
+static int atime_mode = ATIME_STRICT;
+static int lazy = 0;
+static uint64_t pending_count = 0;
+static time_t last_writeback = 0;
+static int writing_back = 0;
+
+static struct {
+  uint64_t atime_skipped;
+  uint64_t deferred;
+  uint64_t written;
+  uint64_t batches;
+} stats;
+
+void time_init(int atime, int lazytime)
+{
+    int i;
+
+    atime_mode = atime;
+    lazy = lazytime;
+    for(i = 0; i < TIME_SHARDS; i++){
+        pthread_mutex_init(&shards[i].lock, NULL);
+        nph_map_init(&shards[i].index);
+    }
+    last_writeback = time_now().tv_sec;
+}
+
+struct timespec time_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    return ts;
+}
+
+static int later(const struct timespec *a, const struct timespec *b)
+{
+    return a->tv_sec > b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec > b->tv_nsec);
+}
+
+static struct shard *shard_of(const npheap_store *inode)
+{
+    return &shards[((uintptr_t)inode / sizeof(npheap_store)) % TIME_SHARDS];
+}
+
+// The entry of inode, NULL if it has none.  Called with the shard lock.
+static struct pending *entry_find(struct shard *s, const npheap_store *inode)
+{
+    uint64_t index;
+
+    if(!nph_map_get(&s->index, (uintptr_t)inode, &index)){
+        return NULL;
+    }
+    return &s->entries[index];
+}
+
+// The entry of inode, added if it has none; NULL without memory.
+// Called with the shard lock.
+static struct pending *entry_get(struct shard *s, npheap_store *inode)
+{
+    struct pending *grown;
+    struct pending *e = entry_find(s, inode);
+    uint64_t cap;
+
+    if(e != NULL){
+        return e;
+    }
+    if(s->count == s->cap){
+        cap = s->cap ? s->cap * 2 : 64;
+        grown = realloc(s->entries, cap * sizeof(struct pending));
+        if(grown == NULL){
+            return NULL;
+        }
+        s->entries = grown;
+        s->cap = cap;
+    }
+    if(nph_map_put(&s->index, (uintptr_t)inode, s->count) != 0){
+        return NULL;
+    }
+    e = &s->entries[s->count++];
+    memset(e, 0, sizeof(struct pending));
+    e->inode = inode;
+    stat_add(&pending_count, 1);
+    return e;
+}
+
+// Drop entry e, moving the last one into its place.  Called with the
+// shard lock.
+static void entry_remove(struct shard *s, struct pending *e)
+{
+    uint64_t index = e - s->entries;
+
+    nph_map_remove(&s->index, (uintptr_t)e->inode);
+    if(index != --s->count){
+        *e = s->entries[s->count];
+        nph_map_put(&s->index, (uintptr_t)e->inode, index);
+    }
+    __atomic_sub_fetch(&pending_count, 1, __ATOMIC_RELAXED);
+}
+
+// Log the times of e that are newer than its inode's into tx
+static void entry_log(struct jtx *tx, const struct pending *e)
+{
+    npheap_store *inode = e->inode;
+
+    if(inode->filename[0] == '\0'){
+        return;
+    }
+    if(later(&e->atime, &inode->mystat.st_atim)){
+        jtx_field(tx, inode, mystat.st_atim, e->atime);
+    }
+    if(later(&e->mtime, &inode->mystat.st_mtim)){
+        jtx_field(tx, inode, mystat.st_mtim, e->mtime);
+    }
+    if(later(&e->ctime, &inode->mystat.st_ctim)){
+        jtx_field(tx, inode, mystat.st_ctim, e->ctime);
+    }
+}
+
+// Commit the times of n inodes logged into tx
+static int batch_commit(struct jtx *tx, uint64_t n)
+{
+    if(n != 0){
+        stat_add(&stats.written, n);
+        stat_add(&stats.batches, 1);
+    }
+    return jtx_commit(tx) != 0 ? -ENOMEM : 0;
+}
+
+// Write the times of inode, or of every inode when it is NULL, back to
+// the inode table.  Returns 0 or -ENOMEM; times that could not be
+// written are lost.  The entries are taken out of the table under the
+// shard lock and committed after it is dropped, so no shard is held
+// across a journal commit.
+int time_flush(npheap_store *inode)
+{
+    struct shard *s;
+    struct pending *e;
+    struct pending *taken;
+    struct pending one;
+    struct jtx tx;
+    uint64_t count;
+    uint64_t j;
+    uint64_t n = 0;
+    int err = 0;
+    int i;
+
+    if(!lazy){
+        return 0;
+    }
+    if(inode != NULL){
+        s = shard_of(inode);
+        pthread_mutex_lock(&s->lock);
+        e = entry_find(s, inode);
+        if(e != NULL){
+            one = *e;
+            entry_remove(s, e);
+        }
+        pthread_mutex_unlock(&s->lock);
+        if(e != NULL){
+            jtx_begin(&tx);
+            entry_log(&tx, &one);
+            err = batch_commit(&tx, 1);
+        }
+        return err;
+    }
+
+    // The batches run on across shards, so they are full whatever
+    // shard the inodes fall in
+    __atomic_store_n(&last_writeback, time_now().tv_sec, __ATOMIC_RELAXED);
+    jtx_begin(&tx);
+    for(i = 0; i < TIME_SHARDS; i++){
+        s = &shards[i];
+        pthread_mutex_lock(&s->lock);
+        taken = s->entries;
+        count = s->count;
+        s->entries = NULL;
+        s->count = 0;
+        s->cap = 0;
+        nph_map_destroy(&s->index);
+        nph_map_init(&s->index);
+        __atomic_sub_fetch(&pending_count, count, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&s->lock);
+
+        for(j = 0; j < count; j++){
+            entry_log(&tx, &taken[j]);
+            if(++n == TIME_BATCH){
+                if(batch_commit(&tx, n) != 0){
+                    err = -ENOMEM;
+                }
+                n = 0;
+                jtx_begin(&tx);
+            }
+        }
+        free(taken);
+    }
+    if(batch_commit(&tx, n) != 0){
+        err = -ENOMEM;
+    }
+    return err;
+}
+
+// Write everything back when the table is full or old enough, unless
+// another thread already is
+static void maybe_write_back(const struct timespec *now)
+{
+    if(__atomic_load_n(&pending_count, __ATOMIC_RELAXED) < TIME_PENDING_MAX &&
+       now->tv_sec < __atomic_load_n(&last_writeback, __ATOMIC_RELAXED) + TIME_WRITEBACK){
+        return;
+    }
+    if(__atomic_exchange_n(&writing_back, 1, __ATOMIC_ACQUIRE) == 0){
+        time_flush(NULL);
+        __atomic_store_n(&writing_back, 0, __ATOMIC_RELEASE);
+    }
+}
+
+// 1 if relatime lets an access at now update an atime of a given its
+// mtime m and ctime c
+static int atime_due(const struct timespec *a, const struct timespec *m,
+                     const struct timespec *c, const struct timespec *now)
+{
+    return !later(a, m) || !later(a, c) || now->tv_sec - a->tv_sec >= TIME_RELATIME;
+}
+
+// inode was opened or read
+void time_accessed(npheap_store *inode)
+{
+    struct timespec now;
+    struct timespec a;
+    struct timespec m;
+    struct timespec c;
+    struct shard *s;
+    struct pending *e;
+
+    if(atime_mode == ATIME_NEVER){
+        stat_add(&stats.atime_skipped, 1);
+        return;
+    }
+    now = time_now();
+    if(!lazy){
+        if(atime_mode == ATIME_RELATIVE &&
+           !atime_due(&inode->mystat.st_atim, &inode->mystat.st_mtim,
+                      &inode->mystat.st_ctim, &now)){
+            stat_add(&stats.atime_skipped, 1);
+            return;
+        }
+        //Only atime changes, so it skips the journal
+        inode->mystat.st_atim = now;
+        ckpt_dirty(inode_block(inode));
+        return;
+    }
+
+    s = shard_of(inode);
+    pthread_mutex_lock(&s->lock);
+    e = entry_find(s, inode);
+    a = inode->mystat.st_atim;
+    m = inode->mystat.st_mtim;
+    c = inode->mystat.st_ctim;
+    if(e != NULL){
+        a = later(&e->atime, &a) ? e->atime : a;
+        m = later(&e->mtime, &m) ? e->mtime : m;
+        c = later(&e->ctime, &c) ? e->ctime : c;
+    }
+    if(atime_mode == ATIME_RELATIVE && !atime_due(&a, &m, &c, &now)){
+        pthread_mutex_unlock(&s->lock);
+        stat_add(&stats.atime_skipped, 1);
+        return;
+    }
+    if(e == NULL){
+        e = entry_get(s, inode);
+    }
+    if(e != NULL){
+        e->atime = now;
+        stat_add(&stats.deferred, 1);
+    }
+    pthread_mutex_unlock(&s->lock);
+    maybe_write_back(&now);
+}
+
+static void log_times(struct jtx *tx, npheap_store *inode, int which,
+                      const struct timespec *now)
+{
+    if(which & TIME_ATIME){
+        jtx_field(tx, inode, mystat.st_atim, *now);
+    }
+    if(which & TIME_MTIME){
+        jtx_field(tx, inode, mystat.st_mtim, *now);
+    }
+    if(which & TIME_CTIME){
+        jtx_field(tx, inode, mystat.st_ctim, *now);
+    }
+}
+
+// The data of inode changed: set the times in which (TIME_*) to now,
+// through tx or, with lazytime, in the table.  atime is only set by
+// the default atime mode.
+void time_changed(npheap_store *inode, int which, struct jtx *tx)
+{
+    struct timespec now = time_now();
+    struct shard *s;
+    struct pending *e;
+
+    if(atime_mode != ATIME_STRICT && (which & TIME_ATIME)){
+        which &= ~TIME_ATIME;
+        stat_add(&stats.atime_skipped, 1);
+    }
+    if(!lazy){
+        log_times(tx, inode, which, &now);
+        return;
+    }
+
+    s = shard_of(inode);
+    pthread_mutex_lock(&s->lock);
+    e = entry_get(s, inode);
+    if(e != NULL){
+        if(which & TIME_ATIME){
+            e->atime = now;
+        }
+        if(which & TIME_MTIME){
+            e->mtime = now;
+        }
+        if(which & TIME_CTIME){
+            e->ctime = now;
+        }
+        stat_add(&stats.deferred, 1);
+    }
+    pthread_mutex_unlock(&s->lock);
+    if(e == NULL){
+        // No room in the table, so the times go straight to the inode
+        log_times(tx, inode, which, &now);
+        return;
+    }
+    maybe_write_back(&now);
+}
+
+// Lay the times of inode not written back yet over st
+void time_stat(const npheap_store *inode, struct stat *st)
+{
+    struct shard *s;
+    struct pending *e;
+
+    if(!lazy){
+        return;
+    }
+    s = shard_of(inode);
+    pthread_mutex_lock(&s->lock);
+    e = entry_find(s, inode);
+    if(e != NULL){
+        if(later(&e->atime, &st->st_atim)){
+            st->st_atim = e->atime;
+        }
+        if(later(&e->mtime, &st->st_mtim)){
+            st->st_mtim = e->mtime;
+        }
+        if(later(&e->ctime, &st->st_ctim)){
+            st->st_ctim = e->ctime;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+// atime and mtime of inode are being set by hand; forget the ones not
+// written back
+void time_forget(const npheap_store *inode)
+{
+    struct shard *s;
+    struct pending *e;
+
+    if(!lazy){
+        return;
+    }
+    s = shard_of(inode);
+    pthread_mutex_lock(&s->lock);
+    e = entry_find(s, inode);
+    if(e != NULL){
+        memset(&e->atime, 0, sizeof(struct timespec));
+        memset(&e->mtime, 0, sizeof(struct timespec));
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+void time_stats(struct nphfs_stats *out)
+{
+    out->time_atime_skipped = __atomic_load_n(&stats.atime_skipped, __ATOMIC_RELAXED);
+    out->time_deferred = __atomic_load_n(&stats.deferred, __ATOMIC_RELAXED);
+    out->time_written = __atomic_load_n(&stats.written, __ATOMIC_RELAXED);
+    out->time_batches = __atomic_load_n(&stats.batches, __ATOMIC_RELAXED);
+    out->time_pending = __atomic_load_n(&pending_count, __ATOMIC_RELAXED);
+}
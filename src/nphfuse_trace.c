@@ -0,0 +1,359 @@
+/*
+  NPHeap File System - operation trace
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  With -o trace=FILE every FUSE operation the mount serves is recorded
+  to FILE: which one, a hash of its path, its offset, size and mode,
+  when it started, how long it took and what it returned.  nphfs-replay
+  drives the same operations against a mount again, so a workload seen
+  in production can be brought back to try a change against.
+
+  Without the option nothing here runs: trace_wrap gives fuse_main a
+  copy of the operation table whose entries time the real ones, and
+  only when tracing.  Each serving thread fills a buffer of its own and
+  writes it out whole when it is full, so recording takes no lock and
+  no system call beyond reading the clock twice.  A thread that exits
+  writes out what it has and leaves its buffer, and its thread number,
+  to the next thread that starts, so the daemon's workers coming and
+  going never add up to more buffers than ran at once.  What is still
+  buffered when the filesystem is unmounted is written by destroy.
+*/
+
+#include "nphfuse.h"
+#include <pthread.h>
+#include <time.h>
+
+#define TRACE_BATCH  512                // records a thread buffers
+
+struct trace_buf {
+    struct trace_buf *next;             // every thread's, for trace_close
+    struct trace_buf *idle_next;        // left by threads that exited
+    uint32_t thread;
+    uint32_t count;
+    struct nphfs_trace_record records[TRACE_BATCH];
+};
+
+static int trace_fd = -1;
+static uint64_t trace_start;            // CLOCK_MONOTONIC ns when opened
+static struct nphfs_trace_header header;
+static off_t trace_end;                 // where the next batch goes
+static int trace_failed = 0;            // a write failed, stop recording
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_buf *buffers = NULL;
+static struct trace_buf *idle = NULL;
+static uint32_t threads = 0;
+static pthread_key_t trace_key;         // hands a buffer back at thread exit
+static __thread struct trace_buf *mine = NULL;
+
+// The operations being traced
+static struct fuse_operations inner;
+static struct fuse_operations traced;
+
+static uint64_t path_hash(const char *path)
+{
+    return path != NULL ? dedup_hash(path, strlen(path)) : 0;
+}
+
+static void trace_thread_exit(void *arg);
+
+// Start a trace in path, replacing whatever it held
+int trace_open(const char *path)
+{
+    int err;
+
+    err = pthread_key_create(&trace_key, trace_thread_exit);
+    if(err != 0){
+        return -err;
+    }
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if(trace_fd < 0){
+        err = -errno;
+        pthread_key_delete(trace_key);
+        return err;
+    }
+    memset(&header, 0, sizeof(header));
+    header.magic = TRACE_MAGIC;
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof(struct nphfs_trace_record);
+    header.start = time(NULL);
+    err = write_full(trace_fd, &header, sizeof(header), 0);
+    if(err != 0){
+        close(trace_fd);
+        trace_fd = -1;
+        pthread_key_delete(trace_key);
+        return err;
+    }
+    trace_end = sizeof(header);
+    trace_start = now_ns();
+    return 0;
+}
+
+// Append a thread's records.  Called with trace_lock held.
+static void flush_locked(struct trace_buf *buf)
+{
+    size_t len = (size_t)buf->count * sizeof(struct nphfs_trace_record);
+
+    if(!trace_failed && write_full(trace_fd, buf->records, len, trace_end) == 0){
+        trace_end += len;
+        header.records += buf->count;
+    }else{
+        trace_failed = 1;
+        header.dropped += buf->count;
+    }
+    buf->count = 0;
+}
+
+// A serving thread is exiting: its records go out now and its buffer
+// waits for the next thread.  Nothing is left to do once the trace is
+// closed, which has freed the buffer.
+static void trace_thread_exit(void *arg)
+{
+    struct trace_buf *buf = (struct trace_buf *)arg;
+
+    pthread_mutex_lock(&trace_lock);
+    if(trace_fd >= 0){
+        if(buf->count != 0){
+            flush_locked(buf);
+        }
+        buf->idle_next = idle;
+        idle = buf;
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+// This thread's buffer, taken the first time it records something from
+// a thread that exited or made
+static struct trace_buf *trace_buffer(void)
+{
+    struct trace_buf *buf = mine;
+
+    if(buf != NULL){
+        return buf;
+    }
+    pthread_mutex_lock(&trace_lock);
+    buf = idle;
+    if(buf != NULL){
+        idle = buf->idle_next;
+    }
+    pthread_mutex_unlock(&trace_lock);
+    if(buf == NULL){
+        buf = (struct trace_buf *)malloc(sizeof(struct trace_buf));
+        if(buf == NULL){
+            return NULL;
+        }
+        buf->count = 0;
+        pthread_mutex_lock(&trace_lock);
+        buf->thread = threads++;
+        buf->next = buffers;
+        buffers = buf;
+        pthread_mutex_unlock(&trace_lock);
+    }
+    pthread_setspecific(trace_key, buf);
+    mine = buf;
+    return buf;
+}
+
+static void trace_record(uint32_t op, uint64_t start, const char *path, const char *path2,
+                         uint64_t offset, uint64_t size, uint32_t mode, int result)
+{
+    uint64_t end = now_ns();
+    struct trace_buf *buf = trace_buffer();
+    struct nphfs_trace_record *r;
+
+    if(buf == NULL){
+        pthread_mutex_lock(&trace_lock);
+        header.dropped++;
+        pthread_mutex_unlock(&trace_lock);
+        return;
+    }
+    r = &buf->records[buf->count++];
+    r->start_ns = start - trace_start;
+    r->latency_ns = end - start;
+    r->path = path_hash(path);
+    r->path2 = path_hash(path2);
+    r->offset = offset;
+    r->size = size;
+    r->mode = mode;
+    r->thread = buf->thread;
+    r->result = result;
+    r->op = op;
+    if(buf->count == TRACE_BATCH){
+        pthread_mutex_lock(&trace_lock);
+        flush_locked(buf);
+        pthread_mutex_unlock(&trace_lock);
+    }
+}
+
+// Write out every thread's buffer and the final header
+void trace_close(void)
+{
+    struct trace_buf *buf;
+    int fd;
+
+    if(trace_fd < 0){
+        return;
+    }
+    pthread_key_delete(trace_key);
+    pthread_mutex_lock(&trace_lock);
+    while(buffers != NULL){
+        buf = buffers;
+        buffers = buf->next;
+        if(buf->count != 0){
+            flush_locked(buf);
+        }
+        free(buf);
+    }
+    idle = NULL;
+    write_full(trace_fd, &header, sizeof(header), 0);
+    fd = trace_fd;
+    trace_fd = -1;
+    pthread_mutex_unlock(&trace_lock);
+    fsync(fd);
+    close(fd);
+}
+
+// One wrapper per operation: run the real one and record it with the
+// path, second path, offset, size and mode given
+#define TRACED(op, code, params, args, path_, path2_, offset_, size_, mode_) \
+    static int traced_##op params                                         \
+    {                                                                     \
+        uint64_t start = now_ns();                                        \
+        int ret = inner.op args;                                          \
+        trace_record(code, start, path_, path2_, offset_, size_, mode_, ret); \
+        return ret;                                                       \
+    }
+
+TRACED(getattr, TRACE_GETATTR, (const char *path, struct stat *statbuf),
+       (path, statbuf), path, NULL, 0, 0, 0)
+TRACED(readlink, TRACE_READLINK, (const char *path, char *link, size_t size),
+       (path, link, size), path, NULL, 0, size, 0)
+TRACED(mknod, TRACE_MKNOD, (const char *path, mode_t mode, dev_t dev),
+       (path, mode, dev), path, NULL, 0, 0, mode)
+TRACED(mkdir, TRACE_MKDIR, (const char *path, mode_t mode),
+       (path, mode), path, NULL, 0, 0, mode)
+TRACED(unlink, TRACE_UNLINK, (const char *path), (path), path, NULL, 0, 0, 0)
+TRACED(rmdir, TRACE_RMDIR, (const char *path), (path), path, NULL, 0, 0, 0)
+// The link is what gets made; the target is only a string
+TRACED(symlink, TRACE_SYMLINK, (const char *path, const char *link),
+       (path, link), link, NULL, 0, strlen(path), 0)
+TRACED(rename, TRACE_RENAME, (const char *path, const char *newpath),
+       (path, newpath), path, newpath, 0, 0, 0)
+TRACED(link, TRACE_LINK, (const char *path, const char *newpath),
+       (path, newpath), path, newpath, 0, 0, 0)
+TRACED(chmod, TRACE_CHMOD, (const char *path, mode_t mode),
+       (path, mode), path, NULL, 0, 0, mode)
+TRACED(chown, TRACE_CHOWN, (const char *path, uid_t uid, gid_t gid),
+       (path, uid, gid), path, NULL, 0, 0, 0)
+TRACED(truncate, TRACE_TRUNCATE, (const char *path, off_t newsize),
+       (path, newsize), path, NULL, newsize, 0, 0)
+TRACED(utime, TRACE_UTIME, (const char *path, struct utimbuf *ubuf),
+       (path, ubuf), path, NULL, 0, 0, 0)
+TRACED(open, TRACE_OPEN, (const char *path, struct fuse_file_info *fi),
+       (path, fi), path, NULL, 0, 0, fi->flags)
+TRACED(read, TRACE_READ, (const char *path, char *buf, size_t size, off_t offset,
+                          struct fuse_file_info *fi),
+       (path, buf, size, offset, fi), path, NULL, offset, size, 0)
+TRACED(write, TRACE_WRITE, (const char *path, const char *buf, size_t size, off_t offset,
+                            struct fuse_file_info *fi),
+       (path, buf, size, offset, fi), path, NULL, offset, size, 0)
+TRACED(statfs, TRACE_STATFS, (const char *path, struct statvfs *statv),
+       (path, statv), path, NULL, 0, 0, 0)
+TRACED(flush, TRACE_FLUSH, (const char *path, struct fuse_file_info *fi),
+       (path, fi), path, NULL, 0, 0, 0)
+TRACED(release, TRACE_RELEASE, (const char *path, struct fuse_file_info *fi),
+       (path, fi), path, NULL, 0, 0, 0)
+TRACED(fsync, TRACE_FSYNC, (const char *path, int datasync, struct fuse_file_info *fi),
+       (path, datasync, fi), path, NULL, 0, 0, datasync)
+#ifdef HAVE_SYS_XATTR_H
+TRACED(setxattr, TRACE_SETXATTR, (const char *path, const char *name, const char *value,
+                                  size_t size, int flags),
+       (path, name, value, size, flags), path, NULL, 0, size, flags)
+TRACED(getxattr, TRACE_GETXATTR, (const char *path, const char *name, char *value, size_t size),
+       (path, name, value, size), path, NULL, 0, size, 0)
+TRACED(listxattr, TRACE_LISTXATTR, (const char *path, char *list, size_t size),
+       (path, list, size), path, NULL, 0, size, 0)
+TRACED(removexattr, TRACE_REMOVEXATTR, (const char *path, const char *name),
+       (path, name), path, NULL, 0, 0, 0)
+#endif
+TRACED(opendir, TRACE_OPENDIR, (const char *path, struct fuse_file_info *fi),
+       (path, fi), path, NULL, 0, 0, 0)
+TRACED(readdir, TRACE_READDIR, (const char *path, void *buf, fuse_fill_dir_t filler,
+                                off_t offset, struct fuse_file_info *fi),
+       (path, buf, filler, offset, fi), path, NULL, offset, 0, 0)
+TRACED(releasedir, TRACE_RELEASEDIR, (const char *path, struct fuse_file_info *fi),
+       (path, fi), path, NULL, 0, 0, 0)
+TRACED(fsyncdir, TRACE_FSYNCDIR, (const char *path, int datasync, struct fuse_file_info *fi),
+       (path, datasync, fi), path, NULL, 0, 0, datasync)
+TRACED(access, TRACE_ACCESS, (const char *path, int mask),
+       (path, mask), path, NULL, 0, 0, mask)
+TRACED(ftruncate, TRACE_FTRUNCATE, (const char *path, off_t offset, struct fuse_file_info *fi),
+       (path, offset, fi), path, NULL, offset, 0, 0)
+TRACED(fgetattr, TRACE_FGETATTR, (const char *path, struct stat *statbuf,
+                                  struct fuse_file_info *fi),
+       (path, statbuf, fi), path, NULL, 0, 0, 0)
+TRACED(ioctl, TRACE_IOCTL, (const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+                            unsigned int flags, void *data),
+       (path, cmd, arg, fi, flags, data), path, NULL, 0, 0, (uint32_t)cmd)
+TRACED(fallocate, TRACE_FALLOCATE, (const char *path, int mode, off_t offset, off_t length,
+                                    struct fuse_file_info *fi),
+       (path, mode, offset, length, fi), path, NULL, offset, length, mode)
+
+// Unmounting ends the trace, after the filesystem's own clean up
+static void traced_destroy(void *userdata)
+{
+    if(inner.destroy != NULL){
+        inner.destroy(userdata);
+    }
+    trace_close();
+}
+
+#define WRAP(op)                        \
+    if(ops->op != NULL){                \
+        traced.op = traced_##op;        \
+    }
+
+// ops with every operation it has recorded before it runs
+const struct fuse_operations *trace_wrap(const struct fuse_operations *ops)
+{
+    inner = *ops;
+    traced = *ops;
+    WRAP(getattr)
+    WRAP(readlink)
+    WRAP(mknod)
+    WRAP(mkdir)
+    WRAP(unlink)
+    WRAP(rmdir)
+    WRAP(symlink)
+    WRAP(rename)
+    WRAP(link)
+    WRAP(chmod)
+    WRAP(chown)
+    WRAP(truncate)
+    WRAP(utime)
+    WRAP(open)
+    WRAP(read)
+    WRAP(write)
+    WRAP(statfs)
+    WRAP(flush)
+    WRAP(release)
+    WRAP(fsync)
+#ifdef HAVE_SYS_XATTR_H
+    WRAP(setxattr)
+    WRAP(getxattr)
+    WRAP(listxattr)
+    WRAP(removexattr)
+#endif
+    WRAP(opendir)
+    WRAP(readdir)
+    WRAP(releasedir)
+    WRAP(fsyncdir)
+    WRAP(access)
+    WRAP(ftruncate)
+    WRAP(fgetattr)
+    WRAP(ioctl)
+    WRAP(fallocate)
+    traced.destroy = traced_destroy;
+    return &traced;
+}
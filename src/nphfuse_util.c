@@ -0,0 +1,75 @@
+/*
+  NPHeap File System - shared helpers
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Whole-buffer file I/O, the monotonic clock the modules time their
+  work with, and the relaxed add their counters are kept with.
+*/
+
+#include "nphfuse_extra.h"
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Write all of buf at off, retrying short writes; 0 or -errno
+int write_full(int fd, const void *buf, size_t len, off_t off)
+{
+    const char *p = (const char *)buf;
+    ssize_t done;
+
+    while(len > 0){
+        done = pwrite(fd, p, len, off);
+        if(done < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            return -errno;
+        }
+        p += done;
+        off += done;
+        len -= done;
+    }
+    return 0;
+}
+
+// Read len bytes at off; whatever lies past the end of the file is zero
+int read_full(int fd, void *buf, size_t len, off_t off)
+{
+    char *p = (char *)buf;
+    ssize_t done;
+
+    while(len > 0){
+        done = pread(fd, p, len, off);
+        if(done < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            return -errno;
+        }
+        if(done == 0){
+            memset(p, 0, len);
+            break;
+        }
+        p += done;
+        off += done;
+        len -= done;
+    }
+    return 0;
+}
+
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Counters may be bumped from any thread and are only read for stats
+void stat_add(uint64_t *counter, uint64_t n)
+{
+    __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+}
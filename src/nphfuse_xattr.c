@@ -0,0 +1,463 @@
+/*
+  NPHeap File System - extended attributes
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  An inode keeps its attributes in xattr_inline, a few dozen bytes at
+  the end of its slot, and spills whatever does not fit there to one
+  attribute block in the data area.  Both hold the same packed entries:
+  a name length byte, a 16-bit value length, the name and the value,
+  ended by a zero name length or the end of the space.  Entries are
+  kept sorted by name and each goes inline if it still fits, so a
+  security.capability or a short user.* tag never leaves the inode.
+  A fast symlink's target takes the inline space, so all of its
+  attributes go to the block.
+
+  Attribute blocks are never changed once written; every change builds
+  the whole new set and logs the inode pointing at a fresh block.  That
+  lets inodes with the same spilled attributes, such as ACLs copied
+  down a tree, and a file and its snapshots share one block.  Blocks
+  written since mount are indexed by a hash of their entries and a set
+  already stored takes another reference instead of a new block; as in
+  nphfuse_dedup.c a block leaves the index before a reference to it is
+  dropped, under the lock a lookup holds until it has its reference.
+
+  The kernel asks for security.capability before every write, and most
+  files have no attributes at all.  xattr_names holds one bit per name
+  hash of the attributes the inode has, so a lookup for one it does not
+  have is answered from the inode alone, without a lock or the block.
+*/
+
+#include "nphfuse_extra.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/xattr.h>
+
+#define XATTR_ENTRY_HEAD  3         // name length byte, 16-bit value length
+#define XATTR_NAME_MAX    255
+#define XATTR_LOCKS       16
+
+struct xattr_entry {
+  const char *name;
+  size_t name_len;
+  const char *value;
+  size_t value_len;
+};
+
+// A changing set is built from the old one in place; the lock keeps
+// two changes to one inode from both dropping its old block
+static pthread_mutex_t xattr_locks[XATTR_LOCKS] = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_MUTEX_INITIALIZER,
+};
+
+static struct nph_map by_hash;      // entries hash -> block id
+static struct nph_map by_id;        // block id -> entries hash
+static uint64_t indexed = 0;        // by_id.count, read without the lock
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Inline space for attributes; a fast symlink's target has it
+static size_t inline_room(const npheap_store *inode)
+{
+    return INODE_FAST_SYMLINK(inode) ? 0 : XATTR_INLINE;
+}
+
+static pthread_mutex_t *xattr_lock(const npheap_store *inode)
+{
+    return &xattr_locks[inode->mystat.st_ino % XATTR_LOCKS];
+}
+
+// The bit name sets in xattr_names
+static uint64_t name_bit(const char *name, size_t len)
+{
+    return 1ULL << (dedup_hash(name, len) & 63);
+}
+
+// Append the entries packed in len bytes at p to ents; returns the new
+// count.  A damaged area ends the walk early rather than running past it.
+static size_t unpack(const unsigned char *p, size_t len, struct xattr_entry *ents, size_t n)
+{
+    size_t pos = 0;
+    uint16_t value_len;
+
+    while(pos + XATTR_ENTRY_HEAD <= len && p[pos] != 0){
+        memcpy(&value_len, p + pos + 1, sizeof(value_len));
+        if(pos + XATTR_ENTRY_HEAD + p[pos] + value_len > len){
+            break;
+        }
+        ents[n].name = (const char *)p + pos + XATTR_ENTRY_HEAD;
+        ents[n].name_len = p[pos];
+        ents[n].value = ents[n].name + p[pos];
+        ents[n].value_len = value_len;
+        n++;
+        pos += XATTR_ENTRY_HEAD + p[pos] + value_len;
+    }
+    return n;
+}
+
+static size_t pack(unsigned char *p, const struct xattr_entry *e)
+{
+    uint16_t value_len = (uint16_t)e->value_len;
+
+    p[0] = (unsigned char)e->name_len;
+    memcpy(p + 1, &value_len, sizeof(value_len));
+    memcpy(p + XATTR_ENTRY_HEAD, e->name, e->name_len);
+    memcpy(p + XATTR_ENTRY_HEAD + e->name_len, e->value, e->value_len);
+    return XATTR_ENTRY_HEAD + e->name_len + e->value_len;
+}
+
+// The attribute block id, or NULL if it is not one
+static const struct nph_xblock *xblock_get(uint64_t id)
+{
+    const struct nph_xblock *blk = (const struct nph_xblock *)heap_get(id);
+
+    if(blk == NULL || !xblock_ok(blk, BLOCK_SIZE)){
+        return NULL;
+    }
+    return blk;
+}
+
+// 1 if the size bytes at blk hold an attribute block.  The hash is
+// left to fsck.nphfs; the block is read on every lookup.
+int xblock_ok(const struct nph_xblock *blk, uint64_t size)
+{
+    return size >= BLOCK_SIZE && blk->magic == NPH_XMAGIC && blk->used <= XATTR_BLOCK_ROOM;
+}
+
+// Every attribute of inode, inline ones first; *n is set to the count.
+// The names and values point into the inode and its block.
+static struct xattr_entry *xattr_load(const npheap_store *inode, size_t *n)
+{
+    const struct nph_xblock *blk = NULL;
+    struct xattr_entry *ents;
+    size_t max = XATTR_INLINE / XATTR_ENTRY_HEAD + 1;
+
+    if(inode->xattr != 0){
+        blk = xblock_get(inode->xattr);
+        if(blk != NULL){
+            max += blk->used / XATTR_ENTRY_HEAD;
+        }
+    }
+    ents = (struct xattr_entry *)malloc(max * sizeof(*ents));
+    if(ents == NULL){
+        return NULL;
+    }
+    *n = unpack(inode->xattr_inline, inline_room(inode), ents, 0);
+    if(blk != NULL){
+        *n = unpack((const unsigned char *)(blk + 1), blk->used, ents, *n);
+    }
+    return ents;
+}
+
+static int name_cmp(const struct xattr_entry *e, const char *name, size_t len)
+{
+    int c = memcmp(e->name, name, e->name_len < len ? e->name_len : len);
+
+    if(c != 0){
+        return c;
+    }
+    return e->name_len < len ? -1 : e->name_len > len;
+}
+
+static long find(const struct xattr_entry *ents, size_t n, const char *name, size_t len)
+{
+    size_t i;
+
+    for(i = 0; i < n; i++){
+        if(name_cmp(&ents[i], name, len) == 0){
+            return (long)i;
+        }
+    }
+    return -1;
+}
+
+// Copy of size bytes of value, or its length if size is 0, as
+// getxattr(2) wants it
+static int give(const void *value, size_t len, void *buf, size_t size)
+{
+    if(size == 0){
+        return (int)len;
+    }
+    if(len > size){
+        return -ERANGE;
+    }
+    memcpy(buf, value, len);
+    return (int)len;
+}
+
+int xattr_get(const npheap_store *inode, const char *name, void *value, size_t size)
+{
+    struct xattr_entry *ents;
+    uint64_t names = __atomic_load_n(&inode->xattr_names, __ATOMIC_ACQUIRE);
+    size_t len = strlen(name);
+    size_t n = 0;
+    long i;
+    int ret;
+
+    if(names == 0 || !(names & name_bit(name, len))){
+        return -ENODATA;
+    }
+    pthread_mutex_lock(xattr_lock(inode));
+    ents = xattr_load(inode, &n);
+    if(ents == NULL){
+        pthread_mutex_unlock(xattr_lock(inode));
+        return -ENOMEM;
+    }
+    i = find(ents, n, name, len);
+    ret = i < 0 ? -ENODATA : give(ents[i].value, ents[i].value_len, value, size);
+    pthread_mutex_unlock(xattr_lock(inode));
+    free(ents);
+    return ret;
+}
+
+int xattr_list(const npheap_store *inode, char *list, size_t size)
+{
+    struct xattr_entry *ents;
+    size_t total = 0;
+    size_t n = 0;
+    size_t i;
+
+    if(inode->xattr_names == 0){
+        return 0;
+    }
+    pthread_mutex_lock(xattr_lock(inode));
+    ents = xattr_load(inode, &n);
+    if(ents == NULL){
+        pthread_mutex_unlock(xattr_lock(inode));
+        return -ENOMEM;
+    }
+    for(i = 0; i < n; i++){
+        if(size != 0 && total + ents[i].name_len + 1 <= size){
+            memcpy(list + total, ents[i].name, ents[i].name_len);
+            list[total + ents[i].name_len] = '\0';
+        }
+        total += ents[i].name_len + 1;
+    }
+    pthread_mutex_unlock(xattr_lock(inode));
+    free(ents);
+    if(size != 0 && total > size){
+        return -ERANGE;
+    }
+    return (int)total;
+}
+
+// An attribute block holding the used bytes of entries at data, with a
+// reference taken for the caller: an indexed one with the same entries
+// or a new one.  Returns its id or 0.
+static uint64_t xblock_store(const void *data, uint32_t used)
+{
+    struct nph_xblock *blk;
+    uint64_t hash = dedup_hash(data, used);
+    uint64_t id = 0;
+    uint64_t old;
+
+    pthread_mutex_lock(&index_lock);
+    if(nph_map_get(&by_hash, hash, &id)){
+        blk = (struct nph_xblock *)heap_get(id);
+        if(blk != NULL && blk->used == used && memcmp(blk + 1, data, used) == 0){
+            share_ref(id);
+            pthread_mutex_unlock(&index_lock);
+            return id;
+        }
+    }
+    pthread_mutex_unlock(&index_lock);
+
+    id = heap_new(BLOCK_SIZE, (void **)&blk);
+    if(id == 0){
+        return 0;
+    }
+    blk->magic = NPH_XMAGIC;
+    blk->used = used;
+    blk->hash = hash;
+    memcpy(blk + 1, data, used);
+    ckpt_dirty(id);
+
+    pthread_mutex_lock(&index_lock);
+    // One block per hash, the newest
+    if(nph_map_get(&by_hash, hash, &old)){
+        nph_map_remove(&by_id, old);
+    }
+    if(nph_map_put(&by_hash, hash, id) == 0 && nph_map_put(&by_id, id, hash) != 0){
+        nph_map_remove(&by_hash, hash);
+    }
+    __atomic_store_n(&indexed, by_id.count, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&index_lock);
+    return id;
+}
+
+// Attribute block id is about to lose a reference
+void xattr_forget(uint64_t id)
+{
+    uint64_t hash;
+
+    if(__atomic_load_n(&indexed, __ATOMIC_ACQUIRE) == 0){
+        return;
+    }
+    pthread_mutex_lock(&index_lock);
+    if(nph_map_get(&by_id, id, &hash)){
+        nph_map_remove(&by_id, id);
+        nph_map_remove(&by_hash, hash);
+        __atomic_store_n(&indexed, by_id.count, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&index_lock);
+}
+
+// Give back the reference xblock_store took for a change that did not
+// commit.  Done under the index lock, which a lookup holds until it has
+// its reference: a block others share stays indexed with one reference
+// less, and one nobody else has leaves the index and is freed.
+static void xblock_unref(uint64_t id)
+{
+    uint64_t hash;
+    int last;
+
+    pthread_mutex_lock(&index_lock);
+    last = share_count(id) == 0;
+    if(!last){
+        share_unref(id, 1);
+    }else if(nph_map_get(&by_id, id, &hash)){
+        nph_map_remove(&by_id, id);
+        nph_map_remove(&by_hash, hash);
+        __atomic_store_n(&indexed, by_id.count, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&index_lock);
+    if(last){
+        heap_free(id);
+    }
+}
+
+// Log the inode giving up its attributes, as it is freed
+void xattr_release(const npheap_store *inode, struct jtx *tx)
+{
+    jtx_free(tx, inode->xattr, 0);
+}
+
+// Set name to the size bytes at value, or remove it if value is NULL,
+// and log the new set in one transaction.  flags are setxattr(2)'s.
+static int xattr_change(npheap_store *inode, const char *name, const void *value,
+                        size_t size, int flags)
+{
+    struct xattr_entry *ents;
+    struct xattr_entry *grown;
+    const struct nph_xblock *old;
+    unsigned char inl[XATTR_INLINE];
+    unsigned char *spill;
+    struct timespec now;
+    struct jtx tx;
+    size_t len = strlen(name);
+    size_t used = 0;
+    size_t spilled = 0;
+    size_t need;
+    size_t n = 0;
+    size_t i;
+    uint64_t names = 0;
+    uint64_t id = 0;
+    long at;
+    int err = 0;
+
+    if(len == 0 || len > XATTR_NAME_MAX){
+        return -ERANGE;
+    }
+    if(value != NULL && XATTR_ENTRY_HEAD + len + size > XATTR_BLOCK_ROOM){
+        return -E2BIG;
+    }
+    spill = (unsigned char *)malloc(XATTR_BLOCK_ROOM);
+    if(spill == NULL){
+        return -ENOMEM;
+    }
+
+    pthread_mutex_lock(xattr_lock(inode));
+    ents = xattr_load(inode, &n);
+    grown = ents != NULL ? (struct xattr_entry *)realloc(ents, (n + 1) * sizeof(*ents)) : NULL;
+    if(grown == NULL){
+        err = -ENOMEM;
+        goto out;
+    }
+    ents = grown;
+    at = find(ents, n, name, len);
+    if(value == NULL || (flags & XATTR_REPLACE)){
+        if(at < 0){
+            err = -ENODATA;
+            goto out;
+        }
+    }else if(at >= 0 && (flags & XATTR_CREATE)){
+        err = -EEXIST;
+        goto out;
+    }
+    if(at >= 0){
+        memmove(&ents[at], &ents[at + 1], (n - at - 1) * sizeof(*ents));
+        n--;
+    }
+    if(value != NULL){
+        for(i = n; i > 0 && name_cmp(&ents[i - 1], name, len) > 0; i--){
+            ents[i] = ents[i - 1];
+        }
+        ents[i].name = name;
+        ents[i].name_len = len;
+        ents[i].value = (const char *)value;
+        ents[i].value_len = size;
+        n++;
+    }
+
+    memset(inl, 0, sizeof(inl));
+    for(i = 0; i < n; i++){
+        need = XATTR_ENTRY_HEAD + ents[i].name_len + ents[i].value_len;
+        if(used + need <= inline_room(inode)){
+            used += pack(inl + used, &ents[i]);
+        }else if(spilled + need <= XATTR_BLOCK_ROOM){
+            spilled += pack(spill + spilled, &ents[i]);
+        }else{
+            err = -ENOSPC;
+            goto out;
+        }
+        names |= name_bit(ents[i].name, ents[i].name_len);
+    }
+    // A change that leaves the spilled entries alone keeps their block
+    old = inode->xattr != 0 ? xblock_get(inode->xattr) : NULL;
+    if(old != NULL && old->used == spilled && memcmp(old + 1, spill, spilled) == 0){
+        id = inode->xattr;
+    }else if(spilled != 0){
+        id = xblock_store(spill, (uint32_t)spilled);
+        if(id == 0){
+            err = -ENOSPC;
+            goto out;
+        }
+    }
+
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    jtx_begin(&tx);
+    jtx_inode(&tx, inode, offsetof(npheap_store, xattr_inline), inl, inline_room(inode));
+    jtx_field(&tx, inode, xattr, id);
+    jtx_field(&tx, inode, xattr_names, names);
+    jtx_field(&tx, inode, mystat.st_ctim, now);
+    if(id != inode->xattr){
+        jtx_free(&tx, inode->xattr, 0);
+    }
+    err = jtx_commit(&tx);
+    if(err != 0 && id != 0 && id != inode->xattr){
+        xblock_unref(id);
+    }
+out:
+    pthread_mutex_unlock(xattr_lock(inode));
+    free(ents);
+    free(spill);
+    return err;
+}
+
+int xattr_set(npheap_store *inode, const char *name, const void *value, size_t size, int flags)
+{
+    return xattr_change(inode, name, value != NULL ? value : "", size, flags);
+}
+
+int xattr_remove(npheap_store *inode, const char *name)
+{
+    return xattr_change(inode, name, NULL, 0, 0);
+}